@@ -0,0 +1,24 @@
+const execSync = require('child_process').execSync;
+const { mkdirSync, existsSync } = require('fs');
+
+// Native shared library of rmmxapianapi.cc for use on the server (e.g. from node through ffi).
+// Built against the Xapian installed on the host, found with xapian-config.
+const xapianConfigArgName = '--xapian-config=';
+const xapianConfigArg = process.argv.find(arg => arg.indexOf(xapianConfigArgName)===0);
+const xapianConfig = xapianConfigArg ? xapianConfigArg.substr(xapianConfigArgName.length) : 'xapian-config';
+const cxx = process.env.CXX || 'c++';
+
+try {
+  console.log('Building Runbox Xapian native library');
+  if(!existsSync('dist')) {
+    mkdirSync('dist');
+  }
+  const xapianFlags = execSync(`${xapianConfig} --cxxflags --libs`).toString().replace(/\n/g, ' ');
+  execSync(`${cxx} -O2 -std=c++11 -fPIC -shared -pthread ` +
+    `rmmxapianapi.cc ${xapianFlags} -lz ` +
+    `-o dist/librmmxapianapi.so`, { stdio: 'inherit' });
+  console.log('Successful build of dist/librmmxapianapi.so');
+} catch(e) {
+  console.error('Compile failed');
+  process.exitCode = 1;
+}
@@ -10,6 +10,14 @@ if (xapianDirArg) {
   console.log('XAPIAN', process.env.XAPIAN);
 }
 
+// Threads for parallel partition search (setParallelPartitionSearch). Xapian must be built with -pthread too.
+const pthreadsFlags = process.argv.indexOf('--pthreads') > -1 ? '-pthread -s USE_PTHREADS=1 -s PTHREAD_POOL_SIZE=4 ' : '';
+
+// Upper limit in bytes for the growing heap, so that allocations fail instead of the browser killing the tab
+const maxMemoryArgName = '--maxmemory=';
+const maxMemoryArg = process.argv.find(arg => arg.indexOf(maxMemoryArgName)===0);
+const maxMemoryFlags = maxMemoryArg ? `-s MAXIMUM_MEMORY=${parseInt(maxMemoryArg.substr(maxMemoryArgName.length), 10)} ` : '';
+
 if(!process.env.XAPIAN) {
   console.error("Environment variable XAPIAN must be set to the location of xapian_core");
 } else {
@@ -19,8 +27,8 @@ if(!process.env.XAPIAN) {
       mkdirSync('dist');
     }
     execSync(`em++ -Oz -s DISABLE_EXCEPTION_CATCHING=0 -s USE_ZLIB=1 ` + 
-      `-s "EXTRA_EXPORTED_RUNTIME_METHODS=['FS','cwrap','stringToUTF8','UTF8ToString','getValue']" ` +
-      `-std=c++11 -s DEMANGLE_SUPPORT=1 -s ALLOW_MEMORY_GROWTH=1 ` +
+      `-s "EXTRA_EXPORTED_RUNTIME_METHODS=['FS','cwrap','stringToUTF8','lengthBytesUTF8','UTF8ToString','getValue']" ` +
+      `-std=c++11 -s DEMANGLE_SUPPORT=1 -s ALLOW_MEMORY_GROWTH=1 ${maxMemoryFlags}${pthreadsFlags}` +
       `-I$XAPIAN/include -I$XAPIAN -I$XAPIAN/common rmmxapianapi.cc $XAPIAN/.libs/libxapian.a ` +
       `-o dist/xapianasm.js -lidbfs.js -lnodefs.js`, { stdio: 'inherit' });
     console.log('Successful build of xapianasm.wasm and xapianasm.js');
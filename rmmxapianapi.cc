@@ -1,417 +1,6761 @@
 #include <xapian.h>
 
+#ifdef __EMSCRIPTEN__
 #include <emscripten.h>
+#include <emscripten/heap.h>
+#else
+// Native build (see compilenative.js). The javascript glue of EM_ASM is not available,
+// so functions returning results through javascript arrays return only their counts.
+#include <chrono>
+#define EMSCRIPTEN_KEEPALIVE // exported by default from the shared library
+#define EM_ASM(...) ((void)0)
+#define EM_ASM_(...) ((void)0)
+
+static double emscripten_get_now() {
+  return std::chrono::duration<double, std::milli>(
+        std::chrono::steady_clock::now().time_since_epoch()).count();
+}
+#endif
+#if !defined(__EMSCRIPTEN__) || defined(__EMSCRIPTEN_PTHREADS__)
+// Native build, or webassembly built with pthreads (compilermmxapianapi.js --pthreads)
+#define HAVE_THREADS
+#include <atomic>
+#include <condition_variable>
+#include <deque>
+#include <exception>
+#include <functional>
+#include <mutex>
+#include <thread>
+#endif
+#include <cstdint>
+#include <cstdio>
 #include <cstdlib>
+#include <cstring>
+#include <ctime>
+#include <algorithm>
 #include <climits>
 #include <fstream>
 #include <iostream>
+#ifdef __APPLE__
+#include <malloc/malloc.h>
+#else
+#include <malloc.h>
+#endif
+#include <list>
+#include <map>
+#include <sstream>
+#include <memory>
+#include <iterator>
+#include <set>
 #include <string>
+#include <unordered_map>
 #include <vector>
 #include <netinet/in.h>
+#include <zlib.h>
+#include <dirent.h>
+#include <sys/stat.h>
 
 using namespace std;
-      
-class DatabaseContainer {
+
+/**
+ * Log levels for setLogLevel. Messages above the current level are discarded.
+ */
+enum LogLevel {
+    LOG_SILENT = 0,
+    LOG_ERROR = 1,
+    LOG_WARNING = 2,
+    LOG_INFO = 3,
+    LOG_DEBUG = 4
+};
+
+static int logLevel = LOG_INFO;
+static ostream discardedLog(NULL);
+
+static ostream & logAt(int level) {
+  return level <= logLevel ? cout : discardedLog;
+}
+
+/**
+ * Entry points measured by IndexMetrics
+ */
+enum EntryPoint {
+    EP_OPEN_DATABASE,
+    EP_ADD_DATABASE,
+    EP_ADD_EMAIL,
+    EP_ADD_EMAILS_BATCH,
+    EP_DELETE_DOCUMENT,
+    EP_MODIFY_DOCUMENT,
+    EP_BULK_UPDATE,
+    EP_COMMIT,
+    EP_RELOAD,
+    EP_COMPACT,
+    EP_EXPORT,
+    EP_IMPORT,
+    EP_SORTED_QUERY,
+    EP_INCREMENTAL_QUERY,
+    EP_ARENA_QUERY,
+    EP_QUERY_INDEX,
+    EP_FOLDER_STATS,
+    EP_THREADS,
+    EP_APPLY_DELTA,
+    EP_SNIPPETS,
+    NUM_ENTRY_POINTS
+};
+
+static const char * const ENTRY_POINT_NAMES[NUM_ENTRY_POINTS] = {
+    "openDatabase",
+    "addDatabase",
+    "addSortableEmail",
+    "addSortableEmailsBatch",
+    "deleteDocument",
+    "modifyDocument",
+    "bulkUpdateDocuments",
+    "commit",
+    "reload",
+    "compact",
+    "export",
+    "import",
+    "sortedQuery",
+    "incrementalSortedQuery",
+    "sortedQueryArena",
+    "queryIndex",
+    "folderStats",
+    "threads",
+    "applyDelta",
+    "snippets"
+};
+
+/**
+ * Call counts, latencies and counters since start or the last reset, returned
+ * to javascript as JSON by getIndexMetrics
+ */
+class IndexMetrics {
 public:
-    Xapian::Database db;
-    Xapian::WritableDatabase dbw;
-    Xapian::Database dbsinglefile;
-    vector<Xapian::WritableDatabase> addedWritableDatabases;
+    // Upper bounds in milliseconds of the latency histogram buckets, the last bucket has no bound
+    static const int LATENCY_BUCKETS = 8;
 
-    Xapian::RangeProcessor *rangeProcessor;
-    
-    DatabaseContainer() {
-      rangeProcessor = NULL;
-    }
-    
-    void openDatabaseAsWritable(const char * path) {
-      dbw = Xapian::WritableDatabase(path,Xapian::DB_CREATE_OR_OPEN); 
-      db = dbw;       
-    }
-    
+    struct EntryPointMetrics {
+      uint64_t calls;
+      uint64_t errors;
+      double totalMs;
+      double maxMs;
+      uint64_t histogram[LATENCY_BUCKETS];
+    };
 
-    void openDatabaseAsReadOnly(const char * path) {
-      db = Xapian::Database(path);              
+    EntryPointMetrics entryPoints[NUM_ENTRY_POINTS];
+    uint64_t documentsIndexed;
+    uint64_t documentsDeleted;
+    uint64_t bytesIndexed; // text and document data of indexed messages
+    uint64_t bytesWritten; // written to files by database imports
+    uint64_t commits;
+    uint64_t partitionProbes; // unique term lookups to find the partition of a document
+    uint64_t partitionLoads; // partitions scanned into the routing table or attached on demand
+    uint64_t parallelQueries; // sorted queries run on the partitions in parallel
+    uint64_t cachedSortQueries; // sorted queries run on the value slot cache
+    uint64_t flagOverlayChanges; // flags set or cleared in the flag overlay
+    uint64_t flagOverlayWrites; // documents written when the flag overlay was written to them
+    uint64_t deltasApplied; // index deltas applied by applyIndexDelta
+    uint64_t tombstonesApplied; // deleted documents removed from the partitions on commit
+    string lastError;
+
+    IndexMetrics() {
+      reset();
     }
 
-    /**
-    * Needs a writable database open before adding this.
-    */
-    void addSingleFileDatabase(const char * path) {      
-      dbsinglefile = Xapian::Database(fileno(fopen(path,"r")),Xapian::DB_OPEN);
-      db.add_database(dbsinglefile);
-    }     
+    void reset() {
+      memset(entryPoints, 0, sizeof(entryPoints));
+      documentsIndexed = 0;
+      documentsDeleted = 0;
+      bytesIndexed = 0;
+      bytesWritten = 0;
+      commits = 0;
+      partitionProbes = 0;
+      partitionLoads = 0;
+      parallelQueries = 0;
+      cachedSortQueries = 0;
+      flagOverlayChanges = 0;
+      flagOverlayWrites = 0;
+      deltasApplied = 0;
+      tombstonesApplied = 0;
+      lastError.clear();
+    }
 
-     /**
-    * Needs a writable database open before adding this.
-    */
-    void addFolderDatabase(const char * path) {  
-      const Xapian::WritableDatabase dbw = Xapian::WritableDatabase(path);
-      addedWritableDatabases.push_back(dbw);   
-      db.add_database(dbw);
-    }       
-    
-    /**
-    * set value range for the query
-    */
-    void setStringValueRange(int valueRangeSlotNumber, const char * prefix) {
-      rangeProcessor = new Xapian::RangeProcessor(valueRangeSlotNumber
-        ,prefix
-      );
-    }        
-    
-    void clearValueRange() {
-      if(rangeProcessor != NULL) {
-        delete rangeProcessor;
-        rangeProcessor=NULL;
+    void record(EntryPoint entryPoint, double ms) {
+      static const double bucketBounds[LATENCY_BUCKETS - 1] = {0.25, 1, 4, 16, 64, 256, 1024};
+      EntryPointMetrics & metrics = entryPoints[entryPoint];
+      metrics.calls++;
+      metrics.totalMs += ms;
+      metrics.maxMs = max(metrics.maxMs, ms);
+      int bucket = 0;
+      while(bucket < LATENCY_BUCKETS - 1 && ms >= bucketBounds[bucket]) {
+        bucket++;
       }
-    }     
+      metrics.histogram[bucket]++;
+    }
 
-    Xapian::WritableDatabase getWritableDatabaseForIdTerm(char * unique_term) {
-      Xapian::WritableDatabase writabledatabase = dbw;   
-      Xapian::PostingIterator p = dbw.postlist_begin(unique_term);
-      
-      if (p != dbw.postlist_end(unique_term)) {        
-        writabledatabase = dbw;
-      } else {      
-        for(int i = 0; i < addedWritableDatabases.size(); i++) {
-          Xapian::WritableDatabase partitionWritableDatabase = addedWritableDatabases[i];
-          
-          Xapian::PostingIterator p = partitionWritableDatabase.postlist_begin(unique_term);
-          if (p != partitionWritableDatabase.postlist_end(unique_term)) {                          
-            writabledatabase = partitionWritableDatabase;
-            break;
-          }
-        }
-      }
-      return writabledatabase;
+    void recordError(EntryPoint entryPoint, const string & message) {
+      entryPoints[entryPoint].errors++;
+      lastError = message;
     }
 
-    Xapian::Document getDocumentByUniqueTerm(char * unique_term, Xapian::WritableDatabase * writabledatabasePtr) {
-      Xapian::Document doc;   
-      Xapian::PostingIterator p = dbw.postlist_begin(unique_term);
-      
-      if (p != dbw.postlist_end(unique_term)) {
-        doc = dbw.get_document(*p);        
-        *writabledatabasePtr = dbw;        
-      } else {      
-        for(int i = 0; i < addedWritableDatabases.size(); i++) {
-          Xapian::WritableDatabase partitionWritableDatabase = addedWritableDatabases[i];
-          
-          Xapian::PostingIterator p = partitionWritableDatabase.postlist_begin(unique_term);
-          if (p != partitionWritableDatabase.postlist_end(unique_term)) {
-            
-            doc = partitionWritableDatabase.get_document(*p);
-            *writabledatabasePtr = partitionWritableDatabase;
-            break;
-          }
+    string toJSON() const {
+      ostringstream json;
+      json << "{\"entryPoints\":{";
+      bool first = true;
+      for(int n = 0; n < NUM_ENTRY_POINTS; n++) {
+        const EntryPointMetrics & metrics = entryPoints[n];
+        if(metrics.calls == 0 && metrics.errors == 0) {
+          continue;
+        }
+        json << (first ? "" : ",") << "\"" << ENTRY_POINT_NAMES[n] << "\":{"
+             << "\"calls\":" << metrics.calls
+             << ",\"errors\":" << metrics.errors
+             << ",\"totalMs\":" << metrics.totalMs
+             << ",\"maxMs\":" << metrics.maxMs
+             << ",\"histogram\":[";
+        for(int bucket = 0; bucket < LATENCY_BUCKETS; bucket++) {
+          json << (bucket > 0 ? "," : "") << metrics.histogram[bucket];
         }
+        json << "]}";
+        first = false;
       }
-      return doc;
+      json << "},\"documentsIndexed\":" << documentsIndexed
+           << ",\"documentsDeleted\":" << documentsDeleted
+           << ",\"bytesIndexed\":" << bytesIndexed
+           << ",\"bytesWritten\":" << bytesWritten
+           << ",\"commits\":" << commits
+           << ",\"partitionProbes\":" << partitionProbes
+           << ",\"partitionLoads\":" << partitionLoads
+           << ",\"parallelQueries\":" << parallelQueries
+           << ",\"cachedSortQueries\":" << cachedSortQueries
+           << ",\"flagOverlayChanges\":" << flagOverlayChanges
+           << ",\"flagOverlayWrites\":" << flagOverlayWrites
+           << ",\"deltasApplied\":" << deltasApplied
+           << ",\"tombstonesApplied\":" << tombstonesApplied
+           << ",\"lastError\":\"";
+      for(const char c : lastError) {
+        if(c == '"' || c == '\\') {
+          json << '\\' << c;
+        } else if((unsigned char) c < 0x20) {
+          json << ' ';
+        } else {
+          json << c;
+        }
+      }
+      json << "\"}";
+      return json.str();
     }
 };
 
-DatabaseContainer *dbc;
+static IndexMetrics metrics;
 
-extern "C" {
-    void EMSCRIPTEN_KEEPALIVE initXapianIndex(const char * path) {                
-        dbc = new DatabaseContainer();
-        dbc->openDatabaseAsWritable(path);
-        
-        cout << "Xapian writable database opened" <<endl;        
+/**
+ * Keeps the heap within a budget where memory is scarce (e.g. mobile browsers, where the
+ * webassembly heap never shrinks once grown): when more than heapBudget bytes are in use,
+ * caches that can be rebuilt are released and pending changes (which Xapian keeps in memory
+ * until commit) are committed early. Sorted queries return at most maxMatches rows per call,
+ * so that larger results are read in pages (with offset) instead of all at once.
+ */
+class MemoryGovernor {
+public:
+    // Checking the heap in use walks the allocator, so it's done at most this often
+    static constexpr double CHECK_INTERVAL_MS = 100;
+
+    double heapBudget; // bytes in use, 0 for no limit
+    unsigned int maxMatches; // rows per sorted query, 0 for no limit
+    unsigned int maxPendingChanges; // commit early when this many changes are pending, 0 for no limit
+
+    double peakHeapUsed;
+    unsigned int cacheReleases;
+    unsigned int forcedCommits;
+    unsigned int cappedQueries;
+
+    MemoryGovernor() : heapBudget(0), maxMatches(0), maxPendingChanges(0), peakHeapUsed(0),
+        cacheReleases(0), forcedCommits(0), cappedQueries(0), lastCheckAt(-CHECK_INTERVAL_MS), lastOverBudget(false) {
     }
-    
-    void EMSCRIPTEN_KEEPALIVE initXapianIndexReadOnly(const char * path) {                
-        dbc = new DatabaseContainer();
-        dbc->openDatabaseAsReadOnly(path);
-        
-        cout << "Xapian readonly database opened" <<endl;        
+
+    /**
+     * Bytes of the heap, including what the allocator has free
+     */
+    static double heapSize() {
+#ifdef __EMSCRIPTEN__
+      return emscripten_get_heap_size();
+#else
+      return mallocStatistics(false);
+#endif
     }
-    
+
     /**
-    * This will add a single file xapian database to an existing database
-    * Must init xapian index with method above before calling this
-    */
-    void EMSCRIPTEN_KEEPALIVE addSingleFileXapianIndex(const char * path) {      
-      dbc->addSingleFileDatabase(path);      
-      cout << "Xapian single file database added" <<endl;      
+     * Bytes allocated, also updating the peak
+     */
+    double heapUsed() {
+      const double used = mallocStatistics(true);
+      peakHeapUsed = max(peakHeapUsed, used);
+      return used;
     }
 
-    void EMSCRIPTEN_KEEPALIVE addFolderXapianIndex(const char * path) {      
-      dbc->addFolderDatabase(path);      
-      cout << "Xapian folder database added" <<endl;      
+    bool overBudget() {
+      if(heapBudget <= 0) {
+        return false;
+      }
+      const double now = emscripten_get_now();
+      if(now - lastCheckAt >= CHECK_INTERVAL_MS) {
+        lastCheckAt = now;
+        // Nothing to walk while the whole heap is within the budget
+        lastOverBudget = heapSize() > heapBudget && heapUsed() > heapBudget;
+      }
+      return lastOverBudget;
     }
-    
-    int EMSCRIPTEN_KEEPALIVE getDocCount() {
-        return dbc->db.get_doccount();
+
+    /**
+     * Called after releasing memory, so that the next check sees it
+     */
+    void released() {
+      lastCheckAt = -CHECK_INTERVAL_MS;
     }
-    
-    int EMSCRIPTEN_KEEPALIVE getLastDocid() {
-        return dbc->db.get_lastdocid();
+
+    bool pendingChangesCapped(unsigned int pendingChanges) const {
+      return maxPendingChanges > 0 && pendingChanges >= maxPendingChanges;
     }
 
     /**
-      * For emails
-      */
-    void EMSCRIPTEN_KEEPALIVE addSortableEmailToXapianIndex(char * idterm,
-              char * from,
-              char * sortablefrom,
-              char * fromemailaddress,
-              int numRecipients,
-              const char ** recipients,
-              char * subject,
-              char * sortablesubject,
-              char * datestring,
-              double size,
-              char * text,
-              char * folder, // Set to null if N/A
-              int flags // From LSB: seen_flag, flagged_flag, answered_flag, attachment
-              ) {
-
+     * The row limit a query asking for maxresults rows (negative for all) is capped at, or 0
+     */
+    unsigned int matchCap(int maxresults) const {
+      return maxMatches > 0 && (maxresults < 0 || (unsigned int) maxresults > maxMatches) ? maxMatches : 0;
+    }
 
-      // Set up a TermGenerator that we'll use in indexing.
-      Xapian::TermGenerator termgenerator;
+    int capMatches(int maxresults) {
+      if(matchCap(maxresults) > 0) {
+        cappedQueries++;
+        return maxMatches;
+      }
+      return maxresults;
+    }
 
-      termgenerator.set_max_word_length(32);
+    /**
+     * At most limit, and at most maxMatches if set, e.g. for the matches kept by incremental search
+     */
+    unsigned int capRows(unsigned int limit) const {
+      return maxMatches > 0 && maxMatches < limit ? maxMatches : limit;
+    }
 
-      Xapian::Document doc;
-      termgenerator.set_document(doc);
-      
-      termgenerator.index_text_without_positions(datestring);
-      termgenerator.index_text_without_positions(datestring,1,"D");
-      termgenerator.index_text_without_positions(fromemailaddress); // Also allow searching by email address though only name is displayed      
-      termgenerator.index_text_without_positions(fromemailaddress,1,"A"); // Also allow searching by email address though only name is displayed      
-      termgenerator.index_text_without_positions(from,1,"A");
-      termgenerator.index_text_without_positions(from);
-      termgenerator.index_text_without_positions(subject,1,"S");      
-      termgenerator.index_text_without_positions(subject);      
-      termgenerator.index_text_without_positions(text);
-      
-      const int seen = flags & 0x01;
-      const int flagged = (flags >> 1) & 0x01;
-      const int answered = (flags >> 2) & 0x01;
-      const int attachment = (flags >> 3) & 0x01;
-      
-      for(int n=0;n<numRecipients;n++) {
-        const char * recipient = recipients[n];
-        termgenerator.index_text_without_positions(recipient);
-        termgenerator.index_text_without_positions(recipient,1,"XTO");
-        string termstring;
-        termstring.append("XRECIPIENT:");
-        termstring.append(recipient);
-        doc.add_term(termstring);
-      }
+private:
+    /**
+     * Bytes in use, or with used false the bytes the allocator got from the system
+     */
+    static double mallocStatistics(bool used) {
+#if defined(__APPLE__)
+      // There's no mallinfo on macOS, NULL sums the statistics of all malloc zones
+      malloc_statistics_t statistics;
+      malloc_zone_statistics(NULL, &statistics);
+      return used ? statistics.size_in_use : statistics.size_allocated;
+#else
+#if defined(__GLIBC__) && (__GLIBC__ > 2 || (__GLIBC__ == 2 && __GLIBC_MINOR__ >= 33))
+      const struct mallinfo2 info = mallinfo2(); // mallinfo is deprecated, and its int fields overflow
+#else
+      const struct mallinfo info = mallinfo();
+#endif
+      return used ? (double) info.uordblks + info.hblkhd : (double) info.arena + info.hblkhd;
+#endif
+    }
 
-      doc.add_value(0,sortablefrom);
-      doc.add_value(1,sortablesubject);
-      doc.add_value(2,datestring);
-      doc.add_value(3,Xapian::sortable_serialise(size));
-      doc.add_value(4,Xapian::sortable_serialise(seen)); // Seen ( deprecated )
-      
-      char *buffer;
+    double lastCheckAt;
+    bool lastOverBudget;
+};
 
-      asprintf(&buffer, "%s\t%s\t%s\t%s", idterm,from, subject,fromemailaddress);
-      doc.set_data(buffer);
-      free(buffer);
+static MemoryGovernor memoryGovernor;
 
-      doc.add_term(idterm);
-      if(folder!=NULL) {
-        // Add folder term
-        asprintf(&buffer,"XFOLDER:%s",folder);
-        doc.add_term(buffer);
-        free(buffer);        
-        if(seen==0) {          
-          // If unread message add to unread folder
-          asprintf(&buffer,"XUNREADFOLDER:%s",folder);
-          doc.add_term(buffer);
-          free(buffer);        
-        }
-      }
+/**
+ * Records the time from construction to destruction as a call of the entry point
+ */
+class ScopedTimer {
+    const EntryPoint entryPoint;
+    const double start;
 
-      if(seen) {
-        doc.add_term("XFseen");
-      }
+public:
+    explicit ScopedTimer(EntryPoint entrypoint) :
+        entryPoint(entrypoint), start(emscripten_get_now()) {}
 
-      if(flagged) {        
-        doc.add_term("XFflagged");
-      }
+    ~ScopedTimer() {
+      metrics.record(entryPoint, emscripten_get_now() - start);
+    }
+};
 
-      if(answered) {
-        doc.add_term("XFanswered");
-      }
+static void reportError(EntryPoint entryPoint, const Xapian::Error & e) {
+  metrics.recordError(entryPoint, string(e.get_type()) + ": " + e.get_msg());
+  logAt(LOG_ERROR) << "Error: " << e.get_type() << " "
+            << e.get_msg() << " "
+            << (e.get_error_string() != NULL ? e.get_error_string() : "") << " "
+            << e.get_description()
+            << endl;
+}
+      
+/**
+ * Reads length prefixed fields from a buffer packed on the javascript side
+ */
+class PackedBufferReader {
+public:
+    PackedBufferReader(const unsigned char * buffer, size_t length) :
+      buffer(buffer), length(length), pos(0) {
+    }
 
-       if(attachment) {
-        doc.add_term("XFattachment");
+    bool readUint32(uint32_t & value) {
+      if(length - pos < 4) {
+        return false;
       }
+      value = (uint32_t)buffer[pos] |
+              ((uint32_t)buffer[pos+1] << 8) |
+              ((uint32_t)buffer[pos+2] << 16) |
+              ((uint32_t)buffer[pos+3] << 24);
+      pos += 4;
+      return true;
+    }
 
-      try {                
-        Xapian::WritableDatabase dbw = dbc->getWritableDatabaseForIdTerm(idterm);
-        dbw.replace_document(idterm, doc);
-      } catch(const Xapian::DatabaseError &e) {
-        cout << "Replace document error:" << e.get_msg() << endl;
-        throw(e);
+    bool readDouble(double & value) {
+      if(length - pos < sizeof(double)) {
+        return false;
       }
-    }
-  
-    void EMSCRIPTEN_KEEPALIVE deleteDocumentByUniqueTerm(char * unique_term) {
-      Xapian::WritableDatabase dbw = dbc->getWritableDatabaseForIdTerm(unique_term);
-      dbw.delete_document(unique_term);
+      memcpy(&value, buffer + pos, sizeof(double));
+      pos += sizeof(double);
+      return true;
     }
 
-    int EMSCRIPTEN_KEEPALIVE deleteDocumentFromAddedWritablesByUniqueTerm(char * unique_term) {
-      for(int i = 0; i < dbc->addedWritableDatabases.size(); i++) {
-        Xapian::WritableDatabase dbw = dbc->addedWritableDatabases[i];
-        
-        Xapian::PostingIterator p = dbw.postlist_begin(unique_term);
-        if (p != dbw.postlist_end(unique_term)) {
-            dbw.delete_document(*p); // sometimes leads to Databasecorrupt error (unexpected end of posting list)
-            cout << "Deleted document with term id " << unique_term 
-                 << " and doc id "
-                 << *p << " from partition " << i << endl;
-      
-            /*dbw.replace_document(*p, Xapian::Document()); // Replace with empty document
-            cout << "Replaced document with term id " << unique_term 
-                 << " and doc id "
-                 << *p << " with empty doc in partition " << i << endl; */
-            return i;
+    /**
+     * A length of 0xffffffff denotes a missing (null) string, reported through isset if given
+     */
+    bool readString(string & value, bool * isset = NULL) {
+      uint32_t stringlength;
+      if(!readUint32(stringlength)) {
+        return false;
+      }
+      if(stringlength == 0xffffffff) {
+        value.clear();
+        if(isset != NULL) {
+          *isset = false;
         }
+        return true;
       }
-      return -1;
-    }    
+      if(length - pos < stringlength) {
+        return false;
+      }
+      value.assign((const char *)buffer + pos, stringlength);
+      pos += stringlength;
+      if(isset != NULL) {
+        *isset = true;
+      }
+      return true;
+    }
 
-    void EMSCRIPTEN_KEEPALIVE closeDatabase() {      
-      dbc->db.close();
-      for(Xapian::WritableDatabase dbw : dbc->addedWritableDatabases) {
-        dbw.close();
+    /**
+     * A string written by ResultArena::appendString, which is followed by a 0 byte
+     */
+    bool readTerminatedString(string & value) {
+      if(!readString(value) || pos == length) {
+        return false;
       }
-      delete dbc;
-      cout << "Database closed" << endl;
+      pos++;
+      return true;
     }
-    
-    void EMSCRIPTEN_KEEPALIVE reloadDatabase() {
-        dbc->db.reopen();
-        cout << "Database reopened" << endl;
+
+private:
+    const unsigned char * buffer;
+    size_t length;
+    size_t pos;
+};
+
+/**
+ * Growable buffer of little endian uint32 values and length prefixed strings
+ * which javascript reads directly from the heap
+ */
+class ResultArena {
+public:
+    static const uint32_t VERSION = 1;
+    static const uint32_t SORTED_ROWS_VERSION = 2; // sortedXapianQueryArena, with the row limit
+
+    void clear() {
+      bytes.clear();
     }
-    
-    void EMSCRIPTEN_KEEPALIVE commitXapianUpdates() {
-        dbc->dbw.commit();
-        for(Xapian::WritableDatabase dbw : dbc->addedWritableDatabases) {
-          dbw.commit();
-        }
+
+    void release() {
+      vector<unsigned char>().swap(bytes);
     }
-    
-    void EMSCRIPTEN_KEEPALIVE compactDatabase() {
-        dbc->db.compact("xapianglasscompact",Xapian::DBCOMPACT_SINGLE_FILE);
+
+    size_t size() const {
+      return bytes.size();
     }
-    
-    void EMSCRIPTEN_KEEPALIVE compactToWritableDatabase(char * path) {
-      dbc->db.compact(path);
-   }
 
-    void EMSCRIPTEN_KEEPALIVE getDocumentData(int id,char * returned_idterm) {
-        //cout << "get doc data: " <<   db.get_document(id).get_data()  <<endl;
-        strcpy(returned_idterm,dbc->db.get_document(id).get_data().c_str());
+    size_t capacity() const {
+      return bytes.capacity();
     }
 
-    void EMSCRIPTEN_KEEPALIVE getStringValue(int docid,int slot, char * returnstring) {
-       strcpy(returnstring,dbc->db.get_document(docid).get_value(slot).c_str());
+    const unsigned char * data() const {
+      return bytes.data();
     }
-    
-    void EMSCRIPTEN_KEEPALIVE setStringValue(int docid, int slot, char * valuestring) {
-        Xapian::Document doc = dbc->db.get_document(docid);
-        doc.add_value(slot,valuestring);
-        dbc->dbw.replace_document(docid,doc);
+
+    void appendUint32(uint32_t value) {
+      const size_t pos = bytes.size();
+      bytes.resize(pos + 4);
+      setUint32(pos, value);
     }
 
-    double EMSCRIPTEN_KEEPALIVE getNumericValue(int docid,int slot) {
-       return Xapian::sortable_unserialise(dbc->db.get_document(docid).get_value(slot));
+    void setUint32(size_t pos, uint32_t value) {
+      bytes[pos] = value & 0xff;
+      bytes[pos+1] = (value >> 8) & 0xff;
+      bytes[pos+2] = (value >> 16) & 0xff;
+      bytes[pos+3] = (value >> 24) & 0xff;
     }
-    
-    void EMSCRIPTEN_KEEPALIVE addTermToDocument(char * unique_id_term, char * term) {
-      Xapian::WritableDatabase writabledatabase;
-      Xapian::Document doc = dbc->getDocumentByUniqueTerm(unique_id_term, &writabledatabase);
-      doc.add_term(term);
-      writabledatabase.replace_document(unique_id_term,doc);     
+
+    void appendString(const char * str, size_t length) {
+      appendUint32(length);
+      bytes.insert(bytes.end(), str, str + length);
+      bytes.push_back(0);
     }
 
-    void EMSCRIPTEN_KEEPALIVE removeTermFromDocument(char * unique_id_term, char * term) {
-      Xapian::WritableDatabase writabledatabase;
-      Xapian::Document doc = dbc->getDocumentByUniqueTerm(unique_id_term, &writabledatabase);
-      doc.remove_term(term);
-      writabledatabase.replace_document(unique_id_term,doc);     
+    void appendString(const string & str) {
+      appendString(str.data(), str.size());
     }
-    
-    void EMSCRIPTEN_KEEPALIVE addTextToDocument(char * unique_id_term, bool without_positions, char * text) {
-      Xapian::WritableDatabase writabledatabase;
-      Xapian::Document doc = dbc->getDocumentByUniqueTerm(unique_id_term, &writabledatabase);
-      
-      // Set up a TermGenerator that we'll use in indexing.
-      Xapian::TermGenerator termgenerator;
 
-      termgenerator.set_max_word_length(32);
-      termgenerator.set_document(doc);
-      if(without_positions) {
-        termgenerator.index_text_without_positions(text);
+private:
+    vector<unsigned char> bytes;
+};
+
+/**
+ * Document data of an email: id term, from, subject and from address. Written as
+ *
+ *   0x00, version (1), flags, then every field as its varint byte length and the bytes
+ *
+ * With DATA_NUMERIC_ID the id term is Q followed by a number, written as a varint
+ * instead of a field, and with DATA_FROM_IS_ADDRESS from equals the from address and
+ * is written empty. Records of earlier versions are the tab separated fields starting
+ * with the id term (never a 0 byte), and are read just the same.
+ */
+class DocumentDataRecord {
+public:
+    enum Field { ID_TERM, FROM, SUBJECT, FROM_EMAIL_ADDRESS, NUM_FIELDS };
+
+    static const unsigned char VERSION = 1;
+    static const unsigned char DATA_NUMERIC_ID = 0x01;
+    static const unsigned char DATA_FROM_IS_ADDRESS = 0x02;
+
+    /**
+     * Replace data with the record, reusing its capacity
+     */
+    static void encode(string & data, const string & idterm, const string & from,
+          const string & subject, const string & fromemailaddress) {
+      uint64_t numericid = 0;
+      unsigned char flags = 0;
+      if(parseNumericIdTerm(idterm, numericid)) {
+        flags |= DATA_NUMERIC_ID;
+      }
+      if(from == fromemailaddress) {
+        flags |= DATA_FROM_IS_ADDRESS;
+      }
+
+      data.clear();
+      data.push_back(0);
+      data.push_back(VERSION);
+      data.push_back(flags);
+      if(flags & DATA_NUMERIC_ID) {
+        appendVarint(data, numericid);
       } else {
-        termgenerator.index_text(text);
+        appendField(data, idterm);
       }
-      writabledatabase.replace_document(unique_id_term,doc);     
+      appendField(data, (flags & DATA_FROM_IS_ADDRESS) ? string() : from);
+      appendField(data, subject);
+      appendField(data, fromemailaddress);
     }
 
-    void EMSCRIPTEN_KEEPALIVE changeDocumentsFolder(char * unique_id_term, char * folder) {      
-      Xapian::WritableDatabase writabledatabase;
-      Xapian::Document doc = dbc->getDocumentByUniqueTerm(unique_id_term, &writabledatabase);
-      
-      Xapian::TermIterator termitbeg = doc.termlist_begin();
-      Xapian::TermIterator termitend = doc.termlist_end();
-      
-      
-      bool unread = false;
-      for (Xapian::TermIterator tm = termitbeg; tm != termitend; ++tm) {    
-        if((*tm).find("XFOLDER:") == 0) {          
-          doc.remove_term((*tm));          
-        } else if((*tm).find("XUNREADFOLDER:") == 0) {
-          doc.remove_term((*tm));      
-          unread = true;              
-        }
-      }       
-
-      char * buffer;
-      asprintf(&buffer,"XFOLDER:%s",folder);
-      doc.add_term(buffer);
-      
-      if(unread) {
-        char * buffer;
-        asprintf(&buffer,"XUNREADFOLDER:%s",folder);
-        doc.add_term(buffer);
+    /**
+     * Finds the field boundaries, data must outlive the record
+     */
+    explicit DocumentDataRecord(const string & data) : data(data) {
+      fields.reserve(NUM_FIELDS);
+      if(data.empty() || data[0] != 0) {
+        size_t fieldstart = 0;
+        while(true) {
+          const size_t fieldend = data.find('\t', fieldstart);
+          addField(fieldstart, (fieldend == string::npos ? data.size() : fieldend) - fieldstart);
+          if(fieldend == string::npos) {
+            break;
+          }
+          fieldstart = fieldend + 1;
+        }
+        return;
       }
 
-      writabledatabase.replace_document(unique_id_term,doc);     
+      if(data.size() < 3 || (unsigned char) data[1] != VERSION) {
+        return; // Written by a later version, no fields
+      }
+      const unsigned char flags = data[2];
+      size_t pos = 3;
+      uint64_t length = 0;
+      if(flags & DATA_NUMERIC_ID) {
+        uint64_t numericid = 0;
+        if(!readVarint(pos, numericid)) {
+          return;
+        }
+        idterm.assign("Q").append(to_string(numericid));
+        addField(string::npos, idterm.size());
+      }
+      while(fields.size() < NUM_FIELDS && readVarint(pos, length) && length <= data.size() - pos) {
+        addField(pos, length);
+        pos += length;
+      }
+      if((flags & DATA_FROM_IS_ADDRESS) && fields.size() == NUM_FIELDS) {
+        fields[FROM] = fields[FROM_EMAIL_ADDRESS];
+      }
     }
 
     /**
-    * set value range for the query
-    */
-    void EMSCRIPTEN_KEEPALIVE setStringValueRange(int valueRangeSlotNumber, char * prefix) {
-      dbc->setStringValueRange(valueRangeSlotNumber,prefix);
+     * Number of fields, more than NUM_FIELDS for earlier records with tabs in fields
+     */
+    size_t size() const {
+      return fields.size();
     }
-    
-    void EMSCRIPTEN_KEEPALIVE clearValueRange() {
-      dbc->clearValueRange();
+
+    const char * getFieldData(size_t n) const {
+      return fields[n].first == string::npos ? idterm.data() : data.data() + fields[n].first;
     }
-    
-    int EMSCRIPTEN_KEEPALIVE getDocIdFromUniqueIdTerm(char * unique_id_term) {
-      Xapian::PostingIterator p = dbc->db.postlist_begin(unique_id_term);
-      
-      if (p != dbc->db.postlist_end(unique_id_term)) {
-        return *p;
+
+    size_t getFieldLength(size_t n) const {
+      return fields[n].second;
+    }
+
+    string getField(size_t n) const {
+      return n < fields.size() ? string(getFieldData(n), getFieldLength(n)) : string();
+    }
+
+    /**
+     * The fields separated by tabs, as stored by earlier versions
+     */
+    void appendTabSeparated(string & out) const {
+      for(size_t n = 0; n < fields.size(); n++) {
+        if(n > 0) {
+          out.push_back('\t');
+        }
+        out.append(getFieldData(n), getFieldLength(n));
+      }
+    }
+
+private:
+    static bool parseNumericIdTerm(const string & idterm, uint64_t & numericid) {
+      // Q0 or Q followed by up to 18 digits without leading zeros, so that it reads back the same
+      if(idterm.size() < 2 || idterm.size() > 19 || idterm[0] != 'Q' ||
+          (idterm[1] == '0' && idterm.size() > 2)) {
+        return false;
+      }
+      numericid = 0;
+      for(size_t n = 1; n < idterm.size(); n++) {
+        if(idterm[n] < '0' || idterm[n] > '9') {
+          return false;
+        }
+        numericid = numericid * 10 + (idterm[n] - '0');
+      }
+      return true;
+    }
+
+    static void appendVarint(string & out, uint64_t value) {
+      while(value >= 0x80) {
+        out.push_back((char) ((value & 0x7f) | 0x80));
+        value >>= 7;
+      }
+      out.push_back((char) value);
+    }
+
+    static void appendField(string & out, const string & field) {
+      appendVarint(out, field.size());
+      out.append(field);
+    }
+
+    bool readVarint(size_t & pos, uint64_t & value) const {
+      value = 0;
+      for(int shift = 0; pos < data.size() && shift < 64; shift += 7) {
+        const unsigned char byte = data[pos++];
+        value |= (uint64_t) (byte & 0x7f) << shift;
+        if(!(byte & 0x80)) {
+          return true;
+        }
+      }
+      return false;
+    }
+
+    void addField(size_t start, size_t length) {
+      fields.push_back(make_pair(start, length));
+    }
+
+    const string & data;
+    string idterm; // of DATA_NUMERIC_ID records
+    vector<pair<size_t, size_t> > fields; // start (npos for idterm) and length
+};
+
+/**
+ * A row of a sorted query result
+ */
+struct SortedMatch {
+    Xapian::docid docid; // of the combined database
+    Xapian::doccount collapseCount;
+    Xapian::Document document; // fetched with the match for result arenas, or empty
+};
+
+/**
+ * With withdocuments the documents of the matches are fetched together (see MSet::fetch)
+ * instead of one by one when the rows are read
+ */
+static void appendSortedMatches(vector<SortedMatch> & matches, const Xapian::MSet & mset,
+      bool withdocuments = false) {
+  if(withdocuments) {
+    mset.fetch();
+  }
+  matches.reserve(matches.size() + mset.size());
+  for (Xapian::MSetIterator m = mset.begin(); m != mset.end(); ++m) {
+    SortedMatch match;
+    match.docid = *m;
+    match.collapseCount = m.get_collapse_count();
+    if(withdocuments) {
+      match.document = m.get_document();
+    }
+    matches.push_back(match);
+  }
+}
+
+/**
+ * Values of selected slots for every document of a combined database, in docid indexed
+ * arrays of dictionary codes per slot. Sorting, collapsing and reading the values of rows
+ * can then use the arrays instead of reading documents. Built on first use after the set
+ * of databases changed, and kept up to date by the changes of documents.
+ */
+class ValueSlotCache {
+public:
+    class Column {
+    public:
+        Xapian::valueno slot;
+        vector<uint32_t> codes; // per docid, 0 for no value
+        vector<string> dictionary; // per code, the empty value first
+
+        explicit Column(Xapian::valueno slot) : slot(slot) {
+          clear();
+        }
+
+        void clear() {
+          codes.clear();
+          dictionary.assign(1, string());
+          codesByValue.clear();
+          codesByValue[string()] = 0;
+          ranks.clear();
+        }
+
+        uint32_t encode(const string & value) {
+          const pair<unordered_map<string, uint32_t>::iterator, bool> entry =
+                codesByValue.insert(make_pair(value, (uint32_t) dictionary.size()));
+          if(entry.second) {
+            dictionary.push_back(value);
+            ranks.clear();
+          }
+          return entry.first->second;
+        }
+
+        /**
+         * Position of every code in sort order of the values (as Xapian sorts by value)
+         */
+        const vector<uint32_t> & getRanks() {
+          if(ranks.size() != dictionary.size()) {
+            vector<uint32_t> order(dictionary.size());
+            for(uint32_t code = 0; code < order.size(); code++) {
+              order[code] = code;
+            }
+            sort(order.begin(), order.end(), [this](uint32_t a, uint32_t b) {
+              return dictionary[a] < dictionary[b];
+            });
+            ranks.resize(order.size());
+            for(uint32_t rank = 0; rank < order.size(); rank++) {
+              ranks[order[rank]] = rank;
+            }
+          }
+          return ranks;
+        }
+
+    private:
+        unordered_map<string, uint32_t> codesByValue;
+        vector<uint32_t> ranks;
+    };
+
+    ValueSlotCache() : built(false) {
+      for(Xapian::valueno slot = 0; slot <= 4; slot++) {
+        columns.push_back(Column(slot));
+      }
+    }
+
+    void setSlots(const vector<Xapian::valueno> & slots) {
+      columns.clear();
+      for(Xapian::valueno slot : slots) {
+        columns.push_back(Column(slot));
+      }
+      invalidate();
+    }
+
+    bool isBuilt() const {
+      return built;
+    }
+
+    void invalidate() {
+      built = false;
+      present.clear();
+      for(Column & column : columns) {
+        column.clear();
+      }
+    }
+
+    /**
+     * Invalidate and give the memory back to the allocator
+     */
+    void release() {
+      built = false;
+      vector<bool>().swap(present);
+      for(Column & column : columns) {
+        column = Column(column.slot);
+      }
+    }
+
+    /**
+     * Approximate bytes allocated
+     */
+    double memoryUsage() const {
+      double bytes = present.capacity() / 8;
+      for(const Column & column : columns) {
+        bytes += column.codes.capacity() * sizeof(uint32_t);
+        for(const string & value : column.dictionary) {
+          // Also a key of codesByValue
+          bytes += 2 * (sizeof(string) + value.capacity()) + sizeof(uint32_t);
+        }
+      }
+      return bytes;
+    }
+
+    void build(const Xapian::Database & db) {
+      invalidate();
+      const Xapian::docid lastdocid = db.get_lastdocid();
+      present.assign(lastdocid + 1, false);
+      for(Xapian::PostingIterator p = db.postlist_begin(""); p != db.postlist_end(""); ++p) {
+        present[*p] = true;
+      }
+      for(Column & column : columns) {
+        column.codes.assign(lastdocid + 1, 0);
+        const Xapian::ValueIterator end = db.valuestream_end(column.slot);
+        for(Xapian::ValueIterator v = db.valuestream_begin(column.slot); v != end; ++v) {
+          column.codes[v.get_docid()] = column.encode(*v);
+        }
+      }
+      built = true;
+    }
+
+    /**
+     * The column of slot, or NULL if not cached
+     */
+    Column * getColumn(int slot) {
+      for(Column & column : columns) {
+        if((int) column.slot == slot) {
+          return &column;
+        }
+      }
+      return NULL;
+    }
+
+    bool hasDocument(Xapian::docid docid) const {
+      return docid < present.size() && present[docid];
+    }
+
+    /**
+     * Value of a cached slot
+     */
+    const string & getValue(const Column & column, Xapian::docid docid) const {
+      return column.dictionary[docid < column.codes.size() ? column.codes[docid] : 0];
+    }
+
+    void setDocument(Xapian::docid docid, const Xapian::Document & doc) {
+      if(!built) {
+        return;
+      }
+      grow(docid);
+      present[docid] = true;
+      for(Column & column : columns) {
+        column.codes[docid] = column.encode(doc.get_value(column.slot));
+      }
+    }
+
+    void setValue(Xapian::docid docid, Xapian::valueno slot, const string & value) {
+      if(!built) {
+        return;
+      }
+      for(Column & column : columns) {
+        if(column.slot == slot) {
+          grow(docid);
+          column.codes[docid] = column.encode(value);
+        }
+      }
+    }
+
+    void removeDocument(Xapian::docid docid) {
+      if(!built || docid >= present.size()) {
+        return;
+      }
+      present[docid] = false;
+      for(Column & column : columns) {
+        column.codes[docid] = 0;
+      }
+    }
+
+    size_t numDocIds() const {
+      return present.size();
+    }
+
+    /**
+     * Sort docids by the values of sortcolumn (ties in docid order, like a sorted query on the
+     * combined database) and add rows offset to offset + maxresults to matches, collapsing
+     * rows with the same (non empty) value of collapsecolumn unless it is NULL
+     */
+    void sortDocuments(vector<Xapian::docid> & docids, Column & sortcolumn, bool reverse,
+          Column * collapsecolumn, Xapian::doccount offset, Xapian::doccount maxresults,
+          vector<SortedMatch> & matches) {
+      const vector<uint32_t> & ranks = sortcolumn.getRanks();
+      const vector<uint32_t> & codes = sortcolumn.codes;
+      const auto before = [&ranks, &codes, reverse](Xapian::docid a, Xapian::docid b) {
+        const uint32_t ranka = ranks[codes[a]];
+        const uint32_t rankb = ranks[codes[b]];
+        if(ranka != rankb) {
+          return reverse ? ranka > rankb : ranka < rankb;
+        }
+        return a < b;
+      };
+      const size_t wanted = maxresults > UINT_MAX - offset ?
+            docids.size() : min<size_t>(docids.size(), offset + maxresults);
+
+      if(collapsecolumn == NULL) {
+        partial_sort(docids.begin(), docids.begin() + wanted, docids.end(), before);
+        for(size_t n = offset; n < wanted; n++) {
+          SortedMatch match;
+          match.docid = docids[n];
+          match.collapseCount = 0;
+          matches.push_back(match);
+        }
+        return;
+      }
+
+      // Every document is visited, so that the collapse counts are exact
+      sort(docids.begin(), docids.end(), before);
+      const int NOT_KEPT = -2;
+      vector<int> rowsByCode(collapsecolumn->dictionary.size(), -1);
+      vector<SortedMatch> rows;
+      for(Xapian::docid docid : docids) {
+        const uint32_t code = collapsecolumn->codes[docid];
+        if(code != 0 && rowsByCode[code] != -1) {
+          if(rowsByCode[code] != NOT_KEPT) {
+            rows[rowsByCode[code]].collapseCount++;
+          }
+          continue;
+        }
+        if(rows.size() >= wanted) {
+          if(code != 0) {
+            rowsByCode[code] = NOT_KEPT;
+          }
+          continue;
+        }
+        if(code != 0) {
+          rowsByCode[code] = rows.size();
+        }
+        SortedMatch match;
+        match.docid = docid;
+        match.collapseCount = 0;
+        rows.push_back(match);
+      }
+      if(rows.size() > offset) {
+        matches.insert(matches.end(), rows.begin() + offset, rows.end());
+      }
+    }
+
+
+private:
+    void grow(Xapian::docid docid) {
+      if(docid < present.size()) {
+        return;
+      }
+      present.resize(docid + 1, false);
+      for(Column & column : columns) {
+        column.codes.resize(docid + 1, 0);
+      }
+    }
+
+    bool built;
+    vector<bool> present;
+    vector<Column> columns;
+};
+
+/**
+ * Write the rows of a sorted query into the arena, see sortedXapianQueryArena for the layout
+ */
+static void writeSortedResultArena(ResultArena & arena, const Xapian::Database & db,
+      const vector<SortedMatch> & matches, int collapsevaluenum,
+      const int valueslots[], int numvalueslots, ValueSlotCache * valuecache, unsigned int cappedat) {
+  vector<ValueSlotCache::Column *> cachedcolumns(numvalueslots, (ValueSlotCache::Column *) NULL);
+  if(valuecache != NULL) {
+    for (int slot = 0; slot < numvalueslots; slot++) {
+      cachedcolumns[slot] = valuecache->getColumn(valueslots[slot]);
+    }
+  }
+
+  arena.clear();
+  arena.appendUint32(ResultArena::SORTED_ROWS_VERSION);
+  arena.appendUint32(matches.size());
+  arena.appendUint32(numvalueslots);
+  arena.appendUint32(0); // total bytes, set when done
+  arena.appendUint32(cappedat);
+
+  const size_t rowoffsetspos = arena.size();
+  for (size_t n = 0; n < matches.size(); n++) {
+    arena.appendUint32(0);
+  }
+
+  int n=0;
+  for (const SortedMatch & match : matches) {
+    arena.setUint32(rowoffsetspos + 4 * n++, arena.size());
+
+    const Xapian::Document doc = match.document.get_docid() != 0 ? match.document : db.get_document(match.docid);
+    arena.appendUint32(match.docid);
+    arena.appendUint32(collapsevaluenum>-1 ? match.collapseCount : 0);
+    for (int slot = 0; slot < numvalueslots; slot++) {
+      if(cachedcolumns[slot] != NULL) {
+        arena.appendString(valuecache->getValue(*cachedcolumns[slot], match.docid));
+      } else {
+        arena.appendString(doc.get_value(valueslots[slot]));
+      }
+    }
+
+    const string data = doc.get_data();
+    const DocumentDataRecord record(data);
+    arena.appendUint32(record.size());
+    for (size_t field = 0; field < record.size(); field++) {
+      arena.appendString(record.getFieldData(field), record.getFieldLength(field));
+    }
+  }
+  arena.setUint32(12, arena.size());
+}
+
+/**
+ * Days since 1970-01-01 of a date of the proleptic Gregorian calendar
+ */
+static int64_t daysFromCivil(int64_t year, int month, int day) {
+  year -= month <= 2;
+  const int64_t era = (year >= 0 ? year : year - 399) / 400;
+  const int64_t yearofera = year - era * 400;
+  const int64_t dayofyear = (153 * (month > 2 ? month - 3 : month + 9) + 2) / 5 + day - 1;
+  const int64_t dayofera = yearofera * 365 + yearofera / 4 - yearofera / 100 + dayofyear;
+  return era * 146097 + dayofera - 719468;
+}
+
+static void civilFromDays(int64_t days, int & year, int & month, int & day) {
+  days += 719468;
+  const int64_t era = (days >= 0 ? days : days - 146096) / 146097;
+  const int64_t dayofera = days - era * 146097;
+  const int64_t yearofera = (dayofera - dayofera / 1460 + dayofera / 36524 - dayofera / 146096) / 365;
+  const int64_t dayofyear = dayofera - (365 * yearofera + yearofera / 4 - yearofera / 100);
+  const int64_t shiftedmonth = (5 * dayofyear + 2) / 153;
+  day = dayofyear - (153 * shiftedmonth + 2) / 5 + 1;
+  month = shiftedmonth < 10 ? shiftedmonth + 3 : shiftedmonth - 9;
+  year = yearofera + era * 400 + (month <= 2);
+}
+
+static int daysInMonth(int year, int month) {
+  return daysFromCivil(month == 12 ? year + 1 : year, month == 12 ? 1 : month + 1, 1) -
+         daysFromCivil(year, month, 1);
+}
+
+/**
+ * Dates of emails: datestrings (YYYYMMDDHHmm in UTC) in slot 2, the same as seconds since
+ * the epoch (sortable_serialise) in slot 5, and year (XDY2024) and month (XDM202401) bucket
+ * terms. Times below are minutes since the epoch.
+ *
+ * As range processor it parses date:begin..end (either may be left out) where begin and end
+ * are dates of any precision (2024, 2024-01, 2024-01-15, 202401151230), today, thismonth,
+ * thisyear, or a number of days, weeks, months or years ago (30d, 2w, 6m, 1y). The end
+ * includes its whole period, so date:2024-01..2024-06 is the first half of 2024 and date:30d..
+ * the last 30 days. Whole years and months of the range match by their bucket terms, and only
+ * the months at the edges check the value. Indexes with documents without the slot 5 value
+ * (indexed by earlier versions) fall back to a range on the datestrings.
+ */
+class EmailDateRangeProcessor : public Xapian::RangeProcessor {
+public:
+    static const Xapian::valueno DATESTRING_SLOT = 2;
+    static const Xapian::valueno EPOCH_SLOT = 5;
+
+    explicit EmailDateRangeProcessor(const Xapian::Database & db) :
+        Xapian::RangeProcessor(EPOCH_SLOT, "date:"), db(db) {
+    }
+
+    /**
+     * Add the epoch value and bucket terms of a datestring, unless it's not a valid date
+     */
+    static void addDateToDocument(Xapian::Document & doc, const string & datestring) {
+      int64_t start;
+      int64_t end;
+      if(!parseDate(datestring, start, end)) {
+        return;
+      }
+      int year, month, day;
+      civilFromDays(floorDiv(start, MINUTES_PER_DAY), year, month, day);
+      doc.add_value(EPOCH_SLOT, Xapian::sortable_serialise((double) start * 60));
+      doc.add_term(yearTerm(year));
+      doc.add_term(monthTerm(year, month));
+    }
+
+    static int64_t currentDay() {
+      return floorDiv(time(NULL), 24 * 60 * 60);
+    }
+
+    /**
+     * True while some documents have no epoch value (indexed before it was added), so that
+     * ranges are matched on the datestrings. Part of parsed query cache keys, since it
+     * changes the parsed query as documents are added.
+     */
+    bool usesDatestrings() const {
+      const Xapian::doccount doccount = db.get_doccount();
+      return doccount == 0 || db.get_value_freq(EPOCH_SLOT) < doccount;
+    }
+
+    Xapian::Query operator()(const string & begin, const string & end) {
+      int64_t start = 0;
+      int64_t endexclusive = 0;
+      int64_t ignored;
+      if((!begin.empty() && !parseBound(begin, start, ignored)) ||
+          (!end.empty() && !parseBound(end, ignored, endexclusive))) {
+        return Xapian::Query(Xapian::Query::OP_INVALID); // Leave it to the other range processors
+      }
+      if(!begin.empty() && !end.empty() && start >= endexclusive) {
+        return Xapian::Query::MatchNothing;
+      }
+
+      if(usesDatestrings()) {
+        return datestringRangeQuery(begin.empty(), start, end.empty(), endexclusive);
+      }
+
+      // Not clamped to the dates in the index, since parsed queries are cached while documents
+      // are added. Open and very long ranges are value ranges instead of bucket terms.
+      if(begin.empty() && end.empty()) {
+        return Xapian::Query::MatchAll;
+      } else if(begin.empty()) {
+        return Xapian::Query(Xapian::Query::OP_VALUE_LE, EPOCH_SLOT, Xapian::sortable_serialise((double) (endexclusive - 1) * 60));
+      } else if(end.empty()) {
+        return Xapian::Query(Xapian::Query::OP_VALUE_GE, EPOCH_SLOT, Xapian::sortable_serialise((double) start * 60));
+      } else if(endexclusive - start > MAX_BUCKET_YEARS * 366 * MINUTES_PER_DAY) {
+        return epochRangeQuery(start, endexclusive);
+      }
+      return bucketRangeQuery(start, endexclusive);
+    }
+
+    /**
+     * Period of a date of any precision from the year (2024) to the minute (202401151230),
+     * optionally with separators (2024-01-15 12:30)
+     */
+    static bool parseDate(const string & text, int64_t & start, int64_t & end) {
+      string digits;
+      for(const char c : text) {
+        if(c >= '0' && c <= '9') {
+          digits.push_back(c);
+        } else if(c != '-' && c != ':' && c != ' ' && c != 'T') {
+          return false;
+        }
+      }
+      if(digits.size() < 4 || digits.size() > 12 || digits.size() % 2 != 0) {
+        return false;
+      }
+      const int year = atoi(digits.substr(0, 4).c_str());
+      const int month = digits.size() >= 6 ? atoi(digits.substr(4, 2).c_str()) : 1;
+      const int day = digits.size() >= 8 ? atoi(digits.substr(6, 2).c_str()) : 1;
+      const int hour = digits.size() >= 10 ? atoi(digits.substr(8, 2).c_str()) : 0;
+      const int minute = digits.size() >= 12 ? atoi(digits.substr(10, 2).c_str()) : 0;
+      if(month < 1 || month > 12 || day < 1 || day > daysInMonth(year, month) || hour > 23 || minute > 59) {
+        return false;
+      }
+      start = daysFromCivil(year, month, day) * MINUTES_PER_DAY + hour * 60 + minute;
+      switch(digits.size()) {
+        case 4: end = monthStart(year + 1, 1); break;
+        case 6: end = monthStart(month == 12 ? year + 1 : year, month == 12 ? 1 : month + 1); break;
+        case 8: end = start + MINUTES_PER_DAY; break;
+        case 10: end = start + 60; break;
+        default: end = start + 1;
+      }
+      return true;
+    }
+
+private:
+    static const int64_t MINUTES_PER_DAY = 24 * 60;
+    static const int64_t MAX_BUCKET_YEARS = 100;
+
+    static int64_t floorDiv(int64_t value, int64_t divisor) {
+      return value >= 0 ? value / divisor : -((-value + divisor - 1) / divisor);
+    }
+
+    static int64_t monthStart(int year, int month) {
+      return daysFromCivil(year, month, 1) * MINUTES_PER_DAY;
+    }
+
+    static string yearTerm(int year) {
+      char term[16];
+      snprintf(term, sizeof(term), "XDY%04d", year);
+      return term;
+    }
+
+    static string monthTerm(int year, int month) {
+      char term[16];
+      snprintf(term, sizeof(term), "XDM%04d%02d", year, month);
+      return term;
+    }
+
+    static string datestring(int64_t minutes) {
+      int year, month, day;
+      const int64_t days = floorDiv(minutes, MINUTES_PER_DAY);
+      const int minuteofday = minutes - days * MINUTES_PER_DAY;
+      civilFromDays(days, year, month, day);
+      char text[32];
+      snprintf(text, sizeof(text), "%04d%02d%02d%02d%02d", year, month, day, minuteofday / 60, minuteofday % 60);
+      return text;
+    }
+
+    /**
+     * A date or a period relative to the current day
+     */
+    static bool parseBound(const string & text, int64_t & start, int64_t & end) {
+      const int64_t today = currentDay();
+      int year, month, day;
+      civilFromDays(today, year, month, day);
+      if(text == "today") {
+        start = today * MINUTES_PER_DAY;
+        end = start + MINUTES_PER_DAY;
+      } else if(text == "thismonth") {
+        start = monthStart(year, month);
+        end = today * MINUTES_PER_DAY + MINUTES_PER_DAY;
+      } else if(text == "thisyear") {
+        start = monthStart(year, 1);
+        end = today * MINUTES_PER_DAY + MINUTES_PER_DAY;
+      } else if(text.size() >= 2 && text.find_first_not_of("0123456789") == text.size() - 1) {
+        const int count = atoi(text.c_str());
+        int64_t days;
+        switch(text[text.size() - 1]) {
+          case 'd': days = today - count; break;
+          case 'w': days = today - 7 * count; break;
+          case 'm':
+          case 'y': {
+            const int months = year * 12 + (month - 1) - (text[text.size() - 1] == 'm' ? count : 12 * count);
+            const int agoyear = floorDiv(months, 12);
+            const int agomonth = months - agoyear * 12 + 1;
+            days = daysFromCivil(agoyear, agomonth, min(day, daysInMonth(agoyear, agomonth)));
+            break;
+          }
+          default: return false;
+        }
+        start = days * MINUTES_PER_DAY;
+        end = start + MINUTES_PER_DAY;
+      } else {
+        return parseDate(text, start, end);
+      }
+      return true;
+    }
+
+    /**
+     * Whole years and months of [start, end) by their bucket terms, and the months at the edges
+     * by their bucket terms filtered by the value
+     */
+    static Xapian::Query bucketRangeQuery(int64_t start, int64_t end) {
+      const Xapian::Query valuerange = epochRangeQuery(start, end);
+      vector<Xapian::Query> buckets;
+      int year, month, day;
+      civilFromDays(floorDiv(start, MINUTES_PER_DAY), year, month, day);
+      while(monthStart(year, month) < end) {
+        if(month == 1 && start <= monthStart(year, 1) && monthStart(year + 1, 1) <= end) {
+          buckets.push_back(Xapian::Query(yearTerm(year)));
+          year++;
+          continue;
+        }
+        const int nextyear = month == 12 ? year + 1 : year;
+        const int nextmonth = month == 12 ? 1 : month + 1;
+        if(start <= monthStart(year, month) && monthStart(nextyear, nextmonth) <= end) {
+          buckets.push_back(Xapian::Query(monthTerm(year, month)));
+        } else {
+          buckets.push_back(Xapian::Query(Xapian::Query::OP_FILTER, Xapian::Query(monthTerm(year, month)), valuerange));
+        }
+        year = nextyear;
+        month = nextmonth;
+      }
+      return Xapian::Query(Xapian::Query::OP_OR, buckets.begin(), buckets.end());
+    }
+
+    static Xapian::Query epochRangeQuery(int64_t start, int64_t end) {
+      return Xapian::Query(Xapian::Query::OP_VALUE_RANGE, EPOCH_SLOT,
+            Xapian::sortable_serialise((double) start * 60), Xapian::sortable_serialise((double) (end - 1) * 60));
+    }
+
+    static Xapian::Query datestringRangeQuery(bool openstart, int64_t start, bool openend, int64_t end) {
+      if(openstart && openend) {
+        return Xapian::Query::MatchAll;
+      } else if(openstart) {
+        return Xapian::Query(Xapian::Query::OP_VALUE_LE, DATESTRING_SLOT, datestring(end - 1));
+      } else if(openend) {
+        return Xapian::Query(Xapian::Query::OP_VALUE_GE, DATESTRING_SLOT, datestring(start));
+      }
+      return Xapian::Query(Xapian::Query::OP_VALUE_RANGE, DATESTRING_SLOT, datestring(start), datestring(end - 1));
+    }
+
+    Xapian::Database db;
+};
+
+static bool documentHasTerm(const Xapian::Document & doc, const string & term) {
+  Xapian::TermIterator tm = doc.termlist_begin();
+  tm.skip_to(term);
+  return tm != doc.termlist_end() && *tm == term;
+}
+
+/**
+ * Flag terms (XFseen, XFflagged, ...) set or cleared without rewriting the documents, by
+ * writable partition and docid within the partition. An entry overrides the term in the
+ * document. Flag queries see the overlay through FlagFieldProcessor, and it's persisted in
+ * the metadata of every partition on commit, until written to the documents in one go
+ * (see DatabaseContainer::writeFlagOverlay).
+ */
+class FlagOverlay {
+public:
+    static const uint32_t VERSION = 1;
+
+    struct Partition {
+      string uuid;
+      map<string, map<Xapian::docid, bool> > flags; // flag term -> docid -> set or cleared
+      bool modified; // since loaded or persisted
+    };
+
+    vector<Partition> partitions; // In the order of DatabaseContainer::getWritablePartition
+
+    FlagOverlay() : entries(0) {
+    }
+
+    static bool isFlagTerm(const string & term) {
+      return term.compare(0, 2, "XF") == 0 && term.compare(0, 8, "XFOLDER:") != 0;
+    }
+
+    bool empty() const {
+      return entries == 0;
+    }
+
+    size_t size() const {
+      return entries;
+    }
+
+    void reset() {
+      partitions.clear();
+      entries = 0;
+    }
+
+    /**
+     * Add the next partition with the overlay persisted in its metadata
+     */
+    void addPartition(const Xapian::Database & partitiondb) {
+      Partition partition;
+      partition.uuid = partitiondb.get_uuid();
+      partition.modified = false;
+      const string persisted = partitiondb.get_metadata("flagoverlay");
+      PackedBufferReader reader((const unsigned char *) persisted.data(), persisted.size());
+      if(!persisted.empty() && !unserialise(reader, partition)) {
+        logAt(LOG_WARNING) << "Ignoring invalid flag overlay of " << partition.uuid << endl;
+        partition.flags.clear();
+      }
+      for(const pair<const string, map<Xapian::docid, bool> > & flag : partition.flags) {
+        entries += flag.second.size();
+      }
+      partitions.push_back(partition);
+    }
+
+    /**
+     * Index of the partition with the uuid, or -1
+     */
+    int findPartition(const string & uuid) const {
+      for(size_t n = 0; n < partitions.size(); n++) {
+        if(partitions[n].uuid == uuid) {
+          return n;
+        }
+      }
+      return -1;
+    }
+
+    void set(int partition, Xapian::docid docid, const string & term, bool present) {
+      Partition & overlay = partitions[partition];
+      const pair<map<Xapian::docid, bool>::iterator, bool> inserted =
+            overlay.flags[term].insert(make_pair(docid, present));
+      if(inserted.second) {
+        entries++;
+      } else {
+        inserted.first->second = present;
+      }
+      overlay.modified = true;
+    }
+
+    /**
+     * Drop the entry of a flag of a document, when back to the flag state of the document
+     */
+    void erase(int partition, Xapian::docid docid, const string & term) {
+      Partition & overlay = partitions[partition];
+      const map<string, map<Xapian::docid, bool> >::iterator flag = overlay.flags.find(term);
+      if(flag != overlay.flags.end() && flag->second.erase(docid) > 0) {
+        entries--;
+        overlay.modified = true;
+      }
+    }
+
+    /**
+     * Returns false if the overlay has nothing for the flag of the document
+     */
+    bool get(int partition, Xapian::docid docid, const string & term, bool & present) const {
+      if(entries == 0 || partition < 0 || partition >= (int) partitions.size()) {
+        return false;
+      }
+      const map<string, map<Xapian::docid, bool> > & flags = partitions[partition].flags;
+      const map<string, map<Xapian::docid, bool> >::const_iterator flag = flags.find(term);
+      if(flag == flags.end()) {
+        return false;
+      }
+      const map<Xapian::docid, bool>::const_iterator entry = flag->second.find(docid);
+      if(entry == flag->second.end()) {
+        return false;
+      }
+      present = entry->second;
+      return true;
+    }
+
+    /**
+     * Drop the entries of a document, when it's deleted or written with its current flags
+     */
+    void removeDocument(int partition, Xapian::docid docid) {
+      if(entries == 0 || partition >= (int) partitions.size()) {
+        return;
+      }
+      Partition & overlay = partitions[partition];
+      for(pair<const string, map<Xapian::docid, bool> > & flag : overlay.flags) {
+        if(flag.second.erase(docid) > 0) {
+          entries--;
+          overlay.modified = true;
+        }
+      }
+    }
+
+    /**
+     * Set the flag terms of the document as overridden by the overlay
+     */
+    void applyToDocument(int partition, Xapian::docid docid, Xapian::Document & doc) const {
+      if(entries == 0 || partition >= (int) partitions.size()) {
+        return;
+      }
+      for(const pair<const string, map<Xapian::docid, bool> > & flag : partitions[partition].flags) {
+        const map<Xapian::docid, bool>::const_iterator entry = flag.second.find(docid);
+        if(entry == flag.second.end()) {
+          continue;
+        }
+        const bool has = documentHasTerm(doc, flag.first);
+        if(entry->second && !has) {
+          doc.add_term(flag.first);
+        } else if(!entry->second && has) {
+          doc.remove_term(flag.first);
+        }
+      }
+    }
+
+    /**
+     * Docids of the partition with the flag set (or cleared) by the overlay, in order
+     */
+    void getDocIds(int partition, const string & term, bool present, vector<Xapian::docid> & docids) const {
+      docids.clear();
+      if(partition < 0 || partition >= (int) partitions.size()) {
+        return;
+      }
+      const map<string, map<Xapian::docid, bool> > & flags = partitions[partition].flags;
+      const map<string, map<Xapian::docid, bool> >::const_iterator flag = flags.find(term);
+      if(flag == flags.end()) {
+        return;
+      }
+      for(const pair<const Xapian::docid, bool> & entry : flag->second) {
+        if(entry.second == present) {
+          docids.push_back(entry.first);
+        }
+      }
+    }
+
+    void clearPartition(int partition) {
+      Partition & overlay = partitions[partition];
+      for(const pair<const string, map<Xapian::docid, bool> > & flag : overlay.flags) {
+        entries -= flag.second.size();
+      }
+      overlay.flags.clear();
+      overlay.modified = true;
+    }
+
+    /**
+     * Format: version, number of flags, and for each flag the term, number of entries and
+     * for each entry the docid and 1 if set or 0 if cleared
+     */
+    static void serialise(const Partition & partition, ResultArena & out) {
+      out.appendUint32(VERSION);
+      out.appendUint32(partition.flags.size());
+      for(const pair<const string, map<Xapian::docid, bool> > & flag : partition.flags) {
+        out.appendString(flag.first);
+        out.appendUint32(flag.second.size());
+        for(const pair<const Xapian::docid, bool> & entry : flag.second) {
+          out.appendUint32(entry.first);
+          out.appendUint32(entry.second ? 1 : 0);
+        }
+      }
+    }
+
+private:
+    static bool unserialise(PackedBufferReader & in, Partition & partition) {
+      uint32_t version;
+      uint32_t numflags;
+      if(!in.readUint32(version) || version != VERSION || !in.readUint32(numflags)) {
+        return false;
+      }
+      for(uint32_t n = 0; n < numflags; n++) {
+        string term;
+        uint32_t numentries;
+        if(!in.readTerminatedString(term) || !in.readUint32(numentries)) {
+          return false;
+        }
+        map<Xapian::docid, bool> & flag = partition.flags[term];
+        for(uint32_t e = 0; e < numentries; e++) {
+          uint32_t docid;
+          uint32_t present;
+          if(!in.readUint32(docid) || !in.readUint32(present)) {
+            return false;
+          }
+          flag[docid] = present != 0;
+        }
+      }
+      return true;
+    }
+
+    size_t entries;
+};
+
+/**
+ * Documents of a shard with a flag set or cleared by the flag overlay, read when the
+ * query is run so that parsed queries stay valid while the overlay changes
+ */
+class FlagPostingSource : public Xapian::PostingSource {
+public:
+    FlagPostingSource(shared_ptr<const FlagOverlay> overlay, const string & term, bool present) :
+        overlay(overlay), term(term), present(present), pos(0), started(false) {
+    }
+
+    Xapian::PostingSource * clone() const {
+      return new FlagPostingSource(overlay, term, present);
+    }
+
+    void init(const Xapian::Database & shard) {
+      overlay->getDocIds(overlay->findPartition(shard.get_uuid()), term, present, docids);
+      pos = 0;
+      started = false;
+    }
+
+    Xapian::doccount get_termfreq_min() const {
+      return docids.size();
+    }
+
+    Xapian::doccount get_termfreq_est() const {
+      return docids.size();
+    }
+
+    Xapian::doccount get_termfreq_max() const {
+      return docids.size();
+    }
+
+    void next(double) {
+      if(started) {
+        pos++;
+      } else {
+        started = true;
+      }
+    }
+
+    void skip_to(Xapian::docid did, double) {
+      started = true;
+      pos = lower_bound(docids.begin() + pos, docids.end(), did) - docids.begin();
+    }
+
+    bool at_end() const {
+      return pos >= docids.size();
+    }
+
+    Xapian::docid get_docid() const {
+      return docids[pos];
+    }
+
+private:
+    shared_ptr<const FlagOverlay> overlay;
+    string term;
+    bool present;
+    vector<Xapian::docid> docids;
+    size_t pos;
+    bool started;
+};
+
+/**
+ * The flag: prefix of the sorted query parser, matching the flag term as overridden by the
+ * flag overlay. Plain terms while the overlay is empty, so the parsed query cache must be
+ * cleared when it gets its first entry.
+ */
+class FlagFieldProcessor : public Xapian::FieldProcessor {
+public:
+    explicit FlagFieldProcessor(shared_ptr<const FlagOverlay> overlay) : overlay(overlay) {
+    }
+
+    Xapian::Query operator()(const string & flag) {
+      return flagQuery(overlay, "XF" + flag);
+    }
+
+    static Xapian::Query flagQuery(shared_ptr<const FlagOverlay> overlay, const string & term) {
+      if(overlay->empty()) {
+        return Xapian::Query(term);
+      }
+      const Xapian::Query cleared((new FlagPostingSource(overlay, term, false))->release());
+      const Xapian::Query set((new FlagPostingSource(overlay, term, true))->release());
+      return Xapian::Query(Xapian::Query::OP_OR,
+            Xapian::Query(Xapian::Query::OP_AND_NOT, Xapian::Query(term), cleared), set);
+    }
+
+private:
+    shared_ptr<const FlagOverlay> overlay;
+};
+
+/**
+ * Documents deleted since the last commit, by writable partition and docid within the partition.
+ * Queries leave them out right away (see TombstonePostingSource), and they are deleted from the
+ * partitions in docid order on commit (see DatabaseContainer::applyTombstones), rather than with
+ * a delete_document for every message in between queries.
+ */
+class Tombstones {
+public:
+    struct Partition {
+      string uuid;
+      set<Xapian::docid> docids;
+    };
+
+    vector<Partition> partitions; // In the order of DatabaseContainer::getWritablePartition
+
+    Tombstones() : entries(0) {
+    }
+
+    bool empty() const {
+      return entries == 0;
+    }
+
+    size_t size() const {
+      return entries;
+    }
+
+    void reset() {
+      partitions.clear();
+      entries = 0;
+    }
+
+    void addPartition(const Xapian::Database & partitiondb) {
+      Partition partition;
+      partition.uuid = partitiondb.get_uuid();
+      partitions.push_back(partition);
+    }
+
+    /**
+     * Returns -1 if no writable partition has the uuid
+     */
+    int findPartition(const string & uuid) const {
+      for(size_t partition = 0; partition < partitions.size(); partition++) {
+        if(partitions[partition].uuid == uuid) {
+          return partition;
+        }
+      }
+      return -1;
+    }
+
+    void add(int partition, Xapian::docid docid) {
+      if(partitions[partition].docids.insert(docid).second) {
+        entries++;
+      }
+    }
+
+    /**
+     * For a docid reused by a document added after the delete
+     */
+    void erase(int partition, Xapian::docid docid) {
+      if(entries > 0 && partitions[partition].docids.erase(docid) > 0) {
+        entries--;
+      }
+    }
+
+    bool contains(int partition, Xapian::docid docid) const {
+      return entries > 0 && partition >= 0 && partitions[partition].docids.count(docid) > 0;
+    }
+
+    void getDocIds(int partition, vector<Xapian::docid> & docids) const {
+      docids.clear();
+      if(partition >= 0) {
+        docids.assign(partitions[partition].docids.begin(), partitions[partition].docids.end());
+      }
+    }
+
+    void clear() {
+      for(Partition & partition : partitions) {
+        partition.docids.clear();
+      }
+      entries = 0;
+    }
+
+private:
+    size_t entries;
+};
+
+/**
+ * Deleted documents of a shard, read when the query is run like FlagPostingSource
+ */
+class TombstonePostingSource : public Xapian::PostingSource {
+public:
+    explicit TombstonePostingSource(shared_ptr<const Tombstones> tombstones) :
+        tombstones(tombstones), pos(0), started(false) {
+    }
+
+    Xapian::PostingSource * clone() const {
+      return new TombstonePostingSource(tombstones);
+    }
+
+    void init(const Xapian::Database & shard) {
+      tombstones->getDocIds(tombstones->findPartition(shard.get_uuid()), docids);
+      pos = 0;
+      started = false;
+    }
+
+    Xapian::doccount get_termfreq_min() const {
+      return docids.size();
+    }
+
+    Xapian::doccount get_termfreq_est() const {
+      return docids.size();
+    }
+
+    Xapian::doccount get_termfreq_max() const {
+      return docids.size();
+    }
+
+    void next(double) {
+      if(started) {
+        pos++;
+      } else {
+        started = true;
+      }
+    }
+
+    void skip_to(Xapian::docid did, double) {
+      started = true;
+      pos = lower_bound(docids.begin() + pos, docids.end(), did) - docids.begin();
+    }
+
+    bool at_end() const {
+      return pos >= docids.size();
+    }
+
+    Xapian::docid get_docid() const {
+      return docids[pos];
+    }
+
+private:
+    shared_ptr<const Tombstones> tombstones;
+    vector<Xapian::docid> docids;
+    size_t pos;
+    bool started;
+};
+
+/**
+ * Turns message text into terms with one term generator reused for every message: optional
+ * stemming and stop words for a language, and limits on the body text indexed. The settings
+ * are stored in the database metadata (see DatabaseContainer::configureIndexing), since queries
+ * must be parsed with the same stemmer and stop words as the terms were generated with.
+ */
+class IndexingPipeline {
+public:
+    static const int VERSION = 3;
+
+    // Value slot of the start of the body text kept for snippets, see addSnippetText
+    static const Xapian::valueno SNIPPET_SLOT = 6;
+    static const size_t MAX_SNIPPET_BYTES = 4096;
+
+    enum StripFlags {
+      STRIP_QUOTED = 1, // lines starting with '>', and everything after an "-----Original Message-----" line
+      STRIP_SIGNATURE = 2 // everything after a "-- " signature separator line
+    };
+
+    struct Settings {
+      string language; // stemmer language (see Xapian::Stem), empty for no stemming
+      string stopwords; // separated by spaces
+      size_t maxBodyBytes; // 0 for no limit
+      int strip; // StripFlags
+      size_t snippetBytes; // of the body kept for snippets, 0 for none
+      bool unstemmedTerms; // Some documents were indexed without the stems of the language
+
+      Settings() : maxBodyBytes(0), strip(0), snippetBytes(0), unstemmedTerms(false) {
+      }
+
+      /**
+       * Format: version, language, stopwords, maxBodyBytes, strip, snippetBytes and
+       * unstemmedTerms on one line each. Version 1 had no snippetBytes, version 2 no
+       * unstemmedTerms.
+       */
+      string serialise() const {
+        ostringstream out;
+        out << VERSION << '\n' << language << '\n' << stopwords << '\n' << maxBodyBytes << '\n' << strip << '\n'
+            << snippetBytes << '\n' << (unstemmedTerms ? 1 : 0) << '\n';
+        return out.str();
+      }
+
+      bool unserialise(const string & serialised) {
+        istringstream in(serialised);
+        int version = 0;
+        string line;
+        if(!(in >> version) || version < 1 || version > VERSION || !getline(in, line) ||
+            !getline(in, language) || !getline(in, stopwords) || !(in >> maxBodyBytes >> strip) ||
+            (version >= 2 && !(in >> snippetBytes)) || (version >= 3 && !(in >> unstemmedTerms))) {
+          *this = Settings();
+          return false;
+        }
+        return true;
+      }
+    };
+
+    Xapian::TermGenerator termGenerator;
+
+    IndexingPipeline() {
+      configure(Settings());
+    }
+
+    const Settings & getSettings() const {
+      return settings;
+    }
+
+    /**
+     * Throws Xapian::InvalidArgumentError if the language has no stemmer
+     */
+    void configure(const Settings & newsettings) {
+      const Xapian::Stem newstemmer = newsettings.language.empty() ? Xapian::Stem() : Xapian::Stem(newsettings.language);
+      settings = newsettings;
+      settings.snippetBytes = min(settings.snippetBytes, MAX_SNIPPET_BYTES);
+      stemmer = newstemmer;
+      stopper.reset();
+      istringstream words(settings.stopwords);
+      string word;
+      while(words >> word) {
+        if(!stopper) {
+          stopper.reset(new Xapian::SimpleStopper());
+        }
+        stopper->add(word);
+      }
+
+      termGenerator = Xapian::TermGenerator();
+      termGenerator.set_max_word_length(32);
+      termGenerator.set_stemmer(stemmer);
+      termGenerator.set_stemming_strategy(settings.language.empty() ?
+            Xapian::TermGenerator::STEM_NONE : Xapian::TermGenerator::STEM_SOME);
+      termGenerator.set_stopper(stopper.get());
+      termGenerator.set_stopper_strategy(Xapian::TermGenerator::STOP_ALL);
+    }
+
+    /**
+     * Parse queries as the terms were generated. The query parser refers to the stopper,
+     * so it must not be used after the next configure. Plain words parse to stems only,
+     * see searchesUnstemmed for documents indexed without them.
+     */
+    void configureQueryParser(Xapian::QueryParser & queryparser) const {
+      queryparser.set_stemmer(stemmer);
+      queryparser.set_stemming_strategy(settings.language.empty() ?
+            Xapian::QueryParser::STEM_NONE : Xapian::QueryParser::STEM_SOME);
+      queryparser.set_stopper(stopper.get());
+    }
+
+    const Xapian::Stem & getStemmer() const {
+      return stemmer;
+    }
+
+    /**
+     * Whether queries must also match words unstemmed, since some documents were indexed
+     * before the language was set (or with another language) and have no stems of it
+     */
+    bool searchesUnstemmed() const {
+      return !settings.language.empty() && settings.unstemmedTerms;
+    }
+
+    /**
+     * The part of the message body to index: without quoted text and signature if configured,
+     * and cut at maxBodyBytes (at a UTF-8 character boundary). Returns text if nothing is left out,
+     * otherwise a buffer valid until the next call.
+     */
+    const string & prepareBody(const string & text) {
+      const string * body = &text;
+      if(settings.strip != 0) {
+        stripBody(text, bodyBuffer);
+        body = &bodyBuffer;
+      }
+      if(settings.maxBodyBytes > 0 && body->size() > settings.maxBodyBytes) {
+        size_t length = settings.maxBodyBytes;
+        while(length > 0 && ((unsigned char) (*body)[length] & 0xC0) == 0x80) {
+          length--;
+        }
+        if(body != &bodyBuffer) {
+          bodyBuffer.assign(text, 0, length);
+          body = &bodyBuffer;
+        } else {
+          bodyBuffer.resize(length);
+        }
+      }
+      return *body;
+    }
+
+    /**
+     * Keep the first snippetBytes of the (prepared) body in the snippet slot, with runs of
+     * whitespace and control characters as single spaces. Stored as a format byte, then
+     * either the text (SNIPPET_TEXT) or its length as a varint and the text compressed
+     * with zlib (SNIPPET_DEFLATE), whichever is shorter.
+     */
+    void addSnippetText(Xapian::Document & doc, const string & body) {
+      if(settings.snippetBytes == 0) {
+        return;
+      }
+      string & text = snippetBuffer;
+      text.clear();
+      for(size_t n = 0; n < body.size() && text.size() < settings.snippetBytes; n++) {
+        const unsigned char c = body[n];
+        if(c <= ' ' || c == 0x7f) {
+          if(!text.empty() && text[text.size() - 1] != ' ') {
+            text.push_back(' ');
+          }
+        } else {
+          text.push_back(c);
+        }
+      }
+      // Leave out a UTF-8 character cut at the end
+      size_t lead = text.size();
+      while(lead > 0 && ((unsigned char) text[lead - 1] & 0xC0) == 0x80) {
+        lead--;
+      }
+      if(lead > 0) {
+        const unsigned char c = text[lead - 1];
+        const size_t charlength = c >= 0xF0 ? 4 : c >= 0xE0 ? 3 : c >= 0xC0 ? 2 : 1;
+        if(text.size() - (lead - 1) < charlength) {
+          text.resize(lead - 1);
+        }
+      }
+      if(text.empty()) {
+        return;
+      }
+
+      uLongf compressedlength = compressBound(text.size());
+      compressedBuffer.resize(compressedlength);
+      string & value = snippetValueBuffer;
+      value.clear();
+      if(compress2((Bytef *) &compressedBuffer[0], &compressedlength,
+              (const Bytef *) text.data(), text.size(), Z_BEST_COMPRESSION) == Z_OK &&
+            compressedlength + 3 < text.size()) {
+        value.push_back(SNIPPET_DEFLATE);
+        for(size_t length = text.size(); ; length >>= 7) {
+          if(length < 0x80) {
+            value.push_back((char) length);
+            break;
+          }
+          value.push_back((char) ((length & 0x7f) | 0x80));
+        }
+        value.append(&compressedBuffer[0], compressedlength);
+      } else {
+        value.push_back(SNIPPET_TEXT);
+        value.append(text);
+      }
+      doc.add_value(SNIPPET_SLOT, value);
+    }
+
+    /**
+     * The text of a snippet slot value, false if there is none
+     */
+    static bool readSnippetText(const string & value, string & text) {
+      if(value.empty()) {
+        return false;
+      }
+      if(value[0] == SNIPPET_TEXT) {
+        text.assign(value, 1, string::npos);
+        return true;
+      }
+      if(value[0] != SNIPPET_DEFLATE) {
+        return false;
+      }
+      size_t pos = 1;
+      uLongf length = 0;
+      for(int shift = 0; ; shift += 7) {
+        if(pos >= value.size() || shift > 28) {
+          return false;
+        }
+        const unsigned char byte = value[pos++];
+        length |= (uLongf) (byte & 0x7f) << shift;
+        if(!(byte & 0x80)) {
+          break;
+        }
+      }
+      if(length > MAX_SNIPPET_BYTES) {
+        return false;
+      }
+      text.resize(length);
+      return length == 0 || (uncompress((Bytef *) &text[0], &length,
+            (const Bytef *) value.data() + pos, value.size() - pos) == Z_OK && length == text.size());
+    }
+
+private:
+    enum SnippetFormat {
+      SNIPPET_TEXT = 0,
+      SNIPPET_DEFLATE = 1
+    };
+
+    void stripBody(const string & text, string & out) const {
+      out.clear();
+      size_t start = 0;
+      while(start < text.size()) {
+        size_t end = text.find('\n', start);
+        if(end == string::npos) {
+          end = text.size();
+        }
+        size_t linestart = start;
+        size_t lineend = end > start && text[end - 1] == '\r' ? end - 1 : end;
+        start = end + 1;
+
+        if((settings.strip & STRIP_SIGNATURE) && text.compare(linestart, lineend - linestart, "-- ") == 0) {
+          break;
+        }
+        if(settings.strip & STRIP_QUOTED) {
+          if(text.compare(linestart, lineend - linestart, "-----Original Message-----") == 0) {
+            break;
+          }
+          while(linestart < lineend && (text[linestart] == ' ' || text[linestart] == '\t')) {
+            linestart++;
+          }
+          if(linestart < lineend && text[linestart] == '>') {
+            continue;
+          }
+        }
+        out.append(text, linestart, end - linestart).append(1, '\n');
+      }
+    }
+
+    Settings settings;
+    Xapian::Stem stemmer;
+    unique_ptr<Xapian::SimpleStopper> stopper;
+    string bodyBuffer;
+    string snippetBuffer;
+    string snippetValueBuffer;
+    vector<char> compressedBuffer;
+};
+
+/**
+ * Field prefixes of the sorted query parser. Boolean ones are filters matched exactly,
+ * never as a partial term (see IncrementalSearchSession::isRefinement).
+ */
+struct QueryField {
+    const char * field;
+    const char * prefix;
+    bool boolean;
+};
+
+static const QueryField SORTED_QUERY_FIELDS[] = {
+    { "flag", "XF", true }, // With a flag overlay, a FlagFieldProcessor instead
+    { "folder", "XFOLDER:", true },
+    { "unreadfolder", "XUNREADFOLDER:", true },
+    { "subject", "S", false },
+    { "from", "A", false },
+    { "to", "XTO", false },
+    { "date", "D", false },
+    { "year", "XDY", true },
+    { "month", "XDM", true }
+};
+
+/**
+ * Query parsers and enquires configured once and reused for every query until
+ * the set of databases or the range processor changes
+ */
+class QueryContext {
+public:
+    static const unsigned PARSE_FLAGS = Xapian::QueryParser::FLAG_DEFAULT | Xapian::QueryParser::FLAG_PARTIAL;
+
+    EmailDateRangeProcessor dateRangeProcessor; // Before the query parsers referring to it
+    unique_ptr<FlagFieldProcessor> flagFieldProcessor; // Also before the query parsers, if any
+    Xapian::QueryParser sortedQueryParser; // Used by sortedXapianQuery and folder counts
+    Xapian::QueryParser incrementalQueryParser; // Same fields, used by incrementalSortedXapianQuery
+    Xapian::QueryParser plainQueryParser; // Used by queryIndex
+    Xapian::Enquire sortedEnquire;
+    Xapian::Enquire plainEnquire;
+    Xapian::Enquire candidateEnquire; // Collects matches in docid order for incremental search
+    Xapian::Enquire snippetEnquire; // Weighs the query terms for snippets
+    bool searchesUnstemmed; // See IndexingPipeline::searchesUnstemmed
+
+    /**
+     * With an indexing pipeline, queries are parsed with its stemmer and stop words (so the
+     * context must not outlive its configuration). With a flag overlay, flag: queries see
+     * the flags set or cleared in it.
+     */
+    QueryContext(const Xapian::Database & db, Xapian::RangeProcessor * rangeProcessor,
+          const IndexingPipeline * pipeline = NULL,
+          shared_ptr<const FlagOverlay> flagOverlay = shared_ptr<const FlagOverlay>()) :
+        dateRangeProcessor(db), sortedEnquire(db), plainEnquire(db), candidateEnquire(db),
+        snippetEnquire(db), searchesUnstemmed(pipeline != NULL && pipeline->searchesUnstemmed()) {
+      if(flagOverlay) {
+        flagFieldProcessor.reset(new FlagFieldProcessor(flagOverlay));
+      }
+      configureSortedQueryParser(sortedQueryParser, db, rangeProcessor);
+      configureSortedQueryParser(incrementalQueryParser, db, rangeProcessor);
+      // For incremental search a partial last term expands to every term with the prefix, not
+      // just the most frequent, so that extending it only narrows the matches. Other queries
+      // keep the default limit, since a short prefix may expand to a large part of the index.
+      incrementalQueryParser.set_max_expansion(0, Xapian::Query::WILDCARD_LIMIT_ERROR,
+            Xapian::QueryParser::FLAG_PARTIAL);
+
+      plainQueryParser.set_database(db);
+      if(pipeline != NULL) {
+        pipeline->configureQueryParser(sortedQueryParser);
+        pipeline->configureQueryParser(incrementalQueryParser);
+        pipeline->configureQueryParser(plainQueryParser);
+      }
+
+      // Ties in docid order, as in the parallel and cached sorted queries
+      sortedEnquire.set_docid_order(Xapian::Enquire::ASCENDING);
+      sortedEnquire.set_weighting_scheme(Xapian::BoolWeight());
+      candidateEnquire.set_weighting_scheme(Xapian::BoolWeight());
+      candidateEnquire.set_docid_order(Xapian::Enquire::ASCENDING);
+    }
+
+    /**
+     * Parse with one of the query parsers of the context. When searching unstemmed too, the
+     * query parsed without stemming is ORed in, so that documents indexed without stems match
+     * their words as written. Negated words then only exclude such documents by either form.
+     */
+    Xapian::Query parse(Xapian::QueryParser & queryparser, const string & querystring, unsigned flags) {
+      const Xapian::Query stemmed = queryparser.parse_query(querystring, flags);
+      if(!searchesUnstemmed) {
+        return stemmed;
+      }
+      queryparser.set_stemming_strategy(Xapian::QueryParser::STEM_NONE);
+      const Xapian::Query unstemmed = queryparser.parse_query(querystring, flags);
+      queryparser.set_stemming_strategy(Xapian::QueryParser::STEM_SOME);
+      return Xapian::Query(Xapian::Query::OP_OR, stemmed, unstemmed);
+    }
+
+private:
+    void configureSortedQueryParser(Xapian::QueryParser & queryparser, const Xapian::Database & db,
+          Xapian::RangeProcessor * rangeProcessor) {
+      queryparser.set_database(db);
+      queryparser.add_rangeprocessor(&dateRangeProcessor);
+      if(rangeProcessor!=NULL) {
+        queryparser.add_rangeprocessor(rangeProcessor);
+      }
+      for(const QueryField & field : SORTED_QUERY_FIELDS) {
+        if(flagFieldProcessor && strcmp(field.field, "flag") == 0) {
+          queryparser.add_boolean_prefix(field.field, flagFieldProcessor.get());
+        } else if(field.boolean) {
+          queryparser.add_boolean_prefix(field.field, field.prefix);
+        } else {
+          queryparser.add_prefix(field.field, field.prefix);
+        }
+      }
+    }
+};
+
+/**
+ * Least recently used cache of parsed queries, so that repeating a query
+ * (e.g. when refreshing a list or typing backwards) doesn't parse it again
+ */
+class ParsedQueryCache {
+public:
+    unsigned int hits;
+    unsigned int misses;
+
+    ParsedQueryCache(size_t capacity) : hits(0), misses(0), capacity(capacity) {
+    }
+
+    bool get(const string & key, Xapian::Query & query) {
+      unordered_map<string, list<pair<string, Xapian::Query> >::iterator>::iterator it = entries.find(key);
+      if(it == entries.end()) {
+        misses++;
+        return false;
+      }
+      hits++;
+      // Move to front as most recently used
+      lru.splice(lru.begin(), lru, it->second);
+      query = it->second->second;
+      return true;
+    }
+
+    void put(const string & key, const Xapian::Query & query) {
+      if(capacity == 0) {
+        return;
+      }
+      lru.push_front(make_pair(key, query));
+      entries[key] = lru.begin();
+      if(entries.size() > capacity) {
+        entries.erase(lru.back().first);
+        lru.pop_back();
+      }
+    }
+
+    void setCapacity(size_t newcapacity) {
+      capacity = newcapacity;
+      while(entries.size() > capacity) {
+        entries.erase(lru.back().first);
+        lru.pop_back();
+      }
+    }
+
+    size_t size() const {
+      return entries.size();
+    }
+
+    void clear() {
+      entries.clear();
+      lru.clear();
+    }
+
+private:
+    size_t capacity;
+    list<pair<string, Xapian::Query> > lru;
+    unordered_map<string, list<pair<string, Xapian::Query> >::iterator> entries;
+};
+
+/**
+ * Parse with the given query parser, using the cache. parsername must identify the query
+ * parser (including its prefixes) and rangekey its range processor in the cache key.
+ * The current day and whether date ranges are matched on datestrings are part of the key
+ * too, since ranges may be relative to the day and the latter changes as documents are added.
+ */
+static Xapian::Query parseCachedQuery(ParsedQueryCache & cache, QueryContext & context,
+      Xapian::QueryParser & queryparser, const char * parsername, const string & rangekey,
+      const string & querystring) {
+  string key;
+  key.reserve(querystring.size() + rangekey.size() + 16);
+  key.append(parsername).append(1, '\0')
+     .append(rangekey).append(1, '\0')
+     .append(to_string(EmailDateRangeProcessor::currentDay())).append(context.dateRangeProcessor.usesDatestrings() ? "d" : "e")
+     .append(1, '\0')
+     .append(querystring);
+
+  Xapian::Query query;
+  if(!cache.get(key, query)) {
+    query = context.parse(queryparser, querystring, QueryContext::PARSE_FLAGS);
+    cache.put(key, query);
+  }
+  return query;
+}
+
+static Xapian::MSet runSortedEnquire(Xapian::Enquire & enquire, const Xapian::Query & query,
+      int sortvaluenum, bool reverse, int offset, int maxresults, int collapsevaluenum) {
+  enquire.set_query(query);        
+  enquire.set_sort_by_value(sortvaluenum,reverse);
+  enquire.set_collapse_key(collapsevaluenum>-1 ? collapsevaluenum : Xapian::BAD_VALUENO, 1);
+  return enquire.get_mset(offset,maxresults);
+}
+
+/**
+ * Posting source matching a set of docids of the combined database, used to restrict
+ * a refined incremental search to the matches of the previous query.
+ *
+ * Xapian initializes a posting source once per shard with shard local docids, so the
+ * combined docids are translated for the shard. The shard is found by identity among the
+ * shards of the combined database, since copied partitions have the same uuid.
+ */
+class CandidatePostingSource : public Xapian::PostingSource {
+public:
+    CandidatePostingSource(shared_ptr<const vector<Xapian::docid> > candidates,
+          const Xapian::Database & db) :
+        candidates(candidates), db(db), pos(0), started(false) {
+    }
+
+    Xapian::PostingSource * clone() const {
+      return new CandidatePostingSource(candidates, db);
+    }
+
+    void init(const Xapian::Database & shard) {
+      localDocids.clear();
+      pos = 0;
+      started = false;
+
+      const size_t numshards = db.internal.size();
+      size_t shardindex = 0;
+      while(shardindex < numshards && db.internal[shardindex] != shard.internal[0]) {
+        shardindex++;
+      }
+      if(shardindex == numshards) {
+        return;
+      }
+      for(Xapian::docid did : *candidates) {
+        if((did - 1) % numshards == shardindex) {
+          localDocids.push_back((did - 1) / numshards + 1);
+        }
+      }
+    }
+
+    Xapian::doccount get_termfreq_min() const {
+      return localDocids.size();
+    }
+
+    Xapian::doccount get_termfreq_est() const {
+      return localDocids.size();
+    }
+
+    Xapian::doccount get_termfreq_max() const {
+      return localDocids.size();
+    }
+
+    void next(double) {
+      if(started) {
+        pos++;
+      } else {
+        started = true;
+      }
+    }
+
+    void skip_to(Xapian::docid did, double) {
+      started = true;
+      pos = lower_bound(localDocids.begin() + pos, localDocids.end(), did) - localDocids.begin();
+    }
+
+    bool at_end() const {
+      return pos >= localDocids.size();
+    }
+
+    Xapian::docid get_docid() const {
+      return localDocids[pos];
+    }
+
+private:
+    shared_ptr<const vector<Xapian::docid> > candidates; // sorted docids of the combined database
+    Xapian::Database db; // the combined database
+    vector<Xapian::docid> localDocids;
+    size_t pos;
+    bool started;
+};
+
+/**
+ * State kept between queries of an incremental (as you type) search
+ */
+struct IncrementalSearchSession {
+    bool active;
+    string querytext;
+    shared_ptr<const vector<Xapian::docid> > candidates; // all matches of querytext, null if too many
+    unsigned int modifications; // DatabaseContainer::modifications when candidates were collected
+
+    unsigned int refinements;
+    unsigned int fullMatches;
+
+    IncrementalSearchSession() : active(false), modifications(0), refinements(0), fullMatches(0) {
+    }
+
+    void reset() {
+      active = false;
+      querytext.clear();
+      candidates.reset();
+    }
+
+    /**
+     * Only keep candidates for queries with at most this many matches
+     */
+    static const Xapian::doccount MAX_CANDIDATES = 50000;
+
+    static bool isWordChar(unsigned char c) {
+      return isalnum(c) || c >= 0x80 || c == '.' || c == '@' || c == '_';
+    }
+
+    /**
+     * True if the matches of newquery are guaranteed to be a subset of the matches of
+     * oldquery. This is the case when the last (partial) term is extended, trailing
+     * whitespace completes the last term, or an AND clause is appended, as long as
+     * neither query contains negations, phrases, groups or boolean filter prefixes
+     * in the last term (which are matched exactly and not as a prefix).
+     */
+    static bool isRefinement(const string & oldquery, const string & newquery) {
+      if(oldquery.empty() || newquery.size() <= oldquery.size() ||
+          newquery.compare(0, oldquery.size(), oldquery) != 0) {
+        return false;
+      }
+      if(newquery.find_first_of("\"()") != string::npos ||
+          newquery.find("NOT") != string::npos ||
+          newquery.find("XOR") != string::npos ||
+          newquery[0] == '-' ||
+          newquery.find(" -") != string::npos) {
+        return false;
+      }
+
+      const size_t lasttokenstart = oldquery.find_last_of(" \t") == string::npos ? 0 : oldquery.find_last_of(" \t") + 1;
+      const string lasttoken = oldquery.substr(lasttokenstart);
+      // Ranges aren't narrowed by extending them, nor is a term made into a range
+      if(lasttoken.find("..") != string::npos || newquery.find("..", lasttokenstart) != string::npos) {
+        return false;
+      }
+      for(const QueryField & field : SORTED_QUERY_FIELDS) {
+        const size_t length = strlen(field.field);
+        if(field.boolean && lasttoken.compare(0, length, field.field) == 0 &&
+            lasttoken.size() > length && lasttoken[length] == ':') {
+          return false;
+        }
+      }
+
+      const string suffix = newquery.substr(oldquery.size());
+      if(suffix.find_first_not_of(" \t") == string::npos) {
+        // Whitespace completes the last term, which is then matched exactly
+        return true;
+      }
+      if(suffix.compare(0, 5, " AND ") == 0) {
+        // A single appended conjunct, possibly with a field prefix
+        if(suffix.size() == 5) {
+          return false;
+        }
+        for(size_t n = 5; n < suffix.size(); n++) {
+          if(!isWordChar(suffix[n]) && suffix[n] != ':') {
+            return false;
+          }
+        }
+        return true;
+      }
+      if(!isWordChar(oldquery[oldquery.size() - 1]) || !isWordChar(suffix[0])) {
+        return false;
+      }
+      for(unsigned char c : suffix) {
+        if(!isWordChar(c)) {
+          return false;
+        }
+      }
+      return true;
+    }
+};
+
+/**
+ * Message counts of a folder
+ */
+struct FolderStats {
+    int total;
+    int unread;
+    int flagged;
+
+    FolderStats() : total(0), unread(0), flagged(0) {
+    }
+};
+
+/**
+ * The folder and flags of a document that are counted in the folder statistics
+ */
+struct DocumentFolderState {
+    bool infolder;
+    string folder;
+    bool seen;
+    bool flagged;
+
+    DocumentFolderState() : infolder(false), seen(false), flagged(false) {
+    }
+
+    static DocumentFolderState of(const Xapian::Document & doc) {
+      DocumentFolderState state;
+      const string folderprefix = "XFOLDER:";
+      // All terms of interest start with XF (XFOLDER: sorts before the flags)
+      Xapian::TermIterator termitend = doc.termlist_end();
+      Xapian::TermIterator tm = doc.termlist_begin();
+      for (tm.skip_to("XF"); tm != termitend; ++tm) {
+        const string term = *tm;
+        if(term.compare(0, 2, "XF") != 0) {
+          break;
+        }
+        if(term.compare(0, folderprefix.size(), folderprefix) == 0) {
+          state.infolder = true;
+          state.folder = term.substr(folderprefix.size());
+        } else if(term == "XFseen") {
+          state.seen = true;
+        } else if(term == "XFflagged") {
+          state.flagged = true;
+        }
+      }
+      return state;
+    }
+};
+
+/**
+ * Where the document with a given unique id term lives
+ */
+struct DocumentLocation {
+    int partition; // 0 is the main writable database, n is addedWritableDatabases[n-1]
+    Xapian::docid docid; // docid within the partition
+};
+
+/**
+ * Starts a stream of the table files of a database directory (see DatabaseExportStream),
+ * which a single file database never starts with
+ */
+static const string DATABASE_TABLES_MAGIC("XTABLES1");
+
+/**
+ * Names and sizes of the files of a database directory
+ */
+static vector<pair<string, double> > databaseTableFiles(const string & path) {
+  vector<pair<string, double> > files;
+  DIR * dir = opendir(path.c_str());
+  if(dir == NULL) {
+    return files;
+  }
+  struct stat info;
+  for(struct dirent * entry = readdir(dir); entry != NULL; entry = readdir(dir)) {
+    if(stat((path + "/" + entry->d_name).c_str(), &info) == 0 && S_ISREG(info.st_mode)) {
+      files.push_back(make_pair(string(entry->d_name), (double) info.st_size));
+    }
+  }
+  closedir(dir);
+  return files;
+}
+
+static void removeDatabaseDirectory(const string & path) {
+  for(const pair<string, double> & file : databaseTableFiles(path)) {
+    remove((path + "/" + file.first).c_str());
+  }
+  remove(path.c_str());
+}
+
+/**
+ * Reads the table files of a (compacted) database directory as one stream in bounded-size
+ * chunks, so that it can be persisted piece by piece instead of copying it out of the heap
+ * at once. After DATABASE_TABLES_MAGIC, every file is [uint32 name length][name][uint64 size]
+ * [content], and a 0 name length ends the stream (integers are little endian).
+ *
+ * Every file is removed once it has been read, and the directory at the end, so the copy
+ * shrinks table by table while it is exported.
+ */
+class DatabaseExportStream {
+    string directory;
+    vector<pair<string, double> > files; // Not started yet, last first
+    string filename; // Being read
+    ifstream file;
+    string header; // Written before the content of the next file
+    size_t headerpos;
+    bool ended;
+    bool active;
+    vector<unsigned char> chunk;
+
+public:
+    DatabaseExportStream() : headerpos(0), ended(false), active(false) {}
+
+    /**
+     * Returns the size of the stream, or -1 if there's no database at directorypath
+     */
+    double open(const string & directorypath, int chunksize) {
+      close();
+      files = databaseTableFiles(directorypath);
+      if(files.empty()) {
+        return -1;
+      }
+      reverse(files.begin(), files.end());
+      directory = directorypath;
+      header = DATABASE_TABLES_MAGIC;
+      headerpos = 0;
+      ended = false;
+      active = true;
+      chunk.resize(chunksize > 0 ? chunksize : 1);
+
+      double size = DATABASE_TABLES_MAGIC.size() + 4;
+      for(const pair<string, double> & f : files) {
+        size += 4 + f.first.size() + 8 + f.second;
+      }
+      return size;
+    }
+
+    /**
+     * Returns the next chunk, or NULL when the whole stream has been read. length is set
+     * to -1 if a file could not be read.
+     */
+    const unsigned char * readChunk(int * length) {
+      *length = 0;
+      if(!active) {
+        return NULL;
+      }
+      size_t filled = 0;
+      while(filled < chunk.size()) {
+        if(headerpos < header.size()) {
+          const size_t n = min(chunk.size() - filled, header.size() - headerpos);
+          memcpy(chunk.data() + filled, header.data() + headerpos, n);
+          filled += n;
+          headerpos += n;
+        } else if(file.is_open()) {
+          file.read((char *) chunk.data() + filled, chunk.size() - filled);
+          filled += file.gcount();
+          if(!file) {
+            file.close();
+            remove((directory + "/" + filename).c_str());
+          }
+        } else if(!nextFile()) {
+          break;
+        }
+      }
+      if(!active) {
+        *length = -1;
+        return NULL;
+      }
+      if(filled == 0) {
+        close();
+        return NULL;
+      }
+      *length = filled;
+      return chunk.data();
+    }
+
+    /**
+     * Removes what is left of the directory
+     */
+    void close() {
+      if(file.is_open()) {
+        file.close();
+      }
+      if(active) {
+        removeDatabaseDirectory(directory);
+        active = false;
+      }
+      files.clear();
+      vector<unsigned char>().swap(chunk);
+    }
+
+private:
+    bool nextFile() {
+      if(ended) {
+        return false;
+      }
+      header.clear();
+      headerpos = 0;
+      if(files.empty()) {
+        appendLittleEndian(header, 0, 4);
+        ended = true;
+        return true;
+      }
+      filename = files.back().first;
+      const uint64_t size = files.back().second;
+      files.pop_back();
+      file.open((directory + "/" + filename).c_str(), ios::in | ios::binary);
+      if(!file.is_open()) {
+        logAt(LOG_ERROR) << "Database export couldn't read " << directory << "/" << filename << endl;
+        close();
+        return false;
+      }
+      appendLittleEndian(header, filename.size(), 4);
+      header.append(filename);
+      appendLittleEndian(header, size, 8);
+      return true;
+    }
+
+    static void appendLittleEndian(string & bytes, uint64_t value, int numbytes) {
+      for(int n = 0; n < numbytes; n++) {
+        bytes.push_back((char) ((value >> (8 * n)) & 0xff));
+      }
+    }
+};
+
+/**
+ * Writes a database from chunks as they arrive, and validates it when done. A stream of
+ * table files (see DatabaseExportStream) is written as a database directory, anything else
+ * (e.g. a downloaded partition) as a single file database.
+ */
+class DatabaseImportStream {
+    enum Format { FORMAT_UNKNOWN, FORMAT_SINGLE_FILE, FORMAT_TABLES };
+    enum TableField { FIELD_NAME_LENGTH, FIELD_NAME, FIELD_SIZE, FIELD_CONTENT, FIELD_END };
+
+    ofstream file;
+    string path;
+    double expectedSize;
+    double written;
+    bool active;
+    Format format;
+    TableField field; // Of FORMAT_TABLES, being read
+    string pending; // Bytes of the magic or the field being read
+    size_t fieldLength;
+    uint64_t remaining; // Bytes of FIELD_CONTENT
+
+public:
+    DatabaseImportStream() : expectedSize(0), written(0), active(false), format(FORMAT_UNKNOWN),
+        field(FIELD_NAME_LENGTH), fieldLength(0), remaining(0) {}
+
+    bool open(const string & targetpath, double expectedsize) {
+      cancel();
+      struct stat info;
+      if(stat(targetpath.c_str(), &info) == 0) {
+        if(S_ISDIR(info.st_mode)) {
+          logAt(LOG_ERROR) << "Database import target " << targetpath << " is a directory" << endl;
+          return false;
+        }
+        remove(targetpath.c_str());
+      }
+      path = targetpath;
+      expectedSize = expectedsize;
+      written = 0;
+      active = true;
+      format = FORMAT_UNKNOWN;
+      pending.clear();
+      return true;
+    }
+
+    /**
+     * Returns the number of bytes written so far, or -1 on error
+     */
+    double write(const unsigned char * buffer, int length) {
+      if(!active) {
+        return -1;
+      }
+      if(!consume(buffer, length)) {
+        cancel();
+        return -1;
+      }
+      written += length;
+      metrics.bytesWritten += length;
+      return written;
+    }
+
+    /**
+     * Close the files and check that they are a complete database. If writablepath is not
+     * empty, a directory is moved there, and a single file compacted into a writable database
+     * there (and removed). On failure the partial files are removed.
+     */
+    bool finish(const string & writablepath) {
+      if(!active) {
+        return false;
+      }
+      if(file.is_open()) {
+        file.close();
+      }
+      if(expectedSize > 0 && written != expectedSize) {
+        logAt(LOG_ERROR) << "Database import incomplete: " << written << " of " << expectedSize << " bytes" << endl;
+        cancel();
+        return false;
+      }
+      if(format == FORMAT_TABLES && field != FIELD_END) {
+        logAt(LOG_ERROR) << "Database import incomplete: the stream of tables didn't end" << endl;
+        cancel();
+        return false;
+      }
+      try {
+        Xapian::Database imported(path);
+        if(!writablepath.empty()) {
+          if(format == FORMAT_TABLES) {
+            imported.close();
+            if(rename(path.c_str(), writablepath.c_str()) != 0) {
+              logAt(LOG_ERROR) << "Couldn't move imported database to " << writablepath << endl;
+              cancel();
+              return false;
+            }
+          } else {
+            imported.compact(writablepath);
+            imported.close();
+            remove(path.c_str());
+          }
+        }
+      } catch(const Xapian::Error &e) {
+        reportError(EP_IMPORT, e);
+        cancel();
+        return false;
+      }
+      active = false;
+      return true;
+    }
+
+    void cancel() {
+      if(file.is_open()) {
+        file.close();
+      }
+      if(active) {
+        if(format == FORMAT_TABLES) {
+          removeDatabaseDirectory(path);
+        } else if(format == FORMAT_SINGLE_FILE) {
+          remove(path.c_str());
+        }
+        active = false;
+      }
+    }
+
+private:
+    bool consume(const unsigned char * buffer, size_t length) {
+      size_t pos = 0;
+      if(format == FORMAT_UNKNOWN) {
+        if(!collect(buffer, length, pos, DATABASE_TABLES_MAGIC.size())) {
+          return true;
+        }
+        if(pending == DATABASE_TABLES_MAGIC) {
+          format = FORMAT_TABLES;
+          field = FIELD_NAME_LENGTH;
+          pending.clear();
+          if(mkdir(path.c_str(), 0777) != 0) {
+            logAt(LOG_ERROR) << "Couldn't create " << path << endl;
+            return false;
+          }
+        } else {
+          format = FORMAT_SINGLE_FILE;
+          file.open(path.c_str(), ios::out | ios::binary | ios::trunc);
+          file.write(pending.data(), pending.size());
+          pending.clear();
+        }
+      }
+      if(format == FORMAT_SINGLE_FILE) {
+        file.write((const char *) buffer + pos, length - pos);
+        return file.good();
+      }
+
+      while(pos < length) {
+        switch(field) {
+          case FIELD_NAME_LENGTH:
+            if(collect(buffer, length, pos, 4)) {
+              fieldLength = readLittleEndian(pending);
+              pending.clear();
+              field = fieldLength == 0 ? FIELD_END : FIELD_NAME;
+              if(fieldLength > 255) {
+                logAt(LOG_ERROR) << "Database import has a table name of " << fieldLength << " bytes" << endl;
+                return false;
+              }
+            }
+            break;
+          case FIELD_NAME:
+            if(collect(buffer, length, pos, fieldLength)) {
+              if(pending.find('/') != string::npos || pending == "." || pending == "..") {
+                logAt(LOG_ERROR) << "Database import has an invalid table name" << endl;
+                return false;
+              }
+              file.open((path + "/" + pending).c_str(), ios::out | ios::binary | ios::trunc);
+              if(!file.is_open()) {
+                logAt(LOG_ERROR) << "Couldn't create " << path << "/" << pending << endl;
+                return false;
+              }
+              pending.clear();
+              field = FIELD_SIZE;
+            }
+            break;
+          case FIELD_SIZE:
+            if(collect(buffer, length, pos, 8)) {
+              remaining = readLittleEndian(pending);
+              pending.clear();
+              field = FIELD_CONTENT;
+            }
+            break;
+          case FIELD_CONTENT: {
+            const size_t n = (size_t) min<uint64_t>(remaining, length - pos);
+            file.write((const char *) buffer + pos, n);
+            if(!file) {
+              return false;
+            }
+            pos += n;
+            remaining -= n;
+            break;
+          }
+          case FIELD_END:
+            logAt(LOG_ERROR) << "Database import has data after the end of the tables" << endl;
+            return false;
+        }
+        if(field == FIELD_CONTENT && remaining == 0) {
+          file.close();
+          field = FIELD_NAME_LENGTH;
+        }
+      }
+      return true;
+    }
+
+    /**
+     * Append bytes from buffer to pending until it has wanted bytes. Returns true if it has.
+     */
+    bool collect(const unsigned char * buffer, size_t length, size_t & pos, size_t wanted) {
+      const size_t n = min(length - pos, wanted - pending.size());
+      pending.append((const char *) buffer + pos, n);
+      pos += n;
+      return pending.size() == wanted;
+    }
+
+    static uint64_t readLittleEndian(const string & bytes) {
+      uint64_t value = 0;
+      for(size_t n = bytes.size(); n > 0; n--) {
+        value = (value << 8) | (unsigned char) bytes[n - 1];
+      }
+      return value;
+    }
+};
+
+/**
+ * A single file partition registered for a folder, opened only when a query may match it
+ */
+struct LazyPartition {
+    string path;
+    vector<string> folders; // Registered folder, replaced by the XFOLDER: terms of the partition once opened
+    double size; // bytes, counted against the partition memory budget while attached
+    bool attached;
+    unsigned int lastUsed;
+    Xapian::Database database;
+    map<string, FolderStats> folderStats; // Counted once, since the partition is read only
+    bool folderStatsCounted;
+};
+
+/**
+ * Count the messages of every folder of database without materializing any matches
+ */
+static void countFolderStats(const Xapian::Database & database, const Xapian::Query & seenquery,
+      const Xapian::Query & flaggedquery, map<string, FolderStats> & folderStats) {
+  Xapian::Enquire enquire(database);
+  enquire.set_weighting_scheme(Xapian::BoolWeight());
+  const Xapian::doccount doccount = database.get_doccount();
+
+  const string folderprefix = "XFOLDER:";
+  Xapian::TermIterator termitend = database.allterms_end(folderprefix);
+  for (Xapian::TermIterator tm = database.allterms_begin(folderprefix); tm != termitend; ++tm) {
+    const Xapian::Query folderquery(*tm);
+    FolderStats stats;
+    stats.total = tm.get_termfreq();
+
+    // Checking at least doccount matches makes the estimates exact
+    enquire.set_query(Xapian::Query(Xapian::Query::OP_AND_NOT, folderquery, seenquery));
+    stats.unread = enquire.get_mset(0, 0, doccount).get_matches_estimated();
+
+    enquire.set_query(Xapian::Query(Xapian::Query::OP_FILTER, folderquery, flaggedquery));
+    stats.flagged = enquire.get_mset(0, 0, doccount).get_matches_estimated();
+
+    folderStats[(*tm).substr(folderprefix.size())] = stats;
+  }
+}
+
+/**
+ * Collect the folders a query is restricted to by its XFOLDER: terms.
+ * Returns false if matches may come from any folder.
+ */
+static bool getRequiredFolders(const Xapian::Query & query, set<string> & folders) {
+  const string folderprefix = "XFOLDER:";
+  switch(query.get_type()) {
+    case Xapian::Query::LEAF_TERM: {
+      const string term = *query.get_terms_begin();
+      if(term.compare(0, folderprefix.size(), folderprefix) != 0) {
+        return false;
+      }
+      folders.insert(term.substr(folderprefix.size()));
+      return true;
+    }
+    case Xapian::Query::OP_AND:
+    case Xapian::Query::OP_FILTER: {
+      // Every subquery must match, so it's enough that one of them is restricted
+      bool restricted = false;
+      set<string> intersection;
+      for(size_t n = 0; n < query.get_num_subqueries(); n++) {
+        set<string> subqueryfolders;
+        if(!getRequiredFolders(query.get_subquery(n), subqueryfolders)) {
+          continue;
+        }
+        if(!restricted) {
+          intersection.swap(subqueryfolders);
+          restricted = true;
+        } else {
+          set<string> common;
+          set_intersection(intersection.begin(), intersection.end(),
+              subqueryfolders.begin(), subqueryfolders.end(), inserter(common, common.begin()));
+          intersection.swap(common);
+        }
+      }
+      if(restricted) {
+        folders.insert(intersection.begin(), intersection.end());
+      }
+      return restricted;
+    }
+    case Xapian::Query::OP_AND_NOT:
+    case Xapian::Query::OP_AND_MAYBE:
+    case Xapian::Query::OP_SCALE_WEIGHT:
+      // Only the first subquery decides what matches
+      return query.get_num_subqueries() > 0 && getRequiredFolders(query.get_subquery(0), folders);
+    case Xapian::Query::OP_OR:
+    case Xapian::Query::OP_SYNONYM: {
+      // Restricted only if every alternative is
+      set<string> alternatives;
+      for(size_t n = 0; n < query.get_num_subqueries(); n++) {
+        if(!getRequiredFolders(query.get_subquery(n), alternatives)) {
+          return false;
+        }
+      }
+      if(query.get_num_subqueries() == 0) {
+        return false;
+      }
+      folders.insert(alternatives.begin(), alternatives.end());
+      return true;
+    }
+    default:
+      return false;
+  }
+}
+
+/**
+ * Operations for bulkUpdateDocuments
+ */
+enum BulkOperation {
+    BULK_ADD_TERM = 0,
+    BULK_REMOVE_TERM = 1,
+    BULK_SET_FOLDER = 2,
+    BULK_SET_SEEN = 3, // Also removes the document from its XUNREADFOLDER:
+    BULK_SET_UNSEEN = 4, // Also adds the document to the XUNREADFOLDER: of its folder
+    BULK_DELETE = 5
+};
+
+/**
+ * Returns the terms of the document starting with prefix
+ */
+static vector<string> documentTermsWithPrefix(const Xapian::Document & doc, const string & prefix) {
+  vector<string> terms;
+  Xapian::TermIterator termitend = doc.termlist_end();
+  Xapian::TermIterator tm = doc.termlist_begin();
+  for (tm.skip_to(prefix); tm != termitend; ++tm) {
+    const string term = *tm;
+    if(term.compare(0, prefix.size(), prefix) != 0) {
+      break;
+    }
+    terms.push_back(term);
+  }
+  return terms;
+}
+
+/**
+ * Replace the XFOLDER: term (and XUNREADFOLDER: term if present) of the document.
+ * Returns false if the document was already in the folder.
+ */
+static bool moveDocumentToFolder(Xapian::Document & doc, const string & folder) {
+  const string folderterm = "XFOLDER:" + folder;
+  const vector<string> folderterms = documentTermsWithPrefix(doc, "XFOLDER:");
+  const vector<string> unreadfolderterms = documentTermsWithPrefix(doc, "XUNREADFOLDER:");
+  if(folderterms.size() == 1 && folderterms[0] == folderterm &&
+      (unreadfolderterms.empty() || (unreadfolderterms.size() == 1 && unreadfolderterms[0] == "XUNREADFOLDER:" + folder))) {
+    return false;
+  }
+
+  for(const string & term : folderterms) {
+    doc.remove_term(term);
+  }
+  for(const string & term : unreadfolderterms) {
+    doc.remove_term(term);
+  }
+  doc.add_term(folderterm);
+  if(!unreadfolderterms.empty()) {
+    doc.add_term("XUNREADFOLDER:" + folder);
+  }
+  return true;
+}
+
+/**
+ * Set or clear XFseen and keep the XUNREADFOLDER: term in sync.
+ * Returns false if the document was unchanged.
+ */
+static bool setDocumentSeen(Xapian::Document & doc, bool seen) {
+  bool modified = false;
+  if(documentHasTerm(doc, "XFseen") != seen) {
+    if(seen) {
+      doc.add_term("XFseen");
+    } else {
+      doc.remove_term("XFseen");
+    }
+    modified = true;
+  }
+
+  const vector<string> folderterms = documentTermsWithPrefix(doc, "XFOLDER:");
+  const vector<string> unreadfolderterms = documentTermsWithPrefix(doc, "XUNREADFOLDER:");
+  if(seen) {
+    for(const string & term : unreadfolderterms) {
+      doc.remove_term(term);
+      modified = true;
+    }
+  } else if(unreadfolderterms.empty() && !folderterms.empty()) {
+    doc.add_term("XUNREADFOLDER:" + folderterms[0].substr(string("XFOLDER:").size()));
+    modified = true;
+  }
+  return modified;
+}
+
+static bool applyBulkOperation(Xapian::Document & doc, int operation, const string & argument) {
+  switch(operation) {
+    case BULK_ADD_TERM:
+      if(documentHasTerm(doc, argument)) {
+        return false;
+      }
+      doc.add_term(argument);
+      return true;
+    case BULK_REMOVE_TERM:
+      if(!documentHasTerm(doc, argument)) {
+        return false;
+      }
+      doc.remove_term(argument);
+      return true;
+    case BULK_SET_FOLDER:
+      return moveDocumentToFolder(doc, argument);
+    case BULK_SET_SEEN:
+      return setDocumentSeen(doc, true);
+    case BULK_SET_UNSEEN:
+      return setDocumentSeen(doc, false);
+    default:
+      return false;
+  }
+}
+
+static bool compareDocumentLocations(const DocumentLocation & a, const DocumentLocation & b) {
+  return a.partition < b.partition || (a.partition == b.partition && a.docid < b.docid);
+}
+
+/**
+ * A thread of ThreadIndex as listed by thread views
+ */
+struct ThreadSummary {
+    Xapian::docid head; // The latest message, the lowest docid of those with the latest date
+    unsigned int messages;
+    unsigned int unread;
+    const string * latestDate;
+};
+
+/**
+ * Conversations by thread key, which is the value thread views collapse on, with their
+ * messages in date order and unread counts. Thread listings, counts and expanding a thread
+ * are lookups here instead of collapsed matches. Documents without a thread key are threads
+ * of their own. Docids are those of the combined database. Threads are persisted in BUCKETS
+ * buckets by hash of their key, so that a commit only rewrites the buckets of changed threads.
+ */
+class ThreadIndex {
+public:
+    static const uint32_t VERSION = 2;
+    static const uint32_t BUCKETS = 256;
+    static const Xapian::valueno THREAD_KEY_SLOT = 1;
+    static const Xapian::valueno DATE_SLOT = 2;
+
+    struct Message {
+      Xapian::docid docid;
+      string date;
+      bool seen;
+    };
+
+    struct Thread {
+      string key;
+      vector<Message> messages; // Oldest first, by date and then docid
+      unsigned int unread;
+
+      Thread() : unread(0) {
+      }
+
+      /**
+       * Of the messages with the latest date the one with the lowest docid, which is the one
+       * kept when collapsing matches sorted by date (ties by docid ascending)
+       */
+      const Message & latest() const {
+        size_t n = messages.size() - 1;
+        while(n > 0 && messages[n - 1].date == messages.back().date) {
+          n--;
+        }
+        return messages[n];
+      }
+    };
+
+    ThreadIndex() : changedBuckets(BUCKETS, true), loaded(false) {
+    }
+
+    bool isLoaded() const {
+      return loaded;
+    }
+
+    /**
+     * Clears the index and marks all buckets as changed, so that they are all persisted again
+     */
+    void invalidate() {
+      threads.clear();
+      threadOfDocId.clear();
+      changedBuckets.assign(BUCKETS, true);
+      loaded = false;
+    }
+
+    /**
+     * Read the thread keys, dates and seen flags of all documents without fetching any document
+     */
+    void build(const Xapian::Database & db) {
+      invalidate();
+      Xapian::ValueIterator key = db.valuestream_begin(THREAD_KEY_SLOT);
+      const Xapian::ValueIterator keyend = db.valuestream_end(THREAD_KEY_SLOT);
+      Xapian::ValueIterator date = db.valuestream_begin(DATE_SLOT);
+      const Xapian::ValueIterator dateend = db.valuestream_end(DATE_SLOT);
+      Xapian::PostingIterator seen = db.postlist_begin("XFseen");
+      const Xapian::PostingIterator seenend = db.postlist_end("XFseen");
+      for(Xapian::PostingIterator p = db.postlist_begin(""); p != db.postlist_end(""); ++p) {
+        const Xapian::docid docid = *p;
+        if(key != keyend) {
+          key.skip_to(docid);
+        }
+        if(date != dateend) {
+          date.skip_to(docid);
+        }
+        if(seen != seenend) {
+          seen.skip_to(docid);
+        }
+        setDocument(docid,
+              key != keyend && key.get_docid() == docid ? *key : string(),
+              date != dateend && date.get_docid() == docid ? *date : string(),
+              seen != seenend && *seen == docid);
+      }
+      loaded = true;
+    }
+
+    void setDocument(Xapian::docid docid, const Xapian::Document & doc) {
+      setDocument(docid, doc.get_value(THREAD_KEY_SLOT), doc.get_value(DATE_SLOT),
+            documentHasTerm(doc, "XFseen"));
+    }
+
+    void setDocument(Xapian::docid docid, const string & key, const string & date, bool seen) {
+      removeDocument(docid);
+      const string threadkey = key.empty() ? string(1, '\0') + to_string(docid) : key;
+      Thread & thread = threads[threadkey];
+      thread.key = threadkey;
+      changedBuckets[bucketOf(threadkey)] = true;
+      const Message message = { docid, date, seen };
+      thread.messages.insert(upper_bound(thread.messages.begin(), thread.messages.end(),
+            message, compareMessages), message);
+      if(!seen) {
+        thread.unread++;
+      }
+      if(docid >= threadOfDocId.size()) {
+        threadOfDocId.resize(docid + 1, NULL);
+      }
+      threadOfDocId[docid] = &thread;
+    }
+
+    void removeDocument(Xapian::docid docid) {
+      Thread * thread = findThread(docid);
+      if(thread == NULL) {
+        return;
+      }
+      threadOfDocId[docid] = NULL;
+      changedBuckets[bucketOf(thread->key)] = true;
+      const size_t message = findMessage(*thread, docid);
+      if(!thread->messages[message].seen) {
+        thread->unread--;
+      }
+      thread->messages.erase(thread->messages.begin() + message);
+      if(thread->messages.empty()) {
+        const string key = thread->key;
+        threads.erase(key);
+      }
+    }
+
+    void setSeen(Xapian::docid docid, bool seen) {
+      Thread * thread = findThread(docid);
+      if(thread == NULL) {
+        return;
+      }
+      Message & message = thread->messages[findMessage(*thread, docid)];
+      if(message.seen != seen) {
+        message.seen = seen;
+        changedBuckets[bucketOf(thread->key)] = true;
+        if(seen) {
+          thread->unread--;
+        } else {
+          thread->unread++;
+        }
+      }
+    }
+
+    /**
+     * The thread of a document, or NULL if not in the index
+     */
+    const Thread * getThread(Xapian::docid docid) const {
+      return docid < threadOfDocId.size() ? threadOfDocId[docid] : NULL;
+    }
+
+    size_t size() const {
+      return threads.size();
+    }
+
+    /**
+     * Summaries of all threads, or with docids (e.g. the messages of a folder) of the threads
+     * of those documents counting only those documents
+     */
+    void summarise(const vector<Xapian::docid> * docids, vector<ThreadSummary> & summaries) const {
+      summaries.clear();
+      if(docids == NULL) {
+        summaries.reserve(threads.size());
+        for(const pair<const string, Thread> & entry : threads) {
+          const Thread & thread = entry.second;
+          const ThreadSummary summary = { thread.latest().docid, (unsigned int) thread.messages.size(),
+                thread.unread, &thread.latest().date };
+          summaries.push_back(summary);
+        }
+        return;
+      }
+
+      unordered_map<const Thread *, size_t> summaryOfThread;
+      for(const Xapian::docid docid : *docids) {
+        const Thread * thread = getThread(docid);
+        if(thread == NULL) {
+          continue;
+        }
+        const Message & message = thread->messages[findMessage(*thread, docid)];
+        const pair<unordered_map<const Thread *, size_t>::iterator, bool> inserted =
+              summaryOfThread.insert(make_pair(thread, summaries.size()));
+        if(inserted.second) {
+          const ThreadSummary summary = { docid, 0, 0, &message.date };
+          summaries.push_back(summary);
+        }
+        ThreadSummary & summary = summaries[inserted.first->second];
+        summary.messages++;
+        if(!message.seen) {
+          summary.unread++;
+        }
+        if(message.date > *summary.latestDate ||
+            (message.date == *summary.latestDate && docid < summary.head)) {
+          summary.head = docid;
+          summary.latestDate = &message.date;
+        }
+      }
+    }
+
+    /**
+     * The buckets changed since the last call, serialised in the format of unserialise. Buckets
+     * left without threads are empty strings.
+     */
+    void serialiseChangedBuckets(map<uint32_t, string> & buckets) {
+      buckets.clear();
+      map<uint32_t, vector<const Thread *> > changed;
+      for(uint32_t bucket = 0; bucket < BUCKETS; bucket++) {
+        if(changedBuckets[bucket]) {
+          changed[bucket];
+        }
+      }
+      if(changed.empty()) {
+        return;
+      }
+      for(const pair<const string, Thread> & entry : threads) {
+        const map<uint32_t, vector<const Thread *> >::iterator bucket = changed.find(bucketOf(entry.first));
+        if(bucket != changed.end()) {
+          bucket->second.push_back(&entry.second);
+        }
+      }
+      for(const pair<const uint32_t, vector<const Thread *> > & bucket : changed) {
+        string & serialised = buckets[bucket.first];
+        if(!bucket.second.empty()) {
+          ResultArena out;
+          serialise(bucket.second, out);
+          serialised.assign((const char *) out.data(), out.size());
+        }
+      }
+      changedBuckets.assign(BUCKETS, false);
+    }
+
+    /**
+     * Format of each bucket: number of threads, and for each thread the key, number of
+     * messages and for each message the docid, date and seen flag. Empty buckets have no threads.
+     */
+    bool unserialise(const vector<string> & buckets) {
+      invalidate();
+      if(buckets.size() != BUCKETS) {
+        return false;
+      }
+      for(const string & bucket : buckets) {
+        if(bucket.empty()) {
+          continue;
+        }
+        PackedBufferReader in((const unsigned char *) bucket.data(), bucket.size());
+        if(!unserialise(in)) {
+          invalidate();
+          return false;
+        }
+      }
+      changedBuckets.assign(BUCKETS, false);
+      loaded = true;
+      return true;
+    }
+
+    /**
+     * FNV-1a, the same on every platform reading the persisted buckets
+     */
+    static uint32_t bucketOf(const string & key) {
+      uint32_t hash = 2166136261u;
+      for(const char c : key) {
+        hash = (hash ^ (unsigned char) c) * 16777619u;
+      }
+      return hash % BUCKETS;
+    }
+
+private:
+    static bool compareMessages(const Message & a, const Message & b) {
+      return a.date < b.date || (a.date == b.date && a.docid < b.docid);
+    }
+
+    static void serialise(const vector<const Thread *> & bucket, ResultArena & out) {
+      out.appendUint32(bucket.size());
+      for(const Thread * thread : bucket) {
+        out.appendString(thread->key);
+        out.appendUint32(thread->messages.size());
+        for(const Message & message : thread->messages) {
+          out.appendUint32(message.docid);
+          out.appendString(message.date);
+          out.appendUint32(message.seen ? 1 : 0);
+        }
+      }
+    }
+
+    bool unserialise(PackedBufferReader & in) {
+      uint32_t numthreads;
+      if(!in.readUint32(numthreads)) {
+        return false;
+      }
+      string key;
+      Message message;
+      for(uint32_t n = 0; n < numthreads; n++) {
+        uint32_t nummessages;
+        if(!in.readTerminatedString(key) || !in.readUint32(nummessages)) {
+          return false;
+        }
+        Thread & thread = threads[key];
+        thread.key = key;
+        thread.messages.reserve(nummessages);
+        for(uint32_t m = 0; m < nummessages; m++) {
+          uint32_t seen;
+          if(!in.readUint32(message.docid) || !in.readTerminatedString(message.date) || !in.readUint32(seen)) {
+            return false;
+          }
+          message.seen = seen != 0;
+          if(!message.seen) {
+            thread.unread++;
+          }
+          thread.messages.push_back(message);
+          if(message.docid >= threadOfDocId.size()) {
+            threadOfDocId.resize(message.docid + 1, NULL);
+          }
+          threadOfDocId[message.docid] = &thread;
+        }
+      }
+      return true;
+    }
+
+    Thread * findThread(Xapian::docid docid) {
+      return docid < threadOfDocId.size() ? threadOfDocId[docid] : NULL;
+    }
+
+    /**
+     * Position of a message of the thread, which must be there
+     */
+    static size_t findMessage(const Thread & thread, Xapian::docid docid) {
+      size_t n = 0;
+      while(thread.messages[n].docid != docid) {
+        n++;
+      }
+      return n;
+    }
+
+    map<string, Thread> threads;
+    vector<Thread *> threadOfDocId; // The thread of every docid in the index, NULL for others
+    vector<bool> changedBuckets; // Buckets to persist on the next commit
+    bool loaded;
+};
+
+#ifdef HAVE_THREADS
+/**
+ * Fixed number of threads running submitted tasks in order of submission
+ */
+class WorkerPool {
+public:
+    explicit WorkerPool(int numthreads) : stopping(false) {
+      for(int n = 0; n < numthreads; n++) {
+        workers.push_back(thread(&WorkerPool::run, this));
+      }
+    }
+
+    /**
+     * Runs the tasks already submitted before the threads are joined
+     */
+    ~WorkerPool() {
+      {
+        lock_guard<mutex> guard(lock);
+        stopping = true;
+      }
+      available.notify_all();
+      for(thread & worker : workers) {
+        worker.join();
+      }
+    }
+
+    void submit(function<void()> task) {
+      {
+        lock_guard<mutex> guard(lock);
+        tasks.push_back(move(task));
+      }
+      available.notify_one();
+    }
+
+private:
+    void run() {
+      while(true) {
+        function<void()> task;
+        {
+          unique_lock<mutex> guard(lock);
+          available.wait(guard, [this] { return stopping || !tasks.empty(); });
+          if(tasks.empty()) {
+            return;
+          }
+          task = move(tasks.front());
+          tasks.pop_front();
+        }
+        task();
+      }
+    }
+
+    vector<thread> workers;
+    deque<function<void()>> tasks;
+    mutex lock;
+    condition_variable available;
+    bool stopping;
+};
+
+/**
+ * A sorted query run on each shard of a combined database in a task of its own, with the
+ * top matches of the shards merged by sort value into the order (and collapsing) of the
+ * same query run on the combined database.
+ *
+ * Xapian objects must not be used from several threads at once, so every shard gets its
+ * own enquire and query, and the shard databases must not be used by anything else until
+ * run returns.
+ */
+class ParallelPartitionSearch {
+public:
+    /**
+     * shardQuery is called for every shard (on the calling thread) and must return a query
+     * sharing nothing with the others, e.g. unserialised or parsed again
+     */
+    ParallelPartitionSearch(const vector<Xapian::Database> & databases, const function<Xapian::Query()> & shardQuery,
+          int sortvaluenum, bool reverse, int collapsevaluenum) :
+        reverse(reverse), collapsing(collapsevaluenum>-1), shards(databases.size()) {
+      for(size_t n = 0; n < databases.size(); n++) {
+        Xapian::Enquire * enquire = new Xapian::Enquire(databases[n]);
+        shards[n].enquire.reset(enquire);
+        enquire->set_query(shardQuery());
+        // Ties must keep their order when a shard is fetched again with more matches
+        enquire->set_docid_order(Xapian::Enquire::ASCENDING);
+        enquire->set_weighting_scheme(Xapian::BoolWeight());
+        enquire->set_sort_by_value(sortvaluenum, reverse);
+        enquire->set_collapse_key(collapsing ? collapsevaluenum : Xapian::BAD_VALUENO, 1);
+      }
+    }
+
+    /**
+     * Rows offset to offset + maxresults of the merged matches, with their documents if
+     * withdocuments (see appendSortedMatches)
+     */
+    void run(WorkerPool & pool, Xapian::doccount offset, Xapian::doccount maxresults,
+          vector<SortedMatch> & matches, bool withdocuments = false) {
+      const Xapian::doccount wanted = maxresults > UINT_MAX - offset ? UINT_MAX : offset + maxresults;
+      fetchAll(pool, wanted);
+
+      // k-way merge of the shard results, keeping the first row of every collapse key
+      vector<SortedMatch> merged;
+      vector<pair<size_t, size_t> > mergedSources; // shard and position of every merged row
+      unordered_map<string, size_t> collapsedRows;
+      vector<size_t> positions(shards.size(), 0);
+      const auto later = [this, &positions](size_t a, size_t b) {
+        return comesBefore(shards[b].matches[positions[b]], shards[a].matches[positions[a]]);
+      };
+
+      vector<size_t> heads;
+      for(size_t n = 0; n < shards.size(); n++) {
+        if(hasMoreMatches(n, positions[n])) {
+          heads.push_back(n);
+        }
+      }
+      make_heap(heads.begin(), heads.end(), later);
+
+      while(!heads.empty() && merged.size() < wanted) {
+        pop_heap(heads.begin(), heads.end(), later);
+        const size_t n = heads.back();
+        heads.pop_back();
+
+        const ShardMatch & match = shards[n].matches[positions[n]++];
+        bool collapsed = false;
+        if(collapsing && !match.collapseKey.empty()) {
+          const pair<unordered_map<string, size_t>::iterator, bool> row =
+                collapsedRows.insert(make_pair(match.collapseKey, merged.size()));
+          if(!row.second) {
+            merged[row.first->second].collapseCount += match.collapseCount + 1;
+            collapsed = true;
+          }
+        }
+        if(!collapsed) {
+          SortedMatch row;
+          row.docid = match.docid;
+          row.collapseCount = match.collapseCount;
+          merged.push_back(row);
+          mergedSources.push_back(make_pair(n, positions[n] - 1));
+        }
+
+        if(hasMoreMatches(n, positions[n])) {
+          heads.push_back(n);
+          push_heap(heads.begin(), heads.end(), later);
+        }
+      }
+
+      if(merged.size() > offset) {
+        if(withdocuments) {
+          fetchDocuments(merged, mergedSources, offset);
+        }
+        matches.insert(matches.end(), merged.begin() + offset, merged.end());
+      }
+    }
+
+private:
+    struct ShardMatch {
+        string sortKey;
+        string collapseKey;
+        Xapian::docid docid; // of the combined database
+        Xapian::doccount collapseCount;
+    };
+
+    struct ShardResults {
+        unique_ptr<Xapian::Enquire> enquire;
+        Xapian::MSet mset; // of the matches, by position
+        vector<ShardMatch> matches;
+        bool complete; // false if the shard may have more matches than fetched
+        exception_ptr error;
+    };
+
+    /**
+     * Fetch the first count matches of every shard, one task per shard.
+     * The calling thread takes the first shard while waiting for the others.
+     */
+    void fetchAll(WorkerPool & pool, Xapian::doccount count) {
+      mutex lock;
+      condition_variable finished;
+      size_t remaining = shards.size() - 1;
+      for(size_t n = 1; n < shards.size(); n++) {
+        pool.submit([this, n, count, &lock, &finished, &remaining] {
+          fetch(n, count);
+          lock_guard<mutex> guard(lock);
+          if(--remaining == 0) {
+            finished.notify_one();
+          }
+        });
+      }
+      fetch(0, count);
+      {
+        unique_lock<mutex> guard(lock);
+        finished.wait(guard, [&remaining] { return remaining == 0; });
+      }
+      for(const ShardResults & shard : shards) {
+        if(shard.error) {
+          rethrow_exception(shard.error);
+        }
+      }
+    }
+
+    /**
+     * Never throws, errors are kept in the shard results
+     */
+    void fetch(size_t n, Xapian::doccount count) {
+      ShardResults & shard = shards[n];
+      shard.complete = false;
+      try {
+        const Xapian::MSet mset = shard.enquire->get_mset(0, count);
+        shard.mset = mset;
+        shard.matches.clear();
+        shard.matches.reserve(mset.size());
+        for (Xapian::MSetIterator m = mset.begin(); m != mset.end(); ++m) {
+          ShardMatch match;
+          match.sortKey = m.get_sort_key();
+          if(collapsing) {
+            match.collapseKey = m.get_collapse_key();
+          }
+          // Documents of the shards are interleaved in the combined database
+          match.docid = (*m - 1) * shards.size() + n + 1;
+          match.collapseCount = m.get_collapse_count();
+          shard.matches.push_back(match);
+        }
+        shard.complete = mset.size() < count;
+      } catch(...) {
+        shard.error = current_exception();
+      }
+    }
+
+    /**
+     * Whether the shard has a match at position, fetching twice as many matches if the
+     * position is past those fetched (the other shards are done, so on this thread)
+     */
+    bool hasMoreMatches(size_t n, size_t position) {
+      ShardResults & shard = shards[n];
+      if(position < shard.matches.size()) {
+        return true;
+      }
+      if(shard.complete || shard.matches.empty()) {
+        return false;
+      }
+      const size_t fetched = shard.matches.size();
+      fetch(n, fetched > UINT_MAX / 2 ? UINT_MAX : 2 * fetched);
+      if(shard.error) {
+        rethrow_exception(shard.error);
+      }
+      return position < shard.matches.size();
+    }
+
+    /**
+     * Fetch the documents of the merged rows from offset on, for every shard the range of
+     * its matches with rows at once
+     */
+    void fetchDocuments(vector<SortedMatch> & merged, const vector<pair<size_t, size_t> > & sources,
+          size_t offset) {
+      vector<size_t> first(shards.size(), SIZE_MAX);
+      vector<size_t> last(shards.size(), 0);
+      for(size_t row = offset; row < merged.size(); row++) {
+        const size_t n = sources[row].first;
+        first[n] = min(first[n], sources[row].second);
+        last[n] = max(last[n], sources[row].second);
+      }
+      for(size_t n = 0; n < shards.size(); n++) {
+        if(first[n] != SIZE_MAX) {
+          const Xapian::MSet & mset = shards[n].mset;
+          mset.fetch(mset[first[n]], last[n] + 1 < mset.size() ? mset[last[n] + 1] : mset.end());
+        }
+      }
+      for(size_t row = offset; row < merged.size(); row++) {
+        merged[row].document = shards[sources[row].first].mset[sources[row].second].get_document();
+      }
+    }
+
+    bool comesBefore(const ShardMatch & a, const ShardMatch & b) const {
+      if(a.sortKey != b.sortKey) {
+        return reverse ? a.sortKey > b.sortKey : a.sortKey < b.sortKey;
+      }
+      return a.docid < b.docid;
+    }
+
+    bool reverse;
+    bool collapsing;
+    vector<ShardResults> shards;
+};
+
+// Shared by the parallel sorted queries of all indexes, see setParallelPartitionSearch
+static unique_ptr<WorkerPool> partitionSearchPool;
+#endif
+
+/**
+ * Work done by runScheduledWrites, as bit flags
+ */
+enum ScheduledWrite {
+    SCHEDULED_COMMIT = 1,
+    SCHEDULED_COMPACTION_STARTED = 2,
+    SCHEDULED_COMPACTION_FINISHED = 4,
+    SCHEDULED_COMPACTION_FAILED = 8
+};
+
+/**
+ * Bytes on disk of a database, either a single file or a directory of tables.
+ * Xapian doesn't expose the free blocks of a database, so growth of the files
+ * since the last compaction is what tells that a compaction is worth doing.
+ */
+static double databaseFileSize(const string & path) {
+  struct stat info;
+  if(stat(path.c_str(), &info) != 0) {
+    return 0;
+  }
+  if(!S_ISDIR(info.st_mode)) {
+    return info.st_size;
+  }
+  double size = 0;
+  DIR * dir = opendir(path.c_str());
+  if(dir == NULL) {
+    return 0;
+  }
+  for(struct dirent * entry = readdir(dir); entry != NULL; entry = readdir(dir)) {
+    if(stat((path + "/" + entry->d_name).c_str(), &info) == 0 && S_ISREG(info.st_mode)) {
+      size += info.st_size;
+    }
+  }
+  closedir(dir);
+  return size;
+}
+
+/**
+ * Compact the databases at paths into a single file at target. The file is written
+ * next to target first, so that target is either the previous or the new compaction.
+ * Returns an empty string or the error.
+ */
+static string compactDatabasesToFile(const vector<string> & paths, const string & target) {
+  const string tmppath = target + ".tmp";
+  string error;
+  // The snapshot is opened from the committed revision, which commits during the compaction may replace
+  for(int attempt = 0; attempt < 3; attempt++) {
+    try {
+      Xapian::Database snapshot;
+      for(const string & path : paths) {
+        snapshot.add_database(Xapian::Database(path));
+      }
+      snapshot.compact(tmppath, Xapian::DBCOMPACT_SINGLE_FILE);
+      snapshot.close();
+      if(rename(tmppath.c_str(), target.c_str()) != 0) {
+        error = "Couldn't rename " + tmppath + " to " + target;
+      } else {
+        error.clear();
+      }
+      break;
+    } catch(const Xapian::DatabaseModifiedError &e) {
+      error = e.get_msg();
+    } catch(const Xapian::Error &e) {
+      error = string(e.get_type()) + ": " + e.get_msg();
+      break;
+    }
+  }
+  if(!error.empty()) {
+    remove(tmppath.c_str());
+  }
+  return error;
+}
+
+/**
+ * Decides when the writable databases of an index are committed and compacted, see
+ * configureWriteScheduler. Changes commit when pending changes, bytes or time reach their
+ * threshold, checked on the next change and by runScheduledWrites, which javascript calls
+ * when idle. Compaction into a single file (as compactDatabase) runs on a thread of its own.
+ * Without threads there is no scheduled compaction, since a compaction can't be split into
+ * steps and would hold up the calling thread for as long as it takes.
+ */
+class WriteScheduler {
+public:
+    enum CompactionState {
+      COMPACTION_IDLE = 0,
+      COMPACTION_RUNNING = 1,
+      COMPACTION_FAILED = 2
+    };
+
+    // Thresholds, 0 for none
+    unsigned int maxPendingChanges;
+    double maxPendingBytes;
+    double maxPendingMs;
+    unsigned int compactAfterRevisions; // commits since the last compaction
+    double compactGrowthRatio; // size on disk compared to the size at the last compaction
+    string compactPath; // no scheduled compaction if empty
+
+    unsigned int pendingChanges;
+    double pendingBytes;
+    double firstPendingAt; // 0 if nothing is pending
+    double lastCommitAt; // 0 if never committed
+    unsigned int scheduledCommits;
+
+    Xapian::rev revisionAtLastCompaction;
+    double sizeAtLastCompaction; // on disk, when the last compaction started
+    double lastCompactionBytes; // of the compacted file
+    unsigned int compactions;
+    string lastCompactionError;
+
+    WriteScheduler() : maxPendingChanges(0), maxPendingBytes(0), maxPendingMs(0),
+        compactAfterRevisions(0), compactGrowthRatio(0),
+        pendingChanges(0), pendingBytes(0), firstPendingAt(0), lastCommitAt(0), scheduledCommits(0),
+        revisionAtLastCompaction(0), sizeAtLastCompaction(0), lastCompactionBytes(0), compactions(0),
+        compactionState(COMPACTION_IDLE), compactionFinished(false) {
+    }
+
+    ~WriteScheduler() {
+#ifdef HAVE_THREADS
+      if(compactionThread.joinable()) {
+        compactionThread.join();
+      }
+#endif
+    }
+
+    void changed(double now) {
+      if(pendingChanges == 0) {
+        firstPendingAt = now;
+      }
+      pendingChanges++;
+    }
+
+    void committed(double now) {
+      pendingChanges = 0;
+      pendingBytes = 0;
+      firstPendingAt = 0;
+      lastCommitAt = now;
+    }
+
+    bool commitDue(double now) const {
+      return pendingChanges > 0 && (
+            (maxPendingChanges > 0 && pendingChanges >= maxPendingChanges) ||
+            (maxPendingBytes > 0 && pendingBytes >= maxPendingBytes) ||
+            (maxPendingMs > 0 && now - firstPendingAt >= maxPendingMs));
+    }
+
+    bool compactionDue(Xapian::rev revision, double size) const {
+      if(compactPath.empty() || getCompactionState() == COMPACTION_RUNNING ||
+          revision == revisionAtLastCompaction) {
+        return false;
+      }
+      return compactions == 0 ||
+            (compactAfterRevisions > 0 && revision - revisionAtLastCompaction >= compactAfterRevisions) ||
+            (compactGrowthRatio > 0 && size >= sizeAtLastCompaction * compactGrowthRatio);
+    }
+
+    /**
+     * Compact the (committed) databases at paths into compactPath
+     */
+    void startCompaction(const vector<string> & paths, Xapian::rev revision, double size) {
+      revisionAtLastCompaction = revision;
+      sizeAtLastCompaction = size;
+      compactionState = COMPACTION_RUNNING;
+#ifdef HAVE_THREADS
+      if(compactionThread.joinable()) {
+        compactionThread.join();
+      }
+      const string target = compactPath;
+      compactionThread = thread([this, paths, target] {
+        const string error = compactDatabasesToFile(paths, target);
+        lock_guard<mutex> guard(compactionLock);
+        compactionError = error;
+        compactionState = error.empty() ? COMPACTION_IDLE : COMPACTION_FAILED;
+        compactionFinished = true;
+      });
+#else
+      (void) paths;
+      compactionError = "Scheduled compaction needs threads";
+      compactionState = COMPACTION_FAILED;
+      compactionFinished = true;
+#endif
+    }
+
+    /**
+     * Returns true once after a compaction finished (see lastCompactionError)
+     */
+    bool collectFinishedCompaction() {
+#ifdef HAVE_THREADS
+      lock_guard<mutex> guard(compactionLock);
+#endif
+      if(!compactionFinished) {
+        return false;
+      }
+      compactionFinished = false;
+      lastCompactionError = compactionError;
+      if(compactionError.empty()) {
+        compactions++;
+        lastCompactionBytes = databaseFileSize(compactPath);
+      } else {
+        logAt(LOG_ERROR) << "Scheduled compaction failed: " << compactionError << endl;
+      }
+      return true;
+    }
+
+    int getCompactionState() const {
+      return compactionState;
+    }
+
+private:
+#ifdef HAVE_THREADS
+    thread compactionThread;
+    mutex compactionLock;
+    atomic<int> compactionState;
+#else
+    int compactionState;
+#endif
+    bool compactionFinished;
+    string compactionError;
+};
+
+/**
+ * Results of applyIndexDelta
+ */
+enum DeltaResult {
+    DELTA_APPLIED = 1,
+    DELTA_ALREADY_APPLIED = 0, // The index is at the revision of the delta or later
+    DELTA_OUT_OF_ORDER = -1, // The index is not at the base revision of the delta
+    DELTA_FAILED = -2
+};
+
+/**
+ * Sync revisions are stored in metadata as decimal strings, with 0 (or nothing) for none
+ */
+static uint64_t parseSyncRevision(const string & persisted) {
+  return persisted.empty() ? 0 : strtoull(persisted.c_str(), NULL, 10);
+}
+
+/**
+ * Open a database at path, which may be a directory or a single file
+ */
+static Xapian::Database openDatabaseAt(const string & path) {
+  struct stat info;
+  if(stat(path.c_str(), &info) == 0 && S_ISREG(info.st_mode)) {
+    FILE * file = fopen(path.c_str(),"r");
+    if(file == NULL) {
+      throw Xapian::DatabaseOpeningError("Couldn't open " + path);
+    }
+    return Xapian::Database(fileno(file),Xapian::DB_OPEN);
+  }
+  return Xapian::Database(path);
+}
+
+class DatabaseContainer {
+public:
+    Xapian::Database db;
+    Xapian::WritableDatabase dbw;
+    Xapian::Database dbsinglefile;
+    vector<Xapian::WritableDatabase> addedWritableDatabases;
+
+    unique_ptr<Xapian::RangeProcessor> rangeProcessor;
+    string rangeProcessorKey; // Identifies the range processor setup in parsed query cache keys
+
+    unique_ptr<QueryContext> queryContext; // Created on first query after open or invalidation
+    ParsedQueryCache parsedQueryCache;
+
+    // Reused for every email added so that indexing doesn't set up a new generator per message,
+    // or allocate strings for terms and document data once they have grown large enough
+    IndexingPipeline indexingPipeline;
+    Xapian::Document emailDocument;
+    string termBuffer;
+    string documentDataBuffer;
+
+    // Routing table from unique id terms (Q<id>) to partition and docid, so that
+    // mutations don't have to probe the postlist of every partition
+    unordered_map<string, DocumentLocation> uniqueTermRoutes;
+    size_t routedPartitions; // number of partitions loaded into uniqueTermRoutes
+    unsigned int routingHits;
+    unsigned int routingMisses;
+    unsigned int routingPartitionLoads;
+
+    // Buffer returned to javascript by sortedXapianQueryArena
+    ResultArena resultArena;
+
+    // The databases combined in db and their uuids, in the order they were added, and the paths
+    // of those that are open (a lazy partition that isn't attached has an empty database in its place)
+    vector<Xapian::Database> combinedShards;
+    vector<string> combinedShardPaths;
+    vector<string> shardUuids;
+
+    // Incremented on every change of documents, so that state derived from query results can be invalidated
+    unsigned int modifications;
+    unsigned int modificationsAtLastCommit;
+    IncrementalSearchSession incrementalSearch;
+
+    bool writable;
+
+    // Total, unread and flagged counts per folder of the databases added with add*Database, loaded
+    // on first use and then kept up to date. Lazy partitions have their own, see getAllFolderStats.
+    map<string, FolderStats> folderStats;
+    bool folderStatsLoaded;
+    unsigned int folderStatsGeneration; // Written to the metadata of every writable database on commit
+    ResultArena folderStatsArena;
+
+    // Databases added with add*Database, which are always part of db, and their paths
+    vector<Xapian::Database> eagerShards;
+    vector<string> eagerShardPaths;
+
+    // Partitions opened on demand by preparePartitionsForQuery, and closed (least recently used first)
+    // when the attached ones exceed partitionMemoryBudget bytes (0 for no limit)
+    vector<LazyPartition> lazyPartitions;
+    Xapian::Database emptyPartition; // In place of lazy partitions that aren't attached
+    string emptyPartitionPath; // Temporary directory of emptyPartition, removed on close
+    double partitionMemoryBudget;
+    unsigned int partitionUseClock;
+    unsigned int partitionAttaches;
+    unsigned int partitionDetaches;
+
+    WriteScheduler writeScheduler;
+
+    // Values of the sorted and displayed slots by docid of db, see getValueSlotCache
+    ValueSlotCache valueSlotCache;
+
+    // Conversations with their messages and unread counts, loaded on first use and then kept up to date
+    ThreadIndex threadIndex;
+    unsigned int threadIndexGeneration; // Written to the metadata of every writable database on commit
+    ResultArena threadListArena;
+
+    // Buffer returned to javascript by getResultSnippets
+    ResultArena snippetArena;
+    string snippetTextBuffer;
+
+    // Flags set or cleared without rewriting the documents, written to them on commit once there
+    // are more than flagOverlayLimit entries (0 to always write flag changes to the documents)
+    shared_ptr<FlagOverlay> flagOverlay;
+    size_t flagOverlayLimit;
+
+    // Documents deleted since the last commit
+    shared_ptr<Tombstones> tombstones;
+
+    // Export started by beginDatabaseExport, one per index
+    DatabaseExportStream databaseExport;
+    
+    DatabaseContainer() : parsedQueryCache(64), flagOverlay(new FlagOverlay()), tombstones(new Tombstones()) {
+      modifications = 0;
+      modificationsAtLastCommit = 0;
+      writable = false;
+      folderStatsLoaded = false;
+      folderStatsGeneration = 0;
+      threadIndexGeneration = 0;
+      routedPartitions = 0;
+      routingHits = 0;
+      routingMisses = 0;
+      routingPartitionLoads = 0;
+      partitionMemoryBudget = 0;
+      partitionUseClock = 0;
+      partitionAttaches = 0;
+      partitionDetaches = 0;
+      flagOverlayLimit = 10000;
+    }
+    
+    void openDatabaseAsWritable(const char * path) {
+      dbw = Xapian::WritableDatabase(path,Xapian::DB_CREATE_OR_OPEN); 
+      db = dbw;       
+      eagerShards.assign(1, dbw);
+      eagerShardPaths.assign(1, path);
+      combinedShards.assign(1, dbw);
+      combinedShardPaths.assign(1, path);
+      shardUuids.assign(1, dbw.get_uuid());
+      writable = true;
+      tombstones->reset();
+      tombstones->addPartition(dbw);
+      loadIndexingSettings();
+      loadFlagOverlay();
+    }
+    
+
+    void openDatabaseAsReadOnly(const char * path) {
+      db = Xapian::Database(path);              
+      eagerShards.assign(1, db);
+      eagerShardPaths.assign(1, path);
+      combinedShards.assign(1, db);
+      combinedShardPaths.assign(1, path);
+      shardUuids.assign(1, db.get_uuid());
+      loadIndexingSettings();
+      loadFlagOverlay();
+    }
+
+    /**
+    * Needs a writable database open before adding this.
+    */
+    void addSingleFileDatabase(const char * path) {      
+      dbsinglefile = Xapian::Database(fileno(fopen(path,"r")),Xapian::DB_OPEN);
+      eagerShards.push_back(dbsinglefile);
+      eagerShardPaths.push_back(path);
+      rebuildCombinedDatabase(); // Before the shards of lazy partitions
+      invalidateQueryContext();
+      invalidateFolderStats();
+      valueSlotCache.invalidate();
+      threadIndex.invalidate();
+    }     
+
+     /**
+    * Needs a writable database open before adding this.
+    */
+    void addFolderDatabase(const char * path) {  
+      const Xapian::WritableDatabase dbw = Xapian::WritableDatabase(path);
+      addedWritableDatabases.push_back(dbw);   
+      eagerShards.push_back(dbw);
+      eagerShardPaths.push_back(path);
+      rebuildCombinedDatabase(); // Before the shards of lazy partitions
+      flagOverlay->addPartition(dbw);
+      tombstones->addPartition(dbw);
+      invalidateQueryContext();
+      invalidateFolderStats();
+      valueSlotCache.invalidate();
+      threadIndex.invalidate();
+    }       
+
+    /**
+     * Register a single file partition holding the messages of folder without opening it.
+     * If size is 0 it's taken from the file. Like adding a database, this changes the docids
+     * of db, but attaching and detaching the partition later doesn't.
+     */
+    void registerLazyPartition(const char * path, const char * folder, double size) {
+      LazyPartition partition;
+      partition.path = path;
+      partition.folders.push_back(folder);
+      partition.size = size;
+      if(partition.size <= 0) {
+        ifstream file(path, ios::in | ios::binary | ios::ate);
+        partition.size = file.is_open() ? (double) file.tellg() : 0;
+      }
+      partition.attached = false;
+      partition.lastUsed = 0;
+      partition.folderStatsCounted = false;
+      lazyPartitions.push_back(partition);
+      rebuildCombinedDatabase();
+    }
+
+    /**
+     * Make sure that every lazy partition a query may match is attached, and detach idle
+     * partitions when over the memory budget. Every registered partition keeps its shard
+     * in db, so docids of db stay the same when partitions are attached or detached.
+     */
+    void preparePartitionsForQuery(const string & querytext) {
+      if(lazyPartitions.empty()) {
+        return;
+      }
+
+      set<string> folders;
+      bool restricted = false;
+      if(!querytext.empty()) {
+        const Xapian::Query query = parseQuery(getQueryContext().sortedQueryParser, "sorted", querytext);
+        restricted = getRequiredFolders(query, folders);
+      }
+
+      partitionUseClock++;
+      bool changed = false;
+      try {
+        for(LazyPartition & partition : lazyPartitions) {
+          bool needed = !restricted;
+          for(size_t n = 0; !needed && n < partition.folders.size(); n++) {
+            needed = folders.count(partition.folders[n]) > 0;
+          }
+          if(!needed) {
+            continue;
+          }
+          partition.lastUsed = partitionUseClock;
+          if(!partition.attached) {
+            attachLazyPartition(partition);
+            changed = true;
+          }
+        }
+      } catch(const Xapian::Error &e) {
+        if(changed) {
+          rebuildCombinedDatabase();
+        }
+        throw;
+      }
+      if(enforcePartitionMemoryBudget() || changed) {
+        rebuildCombinedDatabase();
+      }
+    }
+
+    void attachLazyPartition(LazyPartition & partition) {
+      FILE * file = fopen(partition.path.c_str(),"r");
+      if(file == NULL) {
+        throw Xapian::DatabaseOpeningError("Couldn't open partition " + partition.path);
+      }
+      partition.database = Xapian::Database(fileno(file),Xapian::DB_OPEN);
+      partition.attached = true;
+      partitionAttaches++;
+      metrics.partitionLoads++;
+
+      // Messages may have been moved to other folders before the partition was built
+      partition.folders.clear();
+      const string folderprefix = "XFOLDER:";
+      Xapian::TermIterator termitend = partition.database.allterms_end(folderprefix);
+      for (Xapian::TermIterator tm = partition.database.allterms_begin(folderprefix); tm != termitend; ++tm) {
+        partition.folders.push_back((*tm).substr(folderprefix.size()));
+      }
+    }
+
+    /**
+     * Detach least recently used partitions not used by the current query until the
+     * attached partitions fit the budget. Returns true if any partition was detached.
+     */
+    bool enforcePartitionMemoryBudget() {
+      if(partitionMemoryBudget <= 0) {
+        return false;
+      }
+      double attachedSize = 0;
+      for(const LazyPartition & partition : lazyPartitions) {
+        if(partition.attached) {
+          attachedSize += partition.size;
+        }
+      }
+
+      bool detached = false;
+      while(attachedSize > partitionMemoryBudget) {
+        LazyPartition * leastRecentlyUsed = NULL;
+        for(LazyPartition & partition : lazyPartitions) {
+          if(partition.attached && partition.lastUsed != partitionUseClock &&
+              (leastRecentlyUsed == NULL || partition.lastUsed < leastRecentlyUsed->lastUsed)) {
+            leastRecentlyUsed = &partition;
+          }
+        }
+        if(leastRecentlyUsed == NULL) {
+          break;
+        }
+        leastRecentlyUsed->database = Xapian::Database();
+        leastRecentlyUsed->attached = false;
+        attachedSize -= leastRecentlyUsed->size;
+        partitionDetaches++;
+        detached = true;
+      }
+      return detached;
+    }
+
+    /**
+     * Combine the eagerly added databases with a shard for every lazy partition, which is an
+     * empty database when the partition isn't attached
+     */
+    void rebuildCombinedDatabase() {
+      db = Xapian::Database();
+      combinedShards.clear();
+      combinedShardPaths.clear();
+      shardUuids.clear();
+      for(size_t n = 0; n < eagerShards.size(); n++) {
+        db.add_database(eagerShards[n]);
+        combinedShards.push_back(eagerShards[n]);
+        combinedShardPaths.push_back(eagerShardPaths[n]);
+        shardUuids.push_back(eagerShards[n].get_uuid());
+      }
+      for(const LazyPartition & partition : lazyPartitions) {
+        const Xapian::Database & shard = partition.attached ? partition.database : getEmptyPartition();
+        db.add_database(shard);
+        combinedShards.push_back(shard);
+        shardUuids.push_back(shard.get_uuid());
+        if(partition.attached) {
+          combinedShardPaths.push_back(partition.path);
+        }
+      }
+      // The enquires hold on to the databases, but parsed queries and folder statistics
+      // don't depend on which partitions are attached
+      queryContext.reset();
+      incrementalSearch.reset();
+      valueSlotCache.invalidate();
+      threadIndex.invalidate();
+    }
+
+    /**
+     * An empty glass database (like the partitions, so that db can be compacted), created in a
+     * temporary directory rather than next to the main database, which may be read-only or
+     * persisted
+     */
+    const Xapian::Database & getEmptyPartition() {
+      if(emptyPartition.internal.empty()) {
+        const char * tmpdir = getenv("TMPDIR");
+        string path = string(tmpdir != NULL && tmpdir[0] != 0 ? tmpdir : "/tmp") + "/emptypartitionXXXXXX";
+        if(mkdtemp(&path[0]) == NULL) {
+          throw Xapian::DatabaseCreateError("Couldn't create a directory for the empty partition in " + path);
+        }
+        emptyPartitionPath = path;
+        Xapian::WritableDatabase(path, Xapian::DB_CREATE_OR_OPEN).close();
+        emptyPartition = Xapian::Database(path);
+      }
+      return emptyPartition;
+    }
+
+    void removeEmptyPartition() {
+      if(!emptyPartitionPath.empty()) {
+        emptyPartition.close();
+        removeDatabaseDirectory(emptyPartitionPath);
+        emptyPartitionPath.clear();
+      }
+    }
+    
+    /**
+    * set value range for the query
+    */
+    void setStringValueRange(int valueRangeSlotNumber, const char * prefix) {
+      clearValueRange();
+      rangeProcessor.reset(new Xapian::RangeProcessor(valueRangeSlotNumber, prefix));
+      rangeProcessorKey = to_string(valueRangeSlotNumber) + ":" + prefix;
+    }        
+    
+    void clearValueRange() {
+      // The query parsers refer to the range processor, so drop them first
+      invalidateQueryContext();
+      rangeProcessor.reset();
+      rangeProcessorKey.clear();
+    }     
+
+    /**
+     * Indexing settings stored in the main database, or the defaults
+     */
+    void loadIndexingSettings() {
+      const string persisted = (writable ? dbw : eagerShards[0]).get_metadata("indexingpipeline");
+      IndexingPipeline::Settings settings;
+      if(!persisted.empty() && !settings.unserialise(persisted)) {
+        logAt(LOG_WARNING) << "Ignoring invalid indexing settings" << endl;
+      }
+      try {
+        indexingPipeline.configure(settings);
+      } catch(const Xapian::InvalidArgumentError &e) {
+        logAt(LOG_WARNING) << "Ignoring indexing settings: " << e.get_msg() << endl;
+        indexingPipeline.configure(IndexingPipeline::Settings());
+      }
+      invalidateQueryContext();
+    }
+
+    /**
+     * Use the settings for messages indexed from now on, and store them with the next commit.
+     * Messages already indexed keep their terms until reindexed. After setting or changing the
+     * language of an index that isn't empty, queries also match words unstemmed (see
+     * IndexingPipeline::searchesUnstemmed), so those messages are still found by the words
+     * they contain, but not by other forms of them. Messages indexed with stop words that are
+     * no longer stop words aren't found by those words.
+     */
+    void configureIndexing(const IndexingPipeline::Settings & newsettings) {
+      IndexingPipeline::Settings settings = newsettings;
+      const IndexingPipeline::Settings & current = indexingPipeline.getSettings();
+      settings.unstemmedTerms = current.unstemmedTerms ||
+            (settings.language != current.language && db.get_doccount() > 0);
+      indexingPipeline.configure(settings);
+      if(writable) {
+        dbw.set_metadata("indexingpipeline", settings.serialise());
+        documentsModified();
+      }
+      invalidateQueryContext();
+    }
+
+    QueryContext & getQueryContext() {
+      if(!queryContext) {
+        queryContext.reset(new QueryContext(db, rangeProcessor.get(), &indexingPipeline, flagOverlay));
+      }
+      return *queryContext;
+    }
+
+    ValueSlotCache & getValueSlotCache() {
+      if(!valueSlotCache.isBuilt()) {
+        applyTombstones();
+        valueSlotCache.build(db);
+      }
+      return valueSlotCache;
+    }
+
+    /**
+     * False while the heap is over the memory budget and the value slot cache was released
+     * (see enforceMemoryBudget), since building it again would only add to the heap. Callers
+     * then read the documents and sort with Xapian instead.
+     */
+    bool canUseValueSlotCache() {
+      return valueSlotCache.isBuilt() || !memoryGovernor.overBudget();
+    }
+
+    /**
+     * Docid in db of a document of a writable partition
+     */
+    Xapian::docid getCombinedDocId(int partition, Xapian::docid docid) {
+      return getCombinedDocId(getWritablePartition(partition), docid);
+    }
+
+    Xapian::docid getCombinedDocId(const Xapian::Database & partitiondb, Xapian::docid docid) {
+      return getCombinedDocId(partitiondb.get_uuid(), docid);
+    }
+
+    Xapian::docid getCombinedDocId(const string & uuid, Xapian::docid docid) {
+      const size_t shard = find(shardUuids.begin(), shardUuids.end(), uuid) - shardUuids.begin();
+      return (docid - 1) * shardUuids.size() + shard + 1;
+    }
+
+    void documentReplaced(int partition, Xapian::docid docid, const Xapian::Document & doc) {
+      flagOverlay->removeDocument(partition, docid);
+      if(valueSlotCache.isBuilt() || threadIndex.isLoaded()) {
+        const Xapian::docid combineddocid = getCombinedDocId(partition, docid);
+        if(valueSlotCache.isBuilt()) {
+          valueSlotCache.setDocument(combineddocid, doc);
+        }
+        if(threadIndex.isLoaded()) {
+          threadIndex.setDocument(combineddocid, doc);
+        }
+      }
+    }
+
+    /**
+     * Called after replacing a document of a partition with changed flag terms
+     */
+    void documentFlagsChanged(const Xapian::Database & partitiondb, Xapian::docid docid, const Xapian::Document & doc) {
+      if(threadIndex.isLoaded()) {
+        threadIndex.setSeen(getCombinedDocId(partitiondb, docid), documentHasTerm(doc, "XFseen"));
+      }
+    }
+
+    /**
+     * Load the flag overlay persisted in the writable databases (or the main database if read only)
+     */
+    void loadFlagOverlay() {
+      flagOverlay->reset();
+      if(writable) {
+        flagOverlay->addPartition(dbw);
+        for(Xapian::WritableDatabase & partitionWritableDatabase : addedWritableDatabases) {
+          flagOverlay->addPartition(partitionWritableDatabase);
+        }
+      } else if(!eagerShards.empty()) {
+        flagOverlay->addPartition(eagerShards[0]);
+      }
+    }
+
+    bool usesFlagOverlay(const string & term) const {
+      return writable && flagOverlayLimit > 0 && FlagOverlay::isFlagTerm(term);
+    }
+
+    /**
+     * Whether the document of a partition has the term, without the flag overlay
+     */
+    bool documentHasFlag(const DocumentLocation & location, const string & term) {
+      Xapian::WritableDatabase & partitionWritableDatabase = getWritablePartition(location.partition);
+      Xapian::PostingIterator p = partitionWritableDatabase.postlist_begin(term);
+      p.skip_to(location.docid);
+      return p != partitionWritableDatabase.postlist_end(term) && *p == location.docid;
+    }
+
+    /**
+     * Set or clear a flag of a document in the flag overlay, keeping the folder statistics and
+     * thread index up to date. Returns false if the document already had the flag state.
+     */
+    bool setFlagInOverlay(const DocumentLocation & location, const string & term, bool present) {
+      const bool indocument = documentHasFlag(location, term);
+      bool current = indocument;
+      flagOverlay->get(location.partition, location.docid, term, current);
+      if(current == present) {
+        return false;
+      }
+      const DocumentFolderState before = getFolderStateForStats(location);
+      if(present == indocument) {
+        flagOverlay->erase(location.partition, location.docid, term);
+      } else {
+        if(flagOverlay->empty()) {
+          // flag: queries were parsed to plain terms
+          parsedQueryCache.clear();
+        }
+        flagOverlay->set(location.partition, location.docid, term, present);
+      }
+
+      DocumentFolderState after = before;
+      if(term == "XFseen") {
+        after.seen = present;
+      } else if(term == "XFflagged") {
+        after.flagged = present;
+      }
+      updateFolderStats(before, after);
+      if(term == "XFseen" && threadIndex.isLoaded()) {
+        threadIndex.setSeen(getCombinedDocId(location.partition, location.docid), present);
+      }
+      metrics.flagOverlayChanges++;
+      return true;
+    }
+
+    /**
+     * Set or clear a flag term of the document with the unique term in the flag overlay.
+     * Returns false if the term isn't kept in the overlay, and the document must be changed instead.
+     */
+    bool setFlag(const string & unique_term, const string & term, bool present) {
+      if(!usesFlagOverlay(term)) {
+        return false;
+      }
+      DocumentLocation location;
+      if(!findUniqueTerm(unique_term, location)) {
+        throw Xapian::DocNotFoundError("No document with unique term " + unique_term);
+      }
+      setFlagInOverlay(location, term, present);
+      return true;
+    }
+
+    /**
+     * Document of db with the flags of the flag overlay
+     */
+    Xapian::Document getDocumentWithFlags(Xapian::docid docid) {
+      Xapian::Document doc = db.get_document(docid);
+      if(!flagOverlay->empty()) {
+        const size_t numshards = shardUuids.size();
+        const int partition = flagOverlay->findPartition(shardUuids[(docid - 1) % numshards]);
+        if(partition >= 0) {
+          flagOverlay->applyToDocument(partition, (docid - 1) / numshards + 1, doc);
+        }
+      }
+      return doc;
+    }
+
+    /**
+     * Write the flags of the overlay to the documents (in docid order of every partition)
+     * and empty it
+     */
+    void writeFlagOverlay() {
+      if(!writable || flagOverlay->empty()) {
+        return;
+      }
+      for(size_t partition = 0; partition < flagOverlay->partitions.size(); partition++) {
+        set<Xapian::docid> docids;
+        for(const pair<const string, map<Xapian::docid, bool> > & flag : flagOverlay->partitions[partition].flags) {
+          for(const pair<const Xapian::docid, bool> & entry : flag.second) {
+            docids.insert(entry.first);
+          }
+        }
+        Xapian::WritableDatabase & partitionWritableDatabase = getWritablePartition(partition);
+        for(Xapian::docid docid : docids) {
+          Xapian::Document doc = partitionWritableDatabase.get_document(docid);
+          flagOverlay->applyToDocument(partition, docid, doc);
+          partitionWritableDatabase.replace_document(docid, doc);
+        }
+        flagOverlay->clearPartition(partition);
+        metrics.flagOverlayWrites += docids.size();
+      }
+      parsedQueryCache.clear(); // flag: queries can be plain terms again
+      modifications++;
+    }
+
+    /**
+     * Must be called before committing the writable databases
+     */
+    void persistFlagOverlay() {
+      if(!writable) {
+        return;
+      }
+      for(size_t partition = 0; partition < flagOverlay->partitions.size(); partition++) {
+        FlagOverlay::Partition & overlay = flagOverlay->partitions[partition];
+        if(!overlay.modified) {
+          continue;
+        }
+        ResultArena persisted;
+        if(!overlay.flags.empty()) {
+          FlagOverlay::serialise(overlay, persisted);
+        }
+        getWritablePartition(partition).set_metadata("flagoverlay",
+              string((const char *) persisted.data(), persisted.size()));
+        overlay.modified = false;
+      }
+    }
+
+    /**
+     * Compaction may renumber the documents, so the flag overlay is written to them first,
+     * and the deleted documents must be left out
+     */
+    void prepareCompaction() {
+      if(writable && (!flagOverlay->empty() || !tombstones->empty())) {
+        writeFlagOverlay();
+        commit();
+      }
+    }
+
+    /**
+     * Delete the documents of the tombstones from their partitions, in docid order. Called on
+     * commit, and before anything is rebuilt from the documents of the database.
+     */
+    void applyTombstones() {
+      if(tombstones->empty()) {
+        return;
+      }
+      for(size_t partition = 0; partition < tombstones->partitions.size(); partition++) {
+        Xapian::WritableDatabase & partitionWritableDatabase = getWritablePartition(partition);
+        for(Xapian::docid docid : tombstones->partitions[partition].docids) {
+          partitionWritableDatabase.delete_document(docid);
+        }
+      }
+      metrics.tombstonesApplied += tombstones->size();
+      tombstones->clear();
+    }
+
+    /**
+     * The query without the documents deleted since the last commit
+     */
+    Xapian::Query excludeTombstones(const Xapian::Query & query) const {
+      if(tombstones->empty()) {
+        return query;
+      }
+      return Xapian::Query(Xapian::Query::OP_AND_NOT, query,
+            Xapian::Query((new TombstonePostingSource(tombstones))->release()));
+    }
+
+    /**
+     * Whether a document of db is deleted and not yet committed
+     */
+    bool isTombstone(Xapian::docid docid) const {
+      if(tombstones->empty()) {
+        return false;
+      }
+      const size_t numshards = shardUuids.size();
+      return tombstones->contains(tombstones->findPartition(shardUuids[(docid - 1) % numshards]),
+            (docid - 1) / numshards + 1);
+    }
+
+    /**
+     * Value of a slot of a document of db, from the value slot cache if the slot is cached
+     */
+    string getValue(Xapian::docid docid, int slot) {
+      ValueSlotCache::Column * column = valueSlotCache.getColumn(slot);
+      if(column != NULL && canUseValueSlotCache()) {
+        ValueSlotCache & cache = getValueSlotCache();
+        if(cache.hasDocument(docid)) {
+          return cache.getValue(*column, docid);
+        }
+      }
+      return db.get_document(docid).get_value(slot);
+    }
+
+    void documentDeleted(int partition, Xapian::docid docid) {
+      flagOverlay->removeDocument(partition, docid);
+      if(valueSlotCache.isBuilt() || threadIndex.isLoaded()) {
+        const Xapian::docid combineddocid = getCombinedDocId(partition, docid);
+        valueSlotCache.removeDocument(combineddocid);
+        threadIndex.removeDocument(combineddocid);
+      }
+    }
+
+    /**
+     * Sort with the value slot cache if the query is all documents or a single term
+     * (e.g. a folder) and the sort and collapse slots are cached. Returns false if not.
+     */
+    bool cachedSortedQuery(const Xapian::Query & query, int sortvaluenum, bool reverse,
+          int offset, int maxresults, int collapsevaluenum, vector<SortedMatch> & matches) {
+      ValueSlotCache::Column * sortcolumn = valueSlotCache.getColumn(sortvaluenum);
+      ValueSlotCache::Column * collapsecolumn = collapsevaluenum > -1 ? valueSlotCache.getColumn(collapsevaluenum) : NULL;
+      if(sortcolumn == NULL || (collapsevaluenum > -1 && collapsecolumn == NULL)) {
+        return false;
+      }
+
+      Xapian::Query subquery = query;
+      while(subquery.get_type() == Xapian::Query::OP_SCALE_WEIGHT && subquery.get_num_subqueries() == 1) {
+        subquery = subquery.get_subquery(0); // Boolean filters are parsed as 0 * term
+      }
+      const bool matchall = subquery.get_type() == Xapian::Query::LEAF_MATCH_ALL;
+      if((!matchall && subquery.get_type() != Xapian::Query::LEAF_TERM) || !canUseValueSlotCache()) {
+        return false;
+      }
+
+      ValueSlotCache & cache = getValueSlotCache();
+      vector<Xapian::docid> docids;
+      if(matchall) {
+        docids.reserve(db.get_doccount());
+        for(Xapian::docid docid = 1; docid < cache.numDocIds(); docid++) {
+          if(cache.hasDocument(docid)) {
+            docids.push_back(docid);
+          }
+        }
+      } else {
+        const string term = *subquery.get_terms_begin();
+        docids.reserve(db.get_termfreq(term));
+        for(Xapian::PostingIterator p = db.postlist_begin(term); p != db.postlist_end(term); ++p) {
+          if(cache.hasDocument(*p)) { // Not deleted since the last commit
+            docids.push_back(*p);
+          }
+        }
+      }
+      cache.sortDocuments(docids, *sortcolumn, reverse, collapsecolumn,
+            offset > 0 ? offset : 0, maxresults > 0 ? maxresults : 0, matches);
+      metrics.cachedSortQueries++;
+      return true;
+    }
+
+    /**
+     * Must be called whenever databases are added or reopened, since the
+     * enquires and query parsers hold on to the set of databases
+     */
+    void invalidateQueryContext() {
+      queryContext.reset();
+      parsedQueryCache.clear();
+      incrementalSearch.reset();
+    }
+
+    /**
+     * Called before every change of documents. Commits the changes pending before
+     * this one if they reached a threshold of the write scheduler.
+     */
+    void documentsModified() {
+      const double now = emscripten_get_now();
+      if(writeScheduler.commitDue(now)) {
+        runScheduledCommit();
+      } else if(memoryGovernor.pendingChangesCapped(writeScheduler.pendingChanges)) {
+        if(runScheduledCommit()) {
+          memoryGovernor.forcedCommits++;
+        }
+      }
+      enforceMemoryBudget(true);
+      modifications++;
+      writeScheduler.changed(now);
+    }
+
+    /**
+     * When over the budget of the memory governor, commit pending changes (if commitPending)
+     * and release caches that are rebuilt on demand
+     */
+    void enforceMemoryBudget(bool commitPending) {
+      if(!memoryGovernor.overBudget()) {
+        return;
+      }
+      if(commitPending && writeScheduler.pendingChanges > 0 && runScheduledCommit()) {
+        memoryGovernor.forcedCommits++;
+      }
+      releaseCaches();
+      memoryGovernor.released();
+    }
+
+    /**
+     * The unique term routes are kept, since every change needs them
+     */
+    void releaseCaches() {
+      valueSlotCache.release();
+      parsedQueryCache.clear();
+      incrementalSearch.reset();
+      resultArena.release();
+      threadListArena.release();
+      snippetArena.release();
+      folderStatsArena.release();
+      memoryGovernor.cacheReleases++;
+    }
+
+    /**
+     * Approximate bytes held by the caches of this index and the unique term routes
+     */
+    double getCacheMemoryUsage() const {
+      double bytes = valueSlotCache.memoryUsage();
+      bytes += resultArena.capacity() + threadListArena.capacity() + folderStatsArena.capacity() +
+            snippetArena.capacity();
+      for(const pair<const string, DocumentLocation> & route : uniqueTermRoutes) {
+        bytes += sizeof(route) + route.first.capacity() + sizeof(void *) * 2;
+      }
+      return bytes;
+    }
+
+    void commit() {
+      ScopedTimer timer(EP_COMMIT);
+      metrics.commits++;
+      applyTombstones();
+      if(flagOverlay->size() > flagOverlayLimit) {
+        writeFlagOverlay();
+      }
+      persistFlagOverlay();
+      persistFolderStats();
+      persistThreadIndex();
+      modificationsAtLastCommit = modifications;
+      dbw.commit();
+      for(Xapian::WritableDatabase & partitionWritableDatabase : addedWritableDatabases) {
+        partitionWritableDatabase.commit();
+      }
+      writeScheduler.committed(emscripten_get_now());
+    }
+
+    /**
+     * Errors are reported rather than thrown, since they don't belong to the change that
+     * happened to reach the threshold. Returns true if committed.
+     */
+    bool runScheduledCommit() {
+      if(!writable) {
+        return false;
+      }
+      try {
+        commit();
+        writeScheduler.scheduledCommits++;
+        return true;
+      } catch(const Xapian::Error &e) {
+        reportError(EP_COMMIT, e);
+        return false;
+      }
+    }
+
+    /**
+     * One step of scheduled work, returns the ScheduledWrite flags of what was done:
+     * a due commit, or else starting a due compaction (when nothing is pending, so that
+     * the compaction has every change). A finished compaction is reported on the next call.
+     */
+    int runScheduledWrites() {
+      int done = 0;
+      if(writeScheduler.collectFinishedCompaction()) {
+        done |= writeScheduler.lastCompactionError.empty() ?
+              SCHEDULED_COMPACTION_FINISHED : SCHEDULED_COMPACTION_FAILED;
+      }
+      if(writeScheduler.commitDue(emscripten_get_now())) {
+        if(runScheduledCommit()) {
+          done |= SCHEDULED_COMMIT;
+        }
+        return done;
+      }
+      if(writable && writeScheduler.pendingChanges == 0) {
+        const Xapian::rev revision = getWritableRevision();
+        const double size = getDatabaseFileSize();
+        if(writeScheduler.compactionDue(revision, size)) {
+          prepareCompaction();
+          writeScheduler.startCompaction(combinedShardPaths, getWritableRevision(), size);
+          done |= SCHEDULED_COMPACTION_STARTED;
+        }
+      }
+      return done;
+    }
+
+    /**
+     * Sum of the committed revisions of the writable databases, which grows on every commit
+     */
+    Xapian::rev getWritableRevision() const {
+      Xapian::rev revision = dbw.get_revision();
+      for(const Xapian::WritableDatabase & partitionWritableDatabase : addedWritableDatabases) {
+        revision += partitionWritableDatabase.get_revision();
+      }
+      return revision;
+    }
+
+    double getDatabaseFileSize() const {
+      double size = 0;
+      for(const string & path : combinedShardPaths) {
+        size += databaseFileSize(path);
+      }
+      return size;
+    }
+
+    /**
+     * Parse with the given query parser of the query context, using the parsed query cache.
+     * parsername must identify the query parser (including its prefixes) in the cache key.
+     */
+    Xapian::Query parseQuery(Xapian::QueryParser & queryparser, const char * parsername, const string & querystring) {
+      return parseCachedQuery(parsedQueryCache, getQueryContext(), queryparser, parsername, rangeProcessorKey,
+            querystring);
+    }
+
+    void invalidateFolderStats() {
+      folderStats.clear();
+      folderStatsLoaded = false;
+    }
+
+    void loadFolderStats() {
+      if(folderStatsLoaded) {
+        return;
+      }
+      if(!readPersistedFolderStats()) {
+        rebuildFolderStats();
+      }
+      folderStatsLoaded = true;
+    }
+
+    /**
+     * Count messages of every folder of the eagerly added databases
+     */
+    void rebuildFolderStats() {
+      folderStats.clear();
+      applyTombstones();
+
+      Xapian::Database eagerdb;
+      for(const Xapian::Database & shard : eagerShards) {
+        eagerdb.add_database(shard);
+      }
+      countFolderStats(eagerdb, FlagFieldProcessor::flagQuery(flagOverlay, "XFseen"),
+            FlagFieldProcessor::flagQuery(flagOverlay, "XFflagged"), folderStats);
+    }
+
+    /**
+     * Statistics of every folder, of the eagerly added databases and every lazy partition,
+     * whether attached or not. A lazy partition is opened just for counting if it isn't.
+     */
+    map<string, FolderStats> getAllFolderStats() {
+      loadFolderStats();
+      map<string, FolderStats> all(folderStats);
+      for(LazyPartition & partition : lazyPartitions) {
+        if(!partition.folderStatsCounted) {
+          const Xapian::Database database = partition.attached ? partition.database : openDatabaseAt(partition.path);
+          countFolderStats(database, Xapian::Query("XFseen"), Xapian::Query("XFflagged"), partition.folderStats);
+          partition.folderStatsCounted = true;
+        }
+        for(const pair<const string, FolderStats> & entry : partition.folderStats) {
+          FolderStats & stats = all[entry.first];
+          stats.total += entry.second.total;
+          stats.unread += entry.second.unread;
+          stats.flagged += entry.second.flagged;
+        }
+      }
+      return all;
+    }
+
+    /**
+     * Persisted folder statistics are only used if they were written for the same set of
+     * databases, and no writable database has been committed without them since.
+     * Format: generation and comma separated shard uuids on the first line, then
+     * folder, total, unread and flagged separated by tabs on each line.
+     */
+    bool readPersistedFolderStats() {
+      if(!writable) {
+        return false;
+      }
+      istringstream persisted(dbw.get_metadata("folderstats"));
+      string line;
+      if(!getline(persisted, line)) {
+        return false;
+      }
+      const size_t tabpos = line.find('\t');
+      if(tabpos == string::npos) {
+        return false;
+      }
+      const string generation = line.substr(0, tabpos);
+      if(line.substr(tabpos + 1) != getEagerShardUuidList() ||
+          !hasPersistedGeneration("folderstats_generation", generation)) {
+        return false;
+      }
+
+      folderStats.clear();
+      while(getline(persisted, line)) {
+        istringstream fields(line);
+        string folder;
+        FolderStats stats;
+        if(getline(fields, folder, '\t') && fields >> stats.total >> stats.unread >> stats.flagged) {
+          folderStats[folder] = stats;
+        }
+      }
+      folderStatsGeneration = strtoul(generation.c_str(), NULL, 10);
+      return true;
+    }
+
+    /**
+     * Must be called before committing the writable databases
+     */
+    void persistFolderStats() {
+      if(!writable || modifications == modificationsAtLastCommit) {
+        return;
+      }
+      if(!folderStatsLoaded) {
+        // Documents were changed without keeping the statistics up to date
+        dbw.set_metadata("folderstats", "");
+        return;
+      }
+
+      const string generation = to_string(++folderStatsGeneration);
+      ostringstream persisted;
+      persisted << generation << '\t' << getEagerShardUuidList() << '\n';
+      for(const pair<const string, FolderStats> & entry : folderStats) {
+        persisted << entry.first << '\t' << entry.second.total << '\t'
+                  << entry.second.unread << '\t' << entry.second.flagged << '\n';
+      }
+      dbw.set_metadata("folderstats", persisted.str());
+      setPersistedGeneration("folderstats_generation", generation);
+    }
+
+    /**
+     * Comma separated uuids of the databases combined in db, identifying the docids of db
+     */
+    string getShardUuidList() const {
+      string uuids;
+      for(const string & uuid : shardUuids) {
+        uuids.append(uuids.empty() ? "" : ",").append(uuid);
+      }
+      return uuids;
+    }
+
+    /**
+     * Comma separated uuids of the databases added with add*Database, which folderStats counts
+     */
+    string getEagerShardUuidList() const {
+      string uuids;
+      for(const Xapian::Database & shard : eagerShards) {
+        uuids.append(uuids.empty() ? "" : ",").append(shard.get_uuid());
+      }
+      return uuids;
+    }
+
+    /**
+     * True if every writable database has the generation in the metadata key
+     */
+    bool hasPersistedGeneration(const string & key, const string & generation) {
+      if(dbw.get_metadata(key) != generation) {
+        return false;
+      }
+      for(Xapian::WritableDatabase & partitionWritableDatabase : addedWritableDatabases) {
+        if(partitionWritableDatabase.get_metadata(key) != generation) {
+          return false;
+        }
+      }
+      return true;
+    }
+
+    void setPersistedGeneration(const string & key, const string & generation) {
+      dbw.set_metadata(key, generation);
+      for(Xapian::WritableDatabase & partitionWritableDatabase : addedWritableDatabases) {
+        partitionWritableDatabase.set_metadata(key, generation);
+      }
+    }
+
+    void loadThreadIndex() {
+      if(!threadIndex.isLoaded() && !readPersistedThreadIndex()) {
+        applyTombstones();
+        threadIndex.build(db);
+        vector<Xapian::docid> docids;
+        for(size_t partition = 0; partition < flagOverlay->partitions.size(); partition++) {
+          for(int seen = 0; seen < 2; seen++) {
+            flagOverlay->getDocIds(partition, "XFseen", seen, docids);
+            for(Xapian::docid docid : docids) {
+              threadIndex.setSeen(getCombinedDocId(flagOverlay->partitions[partition].uuid, docid), seen);
+            }
+          }
+        }
+      }
+    }
+
+    /**
+     * Same rules as for persisted folder statistics. The "threadindex" metadata holds the
+     * generation, shard uuids (see getShardUuidList) and ThreadIndex::VERSION, and the
+     * buckets of ThreadIndex::unserialise are in "threadindex:" followed by the bucket number.
+     */
+    bool readPersistedThreadIndex() {
+      if(!writable) {
+        return false;
+      }
+      const string persisted = dbw.get_metadata("threadindex");
+      PackedBufferReader reader((const unsigned char *) persisted.data(), persisted.size());
+      string generation;
+      string uuids;
+      uint32_t version;
+      if(!reader.readTerminatedString(generation) || !reader.readTerminatedString(uuids) ||
+          !reader.readUint32(version) || version != ThreadIndex::VERSION ||
+          uuids != getShardUuidList() || !hasPersistedGeneration("threadindex_generation", generation)) {
+        return false;
+      }
+      vector<string> buckets(ThreadIndex::BUCKETS);
+      for(uint32_t bucket = 0; bucket < ThreadIndex::BUCKETS; bucket++) {
+        buckets[bucket] = dbw.get_metadata("threadindex:" + to_string(bucket));
+      }
+      if(!threadIndex.unserialise(buckets)) {
+        return false;
+      }
+      threadIndexGeneration = strtoul(generation.c_str(), NULL, 10);
+      return true;
+    }
+
+    /**
+     * Writes the buckets of the threads changed since the last commit. Must be called before
+     * committing the writable databases.
+     */
+    void persistThreadIndex() {
+      if(!writable || modifications == modificationsAtLastCommit) {
+        return;
+      }
+      if(!threadIndex.isLoaded()) {
+        dbw.set_metadata("threadindex", "");
+        return;
+      }
+
+      map<uint32_t, string> buckets;
+      threadIndex.serialiseChangedBuckets(buckets);
+      for(const pair<const uint32_t, string> & bucket : buckets) {
+        dbw.set_metadata("threadindex:" + to_string(bucket.first), bucket.second);
+      }
+      const string generation = to_string(++threadIndexGeneration);
+      ResultArena persisted;
+      persisted.appendString(generation);
+      persisted.appendString(getShardUuidList());
+      persisted.appendUint32(ThreadIndex::VERSION);
+      dbw.set_metadata("threadindex", string((const char *) persisted.data(), persisted.size()));
+      setPersistedGeneration("threadindex_generation", generation);
+    }
+
+    /**
+     * Threads by latest message first, of all messages or those of a folder, written to
+     * threadListArena. See listThreads.
+     */
+    void listThreads(const string & folder, int offset, int maxresults) {
+      loadThreadIndex();
+      vector<ThreadSummary> summaries;
+      if(folder.empty()) {
+        threadIndex.summarise(NULL, summaries);
+      } else {
+        const string folderterm = "XFOLDER:" + folder;
+        vector<Xapian::docid> docids;
+        docids.reserve(db.get_termfreq(folderterm));
+        for(Xapian::PostingIterator p = db.postlist_begin(folderterm); p != db.postlist_end(folderterm); ++p) {
+          docids.push_back(*p);
+        }
+        threadIndex.summarise(&docids, summaries);
+      }
+
+      const size_t start = min((size_t) max(offset, 0), summaries.size());
+      const size_t end = min(start + max(maxresults, 0), summaries.size());
+      partial_sort(summaries.begin(), summaries.begin() + end, summaries.end(), compareThreadSummaries);
+
+      ResultArena & arena = threadListArena;
+      arena.clear();
+      arena.appendUint32(summaries.size());
+      arena.appendUint32(end - start);
+      for(size_t n = start; n < end; n++) {
+        arena.appendUint32(summaries[n].head);
+        arena.appendUint32(summaries[n].messages);
+        arena.appendUint32(summaries[n].unread);
+        arena.appendString(*summaries[n].latestDate);
+      }
+    }
+
+    static bool compareThreadSummaries(const ThreadSummary & a, const ThreadSummary & b) {
+      return *a.latestDate > *b.latestDate || (*a.latestDate == *b.latestDate && a.head < b.head);
+    }
+
+    /**
+     * Keep the folder statistics up to date after a document changed from before to after
+     */
+    void updateFolderStats(const DocumentFolderState & before, const DocumentFolderState & after) {
+      if(!folderStatsLoaded) {
+        return;
+      }
+      countInFolderStats(before, -1);
+      countInFolderStats(after, 1);
+    }
+
+    void countInFolderStats(const DocumentFolderState & state, int increment) {
+      if(!state.infolder) {
+        return;
+      }
+      FolderStats & stats = folderStats[state.folder];
+      stats.total += increment;
+      if(!state.seen) {
+        stats.unread += increment;
+      }
+      if(state.flagged) {
+        stats.flagged += increment;
+      }
+      if(stats.total <= 0) {
+        folderStats.erase(state.folder);
+      }
+    }
+
+    DocumentFolderState getFolderStateForStats(const Xapian::Document & doc) {
+      return folderStatsLoaded ? DocumentFolderState::of(doc) : DocumentFolderState();
+    }
+
+    /**
+     * Only looks up the document while folder statistics are loaded, since it costs a document fetch
+     */
+    DocumentFolderState getFolderStateForStats(const DocumentLocation & location) {
+      if(folderStatsLoaded) {
+        Xapian::Document doc = getWritablePartition(location.partition).get_document(location.docid);
+        flagOverlay->applyToDocument(location.partition, location.docid, doc);
+        return DocumentFolderState::of(doc);
+      }
+      return DocumentFolderState();
+    }
+
+    Xapian::WritableDatabase & getWritablePartition(int partition) {
+      return partition == 0 ? dbw : addedWritableDatabases[partition - 1];
+    }
+
+    /**
+     * Load unique id terms of partitions added since last time into the routing table.
+     * The main writable database and earlier partitions take precedence if a term is in several.
+     */
+    void loadUniqueTermRoutes() {
+      const string idprefix = "Q";
+      while(routedPartitions < addedWritableDatabases.size() + 1) {
+        const int partition = routedPartitions;
+        Xapian::WritableDatabase & partitionWritableDatabase = getWritablePartition(partition);
+
+        Xapian::TermIterator termitend = partitionWritableDatabase.allterms_end(idprefix);
+        for (Xapian::TermIterator tm = partitionWritableDatabase.allterms_begin(idprefix); tm != termitend; ++tm) {
+          const string term = *tm;
+          Xapian::PostingIterator p = partitionWritableDatabase.postlist_begin(term);
+          if (p != partitionWritableDatabase.postlist_end(term) && !tombstones->contains(partition, *p)) {
+            DocumentLocation location = { partition, *p };
+            uniqueTermRoutes.emplace(term, location);
+          }
+        }
+        routedPartitions++;
+        routingPartitionLoads++;
+        metrics.partitionLoads++;
+      }
+    }
+
+    void invalidateUniqueTermRoutes() {
+      uniqueTermRoutes.clear();
+      routedPartitions = 0;
+    }
+
+    bool findUniqueTerm(const string & unique_term, DocumentLocation & location) {
+      metrics.partitionProbes++;
+      loadUniqueTermRoutes();
+      unordered_map<string, DocumentLocation>::const_iterator it = uniqueTermRoutes.find(unique_term);
+      if(it == uniqueTermRoutes.end()) {
+        routingMisses++;
+        return false;
+      }
+      routingHits++;
+      location = it->second;
+      return true;
+    }
+
+    void routeUniqueTerm(const string & unique_term, int partition, Xapian::docid docid) {
+      DocumentLocation location = { partition, docid };
+      uniqueTermRoutes[unique_term] = location;
+    }
+
+    void unrouteUniqueTerm(const string & unique_term) {
+      uniqueTermRoutes.erase(unique_term);
+    }
+
+    Xapian::WritableDatabase getWritableDatabaseForIdTerm(const string & unique_term) {
+      DocumentLocation location;
+      if(findUniqueTerm(unique_term, location)) {
+        return getWritablePartition(location.partition);
+      } else {
+        return dbw;
+      }
+    }
+
+    /**
+     * Build the email document in the reused emailDocument and replace it in the
+     * writable database holding the id term (or the main writable database for new messages).
+     */
+    void addSortableEmail(const string & idterm,
+              const string & from,
+              const string & sortablefrom,
+              const string & fromemailaddress,
+              const vector<string> & recipients,
+              const string & subject,
+              const string & sortablesubject,
+              const string & datestring,
+              double size,
+              const string & text,
+              const string * folder, // Set to null if N/A
+              int flags // From LSB: seen_flag, flagged_flag, answered_flag, attachment
+              ) {
+      Xapian::Document & doc = emailDocument;
+      doc.clear_terms();
+      doc.clear_values();
+
+      Xapian::TermGenerator & termgenerator = indexingPipeline.termGenerator;
+      termgenerator.set_document(doc);
+      
+      termgenerator.index_text_without_positions(datestring);
+      termgenerator.index_text_without_positions(datestring,1,"D");
+      termgenerator.index_text_without_positions(fromemailaddress); // Also allow searching by email address though only name is displayed      
+      termgenerator.index_text_without_positions(fromemailaddress,1,"A"); // Also allow searching by email address though only name is displayed      
+      if(from != fromemailaddress) {
+        // Often just the address when the sender has no name
+        termgenerator.index_text_without_positions(from,1,"A");
+        termgenerator.index_text_without_positions(from);
+      }
+      termgenerator.index_text_without_positions(subject,1,"S");      
+      termgenerator.index_text_without_positions(subject);      
+      const string & body = indexingPipeline.prepareBody(text);
+      termgenerator.index_text_without_positions(body);
+      indexingPipeline.addSnippetText(doc, body);
+      
+      const int seen = flags & 0x01;
+      const int flagged = (flags >> 1) & 0x01;
+      const int answered = (flags >> 2) & 0x01;
+      const int attachment = (flags >> 3) & 0x01;
+      
+      for(const string & recipient : recipients) {
+        termgenerator.index_text_without_positions(recipient);
+        termgenerator.index_text_without_positions(recipient,1,"XTO");
+        doc.add_term(termBuffer.assign("XRECIPIENT:").append(recipient));
+      }
+
+      doc.add_value(0,sortablefrom);
+      doc.add_value(1,sortablesubject);
+      doc.add_value(2,datestring);
+      EmailDateRangeProcessor::addDateToDocument(doc, datestring);
+      doc.add_value(3,Xapian::sortable_serialise(size));
+      doc.add_value(4,Xapian::sortable_serialise(seen)); // Seen ( deprecated )
+      
+      string & data = documentDataBuffer;
+      DocumentDataRecord::encode(data, idterm, from, subject, fromemailaddress);
+      doc.set_data(data);
+
+      doc.add_term(idterm);
+      if(folder!=NULL) {
+        // Add folder term
+        doc.add_term(termBuffer.assign("XFOLDER:").append(*folder));
+        if(seen==0) {          
+          // If unread message add to unread folder
+          doc.add_term(termBuffer.assign("XUNREADFOLDER:").append(*folder));
+        }
+      }
+
+      if(seen) {
+        doc.add_term("XFseen");
+      }
+
+      if(flagged) {        
+        doc.add_term("XFflagged");
+      }
+
+      if(answered) {
+        doc.add_term("XFanswered");
+      }
+
+      if(attachment) {
+        doc.add_term("XFattachment");
+      }
+
+      documentsModified();
+      try {
+        DocumentFolderState after;
+        after.infolder = folder!=NULL;
+        after.folder = folder!=NULL ? *folder : string();
+        after.seen = seen;
+        after.flagged = flagged;
+
+        replaceDocument(idterm, doc, after);
+        metrics.documentsIndexed++;
+        metrics.bytesIndexed += data.size() + body.size();
+        writeScheduler.pendingBytes += data.size() + body.size();
+      } catch(const Xapian::Error &e) {
+        invalidateUniqueTermRoutes();
+        invalidateFolderStats();
+        valueSlotCache.invalidate();
+        threadIndex.invalidate();
+        throw;
+      }
+    }
+
+    /**
+     * Replace the document with the unique term in the partition holding it, or add it
+     * to the main writable database, keeping folder statistics and routes up to date
+     */
+    void replaceDocument(const string & idterm, const Xapian::Document & doc, const DocumentFolderState & after) {
+      DocumentLocation location;
+      if(findUniqueTerm(idterm, location)) {
+        const DocumentFolderState before = getFolderStateForStats(location);
+        getWritablePartition(location.partition).replace_document(location.docid, doc);
+        documentReplaced(location.partition, location.docid, doc);
+        updateFolderStats(before, after);
+      } else {
+        // Replaces a deleted document with the unique term if there is one
+        const Xapian::docid docid = dbw.replace_document(idterm, doc);
+        tombstones->erase(0, docid);
+        routeUniqueTerm(idterm, 0, docid);
+        documentReplaced(0, docid, doc);
+        updateFolderStats(DocumentFolderState(), after);
+      }
+    }
+
+    /**
+     * Delete the document with the unique term, which is left out of queries right away and
+     * deleted from its partition on commit. Returns the partition, or -1 if there's no such document.
+     */
+    int deleteDocument(const string & unique_term) {
+      DocumentLocation location;
+      if(!findUniqueTerm(unique_term, location)) {
+        return -1;
+      }
+      const DocumentFolderState before = getFolderStateForStats(location);
+      tombstones->add(location.partition, location.docid);
+      documentDeleted(location.partition, location.docid);
+      unrouteUniqueTerm(unique_term);
+      updateFolderStats(before, DocumentFolderState());
+      metrics.documentsDeleted++;
+      return location.partition;
+    }
+
+    /**
+     * Revision of the server state the index is synced to (0 if not known), see applyDelta
+     */
+    uint64_t getSyncRevision() {
+      return parseSyncRevision((writable ? dbw : eagerShards[0]).get_metadata("syncrevision"));
+    }
+
+    /**
+     * Written with the next commit
+     */
+    void setSyncRevision(uint64_t revision) {
+      dbw.set_metadata("syncrevision", revision > 0 ? to_string(revision) : string());
+    }
+
+    /**
+     * Mark this index as a delta from baserevision to revision of the server state, where the
+     * messages in tombstones (unique terms separated by newlines) were deleted. The documents
+     * of the index replace those with the same unique term when applied.
+     */
+    void markAsDelta(const string & tombstones, uint64_t baserevision, uint64_t revision) {
+      if(revision <= baserevision) {
+        throw Xapian::InvalidArgumentError("The revision of a delta must be after its base revision");
+      }
+      dbw.set_metadata("deltabaserevision", to_string(baserevision));
+      dbw.set_metadata("deltarevision", to_string(revision));
+      dbw.set_metadata("deltatombstones", tombstones);
+    }
+
+    /**
+     * Apply the delta at path (see markAsDelta) if the index is at its base revision: delete
+     * the documents of its tombstones, copy its documents over those with the same unique term
+     * (or add them), and commit it all with the sync revision set to the revision of the delta.
+     *
+     * Deletions and replacements give the same result when repeated, so if a scheduled commit
+     * happens in the middle and the rest fails, the delta can simply be applied again.
+     */
+    DeltaResult applyDelta(const string & path) {
+      if(!writable) {
+        throw Xapian::InvalidOperationError("Can't apply a delta to a read only index");
+      }
+      Xapian::Database delta = openDatabaseAt(path);
+      const uint64_t revision = parseSyncRevision(delta.get_metadata("deltarevision"));
+      if(revision == 0) {
+        throw Xapian::InvalidArgumentError(path + " is not an index delta");
+      }
+      const uint64_t syncrevision = getSyncRevision();
+      if(revision <= syncrevision) {
+        return DELTA_ALREADY_APPLIED;
+      }
+      if(parseSyncRevision(delta.get_metadata("deltabaserevision")) != syncrevision) {
+        return DELTA_OUT_OF_ORDER;
+      }
+
+      documentsModified();
+      try {
+        istringstream tombstones(delta.get_metadata("deltatombstones"));
+        string unique_term;
+        while(getline(tombstones, unique_term)) {
+          if(!unique_term.empty()) {
+            deleteDocument(unique_term);
+          }
+        }
+
+        Xapian::PostingIterator postingend = delta.postlist_end("");
+        for(Xapian::PostingIterator p = delta.postlist_begin(""); p != postingend; ++p) {
+          const Xapian::Document doc = delta.get_document(*p);
+          const vector<string> idterms = documentTermsWithPrefix(doc, "Q");
+          if(idterms.size() != 1) {
+            logAt(LOG_WARNING) << "Skipped document " << *p << " of delta " << path
+                                << " without a single unique term" << endl;
+            continue;
+          }
+          replaceDocument(idterms[0], doc, DocumentFolderState::of(doc));
+          metrics.documentsIndexed++;
+          writeScheduler.pendingBytes += doc.get_data().size();
+        }
+      } catch(const Xapian::Error &e) {
+        invalidateUniqueTermRoutes();
+        invalidateFolderStats();
+        valueSlotCache.invalidate();
+        threadIndex.invalidate();
+        throw;
+      }
+
+      setSyncRevision(revision);
+      commit();
+      metrics.deltasApplied++;
+      return DELTA_APPLIED;
+    }
+
+    /**
+     * Run a query sorted by value, optionally collapsing on a value slot. Throws on errors.
+     * With setParallelPartitionSearch, the partitions of db are searched in parallel.
+     * With withdocuments the matches come with their documents, unless sorted in memory.
+     */
+    vector<SortedMatch> sortedQuery(const char * searchtext,
+            int sortvaluenum,
+            bool reverse,
+            int offset, int maxresults,
+            int collapsevaluenum,
+            bool withdocuments = false) {
+      enforceMemoryBudget(false);
+      maxresults = memoryGovernor.capMatches(maxresults);
+      preparePartitionsForQuery(searchtext);
+      QueryContext & context = getQueryContext();
+
+      Xapian::Query query;
+      if(strlen(searchtext)==0) {
+        query = Xapian::Query::MatchAll;
+      } else {
+        query = parseQuery(context.sortedQueryParser, "sorted", searchtext);
+      }  
+
+      vector<SortedMatch> matches;
+      if(cachedSortedQuery(query, sortvaluenum, reverse, offset, maxresults, collapsevaluenum, matches)) {
+        return matches;
+      }
+      query = excludeTombstones(query);
+#ifdef HAVE_THREADS
+      if(partitionSearchPool && combinedShards.size() > 1) {
+        // Flag overlay and tombstone posting sources can't be serialised, so such queries are
+        // parsed again for every partition, each with posting sources of its own
+        const bool postingsources = !flagOverlay->empty() || !tombstones->empty();
+        const string serialisedquery = postingsources ? string() : query.serialise();
+        const string querytext(searchtext);
+        ParallelPartitionSearch search(combinedShards, [&]() {
+          if(!postingsources) {
+            return Xapian::Query::unserialise(serialisedquery);
+          }
+          return excludeTombstones(querytext.empty() ? Xapian::Query::MatchAll :
+                context.parse(context.sortedQueryParser, querytext, QueryContext::PARSE_FLAGS));
+        }, sortvaluenum, reverse, collapsevaluenum);
+        search.run(*partitionSearchPool, offset, maxresults, matches, withdocuments);
+        metrics.parallelQueries++;
+        return matches;
+      }
+#endif
+      appendSortedMatches(matches, runSortedEnquire(context.sortedEnquire, query, sortvaluenum, reverse,
+            offset, maxresults, collapsevaluenum), withdocuments);
+      return matches;
+    }
+
+    /**
+     * Like sortedQuery, but if searchtext only narrows the previous query of the incremental
+     * search session, the match is restricted to the previous matches instead of run in full.
+     */
+    vector<SortedMatch> incrementalSortedQuery(const char * searchtext,
+            int sortvaluenum,
+            bool reverse,
+            int offset, int maxresults,
+            int collapsevaluenum) {
+      preparePartitionsForQuery(searchtext);
+      QueryContext & context = getQueryContext();
+      IncrementalSearchSession & session = incrementalSearch;
+
+      const string querytext(searchtext);
+      if(querytext.empty()) {
+        session.reset();
+        session.fullMatches++;
+        return sortedQuery(searchtext, sortvaluenum, reverse, offset, maxresults, collapsevaluenum);
+      }
+      enforceMemoryBudget(false);
+      maxresults = memoryGovernor.capMatches(maxresults);
+
+      Xapian::Query query = excludeTombstones(parseQuery(context.incrementalQueryParser, "incremental", querytext));
+
+      const bool refine = session.active && session.candidates &&
+            session.modifications == modifications &&
+            IncrementalSearchSession::isRefinement(session.querytext, querytext);
+      if(refine) {
+        CandidatePostingSource * candidates = new CandidatePostingSource(session.candidates, db);
+        query = Xapian::Query(Xapian::Query::OP_FILTER, query, Xapian::Query(candidates->release()));
+        session.refinements++;
+      } else {
+        session.fullMatches++;
+      }
+      session.active = true;
+      session.querytext = querytext;
+      session.modifications = modifications;
+
+      // A single match gives both the matches kept for refining the next query and the page.
+      // No more matches than the memory governor allows per query are kept.
+      const Xapian::doccount maxcandidates = memoryGovernor.capRows(IncrementalSearchSession::MAX_CANDIDATES);
+      vector<SortedMatch> matches;
+      ValueSlotCache::Column * sortcolumn = valueSlotCache.getColumn(sortvaluenum);
+      ValueSlotCache::Column * collapsecolumn = collapsevaluenum > -1 ? valueSlotCache.getColumn(collapsevaluenum) : NULL;
+      const bool cached = sortcolumn != NULL && (collapsevaluenum < 0 || collapsecolumn != NULL) &&
+            canUseValueSlotCache();
+      if(!cached && collapsevaluenum < 0) {
+        // Sorted by value, the rows up to the page are the matches (unless there are too many)
+        const Xapian::doccount first = offset > 0 ? offset : 0;
+        const Xapian::doccount last = first + (maxresults > 0 ? maxresults : 0);
+        const Xapian::MSet mset = runSortedEnquire(context.sortedEnquire, query, sortvaluenum, reverse,
+              0, max<Xapian::doccount>(maxcandidates + 1, last), -1);
+        keepCandidates(session, mset, maxcandidates);
+        Xapian::doccount row = 0;
+        for (Xapian::MSetIterator m = mset.begin(); m != mset.end() && row < last; ++m, ++row) {
+          if(row >= first) {
+            SortedMatch match;
+            match.docid = *m;
+            match.collapseCount = 0;
+            matches.push_back(match);
+          }
+        }
+        return matches;
+      }
+
+      // Collect the matches in docid order (stops early when there are too many to keep)
+      Xapian::Enquire & candidateEnquire = context.candidateEnquire;
+      candidateEnquire.set_query(query);
+      keepCandidates(session, candidateEnquire.get_mset(0, maxcandidates + 1), maxcandidates);
+      if(cached && session.candidates) {
+        vector<Xapian::docid> docids(*session.candidates);
+        getValueSlotCache().sortDocuments(docids, *sortcolumn, reverse, collapsecolumn,
+              offset > 0 ? offset : 0, maxresults > 0 ? maxresults : 0, matches);
+        metrics.cachedSortQueries++;
+        return matches;
+      }
+
+      // Collapsing on a slot that isn't cached takes a sorted match of its own
+      appendSortedMatches(matches, runSortedEnquire(context.sortedEnquire, query, sortvaluenum, reverse,
+            offset, maxresults, collapsevaluenum));
+      return matches;
+    }
+
+    /**
+     * Keep the matches of an incremental search query in docid order, if not more than maxcandidates
+     */
+    static void keepCandidates(IncrementalSearchSession & session, const Xapian::MSet & mset,
+          Xapian::doccount maxcandidates) {
+      if(mset.size() > maxcandidates) {
+        session.candidates.reset();
+        return;
+      }
+      vector<Xapian::docid> * candidatedocids = new vector<Xapian::docid>();
+      candidatedocids->reserve(mset.size());
+      for (Xapian::MSetIterator m = mset.begin(); m != mset.end(); ++m) {
+        candidatedocids->push_back(*m);
+      }
+      sort(candidatedocids->begin(), candidatedocids->end());
+      session.candidates.reset(candidatedocids);
+    }
+
+    /**
+     * Snippets of at most length bytes of the body text kept for the documents of db (see
+     * IndexingPipeline::addSnippetText), around the best matches of the query, which are
+     * marked with \x01 and \x02. Written to snippetArena: version, number of documents, and
+     * a string for each (empty if no text was kept for the document, or it doesn't exist).
+     */
+    const ResultArena & getSnippets(const string & querytext, const int docids[], int count, size_t length) {
+      QueryContext & context = getQueryContext();
+      const Xapian::Query query = querytext.empty() ?
+            Xapian::Query::MatchAll : parseQuery(context.sortedQueryParser, "sorted", querytext);
+
+      // The weights of the query terms for choosing the snippets, without any matches
+      Xapian::Enquire & enquire = context.snippetEnquire;
+      enquire.set_query(query);
+      const Xapian::MSet mset = enquire.get_mset(0, 0);
+
+      ResultArena & arena = snippetArena;
+      arena.clear();
+      arena.appendUint32(ResultArena::VERSION);
+      arena.appendUint32(count);
+      string & text = snippetTextBuffer;
+      for(int n = 0; n < count; n++) {
+        const Xapian::docid docid = docids[n];
+        string value;
+        if(docid > 0 && docid <= db.get_lastdocid() && !isTombstone(docid)) {
+          try {
+            value = db.get_document(docid).get_value(IndexingPipeline::SNIPPET_SLOT);
+          } catch(const Xapian::DocNotFoundError &) {
+          }
+        }
+        if(IndexingPipeline::readSnippetText(value, text)) {
+          arena.appendString(mset.snippet(text, length, indexingPipeline.getStemmer(),
+                Xapian::MSet::SNIPPET_BACKGROUND_MODEL | Xapian::MSet::SNIPPET_EXHAUSTIVE,
+                "\x01", "\x02", "\xe2\x80\xa6"));
+        } else {
+          arena.appendString(string());
+        }
+      }
+      return arena;
+    }
+
+    /**
+     * Apply a BulkOperation to the documents of the given message ids (unique terms Q<id>).
+     * Documents are grouped by partition and visited in docid order, and only documents
+     * actually changed by the operation are replaced. Returns the number of changed documents.
+     */
+    int bulkUpdateDocuments(const int messageids[], int count, int operation, const string & argument) {
+      documentsModified();
+
+      if(operation == BULK_DELETE) {
+        int deleted = 0;
+        for(int n = 0; n < count; n++) {
+          if(deleteDocument("Q" + to_string(messageids[n])) >= 0) {
+            deleted++;
+          }
+        }
+        return deleted;
+      }
+
+      vector<DocumentLocation> locations;
+      locations.reserve(count);
+      for(int n = 0; n < count; n++) {
+        DocumentLocation location;
+        if(findUniqueTerm("Q" + to_string(messageids[n]), location)) {
+          locations.push_back(location);
+        }
+      }
+      sort(locations.begin(), locations.end(), compareDocumentLocations);
+
+      int changed = 0;
+      try {
+        for(const DocumentLocation & location : locations) {
+          Xapian::WritableDatabase & partitionWritableDatabase = getWritablePartition(location.partition);
+          if((operation == BULK_ADD_TERM || operation == BULK_REMOVE_TERM) && usesFlagOverlay(argument)) {
+            if(setFlagInOverlay(location, argument, operation == BULK_ADD_TERM)) {
+              changed++;
+            }
+            continue;
+          }
+          Xapian::Document doc = partitionWritableDatabase.get_document(location.docid);
+          flagOverlay->applyToDocument(location.partition, location.docid, doc);
+          const DocumentFolderState before = getFolderStateForStats(doc);
+          if(applyBulkOperation(doc, operation, argument)) {
+            // Replacing a document read from the same database only updates the changed postings
+            partitionWritableDatabase.replace_document(location.docid, doc);
+            flagOverlay->removeDocument(location.partition, location.docid);
+            updateFolderStats(before, getFolderStateForStats(doc));
+            documentFlagsChanged(partitionWritableDatabase, location.docid, doc);
+            changed++;
+          }
+        }
+      } catch(const Xapian::Error &e) {
+        invalidateFolderStats();
+        threadIndex.invalidate();
+        throw;
+      }
+      return changed;
+    }
+
+    /**
+     * Leaves the writable database and docid untouched if the unique term isn't found
+     */
+    Xapian::Document getDocumentByUniqueTerm(const string & unique_term,
+          Xapian::WritableDatabase * writabledatabasePtr,
+          Xapian::docid * docidPtr) {
+      Xapian::Document doc;   
+      DocumentLocation location;
+      if(findUniqueTerm(unique_term, location)) {
+        Xapian::WritableDatabase & partitionWritableDatabase = getWritablePartition(location.partition);
+        doc = partitionWritableDatabase.get_document(location.docid);
+        // The callers replace the document, which then has the flags of the overlay
+        flagOverlay->applyToDocument(location.partition, location.docid, doc);
+        flagOverlay->removeDocument(location.partition, location.docid);
+        *writabledatabasePtr = partitionWritableDatabase;
+        *docidPtr = location.docid;
+      }
+      return doc;
+    }
+};
+
+/**
+ * Open indexes by handle. The entry points below take the handle of the index they work on as
+ * their first argument. 0 is the index of initXapianIndex unless another handle is given there.
+ */
+map<int, DatabaseContainer *> indexes;
+int nextIndexHandle = 1;
+#ifdef HAVE_THREADS
+// Indexes of different handles may be used on different threads
+mutex indexesLock;
+#endif
+
+/**
+ * Imports in progress by handle (see beginDatabaseImport), so that several databases can be
+ * imported at the same time
+ */
+map<int, unique_ptr<DatabaseImportStream>> databaseImports;
+int nextImportHandle = 1;
+#ifdef HAVE_THREADS
+mutex databaseImportsLock;
+#endif
+
+/**
+ * The import of a handle, or NULL if there's no such import
+ */
+static DatabaseImportStream * getImport(int handle) {
+#ifdef HAVE_THREADS
+  lock_guard<mutex> guard(databaseImportsLock);
+#endif
+  map<int, unique_ptr<DatabaseImportStream>>::const_iterator it = databaseImports.find(handle);
+  return it != databaseImports.end() ? it->second.get() : NULL;
+}
+
+static void removeImport(int handle) {
+#ifdef HAVE_THREADS
+  lock_guard<mutex> guard(databaseImportsLock);
+#endif
+  databaseImports.erase(handle);
+}
+
+static void closeContainer(DatabaseContainer * container) {
+  // Removes what is left of an unfinished export
+  container->databaseExport.close();
+  if(container->writable) {
+    // Closing commits the pending changes, which should include the deletes
+    try {
+      container->applyTombstones();
+    } catch(const Xapian::Error &e) {
+      reportError(EP_DELETE_DOCUMENT, e);
+    }
+  }
+  container->db.close();
+  for(Xapian::WritableDatabase dbw : container->addedWritableDatabases) {
+    dbw.close();
+  }
+  container->removeEmptyPartition();
+  delete container;
+}
+
+/**
+ * The index of a handle, or NULL if there's no such index
+ */
+static DatabaseContainer * getIndex(int handle) {
+#ifdef HAVE_THREADS
+  lock_guard<mutex> guard(indexesLock);
+#endif
+  map<int, DatabaseContainer *>::const_iterator it = indexes.find(handle);
+  return it != indexes.end() ? it->second : NULL;
+}
+
+/**
+ * Set (or with NULL remove) the index of a handle, closing the index it replaces
+ */
+static void setIndex(int handle, DatabaseContainer * container) {
+  DatabaseContainer * replaced = NULL;
+  {
+#ifdef HAVE_THREADS
+    lock_guard<mutex> guard(indexesLock);
+#endif
+    map<int, DatabaseContainer *>::iterator it = indexes.find(handle);
+    if(it != indexes.end()) {
+      if(it->second != container) {
+        replaced = it->second;
+      }
+      if(container == NULL) {
+        indexes.erase(it);
+      } else {
+        it->second = container;
+      }
+    } else if(container != NULL) {
+      indexes[handle] = container;
+    }
+  }
+  if(replaced != NULL) {
+    closeContainer(replaced);
+  }
+}
+
+static DatabaseContainer * openContainer(const char * path, bool readonly) {
+  unique_ptr<DatabaseContainer> container(new DatabaseContainer());
+  if(readonly) {
+    container->openDatabaseAsReadOnly(path);
+  } else {
+    container->openDatabaseAsWritable(path);
+  }
+  return container.release();
+}
+
+extern "C" {
+    /**
+     * Open the writable database at path as the index of handle index (usually 0), replacing
+     * the index of the handle if there is one
+     */
+    void EMSCRIPTEN_KEEPALIVE initXapianIndex(int index, const char * path) {
+        ScopedTimer timer(EP_OPEN_DATABASE);
+        setIndex(index, NULL); // Close the replaced index first, it may be the same database
+        setIndex(index, openContainer(path, false));
+        
+        logAt(LOG_INFO) << "Xapian writable database opened" <<endl;        
+    }
+    
+    void EMSCRIPTEN_KEEPALIVE initXapianIndexReadOnly(int index, const char * path) {
+        ScopedTimer timer(EP_OPEN_DATABASE);
+        setIndex(index, NULL); // Close the replaced index first, it may be the same database
+        setIndex(index, openContainer(path, true));
+        
+        logAt(LOG_INFO) << "Xapian readonly database opened" <<endl;        
+    }
+    
+    /**
+     * Open an index with a new handle. Returns the handle, or -1 on error.
+     */
+    int EMSCRIPTEN_KEEPALIVE openIndex(const char * path, bool readonly) {
+      ScopedTimer timer(EP_OPEN_DATABASE);
+      try {
+        unique_ptr<DatabaseContainer> container(openContainer(path, readonly));
+#ifdef HAVE_THREADS
+        lock_guard<mutex> guard(indexesLock);
+#endif
+        const int handle = nextIndexHandle++;
+        indexes[handle] = container.release();
+        return handle;
+      } catch(const Xapian::Error &e) {
+        reportError(EP_OPEN_DATABASE, e);
+        return -1;
+      }
+    }
+
+    /**
+     * Exchange the indexes of two handles, e.g. to put an index rebuilt in the background
+     * in place of the one in use. Nothing is closed, and there's no moment without an index:
+     * calls with handle1 that start after the swap use the other index.
+     */
+    int EMSCRIPTEN_KEEPALIVE swapIndexes(int handle1, int handle2) {
+#ifdef HAVE_THREADS
+      lock_guard<mutex> guard(indexesLock);
+#endif
+      map<int, DatabaseContainer *>::iterator it1 = indexes.find(handle1);
+      map<int, DatabaseContainer *>::iterator it2 = indexes.find(handle2);
+      if(it1 == indexes.end() || it2 == indexes.end()) {
+        return 0;
+      }
+      swap(it1->second, it2->second);
+      return 1;
+    }
+
+    /**
+     * Close the index of handle (committing pending changes like closeDatabase)
+     */
+    int EMSCRIPTEN_KEEPALIVE closeIndex(int handle) {
+      if(getIndex(handle) == NULL) {
+        return 0;
+      }
+      setIndex(handle, NULL);
+      return 1;
+    }
+
+    /**
+    * This will add a single file xapian database to an existing database
+    * Must init xapian index with method above before calling this
+    */
+    void EMSCRIPTEN_KEEPALIVE addSingleFileXapianIndex(int index, const char * path) {
+      DatabaseContainer * dbc = getIndex(index);
+      if (!dbc) return;
+      ScopedTimer timer(EP_ADD_DATABASE);
+      dbc->addSingleFileDatabase(path);      
+      logAt(LOG_INFO) << "Xapian single file database added" <<endl;      
+    }
+
+    void EMSCRIPTEN_KEEPALIVE addFolderXapianIndex(int index, const char * path) {
+      DatabaseContainer * dbc = getIndex(index);
+      if (!dbc) return;
+      ScopedTimer timer(EP_ADD_DATABASE);
+      dbc->addFolderDatabase(path);      
+      logAt(LOG_INFO) << "Xapian folder database added" <<endl;      
+    }
+    
+    /**
+     * Register a single file partition (e.g. a downloaded DownloadablePartition) for a folder.
+     * It's opened by the first query that may match messages of the folder. Size in bytes
+     * (0 to use the file size) is counted against the partition memory budget. Registering
+     * changes docids like adding a database does, attaching and detaching the partition doesn't.
+     */
+    void EMSCRIPTEN_KEEPALIVE registerLazyPartition(int index, const char * path, const char * folder, double size) {
+      DatabaseContainer * dbc = getIndex(index);
+      if (!dbc) return;
+      dbc->registerLazyPartition(path, folder, size);
+    }
+
+    /**
+     * Lazy partitions not used by the current query are closed, least recently used first,
+     * while the attached ones exceed this number of bytes. 0 means no limit.
+     */
+    void EMSCRIPTEN_KEEPALIVE setPartitionMemoryBudget(int index, double bytes) {
+      DatabaseContainer * dbc = getIndex(index);
+      if (!dbc) return;
+      dbc->partitionMemoryBudget = bytes;
+    }
+
+    /**
+     * Results: registered partitions, attached partitions, attaches, detaches
+     */
+    int EMSCRIPTEN_KEEPALIVE getLazyPartitionStats(int index, int results[]) {
+      DatabaseContainer * dbc = getIndex(index);
+      if(dbc==0) {
+        return 0;
+      }
+      int attached = 0;
+      for(const LazyPartition & partition : dbc->lazyPartitions) {
+        if(partition.attached) {
+          attached++;
+        }
+      }
+      results[0] = dbc->lazyPartitions.size();
+      results[1] = attached;
+      results[2] = dbc->partitionAttaches;
+      results[3] = dbc->partitionDetaches;
+      return 1;
+    }
+
+    /**
+     * Run sortedXapianQuery and sortedXapianQueryArena on the partitions of the index in
+     * parallel, on numthreads threads shared by all indexes (0 to run on the calling thread
+     * as before), and merge the results. The calling thread waits for the partitions, so in
+     * the browser this should only be used in a web worker.
+     *
+     * Returns 1, or 0 if not built with threads (the webassembly build without --pthreads).
+     */
+    int EMSCRIPTEN_KEEPALIVE setParallelPartitionSearch(int numthreads) {
+#ifdef HAVE_THREADS
+      partitionSearchPool.reset(numthreads > 0 ? new WorkerPool(numthreads) : NULL);
+      return 1;
+#else
+      (void) numthreads;
+      return 0;
+#endif
+    }
+
+    int EMSCRIPTEN_KEEPALIVE getDocCount(int index) {
+        DatabaseContainer * dbc = getIndex(index);
+        if (!dbc) return 0;
+        return dbc->db.get_doccount() - dbc->tombstones->size();
+    }
+    
+    int EMSCRIPTEN_KEEPALIVE getLastDocid(int index) {
+        DatabaseContainer * dbc = getIndex(index);
+        if (!dbc) return 0;
+        return dbc->db.get_lastdocid();
+    }
+
+    /**
+      * For emails
+      */
+    void EMSCRIPTEN_KEEPALIVE addSortableEmailToXapianIndex(int index, char * idterm,
+              char * from,
+              char * sortablefrom,
+              char * fromemailaddress,
+              int numRecipients,
+              const char ** recipients,
+              char * subject,
+              char * sortablesubject,
+              char * datestring,
+              double size,
+              char * text,
+              char * folder, // Set to null if N/A
+              int flags // From LSB: seen_flag, flagged_flag, answered_flag, attachment
+              ) {
+      DatabaseContainer * dbc = getIndex(index);
+      if (!dbc) return;
+      ScopedTimer timer(EP_ADD_EMAIL);
+      vector<string> recipientlist(recipients, recipients + numRecipients);
+      string foldername;
+      if(folder!=NULL) {
+        foldername = folder;
+      }
+
+      try {
+        dbc->addSortableEmail(idterm, from, sortablefrom, fromemailaddress,
+              recipientlist, subject, sortablesubject, datestring,
+              size, text, folder!=NULL ? &foldername : NULL, flags);
+      } catch(const Xapian::DatabaseError &e) {
+        metrics.recordError(EP_ADD_EMAIL, e.get_msg());
+        logAt(LOG_ERROR) << "Replace document error:" << e.get_msg() << endl;
+        throw(e);
+      }
+    }
+
+    /**
+     * Index a batch of emails packed into one buffer, avoiding one boundary crossing
+     * and one set of string allocations per message.
+     *
+     * Each message in the buffer is laid out as (all integers little endian, strings
+     * are UTF-8 without terminator prefixed by their uint32 byte length):
+     *
+     *   idterm, from, sortablefrom, fromemailaddress, subject, sortablesubject,
+     *   datestring, text, folder (length 0xffffffff if N/A),
+     *   uint32 number of recipients followed by that many recipient strings,
+     *   uint32 flags (same bits as for addSortableEmailToXapianIndex),
+     *   float64 size
+     *
+     * statuses[n] is set to 0 if message n was indexed, 1 if indexing failed and 2
+     * if the buffer ended before message n. Returns the number of indexed messages.
+     */
+    int EMSCRIPTEN_KEEPALIVE addSortableEmailsBatch(int index, const unsigned char * buffer, int bufferLength,
+              int numMessages, int statuses[]) {
+      DatabaseContainer * dbc = getIndex(index);
+      if (!dbc) return 0;
+      ScopedTimer timer(EP_ADD_EMAILS_BATCH);
+      PackedBufferReader reader(buffer, bufferLength);
+
+      string idterm, from, sortablefrom, fromemailaddress, subject, sortablesubject,
+            datestring, text, folder;
+      vector<string> recipients;
+
+      int indexed = 0;
+      for(int n=0;n<numMessages;n++) {
+        bool hasfolder = true;
+        bool complete = reader.readString(idterm) &&
+              reader.readString(from) &&
+              reader.readString(sortablefrom) &&
+              reader.readString(fromemailaddress) &&
+              reader.readString(subject) &&
+              reader.readString(sortablesubject) &&
+              reader.readString(datestring) &&
+              reader.readString(text) &&
+              reader.readString(folder, &hasfolder);
+
+        uint32_t numRecipients = 0;
+        complete = complete && reader.readUint32(numRecipients);
+        recipients.resize(complete ? numRecipients : 0);
+        for(uint32_t r=0;complete && r<numRecipients;r++) {
+          complete = reader.readString(recipients[r]);
+        }
+
+        uint32_t flags = 0;
+        double size = 0;
+        complete = complete && reader.readUint32(flags) && reader.readDouble(size);
+
+        if(!complete) {
+          metrics.recordError(EP_ADD_EMAILS_BATCH, "Batch buffer ended");
+          logAt(LOG_WARNING) << "Batch buffer ended before message " << n << " of " << numMessages << endl;
+          for(;n<numMessages;n++) {
+            statuses[n] = 2;
+          }
+          break;
+        }
+
+        try {
+          dbc->addSortableEmail(idterm, from, sortablefrom, fromemailaddress,
+                recipients, subject, sortablesubject, datestring,
+                size, text, hasfolder ? &folder : NULL, flags);
+          statuses[n] = 0;
+          indexed++;
+        } catch(const Xapian::Error &e) {
+          metrics.recordError(EP_ADD_EMAILS_BATCH, e.get_msg());
+          logAt(LOG_ERROR) << "Replace document error for " << idterm << ":" << e.get_msg() << endl;
+          statuses[n] = 1;
+        }
+      }
+      return indexed;
+    }
+  
+    void EMSCRIPTEN_KEEPALIVE deleteDocumentByUniqueTerm(int index, char * unique_term) {
+      DatabaseContainer * dbc = getIndex(index);
+      if (!dbc) return;
+      ScopedTimer timer(EP_DELETE_DOCUMENT);
+      dbc->documentsModified();
+      dbc->deleteDocument(unique_term);
+    }
+
+    int EMSCRIPTEN_KEEPALIVE deleteDocumentFromAddedWritablesByUniqueTerm(int index, char * unique_term) {
+      DatabaseContainer * dbc = getIndex(index);
+      if (!dbc) return -1;
+      ScopedTimer timer(EP_DELETE_DOCUMENT);
+      dbc->documentsModified();
+      DocumentLocation location;
+      if(dbc->findUniqueTerm(unique_term, location) && location.partition > 0) {
+        const int i = location.partition - 1;
+        dbc->deleteDocument(unique_term);
+        logAt(LOG_DEBUG) << "Queued delete of document with term id " << unique_term
+             << " and doc id "
+             << location.docid << " from partition " << i << " until the next commit" << endl;
+        return i;
+      }
+      return -1;
+    }    
+
+    void EMSCRIPTEN_KEEPALIVE closeDatabase(int index) {
+      setIndex(index, NULL);
+      logAt(LOG_INFO) << "Database closed" << endl;
+    }
+    
+    void EMSCRIPTEN_KEEPALIVE reloadDatabase(int index) {
+        DatabaseContainer * dbc = getIndex(index);
+        if (!dbc) return;
+        ScopedTimer timer(EP_RELOAD);
+        dbc->db.reopen();
+        dbc->documentsModified();
+        dbc->invalidateUniqueTermRoutes();
+        dbc->invalidateFolderStats();
+        if(!dbc->writable) {
+          // Only the writer changes these
+          dbc->loadIndexingSettings();
+          dbc->loadFlagOverlay();
+        }
+        dbc->invalidateQueryContext();
+        dbc->valueSlotCache.invalidate();
+        dbc->threadIndex.invalidate();
+        logAt(LOG_INFO) << "Database reopened" << endl;
+    }
+    
+    void EMSCRIPTEN_KEEPALIVE commitXapianUpdates(int index) {
+        DatabaseContainer * dbc = getIndex(index);
+        if (!dbc) return;
+        dbc->commit();
+    }
+
+    /**
+     * Thresholds of the write scheduler of the index. Pending changes are committed
+     * on the next change or runScheduledWrites when there are maxpendingchanges of them, they
+     * hold maxpendingbytes of indexed text, or the first is maxpendingms old (0 for no limit).
+     *
+     * If compactpath is not empty, runScheduledWrites also compacts the index into a single
+     * file there (as compactDatabase) once anything is committed, and then again after
+     * compactafterrevisions commits or when the files on disk grew compactgrowthratio times
+     * (0 for no limit). The compaction runs on a thread of its own. Without threads (the
+     * webassembly build without --pthreads) compactpath is ignored, so that runScheduledWrites
+     * never blocks for a whole compaction; call compactDatabase when convenient instead.
+     *
+     * Returns 1, or 0 for an unknown index or if compactpath is given but there are no threads.
+     */
+    int EMSCRIPTEN_KEEPALIVE configureWriteScheduler(int index, int maxpendingchanges, double maxpendingbytes,
+          double maxpendingms, const char * compactpath, int compactafterrevisions, double compactgrowthratio) {
+      DatabaseContainer * dbc = getIndex(index);
+      if(dbc==0) {
+        return 0;
+      }
+      WriteScheduler & scheduler = dbc->writeScheduler;
+      scheduler.maxPendingChanges = maxpendingchanges > 0 ? maxpendingchanges : 0;
+      scheduler.maxPendingBytes = maxpendingbytes;
+      scheduler.maxPendingMs = maxpendingms;
+      scheduler.compactAfterRevisions = compactafterrevisions > 0 ? compactafterrevisions : 0;
+      scheduler.compactGrowthRatio = compactgrowthratio;
+#ifdef HAVE_THREADS
+      scheduler.compactPath = compactpath;
+      return 1;
+#else
+      scheduler.compactPath.clear();
+      if(compactpath[0] != 0) {
+        logAt(LOG_WARNING) << "Scheduled compaction needs threads, use compactDatabase instead" << endl;
+        return 0;
+      }
+      return 1;
+#endif
+    }
+
+    /**
+     * Indexing settings of the index (see IndexingPipeline): stemmer language (empty
+     * for none), stop words separated by spaces, bytes of body text to index (0 for no limit),
+     * IndexingPipeline::StripFlags and bytes of body text to keep for getResultSnippets (0 for
+     * none, at most 4096). Stored in the index with the next commit, and used when parsing
+     * queries. Returns 0 if there's no stemmer for the language.
+     */
+    int EMSCRIPTEN_KEEPALIVE configureIndexing(int index, const char * language, const char * stopwords,
+          int maxbodybytes, int strip, int snippetbytes) {
+      DatabaseContainer * dbc = getIndex(index);
+      if (!dbc) return 0;
+      IndexingPipeline::Settings settings;
+      settings.language = language;
+      settings.stopwords = stopwords;
+      settings.maxBodyBytes = maxbodybytes > 0 ? maxbodybytes : 0;
+      settings.strip = strip;
+      settings.snippetBytes = snippetbytes > 0 ? snippetbytes : 0;
+      try {
+        dbc->configureIndexing(settings);
+        return 1;
+      } catch(const Xapian::InvalidArgumentError &e) {
+        logAt(LOG_WARNING) << "Invalid indexing settings: " << e.get_msg() << endl;
+        return 0;
+      }
+    }
+
+    /**
+     * Indexing settings of the index, a line for each of version, language, stop words,
+     * body bytes, strip flags, snippet bytes and whether some messages were indexed without
+     * stems of the language (1 or 0). Valid until the next call.
+     */
+    const char * EMSCRIPTEN_KEEPALIVE getIndexingSettings(int index) {
+      DatabaseContainer * dbc = getIndex(index);
+      if (!dbc) return NULL;
+      static string settings;
+      settings = dbc->indexingPipeline.getSettings().serialise();
+      return settings.c_str();
+    }
+
+    /**
+     * Do the commit or compaction due for the index, if any. Meant to be called
+     * when idle (e.g. from a timer), so that writes don't hold up queries. Returns the
+     * ScheduledWrite flags of the work done.
+     */
+    int EMSCRIPTEN_KEEPALIVE runScheduledWrites(int index) {
+      DatabaseContainer * dbc = getIndex(index);
+      if(dbc==0) {
+        return 0;
+      }
+      return dbc->runScheduledWrites();
+    }
+
+    /**
+     * Results: pending changes, pending bytes, ms since the first pending change (0 if none),
+     * ms since the last commit (-1 if none), committed revision, commits since the last
+     * compaction, compaction state (0 idle, 1 running, 2 failed), compactions, bytes of
+     * the last compaction, scheduled commits
+     */
+    int EMSCRIPTEN_KEEPALIVE getWriteSchedulerState(int index, double results[]) {
+      DatabaseContainer * dbc = getIndex(index);
+      if(dbc==0) {
+        return 0;
+      }
+      const WriteScheduler & scheduler = dbc->writeScheduler;
+      const double now = emscripten_get_now();
+      const Xapian::rev revision = dbc->writable ? dbc->getWritableRevision() : 0;
+      results[0] = scheduler.pendingChanges;
+      results[1] = scheduler.pendingBytes;
+      results[2] = scheduler.pendingChanges > 0 ? now - scheduler.firstPendingAt : 0;
+      results[3] = scheduler.lastCommitAt > 0 ? now - scheduler.lastCommitAt : -1;
+      results[4] = revision;
+      results[5] = revision - scheduler.revisionAtLastCompaction;
+      results[6] = scheduler.getCompactionState();
+      results[7] = scheduler.compactions;
+      results[8] = scheduler.lastCompactionBytes;
+      results[9] = scheduler.scheduledCommits;
+      return 1;
+    }
+    
+    /**
+     * Apply the index delta (a directory or single file database marked with markIndexDelta)
+     * at path to the index. Returns a DeltaResult: 1 if applied, 0 if the index already
+     * has it, -1 if the index is not at the base revision of the delta, -2 on errors.
+     */
+    int EMSCRIPTEN_KEEPALIVE applyIndexDelta(int index, const char * path) {
+      DatabaseContainer * dbc = getIndex(index);
+      if (!dbc) return DELTA_FAILED;
+      ScopedTimer timer(EP_APPLY_DELTA);
+      try {
+        return dbc->applyDelta(path);
+      } catch(const Xapian::Error &e) {
+        reportError(EP_APPLY_DELTA, e);
+        return DELTA_FAILED;
+      }
+    }
+
+    /**
+     * Mark the index (e.g. built on the server) as a delta from baserevision to
+     * revision, with the unique terms of deleted messages in tombstones separated by newlines.
+     * Committed with the next commit. Returns 0 if revision is not after baserevision.
+     */
+    int EMSCRIPTEN_KEEPALIVE markIndexDelta(int index, const char * tombstones, double baserevision, double revision) {
+      DatabaseContainer * dbc = getIndex(index);
+      if (!dbc) return 0;
+      try {
+        dbc->markAsDelta(tombstones, (uint64_t) baserevision, (uint64_t) revision);
+        return 1;
+      } catch(const Xapian::InvalidArgumentError &e) {
+        logAt(LOG_WARNING) << "Invalid delta: " << e.get_msg() << endl;
+        return 0;
+      }
+    }
+
+    /**
+     * The revision of the last delta applied, or as set with setSyncRevision
+     */
+    double EMSCRIPTEN_KEEPALIVE getSyncRevision(int index) {
+      DatabaseContainer * dbc = getIndex(index);
+      if (!dbc) return 0;
+      return dbc->getSyncRevision();
+    }
+
+    /**
+     * Set the revision of the server state that the index has, e.g. after downloading
+     * or rebuilding it, so that deltas from that revision apply. Committed with the next commit.
+     */
+    void EMSCRIPTEN_KEEPALIVE setSyncRevision(int index, double revision) {
+      DatabaseContainer * dbc = getIndex(index);
+      if (!dbc) return;
+      dbc->setSyncRevision((uint64_t) revision);
+    }
+
+    void EMSCRIPTEN_KEEPALIVE compactDatabase(int index) {
+        DatabaseContainer * dbc = getIndex(index);
+        if (!dbc) return;
+        ScopedTimer timer(EP_COMPACT);
+        dbc->prepareCompaction();
+        dbc->db.compact("xapianglasscompact",Xapian::DBCOMPACT_SINGLE_FILE);
+    }
+    
+    void EMSCRIPTEN_KEEPALIVE compactToWritableDatabase(int index, char * path) {
+      DatabaseContainer * dbc = getIndex(index);
+      if (!dbc) return;
+      ScopedTimer timer(EP_COMPACT);
+      dbc->prepareCompaction();
+      dbc->db.compact(path);
+   }
+
+    /**
+     * Compact the database into a directory at path and start reading its tables in chunks of
+     * chunksize bytes with readDatabaseExportChunk. Every table is removed once read, and the
+     * directory after the last chunk.
+     *
+     * Returns the total size in bytes, or -1 on error.
+     */
+    double EMSCRIPTEN_KEEPALIVE beginDatabaseExport(int index, const char * path, int chunksize) {
+      DatabaseContainer * dbc = getIndex(index);
+      if (!dbc) return -1;
+      ScopedTimer timer(EP_EXPORT);
+      try {
+        dbc->prepareCompaction();
+        dbc->db.compact(path);
+      } catch(const Xapian::Error &e) {
+        reportError(EP_EXPORT, e);
+        removeDatabaseDirectory(path);
+        return -1;
+      }
+      return dbc->databaseExport.open(path, chunksize);
+    }
+
+    /**
+     * Returns a pointer to the next chunk of the export of the index (valid until the next call)
+     * and sets length, or NULL when the export is complete (or failed, or the index is unknown,
+     * with length -1)
+     */
+    const unsigned char * EMSCRIPTEN_KEEPALIVE readDatabaseExportChunk(int index, int * length) {
+      DatabaseContainer * dbc = getIndex(index);
+      if (!dbc) {
+        *length = -1;
+        return NULL;
+      }
+      return dbc->databaseExport.readChunk(length);
+    }
+
+    void EMSCRIPTEN_KEEPALIVE cancelDatabaseExport(int index) {
+      DatabaseContainer * dbc = getIndex(index);
+      if (!dbc) return;
+      dbc->databaseExport.close();
+    }
+
+    /**
+     * Start writing a database to path from chunks: the tables of an export (beginDatabaseExport)
+     * as a directory, anything else as a single file database. expectedsize (0 if unknown) is
+     * checked when the import is finished.
+     *
+     * Returns the handle of the import for the calls below, or 0 on error.
+     */
+    int EMSCRIPTEN_KEEPALIVE beginDatabaseImport(const char * path, double expectedsize) {
+      unique_ptr<DatabaseImportStream> stream(new DatabaseImportStream());
+      if(!stream->open(path, expectedsize)) {
+        return 0;
+      }
+#ifdef HAVE_THREADS
+      lock_guard<mutex> guard(databaseImportsLock);
+#endif
+      const int handle = nextImportHandle++;
+      databaseImports[handle] = move(stream);
+      return handle;
+    }
+
+    /**
+     * Returns the number of bytes imported so far, or -1 on error or for an unknown import
+     */
+    double EMSCRIPTEN_KEEPALIVE writeDatabaseImportChunk(int handle, const unsigned char * buffer, int length) {
+      DatabaseImportStream * stream = getImport(handle);
+      if (!stream) return -1;
+      return stream->write(buffer, length);
+    }
+
+    /**
+     * Returns 1 if the imported database is complete and can be opened. If writablepath is given,
+     * the database is moved there (or a single file compacted into it), to be opened with
+     * initXapianIndex or addFolderXapianIndex. Otherwise an exported database can be opened from
+     * path, and a single file added with addSingleFileXapianIndex. The import handle is released
+     * either way.
+     */
+    int EMSCRIPTEN_KEEPALIVE finishDatabaseImport(int handle, const char * writablepath) {
+      DatabaseImportStream * stream = getImport(handle);
+      if (!stream) return 0;
+      ScopedTimer timer(EP_IMPORT);
+      const bool finished = stream->finish(writablepath != NULL ? writablepath : "");
+      removeImport(handle);
+      return finished ? 1 : 0;
+    }
+
+    void EMSCRIPTEN_KEEPALIVE cancelDatabaseImport(int handle) {
+      DatabaseImportStream * stream = getImport(handle);
+      if (!stream) return;
+      stream->cancel();
+      removeImport(handle);
+    }
+
+    /**
+     * Copies the document data as tab separated fields into returned_idterm, which must be large
+     * enough. Prefer getDocumentDataFields, which has no such limit.
+     */
+    void EMSCRIPTEN_KEEPALIVE getDocumentData(int index, int id,char * returned_idterm) {
+        DatabaseContainer * dbc = getIndex(index);
+        if (!dbc) {
+          returned_idterm[0] = 0;
+          return;
+        }
+        string fields;
+        DocumentDataRecord(dbc->db.get_document(id).get_data()).appendTabSeparated(fields);
+        strcpy(returned_idterm,fields.c_str());
+    }
+
+    /**
+     * The document data as tab separated fields (id term, from, subject, from address),
+     * valid until the next call
+     */
+    const char * EMSCRIPTEN_KEEPALIVE getDocumentDataFields(int index, int docid) {
+        DatabaseContainer * dbc = getIndex(index);
+        if (!dbc) return NULL;
+        static string fields;
+        fields.clear();
+        DocumentDataRecord(dbc->db.get_document(docid).get_data()).appendTabSeparated(fields);
+        return fields.c_str();
+    }
+
+    /**
+     * One field of the document data (see DocumentDataRecord::Field), valid until the next call
+     */
+    const char * EMSCRIPTEN_KEEPALIVE getDocumentDataField(int index, int docid, int field) {
+        DatabaseContainer * dbc = getIndex(index);
+        if (!dbc) return NULL;
+        static string value;
+        const string data = dbc->db.get_document(docid).get_data();
+        value = DocumentDataRecord(data).getField(field);
+        return value.c_str();
+    }
+
+    void EMSCRIPTEN_KEEPALIVE getStringValue(int index, int docid,int slot, char * returnstring) {
+       DatabaseContainer * dbc = getIndex(index);
+       if (!dbc) {
+         returnstring[0] = 0;
+         return;
+       }
+       strcpy(returnstring,dbc->getValue(docid, slot).c_str());
+    }
+    
+    void EMSCRIPTEN_KEEPALIVE setStringValue(int index, int docid, int slot, char * valuestring) {
+        DatabaseContainer * dbc = getIndex(index);
+        if (!dbc) return;
+        dbc->documentsModified();
+        Xapian::Document doc = dbc->getDocumentWithFlags(docid);
+        doc.add_value(slot,valuestring);
+        dbc->dbw.replace_document(docid,doc);
+        dbc->flagOverlay->removeDocument(0, docid);
+        dbc->valueSlotCache.setValue(docid, slot, valuestring);
+        if(dbc->threadIndex.isLoaded()) {
+          dbc->threadIndex.setDocument(docid, doc);
+        }
+    }
+
+    double EMSCRIPTEN_KEEPALIVE getNumericValue(int index, int docid,int slot) {
+       DatabaseContainer * dbc = getIndex(index);
+       if (!dbc) return 0;
+       return Xapian::sortable_unserialise(dbc->getValue(docid, slot));
+    }
+
+    /**
+     * Value slots kept in memory by docid for sorting and reading values of rows
+     * (by default 0 to 4). No slots turns the cache off.
+     */
+    void EMSCRIPTEN_KEEPALIVE setCachedValueSlots(int index, const int slots[], int count) {
+      DatabaseContainer * dbc = getIndex(index);
+      if (!dbc) return;
+      vector<Xapian::valueno> valueslots;
+      for(int n = 0; n < count; n++) {
+        valueslots.push_back(slots[n]);
+      }
+      dbc->valueSlotCache.setSlots(valueslots);
+    }
+    
+    void EMSCRIPTEN_KEEPALIVE addTermToDocument(int index, char * unique_id_term, char * term) {
+      DatabaseContainer * dbc = getIndex(index);
+      if (!dbc) return;
+      ScopedTimer timer(EP_MODIFY_DOCUMENT);
+      dbc->documentsModified();
+      if(dbc->setFlag(unique_id_term, term, true)) {
+        return;
+      }
+      Xapian::WritableDatabase writabledatabase;
+      Xapian::docid docid = 0;
+      Xapian::Document doc = dbc->getDocumentByUniqueTerm(unique_id_term, &writabledatabase, &docid);
+      const DocumentFolderState before = dbc->getFolderStateForStats(doc);
+      doc.add_term(term);
+      writabledatabase.replace_document(docid,doc);     
+      dbc->updateFolderStats(before, dbc->getFolderStateForStats(doc));
+      dbc->documentFlagsChanged(writabledatabase, docid, doc);
+    }
+
+    void EMSCRIPTEN_KEEPALIVE removeTermFromDocument(int index, char * unique_id_term, char * term) {
+      DatabaseContainer * dbc = getIndex(index);
+      if (!dbc) return;
+      ScopedTimer timer(EP_MODIFY_DOCUMENT);
+      dbc->documentsModified();
+      if(dbc->setFlag(unique_id_term, term, false)) {
+        return;
+      }
+      Xapian::WritableDatabase writabledatabase;
+      Xapian::docid docid = 0;
+      Xapian::Document doc = dbc->getDocumentByUniqueTerm(unique_id_term, &writabledatabase, &docid);
+      const DocumentFolderState before = dbc->getFolderStateForStats(doc);
+      doc.remove_term(term);
+      writabledatabase.replace_document(docid,doc);     
+      dbc->updateFolderStats(before, dbc->getFolderStateForStats(doc));
+      dbc->documentFlagsChanged(writabledatabase, docid, doc);
+    }
+    
+    /**
+     * Number of flag changes kept in the flag overlay before commit writes them to the documents.
+     * With 0, flag terms are added to and removed from the documents right away (after writing
+     * the flags already in the overlay on the next commit).
+     */
+    void EMSCRIPTEN_KEEPALIVE setFlagOverlayLimit(int index, int limit) {
+      DatabaseContainer * dbc = getIndex(index);
+      if (!dbc) return;
+      dbc->flagOverlayLimit = limit > 0 ? limit : 0;
+    }
+
+    int EMSCRIPTEN_KEEPALIVE getFlagOverlaySize(int index) {
+      DatabaseContainer * dbc = getIndex(index);
+      if (!dbc) return 0;
+      return dbc->flagOverlay->size();
+    }
+
+    /**
+     * Documents deleted since the last commit, which are removed from the partitions on commit
+     */
+    int EMSCRIPTEN_KEEPALIVE getTombstoneCount(int index) {
+      DatabaseContainer * dbc = getIndex(index);
+      if (!dbc) return 0;
+      return dbc->tombstones->size();
+    }
+    
+    void EMSCRIPTEN_KEEPALIVE addTextToDocument(int index, char * unique_id_term, bool without_positions, char * text) {
+      DatabaseContainer * dbc = getIndex(index);
+      if (!dbc) return;
+      ScopedTimer timer(EP_MODIFY_DOCUMENT);
+      dbc->documentsModified();
+      Xapian::WritableDatabase writabledatabase;
+      Xapian::docid docid = 0;
+      Xapian::Document doc = dbc->getDocumentByUniqueTerm(unique_id_term, &writabledatabase, &docid);
+      
+      // Usually the body fetched after the message was indexed, so it's prepared like one
+      Xapian::TermGenerator & termgenerator = dbc->indexingPipeline.termGenerator;
+      const string & body = dbc->indexingPipeline.prepareBody(text);
+      termgenerator.set_document(doc);
+      if(without_positions) {
+        termgenerator.index_text_without_positions(body);
+      } else {
+        termgenerator.index_text(body);
+      }
+      writabledatabase.replace_document(docid,doc);     
+    }
+
+    void EMSCRIPTEN_KEEPALIVE changeDocumentsFolder(int index, char * unique_id_term, char * folder) {
+      DatabaseContainer * dbc = getIndex(index);
+      if (!dbc) return;
+      ScopedTimer timer(EP_MODIFY_DOCUMENT);
+      dbc->documentsModified();
+      Xapian::WritableDatabase writabledatabase;
+      Xapian::docid docid = 0;
+      Xapian::Document doc = dbc->getDocumentByUniqueTerm(unique_id_term, &writabledatabase, &docid);
+      const DocumentFolderState before = dbc->getFolderStateForStats(doc);
+      
+      moveDocumentToFolder(doc, folder);
+
+      writabledatabase.replace_document(docid,doc);     
+      dbc->updateFolderStats(before, dbc->getFolderStateForStats(doc));
+    }
+
+    /**
+     * Apply one operation (see BulkOperation) to many messages, e.g. when marking
+     * a selection as read, moving it to another folder or expunging it. The argument is the term
+     * for BULK_ADD_TERM / BULK_REMOVE_TERM and the folder name for BULK_SET_FOLDER.
+     *
+     * Returns the number of documents changed, or -1 on error.
+     */
+    int EMSCRIPTEN_KEEPALIVE bulkUpdateDocuments(int index, const int messageids[], int count, int operation, const char * argument) {
+      DatabaseContainer * dbc = getIndex(index);
+      if (!dbc) return 0;
+      ScopedTimer timer(EP_BULK_UPDATE);
+      try {
+        return dbc->bulkUpdateDocuments(messageids, count, operation, argument != NULL ? argument : "");
+      } catch(const Xapian::Error &e) {
+        reportError(EP_BULK_UPDATE, e);
+        return -1;
+      }
+    }
+
+    /**
+    * set value range for the query
+    */
+    void EMSCRIPTEN_KEEPALIVE setStringValueRange(int index, int valueRangeSlotNumber, char * prefix) {
+      DatabaseContainer * dbc = getIndex(index);
+      if (!dbc) return;
+      dbc->setStringValueRange(valueRangeSlotNumber,prefix);
+    }
+    
+    void EMSCRIPTEN_KEEPALIVE clearValueRange(int index) {
+      DatabaseContainer * dbc = getIndex(index);
+      if (!dbc) return;
+      dbc->clearValueRange();
+    }
+    
+    /**
+     * Statistics for the unique id term routing table in `results[]`:
+     * [hits, misses, number of routed terms, number of partition loads]
+     */
+    int EMSCRIPTEN_KEEPALIVE getUniqueTermRoutingStats(int index, int results[]) {
+      DatabaseContainer * dbc = getIndex(index);
+      if (!dbc) return 0;
+
+      results[0] = dbc->routingHits;
+      results[1] = dbc->routingMisses;
+      results[2] = dbc->uniqueTermRoutes.size();
+      results[3] = dbc->routingPartitionLoads;
+      return 1;
+    }
+
+    /**
+     * Set the number of parsed queries to keep in the cache, 0 disables caching
+     */
+    void EMSCRIPTEN_KEEPALIVE setQueryCacheSize(int index, int size) {
+      DatabaseContainer * dbc = getIndex(index);
+      if (!dbc) return;
+      dbc->parsedQueryCache.setCapacity(size > 0 ? size : 0);
+    }
+
+    /**
+     * Statistics for the parsed query cache in `results[]`: [hits, misses, number of cached queries]
+     */
+    int EMSCRIPTEN_KEEPALIVE getQueryCacheStats(int index, int results[]) {
+      DatabaseContainer * dbc = getIndex(index);
+      if (!dbc) return 0;
+
+      results[0] = dbc->parsedQueryCache.hits;
+      results[1] = dbc->parsedQueryCache.misses;
+      results[2] = dbc->parsedQueryCache.size();
+      return 1;
+    }
+
+    int EMSCRIPTEN_KEEPALIVE getDocIdFromUniqueIdTerm(int index, char * unique_id_term) {
+      DatabaseContainer * dbc = getIndex(index);
+      if (!dbc) return 0;
+      Xapian::PostingIterator p = dbc->db.postlist_begin(unique_id_term);
+      while (p != dbc->db.postlist_end(unique_id_term) && dbc->isTombstone(*p)) {
+        ++p;
+      }
+      
+      if (p != dbc->db.postlist_end(unique_id_term)) {
+        return *p;
       } else {
         return 0;
       }
     }
     
-    int EMSCRIPTEN_KEEPALIVE documentTermList(int docid) {
-      Xapian::Document doc = dbc->db.get_document(docid);
+    int EMSCRIPTEN_KEEPALIVE documentTermList(int index, int docid) {
+      DatabaseContainer * dbc = getIndex(index);
+      if (!dbc) return 0;
+      Xapian::Document doc = dbc->getDocumentWithFlags(docid);
       int numterms = 0;      
       
       Xapian::TermIterator termitbeg = doc.termlist_begin();
@@ -432,8 +6776,10 @@ extern "C" {
     /**
      * return terms starting with X of given document id
      */
-    int EMSCRIPTEN_KEEPALIVE documentXTermList(int docid) {
-      Xapian::Document doc = dbc->db.get_document(docid);
+    int EMSCRIPTEN_KEEPALIVE documentXTermList(int index, int docid) {
+      DatabaseContainer * dbc = getIndex(index);
+      if (!dbc) return 0;
+      Xapian::Document doc = dbc->getDocumentWithFlags(docid);
       int numterms = 0;      
       
       Xapian::TermIterator termitbeg = doc.termlist_begin();
@@ -456,7 +6802,9 @@ extern "C" {
     /**
      * Copy termlist of given termprefix into 
      */
-    int EMSCRIPTEN_KEEPALIVE termlist(char * termprefix) { 
+    int EMSCRIPTEN_KEEPALIVE termlist(int index, char * termprefix) {
+      DatabaseContainer * dbc = getIndex(index);
+      if (!dbc) return 0;
       std::string prefix(termprefix);   
       Xapian::TermIterator termitbeg = dbc->db.allterms_begin(prefix);
       Xapian::TermIterator termitend = dbc->db.allterms_end(prefix);
@@ -477,7 +6825,9 @@ extern "C" {
     /**
     * Will insert a comma separated list of folders in the passed folder list string (make sure to allocate it large enough)
     */
-    int EMSCRIPTEN_KEEPALIVE listFolders(char * folderlist) {
+    int EMSCRIPTEN_KEEPALIVE listFolders(int index, char * folderlist) {
+      DatabaseContainer * dbc = getIndex(index);
+      if (!dbc) return 0;
       const std::string folderprefix = "XFOLDER:";
       Xapian::TermIterator termitbeg = dbc->db.allterms_begin(folderprefix);
       Xapian::TermIterator termitend = dbc->db.allterms_end(folderprefix);
@@ -502,7 +6852,9 @@ extern "C" {
     /**
     * Will insert a comma separated list of folders with unread messages in the passed folder list string (make sure to allocate it large enough)
     */
-    int EMSCRIPTEN_KEEPALIVE listUnreadFolders(char * folderlist) {
+    int EMSCRIPTEN_KEEPALIVE listUnreadFolders(int index, char * folderlist) {
+      DatabaseContainer * dbc = getIndex(index);
+      if (!dbc) return 0;
       const std::string folderprefix = "XUNREADFOLDER:";
       Xapian::TermIterator termitbeg = dbc->db.allterms_begin(folderprefix);
       Xapian::TermIterator termitend = dbc->db.allterms_end(folderprefix);
@@ -524,142 +6876,347 @@ extern "C" {
       return numfolders;
     }
 
-    // returns a pair: [total, unread] in `results[]`
-    int EMSCRIPTEN_KEEPALIVE getFolderMessageCounts(const char *folderName, int results[]) {
+    // returns a pair: [total, unread] in `results[]`
+    int EMSCRIPTEN_KEEPALIVE getFolderMessageCounts(int index, const char *folderName, int results[]) {
+        DatabaseContainer * dbc = getIndex(index);
+        if (!dbc) return 0;
+        ScopedTimer timer(EP_FOLDER_STATS);
+
+        try {
+            const map<string, FolderStats> folderStats = dbc->getAllFolderStats();
+            map<string, FolderStats>::const_iterator it = folderStats.find(folderName);
+            if(it == folderStats.end()) {
+                results[0] = 0;
+                results[1] = 0;
+            } else {
+                results[0] = it->second.total;
+                results[1] = it->second.unread;
+            }
+            return 1;
+        } catch(const Xapian::Error e) {
+            reportError(EP_FOLDER_STATS, e);
+            return 0;
+        }
+    }
+
+    /**
+     * Statistics of all folders, returned as a pointer to a buffer with (uint32 little endian)
+     * the number of folders followed by for each folder: name (byte length, UTF-8 bytes
+     * and a terminating 0), total, unread and flagged counts.
+     *
+     * The buffer is valid until the next call or closeDatabase. Returns 0 on error.
+     */
+    const unsigned char * EMSCRIPTEN_KEEPALIVE getAllFolderStats(int index) {
+        DatabaseContainer * dbc = getIndex(index);
         if (!dbc) return 0;
+        ScopedTimer timer(EP_FOLDER_STATS);
 
-        Xapian::QueryParser queryparser;
-        queryparser.set_database(dbc->db);
-        queryparser.add_boolean_prefix("folder", "XFOLDER:");
-        queryparser.add_boolean_prefix("flag", "XF");
+        try {
+            const map<string, FolderStats> folderStats = dbc->getAllFolderStats();
+            ResultArena & arena = dbc->folderStatsArena;
+            arena.clear();
+            arena.appendUint32(folderStats.size());
+            for(const pair<const string, FolderStats> & entry : folderStats) {
+              arena.appendString(entry.first);
+              arena.appendUint32(entry.second.total);
+              arena.appendUint32(entry.second.unread);
+              arena.appendUint32(entry.second.flagged);
+            }
+            return arena.data();
+        } catch(const Xapian::Error e) {
+            reportError(EP_FOLDER_STATS, e);
+            return 0;
+        }
+    }
 
-        string queryString = "folder:\"";
-        queryString += folderName;
-        queryString += "\"";
+    /**
+     * Threads (see ThreadIndex) with the latest message first, of all messages or only those in
+     * folder if not empty, returned as a pointer to a buffer with (uint32 little endian) the total
+     * number of threads and the number returned, followed by for each thread: docid of the latest
+     * message, number of messages, number of unread messages and the latest date (byte length,
+     * UTF-8 bytes and a terminating 0). Counts are of the messages in folder if given.
+     *
+     * The buffer is valid until the next call or closeDatabase. Returns 0 on error.
+     */
+    const unsigned char * EMSCRIPTEN_KEEPALIVE listThreads(int index, const char * folder, int offset, int maxresults) {
+        DatabaseContainer * dbc = getIndex(index);
+        if (!dbc) return 0;
+        ScopedTimer timer(EP_THREADS);
 
         try {
-            {
-                Xapian::Enquire enquire(dbc->db);
-                Xapian::Query query = queryparser.parse_query(
-                    queryString + " AND NOT flag:seen",
-                    Xapian::QueryParser::FLAG_DEFAULT | Xapian::QueryParser::FLAG_PARTIAL
-                );
-
-                enquire.set_query(query);
-                Xapian::MSet mset = enquire.get_mset(0, UINT_MAX);
-                results[1] = mset.size();
-            }
+            dbc->listThreads(folder != NULL ? folder : "", offset, maxresults);
+            return dbc->threadListArena.data();
+        } catch(const Xapian::Error e) {
+            reportError(EP_THREADS, e);
+            return 0;
+        }
+    }
 
-            {
-                Xapian::Enquire enquire(dbc->db);
-                Xapian::Query query = queryparser.parse_query(
-                    queryString,
-                    Xapian::QueryParser::FLAG_DEFAULT | Xapian::QueryParser::FLAG_PARTIAL
-                );
+    /**
+     * Docids of the messages in the thread of docid, oldest first. Writes at most maxresults
+     * and returns the number of messages in the thread (0 if docid isn't indexed).
+     */
+    int EMSCRIPTEN_KEEPALIVE getThreadMessages(int index, int docid, int results[], int maxresults) {
+        DatabaseContainer * dbc = getIndex(index);
+        if (!dbc) return 0;
+        ScopedTimer timer(EP_THREADS);
 
-                enquire.set_query(query);
-                Xapian::MSet mset = enquire.get_mset(0, UINT_MAX);
-                results[0] = mset.size();
+        try {
+            dbc->loadThreadIndex();
+            const ThreadIndex::Thread * thread = dbc->threadIndex.getThread(docid);
+            if(thread == NULL) {
+              return 0;
             }
+            for(size_t n = 0; n < thread->messages.size() && n < (size_t) maxresults; n++) {
+              results[n] = thread->messages[n].docid;
+            }
+            return thread->messages.size();
+        } catch(const Xapian::Error e) {
+            reportError(EP_THREADS, e);
+            return 0;
+        }
+    }
+
+    // returns a pair: [messages, unread] of the thread of docid in `results[]`
+    int EMSCRIPTEN_KEEPALIVE getThreadCounts(int index, int docid, int results[]) {
+        DatabaseContainer * dbc = getIndex(index);
+        if (!dbc) return 0;
+        ScopedTimer timer(EP_THREADS);
 
+        try {
+            dbc->loadThreadIndex();
+            const ThreadIndex::Thread * thread = dbc->threadIndex.getThread(docid);
+            if(thread == NULL) {
+              return 0;
+            }
+            results[0] = thread->messages.size();
+            results[1] = thread->unread;
             return 1;
-        } catch(const Xapian::QueryParserError e) {
-            cout << "Invalid query: " << queryString << endl;
-            return 0;
         } catch(const Xapian::Error e) {
-            cout << "Error: " << e.get_type() << " "
-                << e.get_msg() << " "
-                << e.get_error_string() << " "
-                << e.get_description()
-                << endl;
+            reportError(EP_THREADS, e);
             return 0;
         }
     }
 
-    int EMSCRIPTEN_KEEPALIVE sortedXapianQuery(char * searchtext, 
+    /**
+     * Docids (and collapse counts) of the rows offset to offset + maxresults of a query sorted
+     * by value. Returns the number of rows. Sets cappedat to the row limit of the memory governor
+     * if it capped maxresults (see configureMemoryGovernor), or 0.
+     */
+    int EMSCRIPTEN_KEEPALIVE sortedXapianQuery(int index, char * searchtext, 
             int sortvaluenum, 
             bool reverse, int results[], 
             int offset, int maxresults,
             int collapsevaluenum,
-            int collapsecount[]
+            int collapsecount[],
+            int * cappedat
           ) {
+      *cappedat = memoryGovernor.matchCap(maxresults);
+      DatabaseContainer * dbc = getIndex(index);
       if(dbc==0) {
           return 0;
       }
-                     
-      Xapian::QueryParser queryparser;  
-      queryparser.set_database(dbc->db);
-      if(dbc->rangeProcessor!=NULL) {
-        queryparser.add_rangeprocessor(dbc->rangeProcessor);
+      ScopedTimer timer(EP_SORTED_QUERY);
+
+      try {            
+          const vector<SortedMatch> matches = dbc->sortedQuery(searchtext, sortvaluenum, reverse,
+                offset, maxresults, collapsevaluenum);
+
+          int n=0;
+          for (const SortedMatch & match : matches) {
+            if(collapsevaluenum>-1) {
+              collapsecount[n] = match.collapseCount;
+            }       
+            // Combined doc id
+            results[n++] = match.docid;
+          }
+          return n;
+         
+      } catch(const Xapian::QueryParserError e) {
+          metrics.recordError(EP_SORTED_QUERY, string("Invalid query: ") + searchtext);
+          logAt(LOG_WARNING) << "Invalid query: " << searchtext << endl;
+          return 0;
+      } catch(const Xapian::Error e) {
+          reportError(EP_SORTED_QUERY, e);
+          return 0;
+      }      
+    }
+
+    /**
+     * Same as sortedXapianQuery, but for search as you type. When the query only narrows
+     * the previous incremental query (e.g. the last partial word gets longer), the previous
+     * matches are filtered instead of matching against the whole database.
+     */
+    int EMSCRIPTEN_KEEPALIVE incrementalSortedXapianQuery(int index, char * searchtext, 
+            int sortvaluenum, 
+            bool reverse, int results[], 
+            int offset, int maxresults,
+            int collapsevaluenum,
+            int collapsecount[],
+            int * cappedat
+          ) {
+      *cappedat = memoryGovernor.matchCap(maxresults);
+      DatabaseContainer * dbc = getIndex(index);
+      if(dbc==0) {
+          return 0;
       }
-      
-      queryparser.add_boolean_prefix("flag", "XF");
-      queryparser.add_boolean_prefix("folder", "XFOLDER:");
-      queryparser.add_boolean_prefix("unreadfolder", "XUNREADFOLDER:");
-      queryparser.add_prefix("subject", "S");
-      queryparser.add_prefix("from", "A");
-      queryparser.add_prefix("to", "XTO");
-      queryparser.add_prefix("date", "D");
+      ScopedTimer timer(EP_INCREMENTAL_QUERY);
 
       try {            
-          Xapian::Query query;
-      
-          Xapian::Enquire enquire(dbc->db);            
-          if(strlen(searchtext)==0) {
-            query = Xapian::Query::MatchAll;
-          } else {
-            query = queryparser.parse_query(searchtext,Xapian::QueryParser::FLAG_DEFAULT | Xapian::QueryParser::FLAG_PARTIAL);          
-          }  
-          enquire.set_query(query);        
-          enquire.set_sort_by_value(sortvaluenum,reverse);
-          enquire.set_docid_order(Xapian::Enquire::DONT_CARE);
-          enquire.set_weighting_scheme(Xapian::BoolWeight());
-          
-          if(collapsevaluenum>-1) {
-            enquire.set_collapse_key(collapsevaluenum, 1);
-          }
-          
-          Xapian::MSet mset = enquire.get_mset(offset,maxresults);
+          const vector<SortedMatch> matches = dbc->incrementalSortedQuery(searchtext, sortvaluenum, reverse,
+                offset, maxresults, collapsevaluenum);
 
           int n=0;
-          for (Xapian::MSetIterator m = mset.begin(); m != mset.end(); ++m) {
+          for (const SortedMatch & match : matches) {
             if(collapsevaluenum>-1) {
-              collapsecount[n] = m.get_collapse_count();
+              collapsecount[n] = match.collapseCount;
             }       
-            // Combined doc id from the * operator                                       
-            results[n++] = *m;
+            results[n++] = match.docid;
           }
           return n;
          
       } catch(const Xapian::QueryParserError e) {
-          cout << "Invalid query: " << searchtext << endl;
+          dbc->incrementalSearch.reset();
+          metrics.recordError(EP_INCREMENTAL_QUERY, string("Invalid query: ") + searchtext);
+          logAt(LOG_WARNING) << "Invalid query: " << searchtext << endl;
+          return 0;
+      } catch(const Xapian::Error e) {
+          dbc->incrementalSearch.reset();
+          reportError(EP_INCREMENTAL_QUERY, e);
+          return 0;
+      }      
+    }
+
+    /**
+     * End the incremental search session, so that the next incremental query is matched in full
+     */
+    void EMSCRIPTEN_KEEPALIVE resetIncrementalSearch(int index) {
+      DatabaseContainer * dbc = getIndex(index);
+      if(dbc!=0) {
+        dbc->incrementalSearch.reset();
+      }
+    }
+
+    /**
+     * Statistics for incremental search in `results[]`:
+     * [refined queries, fully matched queries, number of candidates kept (-1 if too many)]
+     */
+    int EMSCRIPTEN_KEEPALIVE getIncrementalSearchStats(int index, int results[]) {
+      DatabaseContainer * dbc = getIndex(index);
+      if (!dbc) return 0;
+
+      const IncrementalSearchSession & session = dbc->incrementalSearch;
+      results[0] = session.refinements;
+      results[1] = session.fullMatches;
+      results[2] = session.candidates ? session.candidates->size() : -1;
+      return 1;
+    }
+
+    /**
+     * Same as sortedXapianQuery, but returns a pointer to a result arena with the
+     * selected value slots and document data of every row, so that a page of results
+     * can be read without further calls per row. Layout (uint32 little endian):
+     *
+     *   header: version (2), number of rows, number of value slots, total bytes, and the row
+     *           limit of the memory governor if it capped maxresults (see configureMemoryGovernor), or 0
+     *   row offsets: one offset (from arena start) per row
+     *   row: docid, collapse count, the value of each requested slot as a string,
+     *        number of document data fields followed by each field as a string
+     *
+     * Strings are stored as byte length followed by the UTF-8 bytes and a terminating 0.
+     *
+     * The arena is owned by the database container and stays valid until the next
+     * arena query, freeResultArena or closeDatabase. Returns 0 on error.
+     */
+    const unsigned char * EMSCRIPTEN_KEEPALIVE sortedXapianQueryArena(int index, char * searchtext, 
+            int sortvaluenum, 
+            bool reverse,
+            int offset, int maxresults,
+            int collapsevaluenum,
+            const int valueslots[], int numvalueslots
+          ) {
+      DatabaseContainer * dbc = getIndex(index);
+      if(dbc==0) {
+          return 0;
+      }
+      ScopedTimer timer(EP_ARENA_QUERY);
+
+      try {            
+          const vector<SortedMatch> matches = dbc->sortedQuery(searchtext, sortvaluenum, reverse,
+                offset, maxresults, collapsevaluenum, true);
+          ResultArena & arena = dbc->resultArena;
+          writeSortedResultArena(arena, dbc->db, matches, collapsevaluenum, valueslots, numvalueslots,
+                dbc->canUseValueSlotCache() ? &dbc->getValueSlotCache() : NULL,
+                memoryGovernor.matchCap(maxresults));
+          return arena.data();
+         
+      } catch(const Xapian::QueryParserError e) {
+          metrics.recordError(EP_ARENA_QUERY, string("Invalid query: ") + searchtext);
+          logAt(LOG_WARNING) << "Invalid query: " << searchtext << endl;
           return 0;
       } catch(const Xapian::Error e) {
-          cout << "Error: " << e.get_type() << " "
-                    << e.get_msg() << " "
-                    << e.get_error_string() << " "
-                    << e.get_description()
-                    << endl;
+          reportError(EP_ARENA_QUERY, e);
           return 0;
       }      
     }
+
+    void EMSCRIPTEN_KEEPALIVE freeResultArena(int index) {
+      DatabaseContainer * dbc = getIndex(index);
+      if(dbc!=0) {
+        dbc->resultArena.release();
+      }
+    }
+
+    /**
+     * Snippets of the body text of the given documents (e.g. the rows of a page returned by
+     * sortedXapianQueryArena) for the query they were found with, at most length bytes each,
+     * with the matches between \x01 and \x02. Only messages indexed with snippetbytes (see
+     * configureIndexing) have text. Returns a result arena with a string for each document,
+     * valid until the next call, or NULL on errors.
+     */
+    const unsigned char * EMSCRIPTEN_KEEPALIVE getResultSnippets(int index, const char * searchtext,
+          const int docids[], int count, int length) {
+      DatabaseContainer * dbc = getIndex(index);
+      if(dbc==0) {
+          return 0;
+      }
+      ScopedTimer timer(EP_SNIPPETS);
+      try {
+          return dbc->getSnippets(searchtext, docids, count > 0 ? count : 0, length > 0 ? length : 200).data();
+      } catch(const Xapian::QueryParserError e) {
+          metrics.recordError(EP_SNIPPETS, string("Invalid query: ") + searchtext);
+          logAt(LOG_WARNING) << "Invalid query: " << searchtext << endl;
+          return 0;
+      } catch(const Xapian::Error e) {
+          reportError(EP_SNIPPETS, e);
+          return 0;
+      }
+    }
     
-    int EMSCRIPTEN_KEEPALIVE queryIndex(char * searchtext, int results[], int offset, int maxresults)
+    /**
+     * Docids of the matches of the plain query parser by relevance. Sets cappedat to the row
+     * limit of the memory governor if it capped maxresults (see configureMemoryGovernor), or 0.
+     */
+    int EMSCRIPTEN_KEEPALIVE queryIndex(int index, char * searchtext, int results[], int offset, int maxresults,
+          int * cappedat)
     {
+        *cappedat = memoryGovernor.matchCap(maxresults);
+        DatabaseContainer * dbc = getIndex(index);
         if(dbc==0) {
             return 0;
         }
-        
-        Xapian::QueryParser queryparser;        
-        queryparser.set_database(dbc->db);
+        ScopedTimer timer(EP_QUERY_INDEX);
         
         try {
-            Xapian::Query query = queryparser.parse_query(searchtext,Xapian::QueryParser::FLAG_DEFAULT | Xapian::QueryParser::FLAG_PARTIAL);
+            // The plain query parser has no folder prefix, so every partition may match
+            dbc->preparePartitionsForQuery("");
+            QueryContext & context = dbc->getQueryContext();
+            Xapian::Query query = dbc->excludeTombstones(dbc->parseQuery(context.plainQueryParser, "plain", searchtext));
             
-            Xapian::Enquire enquire(dbc->db);
+            Xapian::Enquire & enquire = context.plainEnquire;
             enquire.set_query(query);
 
-            Xapian::MSet mset = enquire.get_mset(offset,maxresults);
+            Xapian::MSet mset = enquire.get_mset(offset, memoryGovernor.capMatches(maxresults));
 
             int n=0;
             for (Xapian::MSetIterator m = mset.begin(); m != mset.end(); ++m) {
@@ -667,10 +7224,440 @@ extern "C" {
             }
             return n;
         } catch(const Xapian::QueryParserError e) {
-            cout << "Invalid query: " << searchtext << endl;
+            metrics.recordError(EP_QUERY_INDEX, string("Invalid query: ") + searchtext);
+            logAt(LOG_WARNING) << "Invalid query: " << searchtext << endl;
             return 0;
         }
     }
+
+    /**
+     * Settings of the memory governor (see MemoryGovernor), shared by all indexes: bytes of heap
+     * in use before caches are released and pending changes committed, rows returned per sorted
+     * query, and pending changes before an early commit. 0 for no limit.
+     */
+    void EMSCRIPTEN_KEEPALIVE configureMemoryGovernor(double heapbudget, int maxmatches, int maxpendingchanges) {
+      memoryGovernor.heapBudget = heapbudget > 0 ? heapbudget : 0;
+      memoryGovernor.maxMatches = maxmatches > 0 ? maxmatches : 0;
+      memoryGovernor.maxPendingChanges = maxpendingchanges > 0 ? maxpendingchanges : 0;
+    }
+
+    /**
+     * Results: heap size, heap in use, peak heap in use (of the values seen by budget checks and
+     * this call, since start or the last reset), heap
+     * budget, bytes held by the caches of the index, its pending changes, cache releases,
+     * forced commits and capped queries. Returns 0 for an unknown index.
+     */
+    int EMSCRIPTEN_KEEPALIVE getMemoryUsage(int index, double results[], bool resetpeak) {
+      DatabaseContainer * dbc = getIndex(index);
+      if (!dbc) return 0;
+      results[0] = MemoryGovernor::heapSize();
+      results[1] = memoryGovernor.heapUsed();
+      results[2] = memoryGovernor.peakHeapUsed;
+      results[3] = memoryGovernor.heapBudget;
+      results[4] = dbc->getCacheMemoryUsage();
+      results[5] = dbc->writeScheduler.pendingChanges;
+      results[6] = memoryGovernor.cacheReleases;
+      results[7] = memoryGovernor.forcedCommits;
+      results[8] = memoryGovernor.cappedQueries;
+      if(resetpeak) {
+        memoryGovernor.peakHeapUsed = results[1];
+      }
+      return 1;
+    }
+
+    /**
+     * Release the caches of the index, e.g. when the page is hidden
+     */
+    void EMSCRIPTEN_KEEPALIVE releaseCaches(int index) {
+      DatabaseContainer * dbc = getIndex(index);
+      if(dbc != 0) {
+        dbc->releaseCaches();
+        memoryGovernor.released();
+      }
+    }
+
+    /**
+     * Returns call counts, errors, latencies (total, max and a histogram with buckets
+     * below 0.25, 1, 4, 16, 64, 256, 1024 ms and above) per entry point, and the
+     * indexing / partition counters, as a JSON string valid until the next call.
+     */
+    const char * EMSCRIPTEN_KEEPALIVE getIndexMetrics() {
+      static string json;
+      json = metrics.toJSON();
+      return json.c_str();
+    }
+
+    void EMSCRIPTEN_KEEPALIVE resetIndexMetrics() {
+      metrics.reset();
+    }
+
+    /**
+     * See LogLevel, from 0 (silent) to 4 (debug). The default is 3 (info).
+     */
+    void EMSCRIPTEN_KEEPALIVE setLogLevel(int level) {
+      logLevel = level;
+    }
     
     
 }
+
+#ifndef __EMSCRIPTEN__
+/**
+ * The databases of a mailbox served by SearchServer. Replaced instead of modified, so that
+ * a worker can tell that its reader was opened from an outdated set of databases.
+ */
+struct ServerMailbox {
+    vector<string> paths; // main database first, then added partitions (folders or single files)
+    int valueRangeSlot; // -1 for no range processor
+    string valueRangePrefix;
+};
+
+/**
+ * Database, query parsers and enquires of one mailbox for one worker thread, since
+ * Xapian objects must not be used from several threads at once
+ */
+struct MailboxReader {
+    shared_ptr<const ServerMailbox> mailbox;
+    Xapian::Database db;
+    vector<Xapian::Database> partitions; // combined in db
+    shared_ptr<FlagOverlay> flagOverlay;
+    IndexingPipeline indexingPipeline; // Only for its query parser settings
+    string indexingSettings; // as stored in the main database
+    unique_ptr<Xapian::RangeProcessor> rangeProcessor;
+    string rangeProcessorKey;
+    unique_ptr<QueryContext> queryContext;
+    ParsedQueryCache parsedQueryCache;
+
+    explicit MailboxReader(const shared_ptr<const ServerMailbox> & mailbox) :
+        mailbox(mailbox), flagOverlay(new FlagOverlay()), parsedQueryCache(64) {
+      for(const string & path : mailbox->paths) {
+        partitions.push_back(Xapian::Database(path));
+        db.add_database(partitions.back());
+      }
+      loadFlagOverlay();
+      if(mailbox->valueRangeSlot >= 0) {
+        rangeProcessor.reset(new Xapian::RangeProcessor(mailbox->valueRangeSlot, mailbox->valueRangePrefix));
+        rangeProcessorKey = to_string(mailbox->valueRangeSlot) + ":" + mailbox->valueRangePrefix;
+      }
+      loadIndexingSettings();
+    }
+
+    /**
+     * Configure the query parsers as the main database was indexed
+     */
+    void loadIndexingSettings() {
+      indexingSettings = partitions[0].get_metadata("indexingpipeline");
+      IndexingPipeline::Settings settings;
+      settings.unserialise(indexingSettings);
+      queryContext.reset(); // Refers to the stopper of the pipeline
+      parsedQueryCache.clear();
+      try {
+        indexingPipeline.configure(settings);
+      } catch(const Xapian::InvalidArgumentError &e) {
+        indexingPipeline.configure(IndexingPipeline::Settings());
+      }
+      queryContext.reset(new QueryContext(db, rangeProcessor.get(), &indexingPipeline, flagOverlay));
+    }
+
+    /**
+     * See commits made since the last query, including the flag overlays written with them
+     */
+    void reopen() {
+      if(db.reopen()) {
+        loadFlagOverlay();
+        if(partitions[0].get_metadata("indexingpipeline") != indexingSettings) {
+          loadIndexingSettings();
+        }
+      }
+    }
+
+    void loadFlagOverlay() {
+      const bool wasempty = flagOverlay->empty();
+      flagOverlay->reset();
+      for(const Xapian::Database & partition : partitions) {
+        flagOverlay->addPartition(partition);
+      }
+      if(wasempty && !flagOverlay->empty()) {
+        parsedQueryCache.clear(); // flag: queries were parsed to plain terms
+      }
+    }
+};
+
+/**
+ * Serves queries for many mailboxes, identified by handles, on a pool of worker threads.
+ * Each worker keeps its own reader per mailbox, reopened when the mailbox has new commits.
+ */
+class SearchServer {
+public:
+    typedef void (*ArenaCallback)(void * userdata, const unsigned char * arena, int length);
+
+    explicit SearchServer(int numthreads) : nextHandle(1), closedMailboxes(0), pool(numthreads) {}
+
+    int openMailbox(const string & path) {
+      const Xapian::Database check(path); // Throws if the database can't be opened
+      ServerMailbox * mailbox = new ServerMailbox();
+      mailbox->paths.push_back(path);
+      mailbox->valueRangeSlot = -1;
+
+      lock_guard<mutex> guard(lock);
+      const int handle = nextHandle++;
+      mailboxes[handle].reset(mailbox);
+      return handle;
+    }
+
+    bool addPartition(int handle, const string & path) {
+      const Xapian::Database check(path);
+      lock_guard<mutex> guard(lock);
+      map<int, shared_ptr<const ServerMailbox>>::iterator it = mailboxes.find(handle);
+      if(it == mailboxes.end()) {
+        return false;
+      }
+      ServerMailbox * mailbox = new ServerMailbox(*it->second);
+      mailbox->paths.push_back(path);
+      it->second.reset(mailbox);
+      return true;
+    }
+
+    bool setValueRange(int handle, int slot, const string & prefix) {
+      lock_guard<mutex> guard(lock);
+      map<int, shared_ptr<const ServerMailbox>>::iterator it = mailboxes.find(handle);
+      if(it == mailboxes.end()) {
+        return false;
+      }
+      ServerMailbox * mailbox = new ServerMailbox(*it->second);
+      mailbox->valueRangeSlot = slot;
+      mailbox->valueRangePrefix = prefix;
+      it->second.reset(mailbox);
+      return true;
+    }
+
+    bool closeMailbox(int handle) {
+      lock_guard<mutex> guard(lock);
+      if(mailboxes.erase(handle) == 0) {
+        return false;
+      }
+      closedMailboxes++;
+      return true;
+    }
+
+    /**
+     * Run a sorted query on a worker thread. The callback gets a result arena in the format
+     * of sortedXapianQueryArena (only valid during the callback), or NULL on error.
+     */
+    void submitSortedQuery(int handle, const string & querytext,
+          int sortvaluenum, bool reverse, int offset, int maxresults, int collapsevaluenum,
+          const vector<int> & valueslots, ArenaCallback callback, void * userdata) {
+      pool.submit([=]() {
+        ResultArena arena;
+        if(runSortedQuery(handle, querytext, sortvaluenum, reverse, offset, maxresults,
+              collapsevaluenum, valueslots, arena)) {
+          callback(userdata, arena.data(), arena.size());
+        } else {
+          callback(userdata, NULL, 0);
+        }
+      });
+    }
+
+private:
+    shared_ptr<const ServerMailbox> getMailbox(int handle) {
+      lock_guard<mutex> guard(lock);
+      map<int, shared_ptr<const ServerMailbox>>::const_iterator it = mailboxes.find(handle);
+      return it != mailboxes.end() ? it->second : shared_ptr<const ServerMailbox>();
+    }
+
+    /**
+     * Runs on a worker thread
+     */
+    bool runSortedQuery(int handle, const string & querytext,
+          int sortvaluenum, bool reverse, int offset, int maxresults, int collapsevaluenum,
+          const vector<int> & valueslots, ResultArena & arena) {
+      static thread_local unordered_map<int, unique_ptr<MailboxReader>> readers;
+      static thread_local unsigned int readersClosedMailboxes = 0;
+
+      if(readersClosedMailboxes != closedMailboxes) {
+        // Close the readers of closed mailboxes
+        readersClosedMailboxes = closedMailboxes;
+        for(unordered_map<int, unique_ptr<MailboxReader>>::iterator it = readers.begin(); it != readers.end();) {
+          if(!getMailbox(it->first)) {
+            it = readers.erase(it);
+          } else {
+            ++it;
+          }
+        }
+      }
+
+      const shared_ptr<const ServerMailbox> mailbox = getMailbox(handle);
+      if(!mailbox) {
+        return false;
+      }
+
+      for(int attempt = 0; attempt < 2; attempt++) {
+        try {
+          unique_ptr<MailboxReader> & reader = readers[handle];
+          if(!reader || reader->mailbox != mailbox) {
+            reader.reset(new MailboxReader(mailbox));
+          } else {
+            reader->reopen();
+          }
+
+          Xapian::Query query;
+          if(querytext.empty()) {
+            query = Xapian::Query::MatchAll;
+          } else {
+            query = parseCachedQuery(reader->parsedQueryCache, *reader->queryContext,
+                  reader->queryContext->sortedQueryParser, "sorted", reader->rangeProcessorKey, querytext);
+          }
+          vector<SortedMatch> matches;
+          appendSortedMatches(matches, runSortedEnquire(reader->queryContext->sortedEnquire, query,
+                sortvaluenum, reverse, offset, maxresults, collapsevaluenum), true);
+          writeSortedResultArena(arena, reader->db, matches, collapsevaluenum,
+                valueslots.data(), valueslots.size(), NULL, 0);
+          return true;
+        } catch(const Xapian::DatabaseModifiedError &e) {
+          // Changed by a commit while reading, try once more with a reopened reader
+          readers.erase(handle);
+        } catch(const Xapian::QueryParserError &e) {
+          logAt(LOG_WARNING) << "Invalid query: " << querytext << endl;
+          return false;
+        } catch(const Xapian::Error &e) {
+          logAt(LOG_ERROR) << "Error: " << e.get_type() << " " << e.get_msg() << endl;
+          readers.erase(handle);
+          return false;
+        }
+      }
+      return false;
+    }
+
+    mutex lock;
+    map<int, shared_ptr<const ServerMailbox>> mailboxes;
+    int nextHandle;
+    atomic<unsigned int> closedMailboxes;
+    WorkerPool pool; // Last, so that the workers are joined before the mailboxes are destroyed
+};
+
+static unique_ptr<SearchServer> searchServer;
+
+/**
+ * Native only: search many mailboxes in parallel, e.g. for searching on the server
+ */
+extern "C" {
+    /**
+     * Start the search server with numthreads worker threads. Returns 0 if already started.
+     */
+    int searchServerStart(int numthreads) {
+      if(searchServer) {
+        return 0;
+      }
+      searchServer.reset(new SearchServer(numthreads > 0 ? numthreads : thread::hardware_concurrency()));
+      return 1;
+    }
+
+    /**
+     * Waits for submitted queries to finish, and closes all mailboxes
+     */
+    void searchServerStop() {
+      searchServer.reset();
+    }
+
+    /**
+     * Returns the handle of the mailbox, or -1 if the database can't be opened
+     */
+    int searchServerOpenMailbox(const char * path) {
+      if(!searchServer) {
+        return -1;
+      }
+      try {
+        return searchServer->openMailbox(path);
+      } catch(const Xapian::Error &e) {
+        logAt(LOG_ERROR) << "Error: " << e.get_type() << " " << e.get_msg() << endl;
+        return -1;
+      }
+    }
+
+    /**
+     * Add a folder or single file partition to the mailbox
+     */
+    int searchServerAddPartition(int handle, const char * path) {
+      if(!searchServer) {
+        return 0;
+      }
+      try {
+        return searchServer->addPartition(handle, path) ? 1 : 0;
+      } catch(const Xapian::Error &e) {
+        logAt(LOG_ERROR) << "Error: " << e.get_type() << " " << e.get_msg() << endl;
+        return 0;
+      }
+    }
+
+    /**
+     * Same as setStringValueRange, for the queries of one mailbox
+     */
+    int searchServerSetValueRange(int handle, int valueRangeSlotNumber, const char * prefix) {
+      return searchServer && searchServer->setValueRange(handle, valueRangeSlotNumber, prefix) ? 1 : 0;
+    }
+
+    int searchServerCloseMailbox(int handle) {
+      return searchServer && searchServer->closeMailbox(handle) ? 1 : 0;
+    }
+
+    /**
+     * Queue a sorted query (same parameters as sortedXapianQueryArena). The callback is called
+     * from a worker thread with the result arena, or NULL on error. Returns 0 if not started.
+     */
+    int searchServerSubmitSortedQuery(int handle, const char * searchtext,
+            int sortvaluenum, bool reverse, int offset, int maxresults, int collapsevaluenum,
+            const int valueslots[], int numvalueslots,
+            SearchServer::ArenaCallback callback, void * userdata) {
+      if(!searchServer) {
+        return 0;
+      }
+      searchServer->submitSortedQuery(handle, searchtext, sortvaluenum, reverse, offset, maxresults,
+            collapsevaluenum, vector<int>(valueslots, valueslots + numvalueslots), callback, userdata);
+      return 1;
+    }
+
+    /**
+     * Blocking version of searchServerSubmitSortedQuery. Sets arena to a copy of the result
+     * arena, to be freed with searchServerFreeResult. Returns its length, or -1 on error.
+     */
+    int searchServerSortedQuery(int handle, const char * searchtext,
+            int sortvaluenum, bool reverse, int offset, int maxresults, int collapsevaluenum,
+            const int valueslots[], int numvalueslots, unsigned char ** arena) {
+      struct PendingResult {
+        mutex lock;
+        condition_variable done;
+        bool finished;
+        unsigned char * arena;
+        int length;
+
+        static void complete(void * userdata, const unsigned char * arena, int length) {
+          PendingResult * result = static_cast<PendingResult *>(userdata);
+          lock_guard<mutex> guard(result->lock);
+          if(arena != NULL) {
+            result->arena = static_cast<unsigned char *>(malloc(length));
+            memcpy(result->arena, arena, length);
+            result->length = length;
+          }
+          result->finished = true;
+          result->done.notify_one();
+        }
+      } result;
+      result.finished = false;
+      result.arena = NULL;
+      result.length = -1;
+
+      if(!searchServerSubmitSortedQuery(handle, searchtext, sortvaluenum, reverse, offset, maxresults,
+            collapsevaluenum, valueslots, numvalueslots, PendingResult::complete, &result)) {
+        return -1;
+      }
+      unique_lock<mutex> guard(result.lock);
+      result.done.wait(guard, [&result] { return result.finished; });
+      *arena = result.arena;
+      return result.length;
+    }
+
+    void searchServerFreeResult(unsigned char * arena) {
+      free(arena);
+    }
+}
+#endif
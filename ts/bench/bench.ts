@@ -0,0 +1,284 @@
+// --------- BEGIN RUNBOX LICENSE ---------
+// Copyright (C) 2016-2018 Runbox Solutions AS (runbox.com).
+// 
+// This file is part of Runbox 7.
+// 
+// Runbox 7 is free software: You can redistribute it and/or modify it
+// under the terms of the GNU General Public License as published by the
+// Free Software Foundation, either version 3 of the License, or (at your
+// option) any later version.
+// 
+// Runbox 7 is distributed in the hope that it will be useful, but
+// WITHOUT ANY WARRANTY; without even the implied warranty of
+// MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE. See the GNU
+// General Public License for more details.
+// 
+// You should have received a copy of the GNU General Public License
+// along with Runbox 7. If not, see <https://www.gnu.org/licenses/>.
+// ---------- END RUNBOX LICENSE ----------
+
+/**
+ * Benchmarks for indexing, querying and mutations on synthetic mailboxes.
+ *
+ * npm run bench -- --sizes=10000,100000,1000000 --seed=1 --output=bench.json
+ *
+ * Indexing options: --language=english --maxbodybytes=4096 --strip=true (quoted text and signatures)
+ * --snippetbytes=300 (body text kept for snippets)
+ *
+ * Results are written as JSON to the output file, or to stdout if not given (progress goes to stderr).
+ */
+
+import { writeFileSync } from 'fs';
+
+import { loadXapian } from '../xapian/xapian.loader';
+import { XapianAPI, IndexingOptions } from '../xapian/rmmxapianapi';
+import { IndexingTools, MessageInfo } from '../xapian/messageinfo';
+import { MailboxGenerator, FOLDERS } from './mailboxgenerator';
+
+declare var FS, MEMFS;
+
+const INDEXING_BATCH_SIZE = 1000;
+const MESSAGES_PER_COMMIT = 10000;
+const MUTATION_RUNS = 200;
+const BULK_MUTATION_RUNS = 20;
+const BULK_SELECTION_SIZE = 100;
+
+const QUERY_CACHE_SIZE = 64;
+const TYPED_QUERY = 'meeting budget';
+
+const QUERIES: { name: string, query: string, collapse?: number }[] = [
+    { name: 'partialPrefix', query: 'wea' },
+    { name: 'twoWordsPartialPrefix', query: 'meeting bud' },
+    { name: 'folder', query: 'folder:"Inbox"' },
+    { name: 'flag', query: 'flag:flagged' },
+    { name: 'unreadInFolder', query: 'folder:"Inbox" AND NOT flag:seen' },
+    { name: 'dateRange', query: 'date:201801010000..201812312359' },
+    { name: 'collapseConversations', query: 'folder:"Inbox"', collapse: 1 }
+];
+
+interface LatencySummary {
+    count: number;
+    meanMs: number;
+    p50Ms: number;
+    p99Ms: number;
+    maxMs: number;
+}
+
+function argument(name: string, defaultValue: string): string {
+    const prefix = `--${name}=`;
+    const arg = process.argv.find(a => a.indexOf(prefix) === 0);
+    return arg ? arg.substr(prefix.length) : defaultValue;
+}
+
+function now(): number {
+    const time = process.hrtime();
+    return time[0] * 1000 + time[1] / 1000000;
+}
+
+function measure(fn: () => void): number {
+    const start = now();
+    fn();
+    return now() - start;
+}
+
+function summarize(samples: number[]): LatencySummary {
+    const sorted = samples.slice().sort((a, b) => a - b);
+    const percentile = (p: number) => sorted.length > 0 ?
+        sorted[Math.min(sorted.length - 1, Math.ceil(p * sorted.length) - 1)] : 0;
+    return {
+        count: sorted.length,
+        meanMs: sorted.length > 0 ? sorted.reduce((sum, sample) => sum + sample, 0) / sorted.length : 0,
+        p50Ms: percentile(0.5),
+        p99Ms: percentile(0.99),
+        maxMs: sorted.length > 0 ? sorted[sorted.length - 1] : 0
+    };
+}
+
+function progress(...args: any[]) {
+    console.error(...args);
+}
+
+function benchmarkMailbox(size: number, seed: number, queryRuns: number, indexingOptions: IndexingOptions) {
+    const directory = `/bench${size}`;
+    FS.mkdir(directory);
+    FS.mount(MEMFS, {}, directory);
+    FS.chdir(directory);
+
+    const xapian = new XapianAPI();
+    const indexer = new IndexingTools(xapian);
+    const generator = new MailboxGenerator(seed);
+
+    xapian.resetIndexMetrics();
+    xapian.initXapianIndex('benchpartition');
+    xapian.setStringValueRange(2, 'date:');
+    xapian.configureIndexing(indexingOptions);
+
+    progress(`Indexing ${size} messages`);
+    const commitSamples: number[] = [];
+    let indexingMs = 0;
+    for (let firstId = 1; firstId <= size; firstId += INDEXING_BATCH_SIZE) {
+        const batch: MessageInfo[] = [];
+        for (let id = firstId; id < firstId + INDEXING_BATCH_SIZE && id <= size; id++) {
+            batch.push(generator.createMessage(id, generator.messageDate(id, size)));
+        }
+        indexingMs += measure(() => indexer.addMessagesToIndex(batch));
+
+        const indexed = firstId + batch.length - 1;
+        if (indexed % MESSAGES_PER_COMMIT === 0 || indexed === size) {
+            commitSamples.push(measure(() => xapian.commitXapianUpdates()));
+            progress(`  ${indexed} of ${size}`);
+        }
+    }
+    const commitMs = commitSamples.reduce((sum, sample) => sum + sample, 0);
+
+    progress('Querying');
+    const queries = {};
+    QUERIES.forEach(q => {
+        const samples: number[] = [];
+        let matches = 0;
+        for (let n = 0; n < queryRuns; n++) {
+            samples.push(measure(() => {
+                matches = xapian.sortedXapianQuery(q.query, 2, 1, 0, 100,
+                    q.collapse !== undefined ? q.collapse : -1).length;
+            }));
+        }
+        queries[q.name] = Object.assign({ query: q.query, firstPageMatches: matches }, summarize(samples));
+    });
+
+    progress('Searching as you type');
+    const keystrokes: string[] = [];
+    for (let n = 1; n <= TYPED_QUERY.length; n++) {
+        keystrokes.push(TYPED_QUERY.substring(0, n));
+    }
+    const typeQueries = (): number[] => {
+        const samples: number[] = [];
+        for (let n = 0; n < queryRuns; n++) {
+            keystrokes.forEach(q => samples.push(measure(() => xapian.sortedXapianQuery(q, 2, 1, 0, 100, -1))));
+        }
+        return samples;
+    };
+    xapian.setQueryCacheSize(0);
+    const uncachedKeystrokes = typeQueries();
+    xapian.setQueryCacheSize(QUERY_CACHE_SIZE);
+    const cachedKeystrokes = typeQueries();
+    const searchAsYouType = {
+        typed: TYPED_QUERY,
+        withoutQueryCache: summarize(uncachedKeystrokes),
+        withQueryCache: summarize(cachedKeystrokes),
+        queryCache: xapian.getQueryCacheStats()
+    };
+
+    progress('Counting folder messages');
+    const folderCounterSamples: number[] = [];
+    const folderQuerySamples: number[] = [];
+    for (let n = 0; n < queryRuns; n++) {
+        FOLDERS.forEach(folder => {
+            folderCounterSamples.push(measure(() => xapian.getFolderMessageCounts(folder)));
+            folderQuerySamples.push(measure(() => {
+                xapian.sortedXapianQuery(`folder:"${folder}"`, 0, 0, 0, size, -1);
+                xapian.sortedXapianQuery(`folder:"${folder}" AND NOT flag:seen`, 0, 0, 0, size, -1);
+            }));
+        });
+    }
+    const folderCounts = {
+        counters: summarize(folderCounterSamples),
+        sortedQueries: summarize(folderQuerySamples)
+    };
+
+    progress('Mutating');
+    const randomId = () => 1 + generator.randomInt(size);
+    const randomSelection = () => {
+        const ids: number[] = [];
+        for (let n = 0; n < BULK_SELECTION_SIZE; n++) {
+            ids.push(randomId());
+        }
+        return ids;
+    };
+
+    const flagSamples: number[] = [];
+    const moveSamples: number[] = [];
+    for (let n = 0; n < MUTATION_RUNS; n++) {
+        const id = randomId();
+        flagSamples.push(measure(() => indexer.flagMessage(id, n % 2 === 0)));
+        moveSamples.push(measure(() => xapian.changeDocumentsFolder('Q' + id, generator.pick(FOLDERS))));
+    }
+    const bulkFlagSamples: number[] = [];
+    const bulkMoveSamples: number[] = [];
+    for (let n = 0; n < BULK_MUTATION_RUNS; n++) {
+        const ids = randomSelection();
+        bulkFlagSamples.push(measure(() => indexer.markMessagesSeen(ids, n % 2 === 0)));
+        bulkMoveSamples.push(measure(() => indexer.moveMessagesToFolder(ids, generator.pick(FOLDERS))));
+    }
+    const mutationCommitMs = measure(() => xapian.commitXapianUpdates());
+
+    progress('Compacting');
+    const compactMs = measure(() => xapian.compactDatabase());
+    const compactBytes = FS.stat('xapianglasscompact').size;
+    FS.unlink('xapianglasscompact');
+
+    const result = {
+        messages: size,
+        indexing: {
+            totalMs: indexingMs,
+            messagesPerSecond: size / (indexingMs / 1000),
+            messagesPerSecondIncludingCommits: size / ((indexingMs + commitMs) / 1000),
+            options: indexingOptions
+        },
+        commit: summarize(commitSamples),
+        queries: queries,
+        searchAsYouType: searchAsYouType,
+        folderCounts: folderCounts,
+        flagToggle: summarize(flagSamples),
+        folderMove: summarize(moveSamples),
+        bulkSeenToggle: Object.assign({ messagesPerCall: BULK_SELECTION_SIZE }, summarize(bulkFlagSamples)),
+        bulkFolderMove: Object.assign({ messagesPerCall: BULK_SELECTION_SIZE }, summarize(bulkMoveSamples)),
+        mutationCommitMs: mutationCommitMs,
+        compaction: {
+            totalMs: compactMs,
+            bytes: compactBytes,
+            bytesPerMessage: compactBytes / size
+        },
+        indexMetrics: xapian.getIndexMetrics()
+    };
+
+    xapian.closeXapianDatabase();
+    FS.chdir('/');
+    FS.unmount(directory);
+    return result;
+}
+
+const sizes = argument('sizes', '10000').split(',').map(size => parseInt(size, 10));
+const seed = parseInt(argument('seed', '1'), 10);
+const queryRuns = parseInt(argument('queryruns', '50'), 10);
+const output = argument('output', '');
+const strip = argument('strip', 'false') === 'true';
+const indexingOptions: IndexingOptions = {
+    language: argument('language', ''),
+    maxBodyBytes: parseInt(argument('maxbodybytes', '0'), 10),
+    stripQuoted: strip,
+    stripSignature: strip,
+    snippetBytes: parseInt(argument('snippetbytes', '0'), 10)
+};
+
+loadXapian().subscribe(() => {
+    const xapian = new XapianAPI();
+    xapian.setLogLevel(1);
+
+    const report = {
+        benchmark: 'runbox-searchindex',
+        version: require('../../package.json').version,
+        node: process.version,
+        date: new Date().toJSON(),
+        seed: seed,
+        queryRuns: queryRuns,
+        results: sizes.map(size => benchmarkMailbox(size, seed, queryRuns, indexingOptions))
+    };
+
+    const json = JSON.stringify(report, null, 2);
+    if (output) {
+        writeFileSync(output, json);
+        progress(`Results written to ${output}`);
+    } else {
+        process.stdout.write(json + '\n');
+    }
+});
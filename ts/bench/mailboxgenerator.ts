@@ -0,0 +1,106 @@
+// --------- BEGIN RUNBOX LICENSE ---------
+// Copyright (C) 2016-2018 Runbox Solutions AS (runbox.com).
+// 
+// This file is part of Runbox 7.
+// 
+// Runbox 7 is free software: You can redistribute it and/or modify it
+// under the terms of the GNU General Public License as published by the
+// Free Software Foundation, either version 3 of the License, or (at your
+// option) any later version.
+// 
+// Runbox 7 is distributed in the hope that it will be useful, but
+// WITHOUT ANY WARRANTY; without even the implied warranty of
+// MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE. See the GNU
+// General Public License for more details.
+// 
+// You should have received a copy of the GNU General Public License
+// along with Runbox 7. If not, see <https://www.gnu.org/licenses/>.
+// ---------- END RUNBOX LICENSE ----------
+
+import { MessageInfo } from '../xapian/messageinfo';
+import { MailAddressInfo } from '../xapian/mailaddressinfo';
+
+const words = [
+    'weather', 'meeting', 'invoice', 'holiday', 'project', 'report', 'budget', 'summer',
+    'release', 'dinner', 'contract', 'update', 'review', 'schedule', 'question', 'payment',
+    'travel', 'ticket', 'newsletter', 'family', 'photos', 'birthday', 'server', 'backup',
+    'kunne', 'været', 'nårsk', 'bedre', 'møte', 'faktura', 'ferie', 'prosjekt'
+];
+
+const names = [
+    'Alice', 'Bob', 'Carol', 'Dave', 'Eve', 'Frank', 'Grace', 'Heidi',
+    'Ivan', 'Judy', 'Mallory', 'Niaj', 'Olivia', 'Peggy', 'Rupert', 'Sybil'
+];
+
+export const FOLDERS = ['Inbox', 'Sent', 'Drafts', 'Archive', 'Lists', 'Work', 'Family', 'Trash'];
+
+const FIRST_MESSAGE_DATE = Date.UTC(2016, 0, 1);
+const MAILBOX_TIMESPAN = 5 * 365 * 24 * 60 * 60 * 1000;
+
+/**
+ * Generates the same synthetic mailbox for the same seed, so that benchmark runs are comparable
+ */
+export class MailboxGenerator {
+    private state: number;
+
+    constructor(seed: number) {
+        this.state = seed >>> 0;
+    }
+
+    /**
+     * Pseudo random number in [0, 1) (mulberry32)
+     */
+    public random(): number {
+        // tslint:disable:no-bitwise
+        let t = (this.state = (this.state + 0x6D2B79F5) >>> 0);
+        t = Math.imul(t ^ (t >>> 15), t | 1);
+        t ^= t + Math.imul(t ^ (t >>> 7), t | 61);
+        return ((t ^ (t >>> 14)) >>> 0) / 4294967296;
+        // tslint:enable:no-bitwise
+    }
+
+    public randomInt(max: number): number {
+        return Math.floor(this.random() * max);
+    }
+
+    public pick<T>(values: T[]): T {
+        return values[this.randomInt(values.length)];
+    }
+
+    /**
+     * Date of message id in a mailbox of count messages, ordered by id and spread over five years
+     */
+    public messageDate(id: number, count: number): Date {
+        return new Date(FIRST_MESSAGE_DATE + Math.floor(MAILBOX_TIMESPAN * id / count));
+    }
+
+    public createMessage(id: number, date: Date): MessageInfo {
+        const sender = this.pick(names);
+        const recipient = this.pick(names);
+        // A limited number of subjects per mailbox, so that conversations have several messages
+        const subject = (this.random() < 0.3 ? 'Re: ' : '') +
+            this.pick(words) + ' ' + this.pick(words) + ' ' + this.randomInt(20);
+
+        const numWords = 20 + this.randomInt(200);
+        const text: string[] = new Array(numWords);
+        for (let n = 0; n < numWords; n++) {
+            text[n] = this.pick(words);
+        }
+
+        return new MessageInfo(id,
+            date,
+            date,
+            this.pick(FOLDERS),
+            this.random() < 0.8,
+            this.random() < 0.1,
+            this.random() < 0.05,
+            [new MailAddressInfo(sender, sender.toLowerCase() + '@example.com')],
+            [new MailAddressInfo(recipient, recipient.toLowerCase() + '@example.com')],
+            [],
+            [],
+            subject,
+            text.join(' '),
+            1000 + this.randomInt(100000),
+            this.random() < 0.15);
+    }
+}
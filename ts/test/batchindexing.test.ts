@@ -0,0 +1,113 @@
+import { suite, test, timeout } from "@testdeck/mocha";
+import { equal } from 'assert';
+
+import { loadXapian } from '../xapian/xapian.loader';
+import { XapianAPI } from '../xapian/rmmxapianapi';
+import { IndexingTools, MessageInfo } from '../xapian/messageinfo';
+import { MailAddressInfo } from '../xapian/mailaddressinfo';
+
+declare var FS, MEMFS;
+
+const subjects = [
+    'Weather1',
+    'Weather2',
+    'Weather3',
+    'ÆØÅ nårsk',
+    'Subject to be removed'
+];
+
+const contents = [
+    'Sun is shining',
+    'Cloudy',
+    'A foggy day',
+    'Været kunne vært bedre',
+    'DeleteTest - this is a test'
+];
+
+const totalMessages = 5000;
+
+/**
+ * Adding messages to the index in batches
+ */
+@suite export class BatchIndexingTest {
+    static messages: MessageInfo[] = [];
+
+    static before(done) {
+        loadXapian().subscribe(() => {
+            FS.mkdir("/batchindexingtest");
+            FS.mount(MEMFS, {},"/batchindexingtest");
+            FS.chdir("/batchindexingtest");
+            done();
+        });
+    }
+
+    @test() createIndex() {
+        const xapian = new XapianAPI();
+        xapian.initXapianIndex('batchpartition');
+
+        for(let id = 1; id <= totalMessages; id++) {
+            BatchIndexingTest.messages.push(new MessageInfo(id, new Date(id * 6 * 60 * 60 * 1000),
+                new Date(id * 6 * 60 * 60 * 1000),
+                id % 2 === 0 ? 'Inbox' : 'Archive',
+                id % 3 === 0,
+                false,
+                id % 7 === 0,
+                [new MailAddressInfo('Sender', 'sender@runbox.com')],
+                [new MailAddressInfo('Receiver', 'receiver@runbox.com')],
+                [new MailAddressInfo('Copy receiver', 'cc@runbox.com')],
+                [],
+                subjects[id % subjects.length],
+                contents[id % contents.length],
+                100 + id,
+                false));
+        }
+    }
+
+    @test(timeout(30000)) addMessagesInBatches() {
+        const xapian = new XapianAPI();
+        const indexer: IndexingTools = new IndexingTools(xapian);
+        const batchSize = 1000;
+        for (let n = 0; n < BatchIndexingTest.messages.length; n += batchSize) {
+            const added = indexer.addMessagesToIndex(BatchIndexingTest.messages.slice(n, n + batchSize));
+            equal(added, Math.min(batchSize, BatchIndexingTest.messages.length - n));
+        }
+        xapian.commitXapianUpdates();
+        equal(xapian.getXapianDocCount(), totalMessages);
+    }
+
+    @test() searchBatchIndexedMessages() {
+        const xapian = new XapianAPI();
+        const messages = BatchIndexingTest.messages;
+
+        equal(xapian.sortedXapianQuery('folder:"Inbox"', 0, 0, 0, 100000, -1).length,
+            messages.filter(m => m.folder === 'Inbox').length);
+        equal(xapian.sortedXapianQuery('flag:seen', 0, 0, 0, 100000, -1).length,
+            messages.filter(m => m.seenFlag).length);
+        equal(xapian.sortedXapianQuery('flag:flagged', 0, 0, 0, 100000, -1).length,
+            messages.filter(m => m.flaggedFlag).length);
+        equal(xapian.sortedXapianQuery('to:cc@runbox.com', 0, 0, 0, 100000, -1).length,
+            messages.length);
+
+        const results = xapian.sortedXapianQuery('Været', 0, 0, 0, 20, -1);
+        equal(results.length, 20);
+        results.forEach((r) => {
+            const dparts = xapian.getDocumentData(r[0]).split('\t');
+            const id = parseInt(dparts[0].substring(1), 10);
+            equal(dparts[2], messages[id - 1].subject);
+            equal(xapian.getNumericValue(r[0], 3), messages[id - 1].size);
+        });
+    }
+
+    @test() replaceExistingMessagesInBatch() {
+        const xapian = new XapianAPI();
+        const indexer: IndexingTools = new IndexingTools(xapian);
+        const moved = BatchIndexingTest.messages.slice(0, 100);
+        moved.forEach(m => m.folder = 'Moved');
+        equal(indexer.addMessagesToIndex(moved), moved.length);
+        xapian.commitXapianUpdates();
+
+        equal(xapian.getXapianDocCount(), totalMessages);
+        equal(xapian.sortedXapianQuery('folder:"Moved"', 0, 0, 0, 100000, -1).length, moved.length);
+        xapian.closeXapianDatabase();
+    }
+}
@@ -109,6 +109,20 @@ const contents = [
         equal(99, results.length);
     }
     
+    @test() uniqueTermRouting() {
+        const xapian = new XapianAPI();
+        const before = xapian.getUniqueTermRoutingStats();
+
+        // The added partition is loaded into the routing table on first lookup
+        xapian.changeDocumentsFolder('Q250', 'Mainpartition');
+        xapian.changeDocumentsFolder('Q50', 'Otherpartition');
+        const after = xapian.getUniqueTermRoutingStats();
+        equal(199, after.routedTerms);
+        equal(before.hits + 2, after.hits);
+        equal(before.misses, after.misses);
+        equal(before.partitionLoads + 1, after.partitionLoads);
+    }
+    
     @test() changeFoldersInMainPartition() {        
         const xapian = new XapianAPI();
         let results = xapian.sortedXapianQuery(`folder:"Mainpartition"`, 0, 0, 0, 100000, -1);
@@ -145,4 +159,243 @@ const contents = [
        equal(99, results.length);       
     }
 
+    @test() bulkUpdateAcrossPartitions() {
+        const xapian = new XapianAPI();
+        const indexer : IndexingTools = new IndexingTools(xapian);
+        const selection = [10, 20, 30, 210, 220, 99999];
+
+        equal(5, indexer.markMessagesSeen(selection, true));
+        equal(0, indexer.markMessagesSeen(selection, true));
+        equal(5, xapian.sortedXapianQuery(`flag:seen`, 0, 0, 0, 100000, -1).length);
+        equal(98, xapian.sortedXapianQuery(`unreadfolder:"Mainpartitionchanged"`, 0, 0, 0, 100000, -1).length);
+
+        equal(5, indexer.flagMessages(selection, true));
+        equal(2, indexer.flagMessages([10, 210], false));
+        equal(3, xapian.sortedXapianQuery(`flag:flagged`, 0, 0, 0, 100000, -1).length);
+
+        equal(5, indexer.moveMessagesToFolder(selection, 'Selected'));
+        equal(5, xapian.sortedXapianQuery(`folder:"Selected"`, 0, 0, 0, 100000, -1).length);
+
+        equal(2, indexer.markMessagesSeen([10, 210], false));
+        equal(2, xapian.sortedXapianQuery(`unreadfolder:"Selected"`, 0, 0, 0, 100000, -1).length);
+        xapian.commitXapianUpdates();
+
+        const stats = xapian.getAllFolderStats().find(f => f.folder === 'Selected');
+        equal(5, stats.total);
+        equal(2, stats.unread);
+        equal(3, stats.flagged);
+    }
+
+    @test() deleteAcrossPartitions() {
+        const xapian = new XapianAPI();
+        const indexer : IndexingTools = new IndexingTools(xapian);
+        const docCount = xapian.getXapianDocCount();
+
+        // Left out right away, and removed from the partitions on commit
+        equal(3, indexer.deleteMessages([10, 210, 220, 99999]));
+        equal(0, indexer.deleteMessages([10]));
+        equal(3, xapian.getTombstoneCount());
+        equal(docCount - 3, xapian.getXapianDocCount());
+        equal(false, xapian.hasMessageId(210));
+        equal(2, xapian.sortedXapianQuery(`folder:"Selected"`, 0, 0, 0, 100000, -1).length);
+        equal(2, xapian.sortedXapianQuery(`folder:"Selected" AND weather1`, 0, 0, 0, 100000, -1).length);
+        equal(2, xapian.getFolderMessageCounts('Selected')[0]);
+
+        // Added again before the commit, in place of the deleted document
+        indexer.addMessageToIndex(new MessageInfo(210, new Date(210 * 6 * 60 * 60 * 1000),
+            new Date(210 * 6 * 60 * 60 * 1000),
+            'Selected',
+            false,
+            false,
+            false,
+            [new MailAddressInfo('Sender', 'sender@runbox.com')],
+            [new MailAddressInfo('Receiver', 'receiver@runbox.com')],
+            [],
+            [],
+            subjects[210 % contents.length],
+            contents[210 % contents.length],
+            100,
+            false));
+        equal(2, xapian.getTombstoneCount());
+        equal(true, xapian.hasMessageId(210));
+
+        xapian.commitXapianUpdates();
+        equal(0, xapian.getTombstoneCount());
+        equal(docCount - 2, xapian.getXapianDocCount());
+        equal(3, xapian.sortedXapianQuery(`folder:"Selected"`, 0, 0, 0, 100000, -1).length);
+        equal(3, xapian.getFolderMessageCounts('Selected')[0]);
+    }
+
+    @test() lazyPartitions() {
+        const xapian = new XapianAPI();
+        const indexer : IndexingTools = new IndexingTools(xapian);
+        const createMessage = (id: number, folder: string) => new MessageInfo(id,
+                new Date(id * 6 * 60 * 60 * 1000),
+                new Date(id * 6 * 60 * 60 * 1000),
+                folder,
+                false,
+                false,
+                false,
+                [new MailAddressInfo('Sender', 'sender@runbox.com')],
+                [new MailAddressInfo('Receiver', 'receiver@runbox.com')],
+                [],
+                [],
+                subjects[id % contents.length],
+                contents[id % contents.length],
+                100,
+                false);
+
+        ['Archive2019', 'Archive2020'].forEach((folder, ndx) => {
+            xapian.initXapianIndex(folder.toLowerCase());
+            for(let id = 1000 * (ndx + 1); id < 1000 * (ndx + 1) + 10; id++) {
+                indexer.addMessageToIndex(createMessage(id, folder));
+            }
+            xapian.commitXapianUpdates();
+            xapian.compactDatabase();
+            xapian.closeXapianDatabase();
+            FS.rename('xapianglasscompact', folder.toLowerCase() + '.singlefile');
+        });
+
+        xapian.initXapianIndex('lazymainpartition');
+        for(let id = 1; id <= 5; id++) {
+            indexer.addMessageToIndex(createMessage(id, 'Inbox'));
+        }
+        xapian.registerLazyPartition('archive2019.singlefile', 'Archive2019', 0);
+        xapian.registerDownloadablePartition('archive2020.singlefile', {
+            folder: 'Archive2020',
+            numberOfMessages: 10,
+            files: [{ filename: 'archive2020.singlefile', compressedsize: 1, uncompressedsize: 1 }]
+        });
+
+        const inbox = xapian.sortedXapianQuery(`folder:"Inbox"`, 0, 0, 0, 100000, -1);
+        equal(5, inbox.length);
+        const inboxData = inbox.map(row => xapian.getDocumentData(row[0]));
+        equal(0, xapian.getLazyPartitionStats().attached);
+
+        // Folder counts include partitions that aren't attached
+        equal(10, xapian.getFolderMessageCounts('Archive2020')[0]);
+        equal(5, xapian.getFolderMessageCounts('Inbox')[0]);
+        equal(0, xapian.getLazyPartitionStats().attached);
+
+        equal(10, xapian.sortedXapianQuery(`folder:"Archive2019"`, 0, 0, 0, 100000, -1).length);
+        equal(1, xapian.getLazyPartitionStats().attached);
+
+        // Only the partition used by the current query fits the budget
+        xapian.setPartitionMemoryBudget(1);
+        equal(10, xapian.sortedXapianQuery(`folder:"Archive2020"`, 0, 0, 0, 100000, -1).length);
+        let stats = xapian.getLazyPartitionStats();
+        equal(1, stats.attached);
+        equal(1, stats.detaches);
+
+        // An unrestricted query needs every partition, regardless of the budget
+        equal(25, xapian.sortedXapianQuery('', 0, 0, 0, 100000, -1).length);
+        stats = xapian.getLazyPartitionStats();
+        equal(2, stats.registered);
+        equal(2, stats.attached);
+        equal(3, stats.attaches);
+
+        // Attaching and detaching partitions doesn't change the docids of other messages
+        equal(inboxData.join('\n'), inbox.map(row => xapian.getDocumentData(row[0])).join('\n'));
+        equal(10, xapian.getFolderMessageCounts('Archive2019')[0]);
+
+        // The empty shard in place of detached partitions is temporary, not next to the index
+        const emptyPartitions = () => FS.readdir('/tmp').filter(name => name.indexOf('emptypartition') === 0).length;
+        equal(1, emptyPartitions());
+        xapian.closeXapianDatabase();
+        equal(0, emptyPartitions());
+        equal(false, FS.analyzePath('lazymainpartition.emptypartition').exists);
+    }
+
+    @test() parallelPartitionSearch() {
+        const xapian = new XapianAPI();
+        const indexer : IndexingTools = new IndexingTools(xapian);
+        const folders = ['Parallelinbox', 'Parallelarchive1', 'Parallelarchive2'];
+
+        folders.forEach((folder, ndx) => {
+            xapian.initXapianIndex(folder.toLowerCase());
+            for(let id = 3000 + ndx; id < 3090; id += folders.length) {
+                indexer.addMessageToIndex(new MessageInfo(id,
+                    new Date(id * 6 * 60 * 60 * 1000),
+                    new Date(id * 6 * 60 * 60 * 1000),
+                    folder,
+                    false,
+                    false,
+                    false,
+                    [new MailAddressInfo('Sender', 'sender@runbox.com')],
+                    [new MailAddressInfo('Receiver', 'receiver@runbox.com')],
+                    [],
+                    [],
+                    subjects[id % contents.length],
+                    contents[id % contents.length],
+                    100,
+                    false));
+            }
+            xapian.commitXapianUpdates();
+            if (ndx < folders.length - 1) {
+                xapian.closeXapianDatabase();
+            }
+        });
+        xapian.addFolderXapianIndex('parallelinbox');
+        xapian.addFolderXapianIndex('parallelarchive1');
+
+        const queries: [string, number, number, number, number, number][] = [
+            ['', 2, 0, 0, 100000, -1],
+            ['', 2, 1, 0, 100000, -1],
+            ['', 2, 1, 10, 25, -1],
+            ['weather1', 2, 0, 3, 5, -1],
+            ['folder:"Parallelarchive1" OR folder:"Parallelarchive2"', 2, 1, 0, 40, -1],
+            ['', 2, 1, 0, 100000, 0] // Same sender in every partition, collapsed to one row
+        ];
+        // Sort with Xapian rather than the value slot cache
+        xapian.setCachedValueSlots([]);
+        // Rows of the result arena with values and document data, which the parallel search reads from the partitions
+        const arenaRows = (q: [string, number, number, number, number, number]) => {
+            const arena = xapian.sortedXapianQueryArena(q[0], q[1], q[2], q[3], q[4], q[5], [0, 2]);
+            const rows: string[] = [];
+            for (let row = 0; row < arena.length; row++) {
+                rows.push([arena.getDocId(row), arena.getCollapseCount(row), arena.getValue(row, 0), arena.getValue(row, 1)]
+                    .concat(arena.getDataFields(row)).join('\t'));
+            }
+            return rows.join('\n');
+        };
+        const sequentialResults = queries.map(q => xapian.sortedXapianQuery(...q));
+        const sequentialArenas = queries.map(arenaRows);
+        equal(90, sequentialResults[0].length);
+        equal(1, sequentialResults[5].length);
+
+        if (!xapian.setParallelPartitionSearch(2)) {
+            console.log('Not built with threads, parallel partition search not tested');
+            xapian.setCachedValueSlots([0, 1, 2, 3, 4]);
+            xapian.closeXapianDatabase();
+            return;
+        }
+        xapian.resetIndexMetrics();
+        queries.forEach((q, ndx) =>
+            equal(sequentialResults[ndx].join(','), xapian.sortedXapianQuery(...q).join(','), q.join(' ')));
+        queries.forEach((q, ndx) => equal(sequentialArenas[ndx], arenaRows(q), q.join(' ')));
+        equal(2 * queries.length, xapian.getIndexMetrics().parallelQueries);
+
+        // Flag changes in the flag overlay and deletes not yet committed are seen by every partition
+        xapian.addTermToDocument('Q3004', 'XFseen');
+        xapian.deleteDocumentByUniqueTerm('Q3003');
+        const pendingQueries: [string, number, number, number, number, number][] = [
+            ['', 2, 0, 0, 100000, -1],
+            ['flag:seen', 2, 0, 0, 100000, -1],
+            ['weather1 AND NOT flag:seen', 2, 1, 0, 100000, -1],
+            ['', 2, 1, 0, 100000, 0]
+        ];
+        xapian.setParallelPartitionSearch(0);
+        const pendingArenas = pendingQueries.map(arenaRows);
+        equal(89, xapian.sortedXapianQuery('', 2, 0, 0, 100000, -1).length);
+        equal(1, xapian.sortedXapianQuery('flag:seen', 2, 0, 0, 100000, -1).length);
+        xapian.setParallelPartitionSearch(2);
+        xapian.resetIndexMetrics();
+        pendingQueries.forEach((q, ndx) => equal(pendingArenas[ndx], arenaRows(q), q.join(' ')));
+        equal(pendingQueries.length, xapian.getIndexMetrics().parallelQueries);
+
+        xapian.setParallelPartitionSearch(0);
+        xapian.setCachedValueSlots([0, 1, 2, 3, 4]);
+        xapian.closeXapianDatabase();
+    }
+
 }
@@ -49,10 +49,12 @@ let getDocIdFromUniqueIdTerm: (idterm: string) => number;
             FS.mount(MEMFS, {},"/modifydoctermstest");
             FS.chdir("/modifydoctermstest");
 
-            addTermToDocument = global['Module'].cwrap('addTermToDocument', null, ['string', 'string']);
-            removeTermFromDocument = global['Module'].cwrap('removeTermFromDocument', null, ['string', 'string']);
-            addTextToDocument = global['Module'].cwrap('addTextToDocument', null, ['string', 'boolean', 'string']);
-            getDocIdFromUniqueIdTerm = global['Module'].cwrap('getDocIdFromUniqueIdTerm', 'number', ['string']);
+            // The entry points of the index of handle 0
+            const xapian = new XapianAPI();
+            addTermToDocument = xapian.addTermToDocument;
+            removeTermFromDocument = xapian.removeTermFromDocument;
+            addTextToDocument = xapian.addTextToDocument;
+            getDocIdFromUniqueIdTerm = xapian.getDocIdFromUniqueIdTerm;
             done();
         });                        
     }
@@ -209,6 +211,54 @@ let getDocIdFromUniqueIdTerm: (idterm: string) => number;
         equal(0, results.length);       
     }
 
+    @test() flagOverlay() {
+        const xapian = new XapianAPI();
+        const idterms = xapian.sortedXapianQuery(`folder:"Mainpartition" OR folder:"Otherpartition"`, 0, 0, 0, 100000, -1)
+            .map(r => xapian.getDocumentData(r[0]).split('\t')[0]);
+        equal(199, idterms.length);
+        xapian.commitXapianUpdates();
+        equal(0, xapian.getFlagOverlaySize());
+        const unreadBefore = xapian.getFolderMessageCounts('Mainpartition')[1];
+        xapian.resetIndexMetrics();
+
+        // Flag changes are kept in the overlay, and seen by flag: queries and counts
+        idterms.forEach(idterm => addTermToDocument(idterm, 'XFseen'));
+        removeTermFromDocument(idterms[0], 'XFseen'); // Back to the document, no longer in the overlay
+        addTermToDocument(idterms[1], 'XFflagged');
+        equal(199, xapian.getFlagOverlaySize());
+        equal(201, xapian.getIndexMetrics().flagOverlayChanges);
+        equal(0, xapian.getIndexMetrics().flagOverlayWrites);
+        equal(198, xapian.sortedXapianQuery(`flag:seen`, 0, 0, 0, 100000, -1).length);
+        equal(1, xapian.sortedXapianQuery(`flag:flagged AND flag:seen`, 0, 0, 0, 100000, -1).length);
+        equal(1, xapian.sortedXapianQuery(`(folder:"Mainpartition" OR folder:"Otherpartition") AND NOT flag:seen`,
+            0, 0, 0, 100000, -1).length);
+
+        const docid = getDocIdFromUniqueIdTerm(idterms[1]);
+        xapian.documentXTermList(docid);
+        const termlistresult: string[] = global['Module']['documenttermlistresult'];
+        equal(1, termlistresult.filter(term => term === 'XFflagged').length);
+
+        // and persisted on commit, until there are more than the limit
+        xapian.commitXapianUpdates();
+        equal(199, xapian.getFlagOverlaySize());
+        xapian.setFlagOverlayLimit(100);
+        xapian.commitXapianUpdates();
+        equal(0, xapian.getFlagOverlaySize());
+        equal(198, xapian.getIndexMetrics().flagOverlayWrites);
+        equal(198, xapian.sortedXapianQuery(`flag:seen`, 0, 0, 0, 100000, -1).length);
+        equal(1, xapian.sortedXapianQuery(`flag:flagged AND flag:seen`, 0, 0, 0, 100000, -1).length);
+
+        idterms.forEach(idterm => removeTermFromDocument(idterm, 'XFseen'));
+        removeTermFromDocument(idterms[1], 'XFflagged');
+        equal(0, xapian.sortedXapianQuery(`flag:seen`, 0, 0, 0, 100000, -1).length);
+        xapian.setFlagOverlayLimit(0);
+        xapian.commitXapianUpdates();
+        equal(0, xapian.getFlagOverlaySize());
+        equal(0, xapian.sortedXapianQuery(`flag:flagged`, 0, 0, 0, 100000, -1).length);
+        equal(unreadBefore, xapian.getFolderMessageCounts('Mainpartition')[1]);
+        xapian.setFlagOverlayLimit(10000);
+    }
+
     @test() addTextInMainPartition() {        
         const xapian = new XapianAPI();
 
@@ -4,3 +4,5 @@ export { ModifyDocTermsTest  } from './modifydocterms.test';
 export { SearchTest          } from './search.test';
 export { MessageInfoTest     } from './messageinfo.test';
 export { MailAddressInfoTest } from './mailaddressinfo.test';
+export { BatchIndexingTest   } from './batchindexing.test';
+export { XapianIndexTest     } from './xapianindex.test';
@@ -5,7 +5,8 @@ import { existsSync, mkdirSync } from 'fs';
 import { execSync } from 'child_process';
 
 import { loadXapian } from '../xapian/xapian.loader';
-import { XapianAPI } from '../xapian/rmmxapianapi';
+import { XapianAPI, ScheduledWrite, DocumentField } from '../xapian/rmmxapianapi';
+import { DatabaseImporter, DatabaseTransferProgress } from '../xapian/databasetransfer';
 import { IndexingTools, MessageInfo } from '../xapian/messageinfo';
 import { MailAddressInfo } from '../xapian/mailaddressinfo';
 
@@ -120,8 +121,7 @@ const contents = [
 
     @test() getFolder() {
         const xapian = new XapianAPI();
-        const documentXTermList: (docid: number) => number = global['Module'].cwrap('documentXTermList', 'number', ['number']);
-        const termcount = documentXTermList(30);
+        const termcount = xapian.documentXTermList(30);
         
         global['Module']['documenttermlistresult']
         equal(global['Module']['documenttermlistresult'].length, 6);
@@ -149,6 +149,135 @@ const contents = [
         });
     }
 
+    @test() searchMessagesResultArena() {
+        const xapian = new XapianAPI();
+        const maxresults = 20;
+        const results = xapian.sortedXapianQuery('Været', 2, 1, 0, maxresults, 1);
+        const arena = xapian.sortedXapianQueryArena('Været', 2, 1, 0, maxresults, 1, [0, 2]);
+        equal(arena.length, results.length);
+        results.forEach((r, row) => {
+            equal(arena.getDocId(row), r[0]);
+            equal(arena.getCollapseCount(row), r[1]);
+            equal(arena.getValue(row, 0), xapian.getStringValue(r[0], 0));
+            equal(arena.getValue(row, 1), xapian.getStringValue(r[0], 2));
+
+            const fields = arena.getDataFields(row);
+            equal(fields.join('\t'), xapian.getDocumentData(r[0]));
+            const id = parseInt(fields[0].substring(1), 10);
+            equal(messagesById[id].subject, fields[2]);
+        });
+    }
+
+    @test() documentDataFields() {
+        const xapian = new XapianAPI();
+        const records = [
+            ['Q0', 'Ola Nordmann', 'Hei på deg', 'ola@example.com'],
+            ['Q18446744073709', 'kari@example.com', 'Sender is the address', 'kari@example.com'],
+            ['Q007', '', '', 'nobody@example.com'],
+            ['Qmsg-å', 'Per', 'Not a numeric id', 'per@example.com']
+        ];
+        records.forEach(record => xapian.addSortableEmailToXapianIndex(
+            record[0], record[1], record[1].toUpperCase(), record[3], [],
+            record[2], record[2].toUpperCase(), '202001010000', 100, 'documentdatafieldstest',
+            'Inbox', true, false, false, false));
+        xapian.commitXapianUpdates();
+
+        const results = xapian.sortedXapianQuery('documentdatafieldstest', 0, 0, 0, 10, -1);
+        equal(results.length, records.length);
+        results.forEach(r => {
+            const docid = r[0];
+            const record = records.find(rec => rec[0] === xapian.getDocumentField(docid, DocumentField.IdTerm));
+            ok(record);
+            equal(xapian.getDocumentData(docid), record.join('\t'));
+            equal(xapian.getDocumentField(docid, DocumentField.IdTerm), record[0]);
+            equal(xapian.getDocumentField(docid, DocumentField.From), record[1]);
+            equal(xapian.getDocumentField(docid, DocumentField.Subject), record[2]);
+            equal(xapian.getDocumentField(docid, DocumentField.FromEmailAddress), record[3]);
+        });
+        records.forEach(record => xapian.deleteDocumentByUniqueTerm(record[0]));
+        xapian.commitXapianUpdates();
+    }
+
+    @test() valueSlotCache() {
+        const xapian = new XapianAPI();
+        const queries: [string, number, number, number, number, number][] = [
+            ['', 2, 1, 0, 50, -1],
+            ['folder:"Inbox"', 2, 0, 100, 50, -1],
+            ['', 2, 1, 0, 10, 1] // Collapsed on the subject
+        ];
+
+        xapian.setCachedValueSlots([]);
+        const uncached = queries.map(q => xapian.sortedXapianQuery(...q));
+        const uncachedValues = uncached[0].map(r => xapian.getStringValue(r[0], 2));
+        xapian.setCachedValueSlots([0, 1, 2, 3, 4]);
+
+        xapian.resetIndexMetrics();
+        queries.forEach((q, ndx) => {
+            const results = xapian.sortedXapianQuery(...q);
+            equal(results.map(r => r[0]).join(','), uncached[ndx].map(r => r[0]).join(','), q.join(' '));
+        });
+        equal(queries.length, xapian.getIndexMetrics().cachedSortQueries);
+        equal(subjects.length, uncached[2].length);
+        equal(uncachedValues.join(','), uncached[0].map(r => xapian.getStringValue(r[0], 2)).join(','));
+
+        // Not a single term, so sorted by Xapian
+        xapian.sortedXapianQuery('Været', 2, 1, 0, 10, -1);
+        equal(queries.length, xapian.getIndexMetrics().cachedSortQueries);
+    }
+
+    @test() valueSlotCacheUpdates() {
+        const xapian = new XapianAPI();
+        const newest = () => xapian.sortedXapianQuery('', 2, 1, 0, 1, -1)[0][0];
+        const oldest = () => xapian.sortedXapianQuery('folder:"Inbox"', 2, 0, 0, 1, -1)[0][0];
+        const previousNewest = newest();
+        const previousOldest = oldest();
+        xapian.resetIndexMetrics();
+
+        // Added documents are sorted by the values they were indexed with
+        xapian.addSortableEmailToXapianIndex('Qvalueslotcache', 'Ola', 'OLA', 'ola@example.com', [],
+            'Value slot cache', 'VALUE SLOT CACHE', '209901011200', 100, 'value slot cache',
+            'Inbox', false, false, false, false);
+        const docid = xapian.getDocIdFromUniqueIdTerm('Qvalueslotcache');
+        equal(docid, newest());
+        equal('209901011200', xapian.getStringValue(docid, 2));
+
+        // setStringValue moves it
+        xapian.setStringValue(docid, 2, '000001011200');
+        equal(previousNewest, newest());
+        equal(docid, oldest());
+        equal('000001011200', xapian.getStringValue(docid, 2));
+
+        // Deleted documents are left out, before and after the commit
+        xapian.deleteDocumentByUniqueTerm('Qvalueslotcache');
+        equal(previousOldest, oldest());
+        xapian.commitXapianUpdates();
+        equal(previousOldest, oldest());
+        equal(previousNewest, newest());
+        equal(6, xapian.getIndexMetrics().cachedSortQueries);
+    }
+
+    @test() indexMetrics() {
+        const xapian = new XapianAPI();
+        xapian.resetIndexMetrics();
+        xapian.setLogLevel(0);
+
+        xapian.sortedXapianQuery(`folder:"Inbox"`, 2, 1, 0, 10, -1);
+        xapian.sortedXapianQuery(`folder:"Inbox"`, 2, 1, 10, 10, -1);
+        xapian.sortedXapianQuery(`subject:(unbalanced`, 2, 1, 0, 10, -1);
+        xapian.setLogLevel(3);
+
+        const metrics = xapian.getIndexMetrics();
+        const sortedQuery = metrics.entryPoints['sortedQuery'];
+        equal(3, sortedQuery.calls);
+        equal(3, sortedQuery.histogram.reduce((sum, count) => sum + count, 0));
+        ok(sortedQuery.maxMs <= sortedQuery.totalMs);
+        equal(undefined, metrics.entryPoints['commit']);
+        equal(0, metrics.documentsIndexed);
+
+        xapian.resetIndexMetrics();
+        equal(undefined, xapian.getIndexMetrics().entryPoints['sortedQuery']);
+    }
+
     @test(timeout(10000)) moveMessages() {
         const xapian = new XapianAPI();
 
@@ -199,29 +328,232 @@ const contents = [
         equal(fastTotal, sortedTotal);
     }
 
-    @test(timeout(10000)) folderMessageCounterBenchmark() {
+    @test() allFolderStats() {
         const xapian = new XapianAPI();
-        const iterations = 1_000;
+        const stats = xapian.getAllFolderStats();
+        const folders = xapian.listFolders();
+        equal(stats.length, folders.length);
+
+        stats.forEach((folderStats) => {
+            const folderQuery = `folder:"${folderStats.folder}"`;
+            equal(folderStats.total, xapian.sortedXapianQuery(folderQuery, 0, 0, 0, 100000, -1).length);
+            equal(folderStats.unread, xapian.sortedXapianQuery(`${folderQuery} AND NOT flag:seen`, 0, 0, 0, 100000, -1).length);
+            equal(folderStats.flagged, xapian.sortedXapianQuery(`${folderQuery} AND flag:flagged`, 0, 0, 0, 100000, -1).length);
+        });
 
-        console.log("Checking using sortedXapianQuery...");
-        const timestamp = (): number => (new Date()).getTime();
-        let t1 = timestamp();
-        for (let i = 0; i < iterations; i++) {
-            xapian.sortedXapianQuery(`folder:"Testfolder" AND NOT flag:seen`, 0, 0, 0, 100000, -1).length;
-            xapian.sortedXapianQuery(`folder:"Testfolder"`, 0, 0, 0, 100000, -1).length;
-        }
+        // Counters are kept up to date when flags change
+        const [total, unread] = xapian.getFolderMessageCounts('Inbox');
+        const inboxUnread = xapian.sortedXapianQuery(`folder:"Inbox" AND NOT flag:seen`, 0, 0, 0, 1, -1);
+        const idterm = xapian.getDocumentData(inboxUnread[0][0]).split('\t')[0];
+        xapian.addTermToDocument(idterm, 'XFseen');
+        equal(xapian.getFolderMessageCounts('Inbox')[0], total);
+        equal(xapian.getFolderMessageCounts('Inbox')[1], unread - 1);
+        xapian.removeTermFromDocument(idterm, 'XFseen');
+        equal(xapian.getFolderMessageCounts('Inbox')[1], unread);
+    }
 
-        const sortedQueryTime = timestamp() - t1;
-        console.log(`sortedXapianQuery runtime: ${sortedQueryTime}ms (${sortedQueryTime / iterations}ms per query)`);
+    @test() threadIndex() {
+        const xapian = new XapianAPI();
+        const collapsed = xapian.sortedXapianQuery('', 2, 1, 0, 100000, 1);
+        const threadList = xapian.listThreads('', 0, 100000);
+        equal(threadList.totalThreads, collapsed.length);
+        equal(threadList.threads.length, collapsed.length);
+        threadList.threads.forEach((thread, ndx) => {
+            equal(thread.docid, collapsed[ndx][0]);
+            equal(thread.latestDate, xapian.getStringValue(thread.docid, 2));
+            ok(thread.messages >= collapsed[ndx][1]);
+
+            const threadMessages = xapian.getThreadMessages(thread.docid);
+            equal(threadMessages.length, thread.messages);
+            equal(xapian.getStringValue(threadMessages[threadMessages.length - 1], 2), thread.latestDate);
+            equal(xapian.getThreadCounts(threadMessages[0]).unread, thread.unread);
+        });
+        equal(threadList.threads.reduce((sum, thread) => sum + thread.messages, 0), xapian.getXapianDocCount());
+        equal(threadList.threads.reduce((sum, thread) => sum + thread.unread, 0),
+            xapian.getAllFolderStats().reduce((sum, folder) => sum + folder.unread, 0));
+
+        const inboxCollapsed = xapian.sortedXapianQuery('folder:"Inbox"', 2, 1, 1, 2, 1);
+        const inboxThreads = xapian.listThreads('Inbox', 1, 2).threads;
+        equal(inboxThreads.map(thread => thread.docid).join(), inboxCollapsed.map(r => r[0]).join());
+
+        // Unread counts are kept up to date when flags change
+        const unreadMessage = xapian.sortedXapianQuery(`folder:"Inbox" AND NOT flag:seen`, 0, 0, 0, 1, -1)[0][0];
+        const unreadThread = xapian.getThreadCounts(unreadMessage);
+        const idterm = xapian.getDocumentField(unreadMessage, DocumentField.IdTerm);
+        xapian.addTermToDocument(idterm, 'XFseen');
+        equal(xapian.getThreadCounts(unreadMessage).messages, unreadThread.messages);
+        equal(xapian.getThreadCounts(unreadMessage).unread, unreadThread.unread - 1);
+        xapian.removeTermFromDocument(idterm, 'XFseen');
+        equal(xapian.getThreadCounts(unreadMessage).unread, unreadThread.unread);
+
+        // Of messages in a thread with the same date the lowest docid is the head, as when collapsing
+        ['Qsamedate1', 'Qsamedate2'].forEach(id => xapian.addSortableEmailToXapianIndex(id, 'Ola', 'OLA',
+            'ola@example.com', [], 'Same date', 'SAME DATE', '209901011200', 100, 'same date',
+            'Inbox', false, false, false, false));
+        const sameDateHead = xapian.getDocIdFromUniqueIdTerm('Qsamedate1');
+        ok(sameDateHead < xapian.getDocIdFromUniqueIdTerm('Qsamedate2'));
+        equal(xapian.sortedXapianQuery('', 2, 1, 0, 1, 1)[0][0], sameDateHead);
+        equal(xapian.listThreads('', 0, 1).threads[0].docid, sameDateHead);
+        equal(xapian.listThreads('', 0, 1).threads[0].messages, 2);
+        ['Qsamedate1', 'Qsamedate2'].forEach(id => xapian.deleteDocumentByUniqueTerm(id));
+        xapian.commitXapianUpdates();
+    }
+
+    @test() dateRanges() {
+        const xapian = new XapianAPI();
+        const count = (query: string) => xapian.sortedXapianQuery(query, 2, 1, 0, 100000, -1).length;
+        const between = (start: number, end: number) => messages.filter(msg =>
+            msg.messageDate.getTime() >= start && msg.messageDate.getTime() < end).length;
+
+        const firstHalf1971 = between(Date.UTC(1971, 0, 1), Date.UTC(1971, 6, 1));
+        ok(firstHalf1971 > 0);
+        equal(count('date:1971-01..1971-06'), firstHalf1971);
+        equal(count('date:197101010000..197106302359'), firstHalf1971);
+        equal(count('date:1971-01-15..1971-02-10'), between(Date.UTC(1971, 0, 15), Date.UTC(1971, 1, 11)));
+        equal(count('date:1971-01-15T06:00..1971-01-15T18:00'),
+            between(Date.UTC(1971, 0, 15, 6), Date.UTC(1971, 0, 15, 18, 1)));
+        equal(count('date:..1970'), between(0, Date.UTC(1971, 0, 1)));
+        equal(count('year:1972'), between(Date.UTC(1972, 0, 1), Date.UTC(1973, 0, 1)));
+        equal(count('month:197203'), between(Date.UTC(1972, 2, 1), Date.UTC(1972, 3, 1)));
+        equal(count('Været AND date:1972..1973'), messages.filter(msg =>
+            msg.messageDate.getUTCFullYear() >= 1972 && msg.messageDate.getUTCFullYear() <= 1973 &&
+            msg.plaintext.indexOf('Været') > -1).length);
+        equal(count('date:30d..'), 0);
+        equal(count('date:1971-06..1971-01'), 0);
+
+        // Cached open ranges also match documents added later outside the dates of the index
+        equal(count('date:2090..'), 0);
+        equal(count('date:..1960'), 0);
+        xapian.addSortableEmailToXapianIndex('Qdaterange', 'Ola', 'OLA', 'ola@example.com', [],
+            'Date range', 'DATE RANGE', '209901011200', 100, 'date range', 'Inbox', false, false, false, false);
+        equal(count('date:2090..'), 1);
+        equal(count('date:2090..2100'), 1);
+        equal(count('date:..1960'), 0);
+        xapian.deleteDocumentByUniqueTerm('Qdaterange');
+        xapian.commitXapianUpdates();
+        equal(count('date:2090..'), 0);
+    }
+
+    @test() memoryGovernor() {
+        const xapian = new XapianAPI();
+        const allRows = xapian.sortedXapianQuery('', 2, 1, 0, 100000, -1);
+        ok(allRows.length > 25);
+        const usageBefore = xapian.getMemoryUsage();
+
+        equal(0, allRows.cappedAt);
+
+        xapian.configureMemoryGovernor({ maxMatches: 10, maxPendingChanges: 2 });
+        const cappedRows = xapian.sortedXapianQuery('', 2, 1, 0, 100000, -1);
+        equal(10, cappedRows.length);
+        equal(10, cappedRows.cappedAt);
+        equal(10, xapian.sortedXapianQueryArena('', 2, 1, 0, 100000, -1).cappedAt);
+        equal(0, xapian.sortedXapianQuery('', 2, 1, 0, 5, -1).cappedAt);
+        // Pages larger than the limit come back capped, and are read on from where they ended
+        const pagedRows = [];
+        xapian.forEachSortedQueryPage('', 2, 1, -1, 25, (rows, offset) => {
+            equal(pagedRows.length, offset);
+            rows.forEach(row => pagedRows.push(row));
+        });
+        equal(allRows.map(row => row[0]).join(), pagedRows.map(row => row[0]).join());
+
+        // Incremental search keeps no more matches than that for refining the next query
+        xapian.resetIncrementalSearch();
+        const incrementalBefore = xapian.getIncrementalSearchStats();
+        equal(10, xapian.incrementalSortedXapianQuery('Været', 2, 1, 0, 100000, -1).length);
+        equal(-1, xapian.getIncrementalSearchStats().candidates);
+        equal(10, xapian.incrementalSortedXapianQuery('Været AND kunne', 2, 1, 0, 100000, -1).length);
+        equal(incrementalBefore.fullMatches + 2, xapian.getIncrementalSearchStats().fullMatches);
+        xapian.resetIncrementalSearch();
+
+        // Pending changes are committed early
+        const idterm = xapian.getDocumentData(allRows[0][0]).split('\t')[0];
+        xapian.addTermToDocument(idterm, 'XFflagged');
+        xapian.removeTermFromDocument(idterm, 'XFflagged');
+        xapian.addTermToDocument(idterm, 'XFflagged');
+        xapian.removeTermFromDocument(idterm, 'XFflagged');
+        const usage = xapian.getMemoryUsage(true);
+        ok(usage.forcedCommits > usageBefore.forcedCommits);
+        ok(usage.cappedQueries > usageBefore.cappedQueries);
+        ok(usage.heapUsed > 0 && usage.heapSize >= usage.heapUsed);
+        ok(usage.peakHeapUsed >= usage.heapUsed);
+
+        // While over the heap budget the released value slot cache isn't built again for every
+        // query, which sorts with Xapian instead
+        xapian.releaseCaches();
+        xapian.configureMemoryGovernor({ heapBudget: 1 });
+        xapian.resetIndexMetrics();
+        equal(allRows.map(row => row[0]).join(), xapian.sortedXapianQuery('', 2, 1, 0, 100000, -1).map(row => row[0]).join());
+        equal(0, xapian.getIndexMetrics().cachedSortQueries);
+
+        xapian.releaseCaches();
+        xapian.configureMemoryGovernor({});
+        equal(allRows.length, xapian.sortedXapianQuery('', 2, 1, 0, 100000, -1).length);
+        equal(1, xapian.getIndexMetrics().cachedSortQueries);
+    }
 
-        console.log("Checking using getFolderMessageCounts...");
-        t1 = timestamp();
-        for (let i = 0; i < iterations; i++) {
-            xapian.getFolderMessageCounts('Testfolder');
+    @test() queryCache() {
+        const xapian = new XapianAPI();
+        const typed = 'Været kunne';
+        const keystrokes: string[] = [];
+        for (let n = 1; n <= typed.length; n++) {
+            keystrokes.push(typed.substring(0, n));
         }
-        const getFolderMessageCountsTime = timestamp() - t1;
-        console.log(`getFolderMessageCounts runtime: ${getFolderMessageCountsTime}ms (${getFolderMessageCountsTime / iterations}ms per query)`);
-        ok(sortedQueryTime >  (2 * getFolderMessageCountsTime), 'getFolderMessageCounts() is noticably faster than using sortedXapianQuery()');
+        const iterations = 3;
+
+        const typeQueries = (): number[] => {
+            let hits: number[] = [];
+            for (let i = 0; i < iterations; i++) {
+                hits = keystrokes.map((q) => xapian.sortedXapianQuery(q, 2, 1, 0, 50, -1).length);
+            }
+            return hits;
+        };
+
+        xapian.setQueryCacheSize(0);
+        const uncachedHits = typeQueries();
+
+        xapian.setQueryCacheSize(64);
+        const statsBefore = xapian.getQueryCacheStats();
+        const cachedHits = typeQueries();
+
+        const statsAfter = xapian.getQueryCacheStats();
+        equal(cachedHits.join(','), uncachedHits.join(','));
+        equal(statsAfter.misses - statsBefore.misses, keystrokes.length);
+        equal(statsAfter.hits - statsBefore.hits, (iterations - 1) * keystrokes.length);
+    }
+
+    @test(timeout(10000)) incrementalSearch() {
+        const xapian = new XapianAPI();
+        xapian.resetIncrementalSearch();
+        const statsBefore = xapian.getIncrementalSearchStats();
+
+        const typed = ['V', 'Væ', 'Vær', 'Været', 'Været AND kunne', 'Været AND kunne ', 'Sun'];
+        typed.forEach((q) => {
+            const expected = xapian.sortedXapianQuery(q, 2, 1, 0, 100000, -1);
+            const incremental = xapian.incrementalSortedXapianQuery(q, 2, 1, 0, 100000, -1);
+            equal(incremental.length, expected.length, q);
+            equal(incremental.map(r => r[0]).join(','), expected.map(r => r[0]).join(','), q);
+        });
+
+        const statsAfter = xapian.getIncrementalSearchStats();
+        // First query and 'Sun' are matched in full, the rest are refinements
+        equal(statsAfter.fullMatches - statsBefore.fullMatches, 2);
+        equal(statsAfter.refinements - statsBefore.refinements, typed.length - 2);
+
+        // Boolean filters are matched exactly, so extending them doesn't narrow the matches
+        ['Været AND year:1', 'Været AND year:19', 'Været AND year:1971', 'Været AND year:1971 AND month:1',
+            'Været AND year:1971 AND month:19710', 'Været AND year:1971 AND month:197103'].forEach((q) => {
+            const expected = xapian.sortedXapianQuery(q, 2, 1, 0, 100000, -1);
+            const incremental = xapian.incrementalSortedXapianQuery(q, 2, 1, 0, 100000, -1);
+            equal(incremental.map(r => r[0]).join(','), expected.map(r => r[0]).join(','), q);
+        });
+        ok(xapian.sortedXapianQuery('Været AND year:1971 AND month:197103', 2, 1, 0, 100000, -1).length > 0);
+
+        // Ranges completed in one step (e.g. pasted) are matched in full
+        ['date:1971', 'date:1971..1972', 'Været AND date:1971', 'Været AND date:1971..1972'].forEach((q) => {
+            const expected = xapian.sortedXapianQuery(q, 2, 1, 0, 100000, -1);
+            const incremental = xapian.incrementalSortedXapianQuery(q, 2, 1, 0, 100000, -1);
+            equal(incremental.map(r => r[0]).join(','), expected.map(r => r[0]).join(','), q);
+        });
     }
 
     @test(timeout(10000)) moveMessages2() {
@@ -305,6 +637,203 @@ const contents = [
         console.log('Created compact database');
     }
 
+    @test(timeout(20000)) exportImportChunks() {
+        const xapian = new XapianAPI();
+        xapian.initXapianIndex('mainpartition');
+        const docCount = xapian.getXapianDocCount();
+
+        const chunks: Uint8Array[] = [];
+        let lastProgress: DatabaseTransferProgress;
+        const files = xapian.exportDatabase(64 * 1024, (chunk, progress) => {
+            chunks.push(chunk.slice());
+            lastProgress = progress;
+        }, 'chunkexport');
+        xapian.closeXapianDatabase();
+
+        equal(chunks.length, files.length);
+        ok(chunks.length > 1);
+        ok(chunks.every(chunk => chunk.length <= 64 * 1024));
+        equal(lastProgress.transferredBytes, lastProgress.totalBytes);
+
+        let importedBytes = 0;
+        const importer = new DatabaseImporter('chunkimport', files,
+            (progress) => importedBytes = progress.transferredBytes);
+        chunks.forEach(chunk => importer.write(chunk));
+        equal(importedBytes, importer.totalBytes);
+        ok(importer.finish('chunkimportwritable'));
+
+        xapian.initXapianIndex('chunkimportwritable');
+        equal(docCount, xapian.getXapianDocCount());
+        xapian.closeXapianDatabase();
+    }
+
+    @test(timeout(20000)) writeScheduler() {
+        const xapian = new XapianAPI();
+        const indexer = new IndexingTools(xapian);
+        xapian.initXapianIndex('scheduledindex');
+        // Scheduled compaction needs threads
+        const compacting = xapian.configureWriteScheduler({ maxPendingChanges: 5, compactPath: 'scheduledcompact' });
+        equal(compacting, xapian.setParallelPartitionSearch(0));
+
+        messages.slice(0, 12).forEach(msg => indexer.addMessageToIndex(msg));
+        let state = xapian.getWriteSchedulerState();
+        equal(2, state.scheduledCommits);
+        equal(2, state.pendingChanges);
+        ok(state.pendingBytes > 0);
+        ok(state.msSinceLastCommit >= 0);
+
+        // Nothing is due: too few pending changes, and compaction waits for them to be committed
+        equal(0, xapian.runScheduledWrites());
+        xapian.commitXapianUpdates();
+        state = xapian.getWriteSchedulerState();
+        equal(0, state.pendingChanges);
+        equal(0, state.compactions);
+
+        if (!compacting) {
+            equal(0, xapian.runScheduledWrites());
+            xapian.closeXapianDatabase();
+            return;
+        }
+        let done = xapian.runScheduledWrites();
+        ok(done & ScheduledWrite.CompactionStarted);
+        while (!(done & (ScheduledWrite.CompactionFinished | ScheduledWrite.CompactionFailed))) {
+            done = xapian.runScheduledWrites();
+        }
+        equal(ScheduledWrite.CompactionFinished, done & ScheduledWrite.CompactionFinished);
+        state = xapian.getWriteSchedulerState();
+        equal(1, state.compactions);
+        equal(0, state.revisionsSinceCompaction);
+        equal(FS.stat('scheduledcompact').size, state.lastCompactionBytes);
+
+        // Not compacted again before anything else is committed
+        equal(0, xapian.runScheduledWrites());
+        xapian.closeXapianDatabase();
+
+        xapian.initXapianIndexReadOnly('scheduledcompact');
+        equal(12, xapian.getXapianDocCount());
+        xapian.closeXapianDatabase();
+    }
+
+    @test() indexingPipeline() {
+        const xapian = new XapianAPI();
+        xapian.initXapianIndex('pipelineindex');
+        equal(false, xapian.configureIndexing({ language: 'klingon' }));
+        ok(xapian.configureIndexing({
+            language: 'english',
+            stopwords: ['the', 'a'],
+            maxBodyBytes: 60,
+            stripQuoted: true,
+            stripSignature: true
+        }));
+        const body = 'The meetings are moved\n' +
+            '> quotedword from the previous message\n' +
+            'See you there\n' +
+            '-- \n' +
+            'signatureword';
+        xapian.addSortableEmailToXapianIndex('Q1', 'Ola', 'OLA', 'ola@example.com', [],
+            'Plans', 'PLANS', '202001010000', 100, body, 'Inbox', false, false, false, false);
+        xapian.commitXapianUpdates();
+
+        equal(1, xapian.sortedXapianQuery('meeting', 0, 0, 0, 10, -1).length);
+        equal(1, xapian.sortedXapianQuery('the meetings', 0, 0, 0, 10, -1).length);
+        equal(0, xapian.sortedXapianQuery('quotedword', 0, 0, 0, 10, -1).length);
+        equal(0, xapian.sortedXapianQuery('signatureword', 0, 0, 0, 10, -1).length);
+        equal(1, xapian.sortedXapianQuery('ola', 0, 0, 0, 10, -1).length);
+
+        xapian.addTextToDocument('Q1', true, 'paddingword '.repeat(10) + 'appendedword');
+        equal(0, xapian.sortedXapianQuery('appendedword', 0, 0, 0, 10, -1).length);
+        xapian.commitXapianUpdates();
+        xapian.closeXapianDatabase();
+
+        // Queries are parsed with the stored settings
+        xapian.initXapianIndexReadOnly('pipelineindex');
+        const options = xapian.getIndexingOptions();
+        equal('english', options.language);
+        equal('the a', options.stopwords.join(' '));
+        equal(60, options.maxBodyBytes);
+        ok(options.stripQuoted && options.stripSignature);
+        equal(1, xapian.sortedXapianQuery('meeting', 0, 0, 0, 10, -1).length);
+        xapian.closeXapianDatabase();
+
+        // Messages indexed before the language was set are found by the words as written
+        xapian.initXapianIndex('stemlaterindex');
+        xapian.addSortableEmailToXapianIndex('Q1', 'Ola', 'OLA', 'ola@example.com', [],
+            'Plans', 'PLANS', '202001010000', 100, 'The meetings are moved', 'Inbox', false, false, false, false);
+        ok(xapian.configureIndexing({ language: 'english' }));
+        xapian.addSortableEmailToXapianIndex('Q2', 'Ola', 'OLA', 'ola@example.com', [],
+            'Plans', 'PLANS', '202001010001', 100, 'The meeting is moved', 'Inbox', false, false, false, false);
+        xapian.commitXapianUpdates();
+        equal(2, xapian.sortedXapianQuery('moved', 0, 0, 0, 10, -1).length);
+        equal(2, xapian.sortedXapianQuery('meetings', 0, 0, 0, 10, -1).length);
+        equal(1, xapian.sortedXapianQuery('meeting', 0, 0, 0, 10, -1).length);
+        xapian.closeXapianDatabase();
+    }
+
+    @test() snippets() {
+        const xapian = new XapianAPI();
+        xapian.initXapianIndex('snippetindex');
+        ok(xapian.configureIndexing({ language: 'english', snippetBytes: 120 }));
+        equal(120, xapian.getIndexingOptions().snippetBytes);
+        const bodies = [
+            'The quarterly budget review is moved to Friday. Please bring the <updated> numbers.',
+            'Lunch on Friday? ' + 'Nothing about money here. '.repeat(20) + 'budget',
+            'No snippet text for this budget'
+        ];
+        bodies.forEach((body, ndx) => {
+            if (ndx === 2) {
+                xapian.configureIndexing({ language: 'english' });
+            }
+            xapian.addSortableEmailToXapianIndex('Q' + (ndx + 1), 'Ola', 'OLA', 'ola@example.com', [],
+                'Snippets ' + ndx, 'SNIPPETS ' + ndx, '20200101000' + ndx, 100, body, 'Inbox', false, false, false, false);
+        });
+        xapian.commitXapianUpdates();
+
+        const arena = xapian.sortedXapianQueryArena('budget', 2, 0, 0, 10, -1);
+        equal(3, arena.length);
+        const snippets = xapian.getSnippets('budget', arena, 60);
+        equal(3, snippets.length);
+        for (let row = 0; row < arena.length; row++) {
+            const docid = arena.getDocId(row);
+            if (docid === xapian.getDocIdFromUniqueIdTerm('Q1')) {
+                ok(snippets[row].indexOf('<b>budget</b>') > -1, snippets[row]);
+            } else if (docid === xapian.getDocIdFromUniqueIdTerm('Q2')) {
+                // The match is after the kept text
+                ok(snippets[row].indexOf('Lunch on Friday?') === 0, snippets[row]);
+                ok(snippets[row].indexOf('<b>') === -1, snippets[row]);
+            } else {
+                equal('', snippets[row]);
+            }
+        }
+
+        const q1 = xapian.getDocIdFromUniqueIdTerm('Q1');
+        ok(xapian.getSnippets('numbers', [q1])[0].indexOf('&lt;updated&gt; <b>numbers</b>') > -1);
+        ok(xapian.getSnippets('', [q1])[0].indexOf('The quarterly budget') === 0);
+        equal('', xapian.getSnippets('budget', [999999])[0]);
+        xapian.closeXapianDatabase();
+    }
+
+    @test() incrementalSearchManyPrefixTerms() {
+        const xapian = new XapianAPI();
+        xapian.initXapianIndex('prefixtermsindex');
+        // More terms starting with the typed prefix than the query parser expands by default
+        for (let n = 0; n < 150; n++) {
+            xapian.addSortableEmailToXapianIndex('Q' + n, 'Ola', 'OLA', 'ola@example.com', [],
+                'Report number' + n, 'REPORT NUMBER' + n, '20200101' + (1000 + n), 100, 'number' + n,
+                'Inbox', false, false, false, false);
+        }
+        xapian.commitXapianUpdates();
+
+        xapian.resetIncrementalSearch();
+        ['n', 'nu', 'number1', 'number14'].forEach((q) => {
+            const expected = xapian.sortedXapianQuery(q, 2, 1, 0, 1000, -1);
+            const incremental = xapian.incrementalSortedXapianQuery(q, 2, 1, 0, 1000, -1);
+            equal(incremental.map(r => r[0]).join(','), expected.map(r => r[0]).join(','), q);
+        });
+        equal(11, xapian.incrementalSortedXapianQuery('number14', 2, 1, 0, 1000, -1).length);
+        equal(150, xapian.sortedXapianQuery('n', 2, 1, 0, 1000, -1).length);
+        xapian.closeXapianDatabase();
+    }
+
     @test(timeout(20000)) openwithcompactpartition() {
         const xapian = new XapianAPI();
         xapian.initXapianIndex('test');
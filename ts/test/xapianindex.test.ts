@@ -0,0 +1,190 @@
+import { suite, test } from "@testdeck/mocha";
+import { equal, ok, throws } from 'assert';
+
+import { loadXapian } from '../xapian/xapian.loader';
+import { XapianAPI, DeltaResult } from '../xapian/rmmxapianapi';
+import { XapianIndex } from '../xapian/xapianindex';
+import { DatabaseImporter } from '../xapian/databasetransfer';
+import { IndexingTools, MessageInfo } from '../xapian/messageinfo';
+import { MailAddressInfo } from '../xapian/mailaddressinfo';
+
+declare var FS, MEMFS;
+
+function createMessages(firstId: number, count: number, folder: string): MessageInfo[] {
+    const messages: MessageInfo[] = [];
+    for(let id = firstId; id < firstId + count; id++) {
+        messages.push(new MessageInfo(id, new Date(id * 6 * 60 * 60 * 1000),
+            new Date(id * 6 * 60 * 60 * 1000),
+            folder,
+            false,
+            false,
+            false,
+            [new MailAddressInfo('Sender', 'sender@runbox.com')],
+            [new MailAddressInfo('Receiver', 'receiver@runbox.com')],
+            [],
+            [],
+            'Subject ' + id,
+            'Message number ' + id,
+            100,
+            false));
+    }
+    return messages;
+}
+
+/**
+ * Several indexes open side by side, selected by handle
+ */
+@suite export class XapianIndexTest {
+    static inbox: XapianIndex;
+    static archive: XapianIndex;
+
+    static before(done) {
+        loadXapian().subscribe(() => {
+            FS.mkdir("/xapianindextest");
+            FS.mount(MEMFS, {},"/xapianindextest");
+            FS.chdir("/xapianindextest");
+            done();
+        });
+    }
+
+    @test() openSideBySide() {
+        const xapian = new XapianAPI();
+        xapian.initXapianIndex('defaultindex');
+        new IndexingTools(xapian).addMessagesToIndex(createMessages(1, 3, 'Inbox'));
+
+        XapianIndexTest.inbox = XapianIndex.open('inboxindex');
+        XapianIndexTest.inbox.use(api => new IndexingTools(api).addMessagesToIndex(createMessages(1, 10, 'Inbox')));
+        XapianIndexTest.archive = XapianIndex.open('archiveindex');
+        XapianIndexTest.archive.use(api => new IndexingTools(api).addMessagesToIndex(createMessages(100, 5, 'Archive')));
+
+        equal(10, XapianIndexTest.inbox.getXapianDocCount());
+        equal(5, XapianIndexTest.archive.sortedXapianQuery('folder:"Archive"', 0, 0, 0, 100, -1).length);
+        equal(0, XapianIndexTest.archive.sortedXapianQuery('folder:"Inbox"', 0, 0, 0, 100, -1).length);
+
+        // Calls without a handle work on the index of initXapianIndex, and calls on different
+        // indexes can be nested
+        equal(3, xapian.getXapianDocCount());
+        XapianIndexTest.inbox.use(inbox => XapianIndexTest.archive.use(archive => {
+            equal(10, inbox.getXapianDocCount());
+            equal(5, archive.getXapianDocCount());
+            equal(3, xapian.getXapianDocCount());
+        }));
+    }
+
+    @test() swapRebuiltIndex() {
+        const inbox = XapianIndexTest.inbox;
+        const rebuilt = XapianIndex.open('rebuiltinboxindex');
+        rebuilt.use(api => new IndexingTools(api).addMessagesToIndex(createMessages(1, 20, 'Inbox')));
+        rebuilt.commitXapianUpdates();
+
+        inbox.swapWith(rebuilt);
+        equal(20, inbox.getXapianDocCount());
+        equal(10, rebuilt.getXapianDocCount());
+
+        rebuilt.close();
+        throws(() => rebuilt.getXapianDocCount());
+        equal(20, inbox.sortedXapianQuery('folder:"Inbox"', 0, 0, 0, 100, -1).length);
+
+        // Entry points return their error value for a closed handle
+        const closed = new XapianAPI(rebuilt.handle);
+        equal(0, closed.getXapianDocCount());
+        equal(0, closed.getDocIdFromUniqueIdTerm('Q1'));
+        equal(-1, closed.deleteDocumentFromAddedWritablesByUniqueTerm('Q1'));
+        equal(DeltaResult.Failed, closed.applyIndexDelta('archivedelta'));
+        equal(null, closed.getMemoryUsage());
+        equal('', closed.getStringValue(1, 0));
+        closed.commitXapianUpdates();
+        throws(() => closed.exportDatabase(1024, () => {}, 'closedexport'));
+    }
+
+    @test() exportAndImportSideBySide() {
+        const exported = { inbox: [] as Uint8Array[], archive: [] as Uint8Array[] };
+        const inboxFiles = XapianIndexTest.inbox.use(inbox => inbox.exportDatabase(4 * 1024, (chunk) => {
+            exported.inbox.push(chunk.slice());
+            if (exported.archive.length === 0) {
+                // The export of another index doesn't disturb this one
+                XapianIndexTest.archive.use(archive => archive.exportDatabase(4 * 1024,
+                    (archivechunk) => exported.archive.push(archivechunk.slice()), 'archiveexport'));
+            }
+        }, 'inboxexport'));
+        equal(inboxFiles.length, exported.inbox.length);
+        ok(exported.archive.length > 1);
+
+        const inboxImporter = new DatabaseImporter('inboximport');
+        const archiveImporter = new DatabaseImporter('archiveimport');
+        for (let n = 0; n < Math.max(exported.inbox.length, exported.archive.length); n++) {
+            if (n < exported.inbox.length) {
+                inboxImporter.write(exported.inbox[n]);
+            }
+            if (n < exported.archive.length) {
+                archiveImporter.write(exported.archive[n]);
+            }
+        }
+        ok(inboxImporter.finish('inboximportwritable'));
+        ok(archiveImporter.finish('archiveimportwritable'));
+
+        const inboxImport = XapianIndex.open('inboximportwritable');
+        const archiveImport = XapianIndex.open('archiveimportwritable');
+        equal(XapianIndexTest.inbox.getXapianDocCount(), inboxImport.getXapianDocCount());
+        equal(XapianIndexTest.archive.getXapianDocCount(), archiveImport.getXapianDocCount());
+        inboxImport.close();
+        archiveImport.close();
+    }
+
+    @test() applyDelta() {
+        const archive = XapianIndexTest.archive;
+        archive.use(api => {
+            api.setSyncRevision(5);
+            api.commitXapianUpdates();
+        });
+
+        // Message 100 deleted, 103 moved to the inbox and 105 and 106 added on the server
+        const delta = XapianIndex.open('archivedelta');
+        delta.use(api => {
+            const indexingTools = new IndexingTools(api);
+            indexingTools.addMessagesToIndex(createMessages(103, 1, 'Inbox'));
+            indexingTools.addMessagesToIndex(createMessages(105, 2, 'Archive'));
+            equal(false, api.markIndexDelta(6, 6, ['Q100']));
+            equal(true, api.markIndexDelta(5, 6, ['Q100']));
+            api.commitXapianUpdates();
+        });
+        delta.close();
+
+        const nextDelta = XapianIndex.open('archivedelta2');
+        nextDelta.use(api => {
+            api.markIndexDelta(6, 7, []);
+            api.commitXapianUpdates();
+        });
+        nextDelta.close();
+
+        archive.use(api => {
+            api.resetIndexMetrics();
+            equal(DeltaResult.OutOfOrder, api.applyIndexDelta('archivedelta2'));
+            equal(DeltaResult.Applied, api.applyIndexDelta('archivedelta'));
+            equal(6, api.getSyncRevision());
+            equal(DeltaResult.AlreadyApplied, api.applyIndexDelta('archivedelta'));
+            equal(DeltaResult.Failed, api.applyIndexDelta('nosuchdelta'));
+
+            equal(6, api.getXapianDocCount());
+            equal(0, api.getDocIdFromUniqueIdTerm('Q100'));
+            equal(1, api.sortedXapianQuery('folder:"Inbox"', 0, 0, 0, 100, -1).length);
+            equal(5, api.sortedXapianQuery('folder:"Archive"', 0, 0, 0, 100, -1).length);
+            equal(5, api.getFolderMessageCounts('Archive')[0]);
+            equal(1, api.getIndexMetrics().deltasApplied);
+            equal(1, api.getIndexMetrics().tombstonesApplied); // Q100, replaced documents aren't deleted
+
+            equal(DeltaResult.Applied, api.applyIndexDelta('archivedelta2'));
+            equal(7, api.getSyncRevision());
+            equal(2, api.getIndexMetrics().deltasApplied);
+        });
+    }
+
+    @test() closeIndexes() {
+        XapianIndexTest.inbox.close();
+        XapianIndexTest.archive.close();
+
+        const xapian = new XapianAPI();
+        equal(3, xapian.getXapianDocCount());
+        xapian.closeXapianDatabase();
+    }
+}
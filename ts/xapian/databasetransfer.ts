@@ -0,0 +1,96 @@
+// --------- BEGIN RUNBOX LICENSE ---------
+// Copyright (C) 2016-2018 Runbox Solutions AS (runbox.com).
+// 
+// This file is part of Runbox 7.
+// 
+// Runbox 7 is free software: You can redistribute it and/or modify it
+// under the terms of the GNU General Public License as published by the
+// Free Software Foundation, either version 3 of the License, or (at your
+// option) any later version.
+// 
+// Runbox 7 is distributed in the hope that it will be useful, but
+// WITHOUT ANY WARRANTY; without even the implied warranty of
+// MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE. See the GNU
+// General Public License for more details.
+// 
+// You should have received a copy of the GNU General Public License
+// along with Runbox 7. If not, see <https://www.gnu.org/licenses/>.
+// ---------- END RUNBOX LICENSE ----------
+
+import { DownloadablePartitionFile } from './downloadablesearchindexmap.class';
+
+declare var Module;
+
+export interface DatabaseTransferProgress {
+    transferredBytes: number;
+    totalBytes: number;
+}
+
+/**
+ * Rebuilds a database from chunks, e.g. read one by one from IndexedDB or downloaded as the files
+ * of a DownloadablePartition, without holding the whole database in memory. The chunks of
+ * XapianAPI.exportDatabase are written as a database directory, others as a single file database.
+ */
+export class DatabaseImporter {
+    public readonly totalBytes: number;
+
+    private handle: number;
+    private $buffer = 0;
+    private bufferSize = 0;
+    private transferredBytes = 0;
+
+    /**
+     * @param totalBytes expected size of the database, or the files whose uncompressed sizes add up to it.
+     *                   0 if unknown.
+     */
+    constructor(private path: string,
+        totalBytes: number | DownloadablePartitionFile[] = 0,
+        private onProgress?: (progress: DatabaseTransferProgress) => void) {
+        this.totalBytes = Array.isArray(totalBytes) ?
+            totalBytes.reduce((sum, file) => sum + file.uncompressedsize, 0) :
+            totalBytes;
+        this.handle = Module.cwrap('beginDatabaseImport', 'number', ['string', 'number'])(path, this.totalBytes);
+        if (this.handle === 0) {
+            throw new Error('Could not create ' + path);
+        }
+    }
+
+    public write(chunk: Uint8Array) {
+        if (chunk.length > this.bufferSize) {
+            Module._free(this.$buffer);
+            this.bufferSize = chunk.length;
+            this.$buffer = Module._malloc(this.bufferSize);
+        }
+        Module.HEAPU8.set(chunk, this.$buffer);
+        const transferred = Module._writeDatabaseImportChunk(this.handle, this.$buffer, chunk.length);
+        if (transferred < 0) {
+            this.releaseBuffer();
+            throw new Error('Could not write to ' + this.path);
+        }
+        this.transferredBytes = transferred;
+        if (this.onProgress) {
+            this.onProgress({ transferredBytes: this.transferredBytes, totalBytes: this.totalBytes });
+        }
+    }
+
+    /**
+     * Verifies the imported database. If writablePath is given, the database is moved there (a single
+     * file is compacted into a writable database there instead, and removed). Otherwise an exported
+     * database can be opened from path, and a single file added with addSingleFileXapianIndex.
+     */
+    public finish(writablePath?: string): boolean {
+        this.releaseBuffer();
+        return Module.cwrap('finishDatabaseImport', 'number', ['number', 'string'])(this.handle, writablePath || '') === 1;
+    }
+
+    public cancel() {
+        this.releaseBuffer();
+        Module._cancelDatabaseImport(this.handle);
+    }
+
+    private releaseBuffer() {
+        Module._free(this.$buffer);
+        this.$buffer = 0;
+        this.bufferSize = 0;
+    }
+}
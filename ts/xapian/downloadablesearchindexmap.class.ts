@@ -30,6 +30,16 @@ export class DownloadablePartition {
     files: DownloadablePartitionFile[];
 }
 
+/**
+ * Changes of the server state from baseRevision to revision, applied with applyIndexDelta
+ */
+export class DownloadableIndexDelta {
+    baseRevision: number;
+    revision: number;
+    files: DownloadablePartitionFile[];
+}
+
 export class DownloadableSearchIndexMap {
     partitions: DownloadablePartition[] = [];
+    deltas?: DownloadableIndexDelta[];
 }
@@ -1,8 +1,14 @@
 export {
-    DownloadablePartitionFile, DownloadablePartition, DownloadableSearchIndexMap
+    DownloadablePartitionFile, DownloadablePartition, DownloadableIndexDelta, DownloadableSearchIndexMap
 } from './downloadablesearchindexmap.class';
 
 export { MailAddressInfo } from './mailaddressinfo';
 export { MessageInfo } from './messageinfo';
-export { XapianAPI, SearchParams } from './rmmxapianapi';
+export { XapianAPI, SearchParams, SortableEmail, UniqueTermRoutingStats, QueryCacheStats,
+    IncrementalSearchStats, FolderStats, ThreadSummary, ThreadList, ThreadCounts, BulkOperation, DocumentField, LazyPartitionStats,
+    IndexMetrics, EntryPointMetrics, MemoryGovernorOptions, MemoryUsage, IndexingOptions, WriteSchedulerOptions, WriteSchedulerState, ScheduledWrite,
+    CompactionState, DeltaResult, CappedRows } from './rmmxapianapi';
+export { SearchResultArena } from './searchresultarena';
+export { XapianIndex } from './xapianindex';
+export { DatabaseImporter, DatabaseTransferProgress } from './databasetransfer';
 export { loadXapian } from './xapian.loader';
@@ -17,7 +17,7 @@
 // along with Runbox 7. If not, see <https://www.gnu.org/licenses/>.
 // ---------- END RUNBOX LICENSE ----------
 
-import { XapianAPI } from './rmmxapianapi';
+import { XapianAPI, SortableEmail, BulkOperation } from './rmmxapianapi';
 import { MailAddressInfo } from './mailaddressinfo';
 
 export class MessageInfo {
@@ -107,25 +107,91 @@ export class IndexingTools {
         }
     }
 
+    public markMessagesSeen(messageIds: number[], seenFlag: boolean): number {
+        return this.indexAPI.bulkUpdateDocuments(messageIds,
+            seenFlag ? BulkOperation.SetSeen : BulkOperation.SetUnseen);
+    }
+
+    public flagMessages(messageIds: number[], flag: boolean): number {
+        return this.indexAPI.bulkUpdateDocuments(messageIds,
+            flag ? BulkOperation.AddTerm : BulkOperation.RemoveTerm, 'XFflagged');
+    }
+
+    public moveMessagesToFolder(messageIds: number[], folder: string): number {
+        return this.indexAPI.bulkUpdateDocuments(messageIds, BulkOperation.SetFolder, folder);
+    }
+
+    public deleteMessages(messageIds: number[]): number {
+        return this.indexAPI.bulkUpdateDocuments(messageIds, BulkOperation.Delete);
+    }
+
     public addMessageToIndex(msginfo: MessageInfo,
             foldersNotToIndex?: string[]
         ) {
-        if (
-            foldersNotToIndex && foldersNotToIndex.find(foldername =>
-                msginfo.folder === foldername)
-         ) {
+        if (this.isInFoldersNotToIndex(msginfo, foldersNotToIndex)) {
             this.indexAPI.deleteDocumentByUniqueTerm('Q' + msginfo.id);
             console.log('Deleted msg id search index', msginfo.id);
             return;
         }
 
-        let conversationId = msginfo.subject ? msginfo.subject.toUpperCase() : '0';
+        const email = this.toSortableEmail(msginfo);
+        this.indexAPI.addSortableEmailToXapianIndex(
+            email.idTerm,
+            email.sender,
+            email.sortableFrom,
+            email.fromEmailAddress,
+            email.recipients,
+            email.subject,
+            email.sortableSubject,
+            email.dateString,
+            email.messageSize,
+            email.text,
+            email.folder,
+            email.seen,
+            email.flagged,
+            email.answered,
+            email.attachment
+        );
+    }
+
+    /**
+     * Same as addMessageToIndex, but serializes all messages into one buffer
+     * that is indexed with a single call into the webassembly module.
+     *
+     * @returns number of messages added to the index
+     */
+    public addMessagesToIndex(msginfos: MessageInfo[],
+            foldersNotToIndex?: string[]
+        ): number {
+        const emails: SortableEmail[] = [];
+        msginfos.forEach((msginfo) => {
+            if (this.isInFoldersNotToIndex(msginfo, foldersNotToIndex)) {
+                this.indexAPI.deleteDocumentByUniqueTerm('Q' + msginfo.id);
+                console.log('Deleted msg id search index', msginfo.id);
+            } else {
+                emails.push(this.toSortableEmail(msginfo));
+            }
+        });
 
-        const beforeSubjectAbbreviationRemoval = conversationId;
+        const statuses = this.indexAPI.addSortableEmailsBatch(emails);
+        statuses.forEach((status, ndx) => {
+            if (status !== 0) {
+                console.error('Failed to index msg id', emails[ndx].idTerm, 'status', status);
+            }
+        });
+        return statuses.filter(status => status === 0).length;
+    }
+
+    private isInFoldersNotToIndex(msginfo: MessageInfo, foldersNotToIndex?: string[]): boolean {
+        return foldersNotToIndex && foldersNotToIndex.find(foldername =>
+                msginfo.folder === foldername) ? true : false;
+    }
+
+    private toSortableEmail(msginfo: MessageInfo): SortableEmail {
+        let conversationId = msginfo.subject ? msginfo.subject.toUpperCase() : '0';
 
         // Remove email subject abbreviation (Re fwd etc)
         conversationId = MessageInfo.getSubjectWithoutAbbreviation(conversationId);
-        const afterSubjectAbbreviationRemoval: string = conversationId;
 
         let recipients = [];
 
@@ -150,8 +216,7 @@ export class IndexingTools {
         const fromAddressInfo = msginfo.from && msginfo.from[0] ? msginfo.from[0] : new MailAddressInfo('', '');
         const visibleFrom = fromAddressInfo.name ? fromAddressInfo.name : fromAddressInfo.address ? fromAddressInfo.address : '';
 
-        // console.log(conversationId);
-        this.indexAPI.addSortableEmailToXapianIndex(
+        return new SortableEmail(
             'Q' + msginfo.id,
             visibleFrom,
             visibleFrom.toUpperCase(),
@@ -17,8 +17,11 @@
 // along with Runbox 7. If not, see <https://www.gnu.org/licenses/>.
 // ---------- END RUNBOX LICENSE ----------
 
+import { SearchResultArena } from './searchresultarena';
+import { DatabaseTransferProgress } from './databasetransfer';
+import { DownloadablePartition, DownloadablePartitionFile } from './downloadablesearchindexmap.class';
+
 declare var Module;
-declare var termlistresult;
 
 const emAllocateString = function (str) {
   if (!str) {
@@ -32,43 +35,78 @@ const emAllocateString = function (str) {
 
 export class XapianAPI {
 
-  public initXapianIndex: (path: string) => void = Module.cwrap('initXapianIndex', null, ['string']);
-  public initXapianIndexReadOnly: (path: string) => void = Module.cwrap('initXapianIndexReadOnly', null, ['string']);
-  public addSingleFileXapianIndex: (path: string) => void = Module.cwrap('addSingleFileXapianIndex', null, ['string']);
-  public addFolderXapianIndex: (path: string) => void = Module.cwrap('addFolderXapianIndex', null, ['string']);
-  public compactDatabase: () => void = Module.cwrap('compactDatabase', null, []);
-  public compactToWritableDatabase: (path: string) => void = Module.cwrap('compactToWritableDatabase', null, ['string']);
+  /**
+   * index is the handle of the index the calls work on: 0 for the index of initXapianIndex,
+   * or a handle returned by XapianIndex.open
+   */
+  constructor(public readonly index: number = 0) {
+  }
+
+  public initXapianIndex: (path: string) => void = this.indexCall('initXapianIndex', null, ['string']);
+  public initXapianIndexReadOnly: (path: string) => void = this.indexCall('initXapianIndexReadOnly', null, ['string']);
+  public addSingleFileXapianIndex: (path: string) => void = this.indexCall('addSingleFileXapianIndex', null, ['string']);
+  public addFolderXapianIndex: (path: string) => void = this.indexCall('addFolderXapianIndex', null, ['string']);
+  public compactDatabase: () => void = this.indexCall('compactDatabase', null, []);
+  public compactToWritableDatabase: (path: string) => void = this.indexCall('compactToWritableDatabase', null, ['string']);
   public addToXapianIndex: (id: string, val: string) => void = Module.cwrap('addToXapianIndex', null, ['string', 'string']);
-  public commitXapianUpdates: () => void = Module.cwrap('commitXapianUpdates', null, []);
-  public getXapianDocCount: () => number = Module.cwrap('getDocCount', 'number', []);
-  public getLastDocid: () => number = Module.cwrap('getLastDocid', 'number', []);
-  public reloadXapianDatabase: () => void = Module.cwrap('reloadDatabase', null, []);
-  public closeXapianDatabase: () => void = Module.cwrap('closeDatabase', null, []);
+  public commitXapianUpdates: () => void = this.indexCall('commitXapianUpdates', null, []);
+  public getXapianDocCount: () => number = this.indexCall('getDocCount', 'number', []);
+  public getLastDocid: () => number = this.indexCall('getLastDocid', 'number', []);
+  public reloadXapianDatabase: () => void = this.indexCall('reloadDatabase', null, []);
+  public closeXapianDatabase: () => void = this.indexCall('closeDatabase', null, []);
   public setStringValueRange: (valuenumber: number, prefix: string) =>
-    void = Module.cwrap('setStringValueRange', null, ['number', 'string']);
-  public clearValueRange: () => void = Module.cwrap('clearValueRange', null, []);
-  public getNumericValue: (docid: number, slot: number) => number = Module.cwrap('getNumericValue', 'number', ['number', 'number']);
-  public termlist: (prefix: string) => number = Module.cwrap('termlist', 'number', ['string']);
-  public documentTermList: (docid: number) => number = Module.cwrap('documentTermList', 'number', ['number']);
-  public documentXTermList: (docid: number) => number = Module.cwrap('documentXTermList', 'number', ['number']);
-  public deleteDocumentByUniqueTerm: (id: string) => void = Module.cwrap('deleteDocumentByUniqueTerm', null, ['string']);
+    void = this.indexCall('setStringValueRange', null, ['number', 'string']);
+  public clearValueRange: () => void = this.indexCall('clearValueRange', null, []);
+  public getNumericValue: (docid: number, slot: number) => number = this.indexCall('getNumericValue', 'number', ['number', 'number']);
+  public termlist: (prefix: string) => number = this.indexCall('termlist', 'number', ['string']);
+  public documentTermList: (docid: number) => number = this.indexCall('documentTermList', 'number', ['number']);
+  public documentXTermList: (docid: number) => number = this.indexCall('documentXTermList', 'number', ['number']);
+  public deleteDocumentByUniqueTerm: (id: string) => void = this.indexCall('deleteDocumentByUniqueTerm', null, ['string']);
   public deleteDocumentFromAddedWritablesByUniqueTerm: (id: string) => number =
-    Module.cwrap('deleteDocumentFromAddedWritablesByUniqueTerm', 'number', ['string']);
+    this.indexCall('deleteDocumentFromAddedWritablesByUniqueTerm', 'number', ['string']);
   public setStringValue: (docid: number, slot: number, val: string) => void =
-    Module.cwrap('setStringValue', null, ['number', 'number', 'string']);
+    this.indexCall('setStringValue', null, ['number', 'number', 'string']);
   public changeDocumentsFolder: (unique_term: string, folder: string) =>
-    void = Module.cwrap('changeDocumentsFolder', null, ['string', 'string']);
-  public addTermToDocument: (idterm: string, termname: string) => void = Module.cwrap('addTermToDocument', null, ['string', 'string']);
+    void = this.indexCall('changeDocumentsFolder', null, ['string', 'string']);
+  public addTermToDocument: (idterm: string, termname: string) => void = this.indexCall('addTermToDocument', null, ['string', 'string']);
   public removeTermFromDocument: (idterm: string, termname: string) => void =
-        Module.cwrap('removeTermFromDocument', null, ['string', 'string']);
+        this.indexCall('removeTermFromDocument', null, ['string', 'string']);
+  /**
+   * Flag terms (XF...) are set and cleared in a flag overlay instead of rewriting the documents,
+   * and written to the documents on commit once the overlay has more than limit flag changes.
+   * 0 writes flag changes to the documents right away.
+   */
+  public setFlagOverlayLimit: (limit: number) => void = this.indexCall('setFlagOverlayLimit', null, ['number']);
+  public getFlagOverlaySize: () => number = this.indexCall('getFlagOverlaySize', 'number', []);
+  /**
+   * Messages deleted since the last commit. They are left out of queries right away,
+   * and removed from the index on commit.
+   */
+  public getTombstoneCount: () => number = this.indexCall('getTombstoneCount', 'number', []);
   public addTextToDocument: (idterm: string, withoutpositions: boolean, text: string) => void =
-        Module.cwrap('addTextToDocument', null, ['string', 'boolean', 'string']);
+        this.indexCall('addTextToDocument', null, ['string', 'boolean', 'string']);
   public getDocIdFromUniqueIdTerm: (idterm: string) => number =
-        Module.cwrap('getDocIdFromUniqueIdTerm', 'number', ['string']);
+        this.indexCall('getDocIdFromUniqueIdTerm', 'number', ['string']);
+  public setQueryCacheSize: (size: number) => void = this.indexCall('setQueryCacheSize', null, ['number']);
+  public resetIncrementalSearch: () => void = this.indexCall('resetIncrementalSearch', null, []);
+  public registerLazyPartition: (path: string, folder: string, size: number) => void =
+        this.indexCall('registerLazyPartition', null, ['string', 'string', 'number']);
+  public setPartitionMemoryBudget: (bytes: number) => void = this.indexCall('setPartitionMemoryBudget', null, ['number']);
+  public resetIndexMetrics: () => void = Module.cwrap('resetIndexMetrics', null, []);
+  /**
+   * Search the partitions of an index on numThreads threads in parallel (0 to turn off).
+   * Returns false if not built with threads (see compilermmxapianapi.js --pthreads).
+   */
+  public setParallelPartitionSearch: (numThreads: number) => boolean =
+        Module.cwrap('setParallelPartitionSearch', 'boolean', ['number']);
+  /**
+   * 0: silent, 1: errors, 2: warnings, 3: info (default), 4: debug
+   */
+  public setLogLevel: (level: number) => void = Module.cwrap('setLogLevel', null, ['number']);
 
   public getStringValue(docid, slot): string {
     const $ret = Module._malloc(1024);
-    Module._getStringValue(docid, slot, $ret);
+    Module._getStringValue(this.index, docid, slot, $ret);
     const ret = Module.UTF8ToString($ret);
     Module._free($ret);
     return ret;
@@ -76,7 +114,7 @@ export class XapianAPI {
 
   public listFolders(): any[] {
     const $ret = Module._malloc(8192);
-    Module._listFolders($ret);
+    Module._listFolders(this.index, $ret);
     const cret = Module.UTF8ToString($ret);
     Module._free($ret);
     const ret: any[] = cret.split(',');
@@ -89,7 +127,7 @@ export class XapianAPI {
 
   public listUnreadFolders(): any[] {
     const $ret = Module._malloc(8192);
-    const folderCount: number = Module._listUnreadFolders($ret);
+    const folderCount: number = Module._listUnreadFolders(this.index, $ret);
     if (folderCount > 0) {
       const cret = Module.UTF8ToString($ret);
       Module._free($ret);
@@ -104,24 +142,24 @@ export class XapianAPI {
     }
   }
 
-  public queryXapianIndex(querystring, offset, maxresults): Array<string> {
+  public queryXapianIndex(querystring, offset, maxresults): CappedRows<string> {
     const $searchResults = Module._malloc(4 * maxresults);
+    const $cappedAt = Module._malloc(4);
     Module.HEAP8.set(new Uint8Array(maxresults * 4), $searchResults);
 
     const $queryString = emAllocateString(querystring);
-    const $resultIdTerm = Module._malloc(128);
 
-    const hits = Module._queryIndex($queryString, $searchResults, offset, maxresults);
+    const hits = Module._queryIndex(this.index, $queryString, $searchResults, offset, maxresults, $cappedAt);
     // console.log(hits);
-    const results = new Array(hits);
+    const results = new Array(hits) as CappedRows<string>;
     for (let n = 0; n < hits; n++) {
       const docid = Module.getValue($searchResults + (n * 4), 'i32');
-      Module._getDocumentData(docid, $resultIdTerm);
-      results[n] = Module.UTF8ToString($resultIdTerm);
+      results[n] = Module.UTF8ToString(Module._getDocumentDataFields(this.index, docid));
     }
+    results.cappedAt = Module.getValue($cappedAt, 'i32');
+    Module._free($cappedAt);
     Module._free($searchResults);
     Module._free($queryString);
-    Module._free($resultIdTerm);
     return results;
 
   }
@@ -131,7 +169,7 @@ export class XapianAPI {
       const $results = Module._malloc(4 * 2);
       Module.HEAP8.set(new Uint8Array(4 * 2), $results);
 
-      const ret = Module._getFolderMessageCounts($folderString, $results);
+      const ret = Module._getFolderMessageCounts(this.index, $folderString, $results);
       let results: number[];
 
       if (ret !== 0) {
@@ -145,24 +183,380 @@ export class XapianAPI {
       return results;
   }
 
+  /**
+   * Total, unread and flagged message counts of all folders, kept up to date by the index
+   */
+  public getAllFolderStats(): FolderStats[] {
+    const $stats = Module._getAllFolderStats(this.index);
+    if ($stats === 0) {
+      return [];
+    }
+    const heap = new DataView(Module.HEAPU8.buffer);
+    const numFolders = heap.getUint32($stats, true);
+    const ret: FolderStats[] = new Array(numFolders);
+    let pos = $stats + 4;
+    for (let n = 0; n < numFolders; n++) {
+      const nameLength = heap.getUint32(pos, true);
+      const folder = Module.UTF8ToString(pos + 4);
+      pos += 4 + nameLength + 1;
+      ret[n] = {
+        folder: folder,
+        total: heap.getUint32(pos, true),
+        unread: heap.getUint32(pos + 4, true),
+        flagged: heap.getUint32(pos + 8, true)
+      };
+      pos += 12;
+    }
+    return ret;
+  }
+
+  /**
+   * Threads (conversations) with the latest message first, from the thread index kept up to date
+   * by the index. With a folder only threads with messages in the folder are listed, and only
+   * those messages are counted.
+   */
+  public listThreads(folder: string, offset: number, maxresults: number): ThreadList {
+    const $folder = emAllocateString(folder || '');
+    const $threads = Module._listThreads(this.index, $folder, offset, maxresults);
+    Module._free($folder);
+    if ($threads === 0) {
+      return { totalThreads: 0, threads: [] };
+    }
+    const heap = new DataView(Module.HEAPU8.buffer);
+    const numThreads = heap.getUint32($threads + 4, true);
+    const ret: ThreadList = { totalThreads: heap.getUint32($threads, true), threads: new Array(numThreads) };
+    let pos = $threads + 8;
+    for (let n = 0; n < numThreads; n++) {
+      const dateLength = heap.getUint32(pos + 12, true);
+      ret.threads[n] = {
+        docid: heap.getUint32(pos, true),
+        messages: heap.getUint32(pos + 4, true),
+        unread: heap.getUint32(pos + 8, true),
+        latestDate: Module.UTF8ToString(pos + 16)
+      };
+      pos += 16 + dateLength + 1;
+    }
+    return ret;
+  }
+
+  /**
+   * Docids of the messages in the thread of a message, oldest first
+   */
+  public getThreadMessages(docid: number): number[] {
+    let maxresults = 64;
+    while (true) {
+      const $results = Module._malloc(4 * maxresults);
+      const count = Module._getThreadMessages(this.index, docid, $results, maxresults);
+      const ret: number[] = [];
+      for (let n = 0; n < count && n < maxresults; n++) {
+        ret.push(Module.getValue($results + (n * 4), 'i32'));
+      }
+      Module._free($results);
+      if (count <= maxresults) {
+        return ret;
+      }
+      maxresults = count;
+    }
+  }
+
+  /**
+   * Exact message and unread counts of the thread of a message, unlike the collapse counts of
+   * sortedXapianQuery which are lower bounds
+   */
+  public getThreadCounts(docid: number): ThreadCounts {
+    const $results = Module._malloc(4 * 2);
+    let counts: ThreadCounts;
+
+    if (Module._getThreadCounts(this.index, docid, $results) !== 0) {
+      counts = {
+        messages: Module.getValue($results, 'i32'),
+        unread: Module.getValue($results + 4, 'i32')
+      };
+    }
+    Module._free($results);
+    return counts;
+  }
+
+  /**
+   * Counters of the unique id term (Q<id>) routing table used to find the partition of a message
+   */
+  public getUniqueTermRoutingStats(): UniqueTermRoutingStats {
+    const $results = Module._malloc(4 * 4);
+    let stats: UniqueTermRoutingStats;
+
+    if (Module._getUniqueTermRoutingStats(this.index, $results) !== 0) {
+      stats = {
+        hits: Module.getValue($results, 'i32'),
+        misses: Module.getValue($results + 4, 'i32'),
+        routedTerms: Module.getValue($results + 8, 'i32'),
+        partitionLoads: Module.getValue($results + 12, 'i32')
+      };
+    }
+    Module._free($results);
+    return stats;
+  }
+
+  /**
+   * Register a downloaded partition stored as a single file at path. It's opened by the first
+   * query that isn't restricted to other folders, instead of when registered. Like adding a
+   * partition, registering changes the docids of the index, but opening and closing it doesn't.
+   */
+  public registerDownloadablePartition(path: string, partition: DownloadablePartition) {
+    const size = partition.files.reduce((sum, file) => sum + file.uncompressedsize, 0);
+    this.registerLazyPartition(path, partition.folder, size);
+  }
+
+  public getLazyPartitionStats(): LazyPartitionStats {
+    const $results = Module._malloc(4 * 4);
+    let stats: LazyPartitionStats;
+
+    if (Module._getLazyPartitionStats(this.index, $results) !== 0) {
+      stats = {
+        registered: Module.getValue($results, 'i32'),
+        attached: Module.getValue($results + 4, 'i32'),
+        attaches: Module.getValue($results + 8, 'i32'),
+        detaches: Module.getValue($results + 12, 'i32')
+      };
+    }
+    Module._free($results);
+    return stats;
+  }
+
+  /**
+   * Auto-commit and compaction thresholds of the current index, see WriteSchedulerOptions.
+   * Returns false if compactPath is given but the build has no threads, see WriteSchedulerOptions.compactPath.
+   */
+  public configureWriteScheduler(options: WriteSchedulerOptions): boolean {
+    return this.indexCall('configureWriteScheduler', 'number', ['number', 'number', 'number', 'string', 'number', 'number'])(
+      options.maxPendingChanges || 0,
+      options.maxPendingBytes || 0,
+      options.maxPendingMs || 0,
+      options.compactPath || '',
+      options.compactAfterRevisions || 0,
+      options.compactGrowthRatio || 0) === 1;
+  }
+
+  /**
+   * Limits on memory use, shared by all indexes, see MemoryGovernorOptions
+   */
+  public configureMemoryGovernor(options: MemoryGovernorOptions) {
+    Module._configureMemoryGovernor(options.heapBudget || 0, options.maxMatches || 0, options.maxPendingChanges || 0);
+  }
+
+  /**
+   * Memory use of the heap and the current index, or null if the index is closed
+   */
+  public getMemoryUsage(resetPeak: boolean = false): MemoryUsage | null {
+    const $results = Module._malloc(8 * 9);
+    if (Module._getMemoryUsage(this.index, $results, resetPeak ? 1 : 0) === 0) {
+      Module._free($results);
+      return null;
+    }
+    const value = (n: number) => Module.getValue($results + n * 8, 'double');
+    const usage: MemoryUsage = {
+      heapSize: value(0),
+      heapUsed: value(1),
+      peakHeapUsed: value(2),
+      heapBudget: value(3),
+      cacheBytes: value(4),
+      pendingChanges: value(5),
+      cacheReleases: value(6),
+      forcedCommits: value(7),
+      cappedQueries: value(8)
+    };
+    Module._free($results);
+    return usage;
+  }
+
+  /**
+   * Release the caches of the current index (rebuilt when needed), e.g. when the page is hidden
+   */
+  public releaseCaches: () => void = this.indexCall('releaseCaches', null, []);
+
+  /**
+   * How messages indexed from now on are turned into terms, see IndexingOptions. The options are
+   * stored in the index with the next commit, so that queries are parsed the same way. Setting a
+   * language on an index with messages makes queries also match words unstemmed, so that those
+   * messages are still found by the words as written. Returns false if there's no stemmer for the language.
+   */
+  public configureIndexing(options: IndexingOptions): boolean {
+    return this.indexCall('configureIndexing', 'number', ['string', 'string', 'number', 'number', 'number'])(
+      options.language || '',
+      (options.stopwords || []).join(' '),
+      options.maxBodyBytes || 0,
+      (options.stripQuoted ? 1 : 0) | (options.stripSignature ? 2 : 0),
+      options.snippetBytes || 0) === 1;
+  }
+
+  public getIndexingOptions(): IndexingOptions {
+    const lines: string[] = Module.UTF8ToString(Module._getIndexingSettings(this.index)).split('\n');
+    const strip = parseInt(lines[4], 10);
+    return {
+      language: lines[1],
+      stopwords: lines[2].split(' ').filter(word => word.length > 0),
+      maxBodyBytes: parseInt(lines[3], 10),
+      stripQuoted: (strip & 1) !== 0,
+      stripSignature: (strip & 2) !== 0,
+      snippetBytes: parseInt(lines[5], 10) || 0
+    };
+  }
+
+  /**
+   * Do the commit or compaction that is due, if any. Call it when idle, e.g. from a timer,
+   * so that writes don't hold up searches. Returns ScheduledWrite flags of the work done.
+   */
+  public runScheduledWrites(): number {
+    return Module._runScheduledWrites(this.index);
+  }
+
+  /**
+   * Call runScheduledWrites every intervalMs. Returns a function that stops it.
+   */
+  public startWriteScheduler(intervalMs: number, onWrite?: (done: number) => void): () => void {
+    const timer = setInterval(() => {
+      const done = this.runScheduledWrites();
+      if (done && onWrite) {
+        onWrite(done);
+      }
+    }, intervalMs);
+    return () => clearInterval(timer);
+  }
+
+  public getWriteSchedulerState(): WriteSchedulerState {
+    const $results = Module._malloc(8 * 10);
+    let state: WriteSchedulerState;
+
+    if (Module._getWriteSchedulerState(this.index, $results) !== 0) {
+      const value = (ndx: number) => Module.getValue($results + 8 * ndx, 'double');
+      state = {
+        pendingChanges: value(0),
+        pendingBytes: value(1),
+        msSinceFirstPendingChange: value(2),
+        msSinceLastCommit: value(3),
+        revision: value(4),
+        revisionsSinceCompaction: value(5),
+        compactionState: value(6),
+        compactions: value(7),
+        lastCompactionBytes: value(8),
+        scheduledCommits: value(9)
+      };
+    }
+    Module._free($results);
+    return state;
+  }
+
+  public getIndexMetrics(): IndexMetrics {
+    return JSON.parse(Module.UTF8ToString(Module._getIndexMetrics()));
+  }
+
+  /**
+   * Counters of the cache of parsed queries
+   */
+  public getQueryCacheStats(): QueryCacheStats {
+    const $results = Module._malloc(4 * 3);
+    let stats: QueryCacheStats;
+
+    if (Module._getQueryCacheStats(this.index, $results) !== 0) {
+      stats = {
+        hits: Module.getValue($results, 'i32'),
+        misses: Module.getValue($results + 4, 'i32'),
+        cachedQueries: Module.getValue($results + 8, 'i32')
+      };
+    }
+    Module._free($results);
+    return stats;
+  }
+
   public sortedXapianQuery(querystring: string,
     sortcol: number,
     reverse: number,
     offset: number,
     maxresults: number,
-    collapsecol: number): Array<any> {
+    collapsecol: number): CappedRows<any> {
+    return this.runSortedQuery(Module._sortedXapianQuery, querystring, sortcol, reverse, offset, maxresults, collapsecol);
+  }
+
+  /**
+   * Same as sortedXapianQuery, but for search as you type: when the query only narrows the
+   * previous incremental query (longer last word, appended AND clause) the previous
+   * matches are filtered instead of searching the whole index again. When collapsing, cache the
+   * sort and collapse slots (setCachedValueSlots) so that each query is a single match.
+   */
+  public incrementalSortedXapianQuery(querystring: string,
+    sortcol: number,
+    reverse: number,
+    offset: number,
+    maxresults: number,
+    collapsecol: number): CappedRows<any> {
+    return this.runSortedQuery(Module._incrementalSortedXapianQuery, querystring, sortcol, reverse, offset, maxresults, collapsecol);
+  }
+
+  public getIncrementalSearchStats(): IncrementalSearchStats {
+    const $results = Module._malloc(4 * 3);
+    let stats: IncrementalSearchStats;
+
+    if (Module._getIncrementalSearchStats(this.index, $results) !== 0) {
+      stats = {
+        refinements: Module.getValue($results, 'i32'),
+        fullMatches: Module.getValue($results + 4, 'i32'),
+        candidates: Module.getValue($results + 8, 'i32')
+      };
+    }
+    Module._free($results);
+    return stats;
+  }
+
+  /**
+   * Run a sorted query pageSize rows at a time, so that a huge result is never held in memory
+   * at once. The callback gets every page with the offset of its first row, and may return
+   * false to stop.
+   */
+  public forEachSortedQueryPage(querystring: string,
+    sortcol: number,
+    reverse: number,
+    collapsecol: number,
+    pageSize: number,
+    callback: (rows: Array<any>, offset: number) => boolean | void) {
+    for (let offset = 0; ; ) {
+      const rows = this.sortedXapianQuery(querystring, sortcol, reverse, offset, pageSize, collapsecol);
+      // A page capped by the memory governor is shorter, but not the last
+      if (rows.length === 0 || callback(rows, offset) === false || (rows.length < pageSize && !rows.cappedAt)) {
+        return;
+      }
+      offset += rows.length;
+    }
+  }
+
+  /**
+   * cwrap of an entry point taking the handle of the index as its first argument, which is
+   * passed by the returned function
+   */
+  private indexCall(name: string, returnType: string, argTypes: string[]): (...args: any[]) => any {
+    const entryPoint = Module.cwrap(name, returnType, ['number'].concat(argTypes));
+    return (...args: any[]) => entryPoint(this.index, ...args);
+  }
+
+  private runSortedQuery(queryFunction: (...args: number[]) => number,
+    querystring: string,
+    sortcol: number,
+    reverse: number,
+    offset: number,
+    maxresults: number,
+    collapsecol: number): CappedRows<any> {
     const $searchResults = Module._malloc(4 * maxresults);
     const $collapseCount = Module._malloc(4 * maxresults);
+    const $cappedAt = Module._malloc(4);
 
     Module.HEAP8.set(new Uint8Array(maxresults * 4), $searchResults);
     Module.HEAP8.set(new Uint8Array(maxresults * 4), $collapseCount);
 
     const $queryString = emAllocateString(querystring);
 
-    const hits = Module._sortedXapianQuery($queryString, sortcol, reverse, $searchResults, offset, maxresults, collapsecol, $collapseCount);
+    const hits = queryFunction(this.index, $queryString, sortcol, reverse, $searchResults, offset, maxresults,
+      collapsecol, $collapseCount, $cappedAt);
     // console.log("Sorted xapian query returned "+hits);
 
-    const results = new Array(hits);
+    const results = new Array(hits) as CappedRows<any>;
     for (let n = 0; n < hits; n++) {
       results[n] = [
         Module.getValue($searchResults + (n * 4), 'i32'),
@@ -170,20 +564,190 @@ export class XapianAPI {
       ];
 
     }
+    results.cappedAt = Module.getValue($cappedAt, 'i32');
+    Module._free($cappedAt);
     Module._free($collapseCount);
     Module._free($searchResults);
     Module._free($queryString);
     return results;
   }
 
-  public getDocumentData(docid) {
-    const $docdata = Module._malloc(1024);
-    Module._getDocumentData(docid, $docdata);
-    const ret = Module.UTF8ToString($docdata);
-    Module._free($docdata);
-    return ret;
+  /**
+   * Value slots kept in memory by docid for sorting and reading row values (default 0 to 4).
+   * Queries for all messages or a single folder or flag, sorted (and collapsed) on cached
+   * slots, are sorted in memory without reading documents. An empty list turns it off.
+   */
+  public setCachedValueSlots(valueslots: number[]) {
+    const $valueSlots = Module._malloc(4 * Math.max(valueslots.length, 1));
+    Module.HEAP32.set(valueslots, $valueSlots >> 2);
+    Module._setCachedValueSlots(this.index, $valueSlots, valueslots.length);
+    Module._free($valueSlots);
   }
 
+  /**
+   * Sorted query returning docids, collapse counts, the given value slots and the document data
+   * of every row in one result arena instead of requiring calls per row.
+   */
+  public sortedXapianQueryArena(querystring: string,
+    sortcol: number,
+    reverse: number,
+    offset: number,
+    maxresults: number,
+    collapsecol: number,
+    valueslots: number[] = []): SearchResultArena {
+    const $queryString = emAllocateString(querystring);
+    const $valueSlots = Module._malloc(4 * Math.max(valueslots.length, 1));
+    Module.HEAP32.set(valueslots, $valueSlots >> 2);
+
+    const $arena = Module._sortedXapianQueryArena(this.index, $queryString, sortcol, reverse, offset, maxresults,
+      collapsecol, $valueSlots, valueslots.length);
+
+    Module._free($valueSlots);
+    Module._free($queryString);
+
+    if ($arena === 0) {
+      return null;
+    }
+    const arena = SearchResultArena.fromHeap($arena);
+    Module._freeResultArena(this.index);
+    return arena;
+  }
+
+  /**
+   * Snippets of the body text around the best matches of the query, for the rows of a page returned by
+   * sortedXapianQueryArena (or the given docids) in one call. The text is HTML escaped, and the matches
+   * are put between highlightStart and highlightEnd. Empty for messages indexed without snippet text
+   * (see IndexingOptions.snippetBytes).
+   */
+  public getSnippets(querystring: string, rows: SearchResultArena | number[], length: number = 200,
+    highlightStart: string = '<b>', highlightEnd: string = '</b>'): string[] {
+    const docids: number[] = [];
+    if (rows instanceof SearchResultArena) {
+      for (let row = 0; row < rows.length; row++) {
+        docids.push(rows.getDocId(row));
+      }
+    } else {
+      docids.push(...rows);
+    }
+
+    const $docids = Module._malloc(4 * Math.max(docids.length, 1));
+    Module.HEAP32.set(docids, $docids >> 2);
+    const $queryString = emAllocateString(querystring);
+
+    const $arena = Module._getResultSnippets(this.index, $queryString, $docids, docids.length, length);
+
+    Module._free($queryString);
+    Module._free($docids);
+    if ($arena === 0) {
+      throw new Error('Invalid query: ' + querystring);
+    }
+
+    const numSnippets = Module.getValue($arena + 4, 'i32');
+    const snippets: string[] = new Array(numSnippets);
+    let pos = $arena + 8;
+    for (let n = 0; n < numSnippets; n++) {
+      const snippetLength = Module.getValue(pos, 'i32');
+      snippets[n] = Module.UTF8ToString(pos + 4)
+        .replace(/&/g, '&amp;').replace(/</g, '&lt;').replace(/>/g, '&gt;').replace(/"/g, '&quot;')
+        .replace(/\x01/g, highlightStart).replace(/\x02/g, highlightEnd);
+      pos += 4 + snippetLength + 1;
+    }
+    return snippets;
+  }
+
+  /**
+   * Apply one operation to all the given messages in a single call, e.g. for a multi-select
+   * "mark as read" or "move to folder". Returns the number of documents actually changed.
+   */
+  public bulkUpdateDocuments(messageIds: number[], operation: BulkOperation, argument: string = ''): number {
+    const $messageIds = Module._malloc(4 * Math.max(messageIds.length, 1));
+    Module.HEAP32.set(messageIds, $messageIds >> 2);
+    const $argument = emAllocateString(argument);
+
+    const changed = Module._bulkUpdateDocuments(this.index, $messageIds, messageIds.length, operation, $argument);
+
+    Module._free($argument);
+    Module._free($messageIds);
+    if (changed < 0) {
+      throw new Error('Bulk update failed');
+    }
+    return changed;
+  }
+
+  /**
+   * Apply an index delta (see markIndexDelta) stored at path, e.g. imported with DatabaseImporter.
+   * Deltas apply in order of their revisions, and applying one again does nothing.
+   */
+  public applyIndexDelta: (path: string) => DeltaResult = this.indexCall('applyIndexDelta', 'number', ['string']);
+
+  /**
+   * Mark the current index as a delta from baseRevision to revision of the server state, where the
+   * messages with the given unique terms (Q<id>) were deleted. Its messages replace those with the
+   * same unique term when applied. Committed with the next commit. Returns false if revision is not
+   * after baseRevision.
+   */
+  public markIndexDelta(baseRevision: number, revision: number, tombstones: string[]): boolean {
+    return this.indexCall('markIndexDelta', 'number', ['string', 'number', 'number'])(
+      tombstones.join('\n'), baseRevision, revision) === 1;
+  }
+
+  /**
+   * The revision of the last delta applied to the current index, 0 if none
+   */
+  public getSyncRevision: () => number = this.indexCall('getSyncRevision', 'number', []);
+
+  /**
+   * Set the revision of the server state the current index has (e.g. after downloading or rebuilding
+   * it), so that deltas from there apply. Committed with the next commit.
+   */
+  public setSyncRevision: (revision: number) => void = this.indexCall('setSyncRevision', null, ['number']);
+
+  /**
+   * Compact the database and hand its tables to onChunk in pieces of at most chunkSize bytes,
+   * e.g. to store each piece as a separate IndexedDB record. The chunk is only valid during the callback
+   * unless copied. Returns the chunk files, which can be passed to DatabaseImporter to rebuild the database.
+   * The compacted copy is written to path, and removed table by table as it is handed over.
+   */
+  public exportDatabase(chunkSize: number,
+    onChunk: (chunk: Uint8Array, progress: DatabaseTransferProgress) => void,
+    path: string = 'xapianexport'): DownloadablePartitionFile[] {
+    const totalBytes = this.indexCall('beginDatabaseExport', 'number', ['string', 'number'])(path, chunkSize);
+    if (totalBytes < 0) {
+      throw new Error('Database export failed');
+    }
+
+    const files: DownloadablePartitionFile[] = [];
+    const $length = Module._malloc(4);
+    let transferredBytes = 0;
+    try {
+      let $chunk: number;
+      while (($chunk = Module._readDatabaseExportChunk(this.index, $length)) !== 0) {
+        const length = Module.getValue($length, 'i32');
+        transferredBytes += length;
+        files.push({ filename: `${path}.${files.length}`, compressedsize: length, uncompressedsize: length });
+        onChunk(Module.HEAPU8.subarray($chunk, $chunk + length), { transferredBytes, totalBytes });
+      }
+      if (Module.getValue($length, 'i32') < 0) {
+        throw new Error('Database export failed');
+      }
+    } finally {
+      Module._free($length);
+      Module._cancelDatabaseExport(this.index);
+    }
+    return files;
+  }
+
+  /**
+   * The document data as tab separated fields: id term, from, subject and from email address
+   */
+  public getDocumentData: (docid: number) => string =
+        this.indexCall('getDocumentDataFields', 'string', ['number']);
+  /**
+   * A single field of the document data, without decoding the others into a string
+   */
+  public getDocumentField: (docid: number, field: DocumentField) => string =
+        this.indexCall('getDocumentDataField', 'string', ['number', 'number']);
+
   public addSortableEmailToXapianIndex(
     idTerm,  // Message id
     sender, // from (name or email address if no name is present)
@@ -236,6 +800,7 @@ export class XapianAPI {
     const $folder = emAllocateString(folder);
 
     Module._addSortableEmailToXapianIndex(
+      this.index,
       $idTerm,
       $sender,
       $sortableFrom,
@@ -272,10 +837,351 @@ export class XapianAPI {
     }
   }
 
+  /**
+   * Index many emails with one call into the webassembly module. All messages are packed
+   * into a single heap allocation (see addSortableEmailsBatch in rmmxapianapi.cc for the layout).
+   *
+   * @returns status per message: 0 if indexed, 1 if indexing failed, 2 if not processed
+   */
+  public addSortableEmailsBatch(emails: SortableEmail[]): number[] {
+    if (emails.length === 0) {
+      return [];
+    }
+    const nullStringLength = 0xffffffff;
+    const stringLength = (str: string) => str ? Module.lengthBytesUTF8(str) : 0;
+
+    let bufferLength = 0;
+    emails.forEach((email) => {
+      bufferLength += 4 + stringLength(email.idTerm) +
+        4 + stringLength(email.sender) +
+        4 + stringLength(email.sortableFrom) +
+        4 + stringLength(email.fromEmailAddress) +
+        4 + stringLength(email.subject) +
+        4 + stringLength(email.sortableSubject) +
+        4 + stringLength(email.dateString) +
+        4 + stringLength(email.text) +
+        4 + stringLength(email.folder) +
+        4 + 4 + 8;
+      (email.recipients || []).forEach((recp) => bufferLength += 4 + stringLength(recp));
+    });
+
+    // Statuses are placed after the message buffer (+1 for the terminator written by stringToUTF8)
+    const statusesOffset = (bufferLength + 1 + 3) & ~3;
+    const $buffer = Module._malloc(statusesOffset + emails.length * 4);
+    const view = new DataView(Module.HEAPU8.buffer, $buffer, statusesOffset);
+    let pos = 0;
+
+    const writeUint32 = (value: number) => {
+      view.setUint32(pos, value, true);
+      pos += 4;
+    };
+    const writeString = (str: string) => {
+      const len = stringLength(str);
+      writeUint32(len);
+      if (len > 0) {
+        Module.stringToUTF8(str, $buffer + pos, len + 1);
+      }
+      pos += len;
+    };
+
+    emails.forEach((email) => {
+      writeString(email.idTerm);
+      writeString(email.sender);
+      writeString(email.sortableFrom);
+      writeString(email.fromEmailAddress);
+      writeString(email.subject);
+      writeString(email.sortableSubject);
+      writeString(email.dateString);
+      writeString(email.text);
+      if (email.folder === null || email.folder === undefined) {
+        writeUint32(nullStringLength);
+      } else {
+        writeString(email.folder);
+      }
+      const recipients = email.recipients || [];
+      writeUint32(recipients.length);
+      recipients.forEach((recp) => writeString(recp));
+      writeUint32(
+        (email.seen ? 1 : 0) +
+        (email.flagged ? 2 : 0) +
+        (email.answered ? 4 : 0) +
+        (email.attachment ? 8 : 0)
+      );
+      view.setFloat64(pos, email.messageSize, true);
+      pos += 8;
+    });
+
+    Module._addSortableEmailsBatch(this.index, $buffer, bufferLength, emails.length, $buffer + statusesOffset);
+
+    const statuses: number[] = Array.from(new Int32Array(Module.HEAPU8.buffer, $buffer + statusesOffset, emails.length));
+    Module._free($buffer);
+    return statuses;
+  }
+
   hasMessageId(id: number): boolean {
-    termlistresult = [];
-    this.termlist('Q' + id);
-    return termlistresult.findIndex(t => t === '') > -1;
+    return this.getDocIdFromUniqueIdTerm('Q' + id) !== 0;
+  }
+}
+
+export enum BulkOperation {
+  AddTerm = 0,
+  RemoveTerm = 1,
+  SetFolder = 2,
+  SetSeen = 3,
+  SetUnseen = 4,
+  Delete = 5
+}
+
+/**
+ * Fields of the document data, see getDocumentField
+ */
+export enum DocumentField {
+  IdTerm = 0,
+  From = 1,
+  Subject = 2,
+  FromEmailAddress = 3
+}
+
+/**
+ * Rows of a query. cappedAt is the row limit of the memory governor (MemoryGovernorOptions.maxMatches)
+ * if the query asked for more rows, so there may be more rows than returned, and 0 otherwise.
+ */
+export interface CappedRows<T> extends Array<T> {
+  cappedAt: number;
+}
+
+export interface MemoryGovernorOptions {
+  /**
+   * When more heap bytes are in use, caches are released and pending changes committed.
+   * The heap isn't returned to the browser once grown, so set it with room to spare.
+   */
+  heapBudget?: number;
+  /**
+   * Return at most this many rows per query (see forEachSortedQueryPage). Results report
+   * the limit when they were capped, see CappedRows and SearchResultArena.cappedAt. Incremental
+   * search only refines queries with at most this many matches.
+   */
+  maxMatches?: number;
+  /**
+   * Commit when this many changes are pending, since Xapian keeps them in memory until then
+   */
+  maxPendingChanges?: number;
+}
+
+export interface MemoryUsage {
+  /**
+   * Bytes of the heap, also those the allocator has free
+   */
+  heapSize: number;
+  heapUsed: number;
+  peakHeapUsed: number;
+  heapBudget: number;
+  /**
+   * Bytes held by the caches of the current index (value slots, result buffers, unique term routes)
+   */
+  cacheBytes: number;
+  pendingChanges: number;
+  cacheReleases: number;
+  forcedCommits: number;
+  cappedQueries: number;
+}
+
+export interface IndexingOptions {
+  /**
+   * Stem words for this language (e.g. 'english'), no stemming if empty
+   */
+  language?: string;
+  /**
+   * Words not indexed, and left out of queries
+   */
+  stopwords?: string[];
+  /**
+   * Index at most this many bytes of the message body (0 for all of it)
+   */
+  maxBodyBytes?: number;
+  /**
+   * Leave out quoted lines (starting with '>') and forwarded or replied to messages
+   * after an "-----Original Message-----" line
+   */
+  stripQuoted?: boolean;
+  /**
+   * Leave out the signature after a "-- " line
+   */
+  stripSignature?: boolean;
+  /**
+   * Keep this many bytes (at most 4096) of the start of the body text, compressed, for getSnippets.
+   * 0 (the default) keeps none, since it adds to the size of the index.
+   */
+  snippetBytes?: number;
+}
+
+export interface WriteSchedulerOptions {
+  /**
+   * Commit when this many changes are pending
+   */
+  maxPendingChanges?: number;
+  /**
+   * Commit when the pending changes hold this many bytes of indexed text
+   */
+  maxPendingBytes?: number;
+  /**
+   * Commit when the first pending change is this old (checked on changes and runScheduledWrites)
+   */
+  maxPendingMs?: number;
+  /**
+   * Compact the index into a single file here from runScheduledWrites, on a thread of its own.
+   * Ignored without threads (see compilermmxapianapi.js --pthreads), where compacting would block
+   * runScheduledWrites; call compactDatabase when convenient instead.
+   */
+  compactPath?: string;
+  /**
+   * Compact again after this many commits
+   */
+  compactAfterRevisions?: number;
+  /**
+   * Compact again when the database files grew this many times since the last compaction
+   */
+  compactGrowthRatio?: number;
+}
+
+export enum ScheduledWrite {
+  Commit = 1,
+  CompactionStarted = 2,
+  CompactionFinished = 4,
+  CompactionFailed = 8
+}
+
+export enum DeltaResult {
+  Applied = 1,
+  AlreadyApplied = 0,
+  OutOfOrder = -1,
+  Failed = -2
+}
+
+export enum CompactionState {
+  Idle = 0,
+  Running = 1,
+  Failed = 2
+}
+
+export interface WriteSchedulerState {
+  pendingChanges: number;
+  pendingBytes: number;
+  msSinceFirstPendingChange: number;
+  msSinceLastCommit: number; // -1 if never committed
+  revision: number;
+  revisionsSinceCompaction: number;
+  compactionState: CompactionState;
+  compactions: number;
+  lastCompactionBytes: number;
+  scheduledCommits: number;
+}
+
+export interface FolderStats {
+  folder: string;
+  total: number;
+  unread: number;
+  flagged: number;
+}
+
+export interface ThreadSummary {
+  /**
+   * The latest message of the thread, of messages with the same date the one with the lowest
+   * docid like in queries collapsed on the thread key
+   */
+  docid: number;
+  messages: number;
+  unread: number;
+  latestDate: string;
+}
+
+export interface ThreadList {
+  totalThreads: number;
+  threads: ThreadSummary[];
+}
+
+export interface ThreadCounts {
+  messages: number;
+  unread: number;
+}
+
+export interface UniqueTermRoutingStats {
+  hits: number;
+  misses: number;
+  routedTerms: number;
+  partitionLoads: number;
+}
+
+export interface LazyPartitionStats {
+  registered: number;
+  attached: number;
+  attaches: number;
+  detaches: number;
+}
+
+export interface EntryPointMetrics {
+  calls: number;
+  errors: number;
+  totalMs: number;
+  maxMs: number;
+  /**
+   * Number of calls below 0.25, 1, 4, 16, 64, 256, 1024 ms and above
+   */
+  histogram: number[];
+}
+
+export interface IndexMetrics {
+  /**
+   * Only entry points that have been called since the last reset are included
+   */
+  entryPoints: { [entryPoint: string]: EntryPointMetrics };
+  documentsIndexed: number;
+  documentsDeleted: number;
+  bytesIndexed: number;
+  bytesWritten: number;
+  commits: number;
+  partitionProbes: number;
+  partitionLoads: number;
+  parallelQueries: number;
+  cachedSortQueries: number;
+  flagOverlayChanges: number; // Flags set or cleared in the flag overlay
+  flagOverlayWrites: number; // Documents rewritten when the flag overlay was written to them
+  deltasApplied: number; // Index deltas applied by applyIndexDelta
+  tombstonesApplied: number; // Deleted documents removed from the partitions on commit
+  lastError: string;
+}
+
+export interface QueryCacheStats {
+  hits: number;
+  misses: number;
+  cachedQueries: number;
+}
+
+export interface IncrementalSearchStats {
+  refinements: number;
+  fullMatches: number;
+  candidates: number; // -1 if the last query had too many matches to refine
+}
+
+export class SortableEmail {
+  constructor(
+    public idTerm: string,  // Message id
+    public sender: string, // from (name or email address if no name is present)
+    public sortableFrom: string, // e.g. uppercase of the field above
+    public fromEmailAddress: string,
+    public recipients: string[], // recipient email addresses
+    public subject: string,
+    public sortableSubject: string, // Uppercase of subject
+    public dateString: string, // Datestring (YYYYMMDDHHmm)
+    public messageSize: number, // mail message size in bytes
+    public text: string, // mail text content (may also add attachment text here)
+    public folder: string,
+    public seen: boolean,
+    public flagged: boolean,
+    public answered: boolean,
+    public attachment: boolean
+  ) {
+
   }
 }
 
@@ -0,0 +1,110 @@
+// --------- BEGIN RUNBOX LICENSE ---------
+// Copyright (C) 2016-2018 Runbox Solutions AS (runbox.com).
+// 
+// This file is part of Runbox 7.
+// 
+// Runbox 7 is free software: You can redistribute it and/or modify it
+// under the terms of the GNU General Public License as published by the
+// Free Software Foundation, either version 3 of the License, or (at your
+// option) any later version.
+// 
+// Runbox 7 is distributed in the hope that it will be useful, but
+// WITHOUT ANY WARRANTY; without even the implied warranty of
+// MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE. See the GNU
+// General Public License for more details.
+// 
+// You should have received a copy of the GNU General Public License
+// along with Runbox 7. If not, see <https://www.gnu.org/licenses/>.
+// ---------- END RUNBOX LICENSE ----------
+
+
+declare var Module;
+
+const ARENA_VERSION = 2;
+const HEADER_BYTES = 20;
+
+/**
+ * Rows of a sorted query result as written by sortedXapianQueryArena in rmmxapianapi.cc.
+ *
+ * The arena is copied out of the webassembly heap when constructed, so it stays valid
+ * after later queries and heap growth.
+ */
+export class SearchResultArena {
+    public readonly length: number;
+    public readonly numValueSlots: number;
+    /**
+     * Row limit of the memory governor if it capped the query (see MemoryGovernorOptions.maxMatches), or 0
+     */
+    public readonly cappedAt: number;
+
+    private view: DataView;
+    private decoder = new TextDecoder('utf-8');
+
+    constructor(private bytes: Uint8Array) {
+        this.view = new DataView(bytes.buffer, bytes.byteOffset, bytes.byteLength);
+        if (this.view.getUint32(0, true) !== ARENA_VERSION) {
+            throw new Error('Unsupported search result arena version ' + this.view.getUint32(0, true));
+        }
+        this.length = this.view.getUint32(4, true);
+        this.numValueSlots = this.view.getUint32(8, true);
+        this.cappedAt = this.view.getUint32(16, true);
+    }
+
+    static fromHeap($arena: number): SearchResultArena {
+        const totalBytes = new DataView(Module.HEAPU8.buffer, $arena, HEADER_BYTES).getUint32(12, true);
+        return new SearchResultArena(Module.HEAPU8.slice($arena, $arena + totalBytes));
+    }
+
+    public getDocId(row: number): number {
+        return this.view.getUint32(this.rowOffset(row), true);
+    }
+
+    public getCollapseCount(row: number): number {
+        return this.view.getUint32(this.rowOffset(row) + 4, true);
+    }
+
+    /**
+     * @param slotIndex index into the value slots requested in the query (not the slot number)
+     */
+    public getValue(row: number, slotIndex: number): string {
+        let pos = this.rowOffset(row) + 8;
+        for (let n = 0; n < slotIndex; n++) {
+            pos = this.skipString(pos);
+        }
+        return this.readString(pos);
+    }
+
+    /**
+     * Fields of the document data, e.g. [idterm, from, subject, fromemailaddress] for emails
+     */
+    public getDataFields(row: number): string[] {
+        let pos = this.rowOffset(row) + 8;
+        for (let n = 0; n < this.numValueSlots; n++) {
+            pos = this.skipString(pos);
+        }
+        const numFields = this.view.getUint32(pos, true);
+        pos += 4;
+        const fields: string[] = new Array(numFields);
+        for (let n = 0; n < numFields; n++) {
+            fields[n] = this.readString(pos);
+            pos = this.skipString(pos);
+        }
+        return fields;
+    }
+
+    private rowOffset(row: number): number {
+        if (row < 0 || row >= this.length) {
+            throw new RangeError('Row ' + row + ' out of range, arena has ' + this.length + ' rows');
+        }
+        return this.view.getUint32(HEADER_BYTES + row * 4, true);
+    }
+
+    private readString(pos: number): string {
+        const len = this.view.getUint32(pos, true);
+        return this.decoder.decode(this.bytes.subarray(pos + 4, pos + 4 + len));
+    }
+
+    private skipString(pos: number): number {
+        return pos + 4 + this.view.getUint32(pos, true) + 1;
+    }
+}
@@ -0,0 +1,98 @@
+// --------- BEGIN RUNBOX LICENSE ---------
+// Copyright (C) 2016-2018 Runbox Solutions AS (runbox.com).
+// 
+// This file is part of Runbox 7.
+// 
+// Runbox 7 is free software: You can redistribute it and/or modify it
+// under the terms of the GNU General Public License as published by the
+// Free Software Foundation, either version 3 of the License, or (at your
+// option) any later version.
+// 
+// Runbox 7 is distributed in the hope that it will be useful, but
+// WITHOUT ANY WARRANTY; without even the implied warranty of
+// MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE. See the GNU
+// General Public License for more details.
+// 
+// You should have received a copy of the GNU General Public License
+// along with Runbox 7. If not, see <https://www.gnu.org/licenses/>.
+// ---------- END RUNBOX LICENSE ----------
+
+import { XapianAPI } from './rmmxapianapi';
+
+declare var Module;
+
+/**
+ * An index opened side by side with the index of initXapianIndex (and other XapianIndex instances).
+ *
+ * The XapianAPI given to use() passes the handle of this index to every entry point, so calls on
+ * different indexes can be mixed and nested freely. To rebuild an index in the background without
+ * any time where search is unavailable, build it into a new XapianIndex and then swap it in:
+ *
+ *   const rebuilt = XapianIndex.open('rebuilt');
+ *   rebuilt.use(api => new IndexingTools(api).addMessagesToIndex(messages));
+ *   inbox.swapWith(rebuilt);
+ *   rebuilt.close(); // closes the old index
+ */
+export class XapianIndex {
+    /**
+     * The index opened by initXapianIndex / initXapianIndexReadOnly
+     */
+    static readonly DEFAULT_HANDLE = 0;
+
+    private api: XapianAPI;
+    private closed = false;
+
+    constructor(public readonly handle: number) {
+        this.api = new XapianAPI(handle);
+    }
+
+    static open(path: string, readOnly: boolean = false): XapianIndex {
+        const handle = Module.cwrap('openIndex', 'number', ['string', 'boolean'])(path, readOnly);
+        if (handle < 0) {
+            throw new Error('Could not open index ' + path);
+        }
+        return new XapianIndex(handle);
+    }
+
+    public use<T>(fn: (api: XapianAPI) => T): T {
+        if (this.closed) {
+            throw new Error(`Index ${this.handle} is not open`);
+        }
+        return fn(this.api);
+    }
+
+    /**
+     * Exchange the underlying indexes of this and the other handle
+     */
+    public swapWith(other: XapianIndex) {
+        if (Module._swapIndexes(this.handle, other.handle) !== 1) {
+            throw new Error(`Can't swap index ${this.handle} with ${other.handle}`);
+        }
+    }
+
+    public close() {
+        Module._closeIndex(this.handle);
+        this.closed = true;
+    }
+
+    public getXapianDocCount(): number {
+        return this.use(api => api.getXapianDocCount());
+    }
+
+    public sortedXapianQuery(querystring: string,
+        sortcol: number,
+        reverse: number,
+        offset: number,
+        maxresults: number,
+        collapsecol: number): Array<any> {
+        return this.use(api => api.sortedXapianQuery(querystring, sortcol, reverse, offset, maxresults, collapsecol));
+    }
+
+    public getDocumentData(docid: number): string {
+        return this.use(api => api.getDocumentData(docid));
+    }
+
+    public commitXapianUpdates() {
+        this.use(api => api.commitXapianUpdates());
+    }
+}